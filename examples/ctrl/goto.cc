@@ -0,0 +1,72 @@
+#include "stage.hh"
+using namespace Stg;
+
+// Drives a position model to the model named in its controller
+// arguments, e.g. ctrl "goto charger", following the world's shared
+// path planner. Every robot with the same goal shares one field.
+
+static const double cruisespeed = 0.4;
+static const double turngain = 1.0;
+static const meters_t arrived = 0.3;
+
+typedef struct
+{
+  ModelPosition* pos;
+  Model* goal;
+  Planner* planner;
+} robot_t;
+
+int PositionUpdate( Model* mod, robot_t* robot );
+
+// Stage calls this when the model starts up
+extern "C" int Init( Model* mod, CtrlArgs* args )
+{
+  // the goal is the last word of the arguments
+  const std::string& cmd( args->cmdline );
+  const size_t start( cmd.find_last_of( ' ' ));
+  const std::string goalname( start == std::string::npos ? cmd : cmd.substr( start+1 ));
+
+  robot_t* robot = new robot_t;
+  robot->pos = (ModelPosition*)mod;
+  robot->goal = mod->GetWorld()->GetModel( goalname );
+  robot->planner = mod->GetWorld()->GetPlanner();
+
+  if( robot->goal == NULL )
+    {
+      PRINT_ERR1( "goto: no goal model named \"%s\"", goalname.c_str() );
+      delete robot;
+      return 1;
+    }
+
+  // start computing the way there now
+  robot->planner->Request( robot->goal->GetGlobalPose() );
+
+  robot->pos->AddCallback( Model::CB_UPDATE, (model_callback_t)PositionUpdate, robot );
+  robot->pos->Subscribe(); // starts the position updates
+
+  return 0; //ok
+}
+
+int PositionUpdate( Model* mod, robot_t* robot )
+{
+  const Pose pose( robot->pos->GetGlobalPose() );
+
+  radians_t heading;
+  meters_t distance;
+
+  if( ! robot->planner->Direction( robot->goal->GetGlobalPose(), pose,
+				   heading, &distance )
+      || distance < arrived )
+    {
+      // still planning, there already, or no way there
+      robot->pos->Stop();
+      return 0;
+    }
+
+  // turn toward the next cell, slowing down to turn sharply
+  const radians_t error( normalize( heading - pose.a ));
+  robot->pos->SetSpeed( cruisespeed * std::max( 0.0, cos( error )), 0,
+			turngain * error );
+
+  return 0; // run again
+}
@@ -10,25 +10,19 @@ using namespace Stg;
 
 const double DEVIATION = 0.05;
 
-double simple_normal_deviate( double mean, double stddev )
-{
-  double x = 0.0;
-  
-  for( int i=0; i<12; i++ )
-    x += rand()/(RAND_MAX+1.0);
-  
-  return ( stddev * (x - 6.0) + mean );  
-}
-
 // process the ranger data
 int RangerUpdate( ModelRanger* mod, void* dummy )
 {
   // get the data
 	std::vector<meters_t>& scan = mod->GetSensorsMutable()[0].ranges;
 	
+  // this update's noise, the same in every run with the same world
+  // seed. The ranger's "noise" property does this without a plugin.
+  Rng rng( mod->GetRng() );
+
   if( scan.size()>0 )
     FOR_EACH( it, scan )
-      *it *= simple_normal_deviate( 1.0, DEVIATION );
+      *it *= rng.Normal( 1.0, DEVIATION );
   
   return 0; // run again
 }
@@ -1,6 +1,7 @@
 /**
  * File: rasterize.cc
- * Description: example of how to use the Stg::Model::Rasterize() method
+ * Description: example of how to use the Stg::Model::Rasterize() and
+ * Stg::World::GetOccupancy() methods
  * Date: 12 June 2009
  * Author: Richard Vaughan
 */
@@ -35,6 +36,29 @@ extern "C" int Init( Model* mod )
 	putchar( data[x + ((dh-y-1)*dw)] ? 'O' : '.' );
       putchar( '\n' );
     }  
+
+  // the world's bitmap as the sensors see it, over the same area if
+  // the model is not rotated, including anything else that is there.
+  // The cells are square, so the rows needed to cover the model's
+  // length depend on its shape.
+  Pose pose( mod->GetGlobalPose() );
+  const meters_t res = modsz.x / (float)dw;
+  const unsigned int oh = std::max( 1, (int)ceil( modsz.y / res ));
+  std::vector<uint8_t> occ( dw * oh );
+  mod->GetWorld()->GetOccupancy( pose.x - modsz.x/2.0, pose.y - modsz.y/2.0,
+				 dw, oh, res, &occ[0] );
+  
+  printf( "[Rasterize] World occupancy around model \"%s\":\n", 
+	  mod->Token() );
+
+  for( unsigned int y=0; y<oh; y++ )
+    {
+      printf( "[Rasterize] " );
+      for( unsigned int x=0; x<dw; x++ )
+	putchar( occ[x + ((oh-y-1)*dw)] ? 'O' : '.' );
+      putchar( '\n' );
+    }  
+
   delete data;
   puts( "[Rasterize] Done" );
 
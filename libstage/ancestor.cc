@@ -14,7 +14,9 @@ Ancestor::Ancestor() :
 
 Ancestor::~Ancestor()
 {
-  FOR_EACH( it, children )
+  // a copy, as each child takes itself out of children
+  const std::vector<Model*> doomed( children );
+  FOR_EACH( it, doomed )
 	 delete (*it);
 }
 
@@ -7,6 +7,54 @@ using std::vector;
 static void canonicalize_winding(vector<point_t>& pts);
 
 
+// equality for BlockGeom that matches NaNs to each other instead of
+// to nothing
+static inline bool same_nan_equal( double a, double b )
+{
+  return( a == b || (a != a && b != b) );
+}
+
+// mix [v] into [hash], with every NaN, and both zeros, hashed alike as
+// same_nan_equal() finds them equal
+static inline void hash_coord( uint64_t& hash, double v )
+{
+  if( v != v )
+    v = NAN;
+  v += 0.0; // -0 becomes +0
+
+  uint64_t bits;
+  memcpy( &bits, &v, sizeof(bits) );
+  hash = ( hash ^ bits ) * 1099511628211ULL;
+}
+
+uint64_t BlockGeom::Hash( const std::vector<point_t>& pts, const Bounds& z )
+{
+  uint64_t hash( 14695981039346656037ULL );
+  hash_coord( hash, z.min );
+  hash_coord( hash, z.max );
+  FOR_EACH( it, pts )
+    {
+      hash_coord( hash, it->x );
+      hash_coord( hash, it->y );
+    }
+  return hash;
+}
+
+bool BlockGeom::Same( const std::vector<point_t>& other, const Bounds& oz ) const
+{
+  if( pts.size() != other.size() ||
+      ! same_nan_equal( z.min, oz.min ) || 
+      ! same_nan_equal( z.max, oz.max ))
+    return false;
+
+  for( size_t i=0; i<pts.size(); ++i )
+    if( ! same_nan_equal( pts[i].x, other[i].x ) ||
+	! same_nan_equal( pts[i].y, other[i].y ))
+      return false;
+
+  return true;
+}
+
 /** Create a new block. A model's body is a list of these
     blocks. The point data is copied, so pts can safely be freed
     after calling this.*/
@@ -14,13 +62,15 @@ Block::Block(  BlockGroup* group,
 	       const std::vector<point_t>& pts,
 	       const Bounds& zrange ) :
   group(group),
-  pts(pts),
-  local_z( zrange ),
+  geom(NULL),
   global_z(),
   rendered_cells() 
 {
   assert( group );
-  canonicalize_winding(this->pts);
+
+  std::vector<point_t> wound( pts );
+  canonicalize_winding( wound );
+  SetGeom( wound, zrange );
 }
 
 /** A from-file  constructor */
@@ -28,8 +78,7 @@ Block::Block( BlockGroup* group,
 	      Worldfile* wf,
 	      int entity)
   : group(group),
-    pts(),
-    local_z(),
+    geom(NULL),
     global_z(),
     rendered_cells()
 {
@@ -38,24 +87,68 @@ Block::Block( BlockGroup* group,
   assert(entity);
   
   Load( wf, entity );
-  canonicalize_winding(this->pts);
+}
+
+Block::Block( const Block& other ) 
+  : group(other.group),
+    geom(other.geom),
+    global_z(other.global_z),
+    rendered_cells()
+{
+  rendered_cells[0] = other.rendered_cells[0];
+  rendered_cells[1] = other.rendered_cells[1];
+
+  if( geom )
+    group->mod.world->RetainBlockGeom( geom );
+}
+
+Block& Block::operator=( const Block& other )
+{
+  if( other.geom )
+    other.group->mod.world->RetainBlockGeom( other.geom );
+  if( geom )
+    group->mod.world->ReleaseBlockGeom( geom );
+
+  group = other.group;
+  geom = other.geom;
+  global_z = other.global_z;
+  rendered_cells[0] = other.rendered_cells[0];
+  rendered_cells[1] = other.rendered_cells[1];
+  
+  return *this;
 }
 
 Block::~Block()
 {
   UnMap(0);
   UnMap(1);
+
+  if( geom )
+    group->mod.world->ReleaseBlockGeom( geom );
 }
 
+void Block::SetGeom( const std::vector<point_t>& pts, const Bounds& z )
+{
+  // intern the new geometry before releasing the old, so that setting
+  // an unchanged geometry does not destroy and recreate it
+  const BlockGeom* old( geom );
+  geom = group->mod.world->InternBlockGeom( pts, z );
+
+  if( old )
+    group->mod.world->ReleaseBlockGeom( old );
+}
 
 
 void Block::Translate( double x, double y )
 {
+  std::vector<point_t> pts( geom->pts );
   FOR_EACH( it, pts )
     {
       it->x += x;
       it->y += y;
     }
+
+  SetGeom( pts, geom->z );
   
   group->BuildDisplayList();
 }
@@ -69,7 +162,7 @@ double Block::CenterY()
   double min = billion;
   double max = -billion;
   
-  FOR_EACH( it, pts )
+  FOR_EACH( it, geom->pts )
     {
       if( it->y > max ) max = it->y;
       if( it->y < min ) min = it->y;
@@ -88,7 +181,7 @@ double Block::CenterX()
   double min = billion;
   double max = -billion;
   
-  FOR_EACH( it, pts )
+  FOR_EACH( it, geom->pts )
     {
       if( it->x > max ) max = it->x;
       if( it->x < min ) min = it->x;
@@ -121,68 +214,43 @@ void Block::SetCenterX( double x )
 
 void Block::SetZ( double min, double max )
 {
-  local_z.min = min;
-  local_z.max = max;
+  SetGeom( geom->pts, Bounds( min, max ));
 
   // force redraw
   group->BuildDisplayList();
 }
 
-void Block::AppendTouchingModels( std::set<Model*>& touchers )
-{
-  unsigned int layer = group->mod.world->updates % 2;
-  
-  // for every cell we are rendered into
-  FOR_EACH( cell_it, rendered_cells[layer] )
-    // for every block rendered into that cell
-    FOR_EACH( block_it, (*cell_it)->GetBlocks(layer) )
-    {
-      if( !group->mod.IsRelated( &(*block_it)->group->mod ))
-	touchers.insert( &(*block_it)->group->mod );
-    }
-}
-
-Model* Block::TestCollision()
+Model* Block::TestCollision( const std::vector<Model*>& candidates )
 {
-  //printf( "model %s block %p test collision...\n", mod->Token(), this );
+  if ( global_z.min < 0 )
+    return group->mod.world->GetGround();
 
-  // find the set of cells we would render into given the current global pose
-  //GenerateCandidateCells();
-  
-  if( group->mod.vis.obstacle_return )
-    {
-      if ( global_z.min < 0 )
-	return group->mod.world->GetGround();
+  // the broad phase found nothing we could hit
+  if( candidates.empty() )
+    return NULL;
 	  
-      unsigned int layer = group->mod.world->updates % 2;
+  World* world( group->mod.world );
+  unsigned int layer = world->updates % 2;
 
-      // for every cell we may be rendered into
-      FOR_EACH( cell_it, rendered_cells[layer] )
+  // for every cell we may be rendered into
+  FOR_EACH( cell_it, rendered_cells[layer] )
+    {
+      // for every block rendered into that cell
+      FOR_EACH( block_it, (*cell_it)->GetBlocks(layer) )
 	{
-	  // for every block rendered into that cell
-	  FOR_EACH( block_it, (*cell_it)->GetBlocks(layer) )
-	    {
-	      Block* testblock = *block_it;
-	      Model* testmod = &testblock->group->mod;
-				
-	      //printf( "   testing block %p of model %s\n", testblock, testmod->Token() );
-				
-	      // if the tested model is an obstacle and it's not attached to this model
-	      if( (testmod != &group->mod) &&
-		  testmod->vis.obstacle_return &&
-		  (!group->mod.IsRelated( testmod )) && 
-		  // also must intersect in the Z range
-		  testblock->global_z.min <= global_z.max && 
-		  testblock->global_z.max >= global_z.min )
-		{
-		  //puts( "HIT");
-		  return testmod; // bail immediately with the bad news
-		}
-	    }
+	  Block* testblock = *block_it;
+	  ++world->collision_stats.block_checks;
+
+	  // if the block intersects in the Z range and belongs to a
+	  // candidate, which is an obstacle not attached to this model
+	  if( testblock->global_z.min <= global_z.max && 
+	      testblock->global_z.max >= global_z.min &&
+	      std::find( candidates.begin(), candidates.end(), 
+			 &testblock->group->mod ) != candidates.end() )
+	    return &testblock->group->mod; // bail immediately with the bad news
 	}
     }
 
-  //printf( "model %s block %p collision done. no hits.\n", mod->Token(), this );
   return NULL; // no hit
 }
 
@@ -190,13 +258,13 @@ void Block::Map( unsigned int layer )
 {  
   // calculate the global pixel coords of the block vertices
   // and render this block's polygon into the world
-  group->mod.world->MapPoly( group->mod.LocalToPixels( pts ), this, layer );
+  group->mod.world->MapPoly( group->mod.LocalToPixels( geom->pts ), this, layer );
   
   // update the block's absolute z bounds at this rendering
   Pose gpose( group->mod.GetGlobalPose() );
   gpose.z += group->mod.geom.pose.z;
-  global_z.min = local_z.min + gpose.z;
-  global_z.max = local_z.max + gpose.z;
+  global_z.min = geom->z.min + gpose.z;
+  global_z.max = geom->z.max + gpose.z;
 }
 
 
@@ -224,6 +292,7 @@ void Block::Rasterize( uint8_t* data,
   //printf( "rasterize block %p : w: %u h: %u  scale %.2f %.2f  offset %.2f %.2f\n",
   //	 this, width, height, scalex, scaley, offsetx, offsety );
 	
+  const std::vector<point_t>& pts( geom->pts );
   const size_t pt_count = pts.size();
   for( size_t i=0; i<pt_count; ++i )
     {
@@ -232,7 +301,8 @@ void Block::Rasterize( uint8_t* data,
       point_t mpt2 = pts[(i+1)%pt_count]; // BlockPointToModelMeters( pts[(i+1)%pt_count] );
 	  
       // record for debug visualization
-      group->mod.rastervis.AddPoint( mpt1.x, mpt1.y );
+      if( group->mod.rastervis )
+	group->mod.rastervis->AddPoint( mpt1.x, mpt1.y );
 	  
       // shift to the bottom left of the model
       mpt1.x += group->mod.geom.size.x/2.0;
@@ -297,8 +367,8 @@ void Block::DrawTop()
   // extent
 
   glBegin( GL_POLYGON);
-  FOR_EACH( it, pts )
-    glVertex3f( it->x, it->y, local_z.max );
+  FOR_EACH( it, geom->pts )
+    glVertex3f( it->x, it->y, geom->z.max );
   glEnd();
 }
 
@@ -307,21 +377,24 @@ void Block::DrawSides()
   // construct a strip that wraps around the polygon
   glBegin(GL_QUAD_STRIP);
 
+  const std::vector<point_t>& pts( geom->pts );
+  const Bounds& z( geom->z );
+
   FOR_EACH( it, pts )
     {
-      glVertex3f( it->x, it->y, local_z.max );
-      glVertex3f( it->x, it->y, local_z.min );
+      glVertex3f( it->x, it->y, z.max );
+      glVertex3f( it->x, it->y, z.min );
     }
   // close the strip
-  glVertex3f( pts[0].x, pts[0].y, local_z.max );
-  glVertex3f( pts[0].x, pts[0].y, local_z.min );
+  glVertex3f( pts[0].x, pts[0].y, z.max );
+  glVertex3f( pts[0].x, pts[0].y, z.min );
   glEnd();
 }
 
 void Block::DrawFootPrint()
 {
   glBegin(GL_POLYGON);	
-  FOR_EACH( it, pts )
+  FOR_EACH( it, geom->pts )
     glVertex2f( it->x, it->y );
   glEnd();
 }
@@ -336,6 +409,7 @@ void Block::Load( Worldfile* wf, int entity )
 {
   const size_t pt_count = wf->ReadInt( entity, "points", 0);
 
+  std::vector<point_t> pts;
   char key[256];
   for( size_t p=0; p<pt_count; ++p )	      
     {
@@ -348,7 +422,10 @@ void Block::Load( Worldfile* wf, int entity )
   
   canonicalize_winding(pts);
 
-  wf->ReadTuple( entity, "z", 0, 2, "ll", &local_z.min, &local_z.max );  
+  Bounds z;
+  wf->ReadTuple( entity, "z", 0, 2, "ll", &z.min, &z.max );  
+
+  SetGeom( pts, z );
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
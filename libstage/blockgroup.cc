@@ -10,10 +10,17 @@
 using namespace Stg;
 using namespace std;
 
+std::map<std::string,std::vector<std::vector<point_t> > > BlockGroup::bitmap_polys;
+
 BlockGroup::BlockGroup( Model& mod ) 
   : blocks(),
     displaylist(0),
-    mod(mod)
+    mod(mod),
+    displaylist_stale(true),
+    mesh_fill(),
+    mesh_lines(),
+    mesh_foot(),
+    mesh_valid(false)
 { /* empty */ }
 
 BlockGroup::~BlockGroup()
@@ -34,18 +41,12 @@ void BlockGroup::Clear()
   blocks.clear();
 }
 
-void BlockGroup::AppendTouchingModels( std::set<Model*>& v )
-{
-  FOR_EACH( it, blocks )
-    it->AppendTouchingModels( v );  
-}
-
-Model* BlockGroup::TestCollision()
+Model* BlockGroup::TestCollision( const std::vector<Model*>& candidates )
 {
   Model* hitmod = NULL;
    
   FOR_EACH( it, blocks )
-    if( (hitmod = it->TestCollision()))
+    if( (hitmod = it->TestCollision( candidates )))
       break; // bail on the earliest collision
 
   return hitmod; // NULL if no collision
@@ -63,7 +64,7 @@ bounds3d_t BlockGroup::BoundingBox() const
   FOR_EACH( it, blocks )
     {
       // examine all the points in the polygon
-      FOR_EACH( pit, it->pts )
+      FOR_EACH( pit, it->geom->pts )
 	{
 	  if( pit->x < minx ) minx = pit->x;
 	  if( pit->y < miny ) miny = pit->y;
@@ -71,8 +72,8 @@ bounds3d_t BlockGroup::BoundingBox() const
 	  if( pit->y > maxy ) maxy = pit->y;
 	}
       
-      if( it->local_z.min < minz ) minz = it->local_z.min;	  
-      if( it->local_z.max > maxz ) maxz = it->local_z.max;
+      if( it->geom->z.min < minz ) minz = it->geom->z.min;	  
+      if( it->geom->z.max > maxz ) maxz = it->geom->z.max;
      }
       
    return bounds3d_t( Bounds( minx,maxx), Bounds(miny,maxy), Bounds(minz,maxz));
@@ -93,18 +94,23 @@ void BlockGroup::CalcSize()
   // that the original points are now in model coordinates
   const Size modsize = mod.geom.size;
   
+  // identical models scale identical blocks identically, so the
+  // results are shared between them
   FOR_EACH( it, blocks )
     {
       // polygon edges
-      FOR_EACH( pit, it->pts  )
+      std::vector<point_t> pts( it->geom->pts );
+      FOR_EACH( pit, pts )
 	{
 	  pit->x = (pit->x - offset.x) * (modsize.x/size.x);
 	  pit->y = (pit->y - offset.y) * (modsize.y/size.y);     
 	}
 
       // vertical bounds
-      it->local_z.min = (it->local_z.min - offset.z) * (modsize.z/size.z);
-      it->local_z.max = (it->local_z.max - offset.z) * (modsize.z/size.z);
+      const Bounds z( (it->geom->z.min - offset.z) * (modsize.z/size.z),
+		      (it->geom->z.max - offset.z) * (modsize.z/size.z) );
+
+      it->SetGeom( pts, z );
     }
 }
 
@@ -211,11 +217,11 @@ void BlockGroup::BuildDisplayList()
   FOR_EACH( blk, blocks )
     {      
       std::vector<GLdouble> verts;      
-      FOR_EACH( it, blk->pts )
+      FOR_EACH( it, blk->geom->pts )
 	{
 	  verts.push_back( it->x ); 
 	  verts.push_back( it->y ); 
-	  verts.push_back( blk->local_z.max );
+	  verts.push_back( blk->geom->z.max );
 	}       
       contours.push_back( verts );
     }
@@ -281,17 +287,183 @@ void BlockGroup::BuildDisplayList()
   glEndList();
 }
 
+void BlockGroup::CheckRebuild()
+{
+  // the display list and the mesh are rebuilt independently, since
+  // either may be in use
+  if( mod.rebuild_displaylist )
+    {
+      displaylist_stale = true;
+      mesh_valid = false;
+      mod.rebuild_displaylist = 0;
+    }
+}
+
 void BlockGroup::CallDisplayList()
 {
-  if( displaylist == 0 || mod.rebuild_displaylist )
+  CheckRebuild();
+
+  if( displaylist == 0 || displaylist_stale )
     {
       BuildDisplayList();
-      mod.rebuild_displaylist = 0;
+      displaylist_stale = false;
     }
   
   glCallList( displaylist );
 }
 
+// tesselation callbacks used in BlockGroup::BuildMesh(), which collect
+// the triangles in a vector instead of drawing them
+
+class TessMesh
+{
+public:
+  std::vector<GLfloat>& tris;
+  std::list< std::vector<GLdouble> > combined; ///< new vertices, freed with the mesh
+
+  TessMesh( std::vector<GLfloat>& tris ) : tris(tris), combined() {}
+};
+
+static void meshVertexCallback( GLdouble* vertex, TessMesh* mesh )
+{
+  mesh->tris.push_back( vertex[0] );
+  mesh->tris.push_back( vertex[1] );
+  mesh->tris.push_back( vertex[2] );
+}
+
+static void meshEdgeFlagCallback( GLboolean flag, TessMesh* mesh )
+{
+  // having an edge flag callback makes GLU emit separate triangles,
+  // rather than fans and strips
+  (void)flag; (void)mesh;
+}
+
+static void meshCombineCallback( GLdouble coords[3], 
+				 GLdouble *vertex_data[4],
+				 GLfloat weight[4], GLdouble **dataOut,
+				 TessMesh* mesh )
+{
+  mesh->combined.push_back( std::vector<GLdouble>( coords, coords+3 ));
+  *dataOut = &mesh->combined.back()[0];
+}
+
+void BlockGroup::BuildMesh()
+{
+  mesh_fill.clear();
+  mesh_lines.clear();
+  mesh_foot.clear();
+  mesh_valid = true;
+
+  if( blocks.empty() )
+    return;
+  
+  // the blocks' points in the model's frame, shifted by the geom
+  // pose as in the display list
+  const Pose& gp = mod.GetGeom().pose;
+  const double c = cos( gp.a );
+  const double s = sin( gp.a );
+
+  std::vector<std::vector<GLdouble> > contours;
+  
+  FOR_EACH( blk, blocks )
+    {      
+      const std::vector<point_t>& pts( blk->geom->pts );
+      const Bounds& z( blk->geom->z );
+      
+      std::vector<GLdouble> verts;      
+      FOR_EACH( it, pts )
+	{
+	  verts.push_back( gp.x + c * it->x - s * it->y ); 
+	  verts.push_back( gp.y + s * it->x + c * it->y ); 
+	  verts.push_back( gp.z + z.max );
+	}       
+      contours.push_back( verts );
+
+      // each side is a quad, drawn as two triangles, with its edges
+      // outlined
+      const GLfloat zmin = gp.z + z.min;
+      const GLfloat zmax = gp.z + z.max;
+      const size_t n = pts.size();
+
+      for( size_t p=0; p<n; ++p )
+	{
+	  const GLfloat x1 = verts[3*p], y1 = verts[3*p+1];
+	  const GLfloat x2 = verts[3*((p+1)%n)], y2 = verts[3*((p+1)%n)+1];
+
+	  const GLfloat quad[] = { x1, y1, zmax,  x1, y1, zmin,  x2, y2, zmin,
+				   x1, y1, zmax,  x2, y2, zmin,  x2, y2, zmax };
+	  mesh_fill.insert( mesh_fill.end(), quad, quad+18 );
+
+	  const GLfloat edges[] = { x1, y1, zmax,  x2, y2, zmax,
+				    x1, y1, zmin,  x2, y2, zmin,
+				    x1, y1, zmin,  x1, y1, zmax };
+	  mesh_lines.insert( mesh_lines.end(), edges, edges+18 );
+	}
+    }
+
+  // the tops are tesselated together, as in the display list
+  std::vector<GLfloat> tops;
+  TessMesh mesh( tops );
+
+  GLUtesselator* tobj = gluNewTess();
+  assert( tobj );
+
+  gluTessCallback( tobj, GLU_TESS_VERTEX_DATA, (GLvoid (*) ()) &meshVertexCallback );
+  gluTessCallback( tobj, GLU_TESS_EDGE_FLAG_DATA, (GLvoid (*) ()) &meshEdgeFlagCallback );
+  gluTessCallback( tobj, GLU_TESS_COMBINE_DATA, (GLvoid (*) ()) &meshCombineCallback );
+  gluTessCallback( tobj, GLU_TESS_ERROR, (GLvoid (*) ()) &errorCallback );
+
+  gluTessBeginPolygon( tobj, &mesh );
+  
+  FOR_EACH( contour, contours )
+    {      
+      gluTessBeginContour( tobj );      
+      for( size_t v=0; v<contour->size(); v+=3 )
+	gluTessVertex( tobj, &(*contour)[v], &(*contour)[v] );      
+      gluTessEndContour( tobj );
+    }
+      
+  gluTessEndPolygon( tobj );
+  gluDeleteTess( tobj );
+
+  mesh_fill.insert( mesh_fill.end(), tops.begin(), tops.end() );
+
+  // the footprint is the tops flattened onto the floor
+  mesh_foot = tops;
+  for( size_t v=2; v<mesh_foot.size(); v+=3 )
+    mesh_foot[v] = 0.0;
+}
+
+void BlockGroup::AppendBlocks( const Pose& pose, const Color& color,
+			       VertexBatch& fill, VertexBatch& lines )
+{
+  CheckRebuild();
+
+  if( ! mesh_valid )
+    BuildMesh();
+
+  GLubyte rgba[4];
+  VertexBatch::Pack( color, rgba );
+  fill.Append( pose, mesh_fill, rgba );
+
+  // outlines in a darker shade, as in the display list
+  Color dark( color.r/2.0, color.g/2.0, color.b/2.0, color.a );
+  VertexBatch::Pack( dark, rgba );
+  lines.Append( pose, mesh_lines, rgba );
+}
+
+void BlockGroup::AppendFootPrint( const Pose& pose, 
+				  const GLubyte rgba[4], 
+				  VertexBatch& batch )
+{
+  CheckRebuild();
+
+  if( ! mesh_valid )
+    BuildMesh();
+  
+  batch.Append( pose, mesh_foot, rgba );
+}
+
 void BlockGroup::LoadBlock( Worldfile* wf, int entity )
 {
   AppendBlock( Block( this, wf, entity ));
@@ -322,16 +494,26 @@ void BlockGroup::LoadBitmap( const std::string& bitmapfile, Worldfile* wf )
   
   Color col( 1.0, 0.0, 1.0, 1.0 );
 
-  std::vector<std::vector<point_t> > polys;
-  
-  if( polys_from_image_file( full,
-			     polys ) )
+  std::map<std::string,std::vector<std::vector<point_t> > >::iterator cached =
+    bitmap_polys.find( full );
+
+  if( cached == bitmap_polys.end() )
     {
-      PRINT_ERR1( "failed to load polys from image file \"%s\"",
-		  full.c_str() );
-      return;
+      std::vector<std::vector<point_t> > traced;
+      
+      if( polys_from_image_file( full,
+				 traced ) )
+	{
+	  PRINT_ERR1( "failed to load polys from image file \"%s\"",
+		      full.c_str() );
+	  return;
+	}
+
+      cached = bitmap_polys.insert( std::make_pair( full, traced )).first;
     }
   
+  const std::vector<std::vector<point_t> >& polys( cached->second );
+  
   FOR_EACH( it, polys )
     AppendBlock( Block( this,
 			*it,
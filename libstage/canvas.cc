@@ -71,6 +71,7 @@ Canvas::Canvas( WorldGui* world,
   interval( 40 ), // msec between redraws
   // initialize Option objects
   //  showBlinken( "Blinkenlights", "show_blinkenlights", "", true, world ), 
+  batchRender( "Debug/Batch rendering", "batch_render", "", true, world ),
   showBBoxes( "Debug/Bounding boxes", "show_boundingboxes", "^b", false, world ),
   showBlocks( "Blocks", "show_blocks", "b", true, world ),
   showBlur( "Trails/Blur", "show_trailblur", "^d", false, world ),
@@ -89,6 +90,11 @@ Canvas::Canvas( WorldGui* world,
   showVoxels( "Debug/Voxels", "show_voxels", "^v", false, world ),
   pCamOn( "Perspective camera", "pcam_on", "r", false, world ),
   visualizeAll( "Selected only", "vis_all", "v", false, world ),
+  block_fill(),
+  block_lines(),
+  trail_fill(),
+  ray_lines(),
+  snapshot( NULL ),
   // and the rest 
   graphics( true ),
   world( world ),
@@ -427,7 +433,9 @@ int Canvas::handle(int event)
       {
 	//else
 	{
+	  world->LockSim();
 	  Model* mod = getModel( startx, starty );
+	  world->UnlockSim();
 	  startx = Fl::event_x();
 	  starty = Fl::event_y();
 	  selectedModel = false;
@@ -494,7 +502,7 @@ int Canvas::handle(int event)
 	    FOR_EACH( it, selected_models )
 	      {
 		Model* mod = *it;
-		mod->AddToPose( x-sx, y-sy, 0, 0 );
+		world->EditPose( mod, Pose( x-sx, y-sy, 0, 0 ));
 	      }
 	  }
 	  else {
@@ -517,7 +525,7 @@ int Canvas::handle(int event)
 	      FOR_EACH( it, selected_models )
 		{
 		  Model* mod = *it;
-		  mod->AddToPose( 0,0,0, 0.05*(dx+dy) );
+		  world->EditPose( mod, Pose( 0,0,0, 0.05*(dx+dy) ));
 		}
 	    }
 	    else
@@ -711,10 +719,62 @@ void Canvas::DrawFloor()
   glEnd();
 }
 
+bool Canvas::ShowsData( const DataSnapshot& ds ) const
+{
+  if( ! visualizeAll.isEnabled() )
+    return true;
+
+  // the data of the selected models and their descendants
+  FOR_EACH( it, ds.lineage )
+    if( selected_models.size() > 0 ?
+	std::find( selected_models.begin(), selected_models.end(), *it ) != selected_models.end() :
+	*it == last_selection )
+      return true;
+
+  return false;
+}
+
 void Canvas::DrawBlocks() 
 {
+  if( ! batchRender )
+    {
+      FOR_EACH( it, models_sorted )
+	(*it)->DrawBlocksTree();
+      return;
+    }
+
+  // a threaded world has gathered the blocks already
+  if( snapshot )
+    {
+      DrawBlockBatches( snapshot->block_fill, snapshot->block_lines );
+      return;
+    }
+
+  // gather every block in world coordinates and draw them all at
+  // once
+  block_fill.Clear();
+  block_lines.Clear();
+
   FOR_EACH( it, models_sorted )
-    (*it)->DrawBlocksTree();
+    (*it)->AppendBlocksTree( block_fill, block_lines );
+
+  DrawBlockBatches( block_fill, block_lines );
+}
+
+void Canvas::DrawBlockBatches( const VertexBatch& fill, const VertexBatch& lines )
+{
+  glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+  glEnable(GL_POLYGON_OFFSET_FILL);
+  glPolygonOffset(0.5, 0.5);
+
+  fill.Draw( GL_TRIANGLES );
+
+  glDisable(GL_POLYGON_OFFSET_FILL);  
+  glDepthMask(GL_FALSE);
+
+  lines.Draw( GL_LINES );
+
+  glDepthMask(GL_TRUE);
 }
 
 void Canvas::DrawBoundingBoxes() 
@@ -925,8 +985,26 @@ void Canvas::renderFrame()
     {
       glDisable( GL_DEPTH_TEST ); // using alpha blending		
 		
-      FOR_EACH( it, models_sorted )
-	(*it)->DrawTrailFootprint();
+      if( batchRender && snapshot )
+	{
+	  // drawn from the snapshot, so the simulation can carry on
+	  world->UnlockSim();
+	  glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+	  snapshot->trail_fill.Draw( GL_TRIANGLES );
+	  world->LockSim();
+	}
+      else if( batchRender )
+	{
+	  trail_fill.Clear();
+	  FOR_EACH( it, models_sorted )
+	    (*it)->AppendTrailFootprint( trail_fill );
+
+	  glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+	  trail_fill.Draw( GL_TRIANGLES );
+	}
+      else
+	FOR_EACH( it, models_sorted )
+	  (*it)->DrawTrailFootprint();
 		
       glEnable( GL_DEPTH_TEST );
     }
@@ -951,7 +1029,17 @@ void Canvas::renderFrame()
       (*it)->DrawTrailBlocks();  
     
   if( showBlocks )
-    DrawBlocks();
+    {
+      const bool unlock = batchRender && snapshot;
+
+      if( unlock )
+	world->UnlockSim();
+
+      DrawBlocks();
+
+      if( unlock )
+	world->LockSim();
+    }
 	
   if( showBBoxes )
     DrawBoundingBoxes();
@@ -981,9 +1069,38 @@ void Canvas::renderFrame()
 	else if ( last_selection ) {
 	  last_selection->DataVisualizeTree( current_camera );
 	}
+
+	// the models whose data was copied into the snapshot, drawn
+	// while the simulation carries on
+	if( snapshot )
+	  {
+	    world->UnlockSim();
+
+	    FOR_EACH( it, snapshot->data )
+	      if( ShowsData( **it ))
+		{
+		  glPushMatrix();
+		  Gl::pose_shift( (*it)->gpose );
+		  (*it)->Draw( world, current_camera );
+		  glPopMatrix();
+		}
+	  }
+
+	// whatever the visualizations batched up
+	glDepthMask( GL_FALSE );
+	glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+	vis_fill.Draw( GL_TRIANGLES );
+	glDepthMask( GL_TRUE );
+	vis_lines.Draw( GL_LINES );
+
+	if( snapshot )
+	  world->LockSim();
       }
     }
 
+  vis_fill.Clear();
+  vis_lines.Clear();
+
   if( showGrid ) 
     FOR_EACH( it, models_sorted )
       (*it)->DrawGrid();
@@ -1004,16 +1121,33 @@ void Canvas::renderFrame()
   if( world->ray_list.size() > 0 )
     {
       glDisable( GL_DEPTH_TEST );
-      PushColor( 0,0,0,0.5 );
-      FOR_EACH( it, world->ray_list )
+
+      if( batchRender )
 	{
-	  float* pts = *it;
-	  glBegin( GL_LINES );
-	  glVertex2f( pts[0], pts[1] );
-	  glVertex2f( pts[2], pts[3] );
-	  glEnd();
-	}  
-      PopColor();
+	  static const GLubyte rgba[4] = { 0, 0, 0, 127 };
+	  ray_lines.Clear();
+	  FOR_EACH( it, world->ray_list )
+	    {
+	      float* pts = *it;
+	      ray_lines.Vertex( pts[0], pts[1], 0, rgba );
+	      ray_lines.Vertex( pts[2], pts[3], 0, rgba );
+	    }
+	  ray_lines.Draw( GL_LINES );
+	}
+      else
+	{
+	  PushColor( 0,0,0,0.5 );
+	  FOR_EACH( it, world->ray_list )
+	    {
+	      float* pts = *it;
+	      glBegin( GL_LINES );
+	      glVertex2f( pts[0], pts[1] );
+	      glVertex2f( pts[2], pts[3] );
+	      glEnd();
+	    }  
+	  PopColor();
+	}
+
       glEnable( GL_DEPTH_TEST );
 		 
       world->ClearRays();
@@ -1034,7 +1168,7 @@ void Canvas::renderFrame()
       glLoadIdentity();
       glDisable( GL_DEPTH_TEST );
 
-      std::string clockstr = world->ClockString();
+      std::string clockstr = snapshot ? snapshot->clock : world->ClockString();
       if( showFollow == true && last_selection )
 	clockstr.append( " [FOLLOW MODE]" );
 		
@@ -1204,6 +1338,7 @@ void Canvas::createMenuItems( Fl_Menu_Bar* menu, std::string path )
   showTrails.createMenuItem( menu, path ); 
   showTrailRise.createMenuItem( menu, path );  // broken
   showBBoxes.createMenuItem( menu, path );
+  batchRender.createMenuItem( menu, path );
   //showVoxels.createMenuItem( menu, path );  
   showScreenshots.createMenuItem( menu, path );  
 }
@@ -1225,6 +1360,7 @@ void Canvas::Load( Worldfile* wf, int sec )
   showFlags.Load( wf, sec );
   showBlocks.Load( wf, sec );
   showBBoxes.Load( wf, sec );
+  batchRender.Load( wf, sec );
   showBlur.Load( wf, sec );
   showClock.Load( wf, sec );
   showFollow.Load( wf, sec );
@@ -1257,6 +1393,7 @@ void Canvas::Save( Worldfile* wf, int sec )
   showData.Save( wf, sec );
   showBlocks.Save( wf, sec );
   showBBoxes.Save( wf, sec );
+  batchRender.Save( wf, sec );
   showBlur.Save( wf, sec );
   showClock.Save( wf, sec );
   showFlags.Save( wf, sec );
@@ -1302,6 +1439,11 @@ void Canvas::draw()
       glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
     }            
 
+  // a threaded world keeps running while we draw, apart from the
+  // parts of the frame that read the models directly
+  snapshot = batchRender ? world->AcquireSnapshot() : NULL;
+  world->LockSim();
+
   //Follow the selected robot	
   if( showFollow  && last_selection ) 
     {
@@ -1319,6 +1461,14 @@ void Canvas::draw()
   
   current_camera->Draw();	
   renderFrame();
+
+  world->UnlockSim();
+
+  if( snapshot )
+    {
+      world->ReleaseSnapshot();
+      snapshot = NULL;
+    }
 }
 
 void Canvas::resize(int X,int Y,int W,int H) 
@@ -78,6 +78,7 @@ namespace Stg
 	 void RemoveModel( Model* mod );
 
 	 Option //showBlinken, 
+		batchRender,
 		showBBoxes,
 		showBlocks, 
 		showBlur,
@@ -96,6 +97,23 @@ namespace Stg
 		showVoxels,
 		pCamOn,
 		visualizeAll;
+
+	 /** Vertex batches rebuilt and drawn each frame when batchRender
+		  is set: block surfaces and outlines, trail footprints and
+		  debug rays. */
+	 VertexBatch block_fill, block_lines, trail_fill, ray_lines;
+
+	 /** While a frame is drawn for a threaded world, the snapshot it
+		  is drawn from. Otherwise NULL. */
+	 const WorldGui::RenderSnapshot* snapshot;
+
+	 /** Draw block surfaces and outlines with the state used by the
+		  blocks' display lists */
+	 static void DrawBlockBatches( const VertexBatch& fill, const VertexBatch& lines );
+
+	 /** Returns true if the data in [ds] is shown, as it would be if
+		  drawn by Model::DataVisualizeTree() */
+	 bool ShowsData( const DataSnapshot& ds ) const;
   
   public:
 	 Canvas( WorldGui* world, int x, int y, int width, int height);
@@ -108,6 +126,18 @@ namespace Stg
   
 	 std::map< std::string, Option* > _custom_options;
 
+	 /** Sensor visualizations can add to these batches instead of
+		  drawing immediately, if Batching() is true. They are in world
+		  coordinates, and are drawn after all the models' visualizations,
+		  filled triangles then lines. */
+	 VertexBatch vis_fill, vis_lines;
+
+	 /** Returns true if the canvas draws with vertex batches */
+	 bool Batching() const { return batchRender.isEnabled(); }
+
+	 /** Turn batched drawing on or off */
+	 void SetBatching( bool on ){ batchRender.set( on ); }
+
 	 void Screenshot();
 	 void InitGl();
 	 void InitTextures();
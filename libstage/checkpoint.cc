@@ -0,0 +1,325 @@
+/*
+  checkpoint.cc
+  Binary checkpoints of the complete state of a running World.
+  See checkpoint.hh for the file format.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include "checkpoint.hh"
+
+using namespace Stg;
+
+static const char CHECKPOINT_MAGIC[8] = { 'S','T','G','C','K','P','T','\0' };
+static const char CHECKPOINT_END[8] = { 'S','T','G','C','E','N','D','\0' };
+
+const uint32_t Checkpoint::CHECKPOINT_VERSION;
+
+std::set<CheckpointWriter*> CheckpointWriter::open_writers;
+
+Checkpoint::Checkpoint() :
+  sim_time( 0 ),
+  updates( 0 ),
+  seed( 0 ),
+  interval( 0 ),
+  worldfile(),
+  bitmaps(),
+  models(),
+  events()
+{
+}
+
+void Checkpoint::Encode( StateWriter& out ) const
+{
+  const size_t start( out.bytes.size() );
+
+  out.bytes.insert( out.bytes.end(), CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + 8 );
+  out.Put( CHECKPOINT_VERSION );
+  out.Put( (uint64_t)sim_time );
+  out.Put( updates );
+  out.Put( seed );
+  out.Put( (uint64_t)interval );
+  out.PutString( worldfile );
+
+  out.Put( (uint32_t)bitmaps.size() );
+  FOR_EACH( it, bitmaps )
+    {
+      out.PutString( it->first );
+      out.Put( (uint32_t)it->second.size() );
+      FOR_EACH( poly, it->second )
+	{
+	  out.Put( (uint32_t)poly->size() );
+	  FOR_EACH( pt, *poly )
+	    {
+	      out.Put( pt->x );
+	      out.Put( pt->y );
+	    }
+	}
+    }
+
+  out.Put( (uint32_t)models.size() );
+  FOR_EACH( it, models )
+    {
+      out.PutString( it->name );
+      out.PutString( it->type );
+      out.PutString( it->parent );
+      out.Put( it->subs );
+      out.Put( (uint32_t)it->state.size() );
+      out.bytes.insert( out.bytes.end(), it->state.begin(), it->state.end() );
+    }
+
+  out.Put( (uint32_t)events.size() );
+  FOR_EACH( it, events )
+    {
+      out.PutString( it->name );
+      out.Put( (uint64_t)it->time );
+    }
+
+  out.Put( (uint64_t)( out.bytes.size() - start ));
+  out.bytes.insert( out.bytes.end(), CHECKPOINT_END, CHECKPOINT_END + 8 );
+}
+
+bool Checkpoint::Decode( const std::vector<uint8_t>& bytes )
+{
+  // check both ends before believing anything in between
+  if( bytes.size() < 32 ||
+      memcmp( &bytes[0], CHECKPOINT_MAGIC, 8 ) != 0 ||
+      memcmp( &bytes[bytes.size()-8], CHECKPOINT_END, 8 ) != 0 )
+    return false;
+
+  uint64_t length;
+  memcpy( &length, &bytes[bytes.size()-16], 8 );
+  if( length != bytes.size() - 16 )
+    return false;
+
+  StateReader in( &bytes[8], bytes.size() - 24 );
+
+  if( in.Get<uint32_t>() != CHECKPOINT_VERSION )
+    return false;
+
+  sim_time = in.Get<uint64_t>();
+  updates = in.Get<uint64_t>();
+  seed = in.Get<uint64_t>();
+  interval = in.Get<uint64_t>();
+  worldfile = in.GetString();
+
+  bitmaps.clear();
+  for( uint32_t b( in.Get<uint32_t>() ); b > 0 && in.Ok(); --b )
+    {
+      polygons_t& polys( bitmaps[ in.GetString() ] );
+
+      for( uint32_t p( in.Get<uint32_t>() ); p > 0 && in.Ok(); --p )
+	{
+	  polys.push_back( std::vector<point_t>() );
+	  for( uint32_t n( in.Get<uint32_t>() ); n > 0 && in.Ok(); --n )
+	    {
+	      const meters_t x( in.Get<meters_t>() );
+	      const meters_t y( in.Get<meters_t>() );
+	      polys.back().push_back( point_t( x, y ));
+	    }
+	}
+    }
+
+  models.clear();
+  for( uint32_t m( in.Get<uint32_t>() ); m > 0 && in.Ok(); --m )
+    {
+      models.push_back( ModelRecord() );
+      ModelRecord& rec( models.back() );
+
+      rec.name = in.GetString();
+      rec.type = in.GetString();
+      rec.parent = in.GetString();
+      rec.subs = in.Get<int32_t>();
+
+      // a string is a count and bytes, just like a state record
+      const std::string state( in.GetString() );
+      rec.state.assign( state.begin(), state.end() );
+    }
+
+  events.clear();
+  for( uint32_t e( in.Get<uint32_t>() ); e > 0 && in.Ok(); --e )
+    {
+      const std::string name( in.GetString() );
+      events.push_back( EventRecord( name, in.Get<uint64_t>() ));
+    }
+
+  return( in.Ok() && in.AtEnd() );
+}
+
+bool Checkpoint::Write( const std::string& filename ) const
+{
+  StateWriter out;
+  Encode( out );
+
+  const std::string tmpname( filename + ".tmp" );
+
+  const int fd( open( tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 ));
+  if( fd < 0 )
+    {
+      PRINT_ERR2( "failed to open checkpoint file \"%s\": %s",
+		  tmpname.c_str(), strerror(errno) );
+      return false;
+    }
+
+  size_t done( 0 );
+  while( done < out.bytes.size() )
+    {
+      const ssize_t n( write( fd, &out.bytes[done], out.bytes.size() - done ));
+      if( n < 0 && errno == EINTR )
+	continue;
+      if( n <= 0 )
+	break;
+      done += n;
+    }
+
+  // the data must be on disk before the rename makes it the
+  // checkpoint, or a crash could leave neither file complete
+  const bool ok( done == out.bytes.size() && fsync( fd ) == 0 );
+  close( fd );
+
+  if( ! ok || rename( tmpname.c_str(), filename.c_str() ) != 0 )
+    {
+      PRINT_ERR2( "failed to write checkpoint file \"%s\": %s",
+		  filename.c_str(), strerror(errno) );
+      unlink( tmpname.c_str() );
+      return false;
+    }
+
+  return true;
+}
+
+bool Checkpoint::Read( const std::string& filename )
+{
+  FILE* fp( fopen( filename.c_str(), "rb" ));
+  if( fp == NULL )
+    {
+      PRINT_ERR2( "failed to open checkpoint file \"%s\": %s",
+		  filename.c_str(), strerror(errno) );
+      return false;
+    }
+
+  std::vector<uint8_t> bytes;
+  uint8_t buf[1<<16];
+  size_t n;
+  while( (n = fread( buf, 1, sizeof(buf), fp )) > 0 )
+    bytes.insert( bytes.end(), buf, buf + n );
+  fclose( fp );
+
+  if( ! Decode( bytes ))
+    {
+      PRINT_ERR1( "checkpoint file \"%s\" is incomplete, or of another version",
+		  filename.c_str() );
+      return false;
+    }
+
+  return true;
+}
+
+CheckpointWriter::CheckpointWriter( World* world, const std::string& filename ) :
+  world( world ),
+  filename( filename ),
+  pending( NULL ),
+  written( 0 ),
+  thread(),
+  mutex(),
+  cond(),
+  quit( false )
+{
+  pthread_mutex_init( &mutex, NULL );
+  pthread_cond_init( &cond, NULL );
+  pthread_create( &thread, NULL, WriterThreadEntry, this );
+
+  // Stage usually exits without destroying its worlds, so make sure
+  // the last checkpoint is finished anyway
+  static bool registered = false;
+  if( ! registered )
+    {
+      atexit( CloseAll );
+      registered = true;
+    }
+
+  open_writers.insert( this );
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+  open_writers.erase( this );
+
+  pthread_mutex_lock( &mutex );
+  quit = true;
+  pthread_cond_signal( &cond );
+  pthread_mutex_unlock( &mutex );
+
+  pthread_join( thread, NULL );
+  pthread_mutex_destroy( &mutex );
+  pthread_cond_destroy( &cond );
+
+  printf( "[Checkpoint \"%s\": %lu written]\n",
+	  filename.c_str(), (unsigned long)written );
+}
+
+void CheckpointWriter::CloseAll()
+{
+  while( ! open_writers.empty() )
+    (*open_writers.begin())->world->StopCheckpoints();
+}
+
+bool CheckpointWriter::Busy()
+{
+  pthread_mutex_lock( &mutex );
+  const bool busy( pending != NULL );
+  pthread_mutex_unlock( &mutex );
+  return busy;
+}
+
+bool CheckpointWriter::Write( Checkpoint* ckpt )
+{
+  pthread_mutex_lock( &mutex );
+  const bool idle( pending == NULL );
+  if( idle )
+    {
+      pending = ckpt;
+      pthread_cond_signal( &cond );
+    }
+  pthread_mutex_unlock( &mutex );
+
+  if( ! idle )
+    delete ckpt;
+  return idle;
+}
+
+void* CheckpointWriter::WriterThreadEntry( void* arg )
+{
+  ((CheckpointWriter*)arg)->WriterThread();
+  return NULL;
+}
+
+void CheckpointWriter::WriterThread()
+{
+  pthread_mutex_lock( &mutex );
+
+  while( true )
+    {
+      // finish the checkpoint in hand before quitting
+      if( pending == NULL )
+	{
+	  if( quit )
+	    break;
+	  pthread_cond_wait( &cond, &mutex );
+	  continue;
+	}
+
+      Checkpoint* ckpt( pending );
+      pthread_mutex_unlock( &mutex );
+
+      if( ckpt->Write( filename ))
+	++written;
+      delete ckpt;
+
+      pthread_mutex_lock( &mutex );
+      pending = NULL;
+    }
+
+  pthread_mutex_unlock( &mutex );
+}
@@ -0,0 +1,158 @@
+#pragma once
+/*
+  checkpoint.hh
+  Binary checkpoints of the complete state of a running World.
+*/
+
+#include "stage.hh"
+
+namespace Stg
+{
+  /** The state of a World at the end of an update, as taken by
+      World::SaveCheckpoint() and restored by World::StartRestore().
+
+      A checkpoint holds what a worldfile can't: the clock, every
+      model's state as written by Model::SaveState() (poses,
+      velocities, odometry error and estimates, sensor buffers,
+      powerpack charge, gripper state, ...), the models' parents and
+      subscriptions, and the pending events of every event queue, so
+      a restored world carries on exactly where the checkpointed one
+      left off. It also holds the polygons traced from the world's
+      bitmaps, so a restore needn't read and trace the images again.
+
+      The file is written in native byte order. Strings and arrays
+      are preceded by a u32 count, as written by StateWriter:
+
+      @verbatim
+      header:  "STGCKPT\0" u32 version, u64 sim_time, u64 updates,
+               u64 seed, u64 interval_usec, string worldfile
+      bitmaps: u32 count, then for each
+               string path, u32 polygons, then for each polygon
+               u32 points, {f64 x, f64 y}[points]
+      models:  u32 count, then for each
+               string name, string type, string parent name (empty
+               at the top level), i32 subscriptions,
+               u32 bytes + the Model::SaveState() record
+      events:  u32 count, then for each
+               string model name, u64 time
+      trailer: u64 bytes before the trailer, "STGCEND\0"
+      @endverbatim
+
+      A file without a matching trailer, e.g. because the process was
+      killed while writing it, is rejected. Files are written to a
+      temporary name and renamed over the old checkpoint, so the last
+      complete checkpoint survives a crash.
+  */
+  class Checkpoint
+  {
+  public:
+    static const uint32_t CHECKPOINT_VERSION = 1;
+
+    /** One model's state */
+    class ModelRecord
+    {
+    public:
+      std::string name, type, parent;
+      int32_t subs;
+      std::vector<uint8_t> state;
+
+      ModelRecord() : name(), type(), parent(), subs(0), state() {}
+    };
+
+    /** A model's pending update event */
+    class EventRecord
+    {
+    public:
+      std::string name;
+      usec_t time;
+
+      EventRecord( const std::string& name, usec_t time )
+	: name(name), time(time) {}
+    };
+
+    typedef std::vector<std::vector<point_t> > polygons_t;
+
+    usec_t sim_time;
+    uint64_t updates;
+    uint64_t seed;
+    usec_t interval;
+    std::string worldfile;
+
+    /** polygons traced from each bitmap, by full path */
+    std::map<std::string,polygons_t> bitmaps;
+
+    /** in order of model id */
+    std::vector<ModelRecord> models;
+
+    /** the pending events of all the event queues, earliest first */
+    std::vector<EventRecord> events;
+
+    Checkpoint();
+
+    /** Append the file's contents to [out] */
+    void Encode( StateWriter& out ) const;
+
+    /** Decode the contents of a file. Returns false if they are
+	incomplete or of another version. */
+    bool Decode( const std::vector<uint8_t>& bytes );
+
+    /** Write the checkpoint to a temporary file next to [filename],
+	sync it to disk, and rename it to [filename]. Returns false,
+	leaving any older file in place, if it could not be written. */
+    bool Write( const std::string& filename ) const;
+
+    /** Read the checkpoint in [filename]. Returns false if the file
+	could not be read or decoded. */
+    bool Read( const std::string& filename );
+  };
+
+  /** Writes the checkpoints a World hands it to a file in a
+      background thread, so the simulation only pays for copying the
+      state, not for encoding it or for the disk. One checkpoint is
+      written at a time: while one is in progress, Busy() is true and
+      the World doesn't take another. */
+  class CheckpointWriter
+  {
+  public:
+    /** Starts the writer thread, which writes to [filename] */
+    CheckpointWriter( World* world, const std::string& filename );
+
+    /** Waits for the checkpoint in progress, if any, to be written */
+    ~CheckpointWriter();
+
+    /** Returns true if a checkpoint is being written */
+    bool Busy();
+
+    /** Write [ckpt] in the background, taking ownership of it.
+	Returns false, and deletes [ckpt], if the last checkpoint is
+	still being written. */
+    bool Write( Checkpoint* ckpt );
+
+    /** The number of checkpoints written successfully so far */
+    uint64_t Written() const { return written; }
+
+    /** Finish all checkpoints in progress. Registered with atexit(3),
+	since Stage usually quits without destroying its worlds. */
+    static void CloseAll();
+
+  private:
+    static void* WriterThreadEntry( void* arg );
+    void WriterThread();
+
+    World* world;
+    std::string filename;
+
+    /** the checkpoint being written, or NULL */
+    Checkpoint* pending;
+
+    volatile uint64_t written;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool quit; ///< set with mutex held to stop the writer
+
+    static std::set<CheckpointWriter*> open_writers;
+  };
+
+}; // namespace Stg
@@ -172,3 +172,50 @@ void Stg::Gl::draw_grid( bounds3d_t vol )
 }
 
 
+
+void VertexBatch::Append( const Pose& pose, 
+			  const std::vector<GLfloat>& local, 
+			  const GLubyte rgba[4] )
+{
+  const double c = cos( pose.a );
+  const double s = sin( pose.a );
+  
+  const size_t count = local.size() / 3;
+  const size_t first = verts.size();
+  verts.resize( first + 3 * count );
+  
+  GLfloat* out = &verts[first];
+  const GLfloat* in = count ? &local[0] : NULL;
+  
+  for( size_t v=0; v<count; ++v, in += 3, out += 3 )
+    {
+      out[0] = pose.x + c * in[0] - s * in[1];
+      out[1] = pose.y + s * in[0] + c * in[1];
+      out[2] = pose.z + in[2];
+    }
+  
+  colors.reserve( colors.size() + 4 * count );
+  for( size_t v=0; v<count; ++v )
+    colors.insert( colors.end(), rgba, rgba+4 );
+}
+
+void VertexBatch::Draw( GLenum mode ) const
+{
+  if( verts.empty() )
+    return;
+
+  // the vertex array is always enabled
+  glEnableClientState( GL_COLOR_ARRAY );
+  glVertexPointer( 3, GL_FLOAT, 0, &verts[0] );
+  glColorPointer( 4, GL_UNSIGNED_BYTE, 0, &colors[0] );
+  glDrawArrays( mode, 0, Count() );
+  glDisableClientState( GL_COLOR_ARRAY );
+}
+
+void VertexBatch::Pack( const Color& col, GLubyte rgba[4] )
+{
+  rgba[0] = (GLubyte)( col.r * 255.0 );
+  rgba[1] = (GLubyte)( col.g * 255.0 );
+  rgba[2] = (GLubyte)( col.b * 255.0 );
+  rgba[3] = (GLubyte)( col.a * 255.0 );
+}
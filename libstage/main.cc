@@ -19,12 +19,46 @@
 
     -a \"str\"       : equivalent to --args "str"
 
+    --replay \"log\" : replay a log written with the log_file world property, instead of simulating
+
+    -r \"log\"       : equivalent to --replay "log"
+
+    --restore \"file\" : restore a checkpoint written with the checkpoint_file world property, and carry on from there
+
+    -R \"file\"      : equivalent to --restore "file"
+
+    --pace <factor> : without a GUI, keep to this multiple of real time, overriding the pace world property
+
+    -p <factor>    : equivalent to --pace <factor>
+
+    --trials <n>   : without a GUI, fork n runs of the loaded world, seeded in turn, which each write their results when the world reaches its quit_time
+
+    -t <n>         : equivalent to --trials <n>
+
+    --jobs <n>     : run at most n trials at once, one per processor by default
+
+    -j <n>         : equivalent to --jobs <n>
+
+    --sweep \"file\" : give trial i the controller argument string on line i of file, in turn; blank lines and lines starting with # are skipped
+
+    -s \"file\"      : equivalent to --sweep "file"
+
+    --vary \"file\"  : give trial i the world properties on line i of file, in turn, as name value pairs; seed, interval_sim and quit_time can vary
+
+    -v \"file\"      : equivalent to --vary "file"
+
+    --results \"prefix\" : trial i writes its results to prefix.i, "trial" by default
+
+    -o \"prefix\"    : equivalent to --results "prefix"
+
     -h             : equivalent to --help"
 
     -?             : equivalent to --help
  */
 
 #include <getopt.h>
+#include <unistd.h>
+#include <fstream>
 
 #include "stage.hh"
 #include "config.h"
@@ -40,6 +74,22 @@ const char* USAGE =
   "  --help         : print this message\n"
   "  --args \"str\"   : define an argument string to be passed to all controllers\n"
   "  -a \"str\"       : equivalent to --args \"str\"\n"
+  "  --replay \"log\" : replay a log written with the log_file world property, instead of simulating\n"
+  "  -r \"log\"       : equivalent to --replay \"log\"\n"
+  "  --restore \"file\" : restore a checkpoint written with the checkpoint_file world property, and carry on from there\n"
+  "  -R \"file\"      : equivalent to --restore \"file\"\n"
+  "  --pace <factor> : without a GUI, keep to this multiple of real time, overriding the pace world property\n"
+  "  -p <factor>    : equivalent to --pace <factor>\n"
+  "  --trials <n>   : without a GUI, fork n runs of the loaded world, seeded in turn, which each write their results when the world reaches its quit_time\n"
+  "  -t <n>         : equivalent to --trials <n>\n"
+  "  --jobs <n>     : run at most n trials at once, one per processor by default\n"
+  "  -j <n>         : equivalent to --jobs <n>\n"
+  "  --sweep \"file\" : give trial i the controller argument string on line i of file, in turn\n"
+  "  -s \"file\"      : equivalent to --sweep \"file\"\n"
+  "  --vary \"file\"  : give trial i the world properties seed, interval_sim and quit_time on line i of file, as name value pairs\n"
+  "  -v \"file\"      : equivalent to --vary \"file\"\n"
+  "  --results \"prefix\" : trial i writes its results to prefix.i, \"trial\" by default\n"
+  "  -o \"prefix\"    : equivalent to --results \"prefix\"\n"
   "  -h             : equivalent to --help\n"
   "  -?             : equivalent to --help";
 
@@ -49,9 +99,35 @@ static struct option longopts[] = {
 	{ "clock",  optional_argument,   NULL,  'c' },
 	{ "help",  optional_argument,   NULL,  'h' },
 	{ "args",  required_argument,   NULL,  'a' },
+	{ "replay",  required_argument,   NULL,  'r' },
+	{ "restore",  required_argument,   NULL,  'R' },
+	{ "pace",  required_argument,   NULL,  'p' },
+	{ "trials",  required_argument,   NULL,  't' },
+	{ "jobs",  required_argument,   NULL,  'j' },
+	{ "sweep",  required_argument,   NULL,  's' },
+	{ "vary",  required_argument,   NULL,  'v' },
+	{ "results",  required_argument,   NULL,  'o' },
 	{ NULL, 0, NULL, 0 }
 };
 
+// Append the lines of [filename] to [lines], skipping blank lines and
+// comments. Exits if the file can't be read.
+static void ReadLines( const char* filename, const char* what,
+							  std::vector<std::string>& lines )
+{
+  std::ifstream in( filename );
+  if( ! in )
+	 {
+		PRINT_ERR2( "failed to open %s file \"%s\"", what, filename );
+		exit( EXIT_FAILURE );
+	 }
+  
+  std::string line;
+  while( std::getline( in, line ) )
+	 if( line.size() && line[0] != '#' )
+		lines.push_back( line );
+}
+
 int main( int argc, char* argv[] )
 {
   // initialize libstage - call this first
@@ -62,8 +138,16 @@ int main( int argc, char* argv[] )
   int ch=0, optindex=0;
   bool usegui = true;
   bool showclock = false;
+  const char* replayfile = NULL;
+  const char* restorefile = NULL;
+  double pace = -1; // use the worldfile's
+  unsigned int trials = 0;
+  unsigned int jobs = std::max( 1L, sysconf( _SC_NPROCESSORS_ONLN ));
+  std::vector<std::string> sweep;
+  std::vector<std::string> vary;
+  std::string results = "trial";
   
-  while ((ch = getopt_long(argc, argv, "cgh?", longopts, &optindex)) != -1)
+  while ((ch = getopt_long(argc, argv, "cgh?r:R:p:t:j:s:v:o:", longopts, &optindex)) != -1)
 	 {
 		switch( ch )
 		  {
@@ -81,6 +165,31 @@ int main( int argc, char* argv[] )
 			 usegui = false;
 			 printf( "[GUI disabled]" );
 			 break;
+		  case 'r':
+			 replayfile = optarg;
+			 break;
+		  case 'R':
+			 restorefile = optarg;
+			 break;
+		  case 'p':
+			 pace = atof( optarg );
+			 printf( "[Pace %.2f]", pace );
+			 break;
+		  case 't':
+			 trials = std::max( 0, atoi( optarg ));
+			 break;
+		  case 'j':
+			 jobs = std::max( 1, atoi( optarg ));
+			 break;
+		  case 's':
+			 ReadLines( optarg, "sweep", sweep );
+			 break;
+		  case 'v':
+			 ReadLines( optarg, "vary", vary );
+			 break;
+		  case 'o':
+			 results = optarg;
+			 break;
 		  case 'h':  
 		  case '?':  
 			 puts( USAGE );
@@ -93,6 +202,19 @@ int main( int argc, char* argv[] )
 		  }
 	 }
   
+  // trials run headless, each to its own results file
+  if( trials )
+	 {
+		if( argc - optind != 1 )
+		  {
+			 PRINT_ERR( "trials need exactly one worldfile" );
+			 exit( EXIT_FAILURE );
+		  }
+		
+		usegui = false;
+		printf( "[Trials %u]", trials );
+	 }
+
   puts("");// end the first start-up line
 
   // arguments at index [optindex] and later are not options, so they
@@ -107,9 +229,32 @@ int main( int argc, char* argv[] )
 			 World* world = ( usegui ? 
 										new WorldGui( 400, 300, worldfilename ) : 
 									new World( worldfilename ) );
+
+			 // before loading, so no controllers are started
+			 if( replayfile && ! world->StartReplay( replayfile ) )
+				exit( EXIT_FAILURE );
+
+			 if( restorefile && ! world->StartRestore( restorefile ) )
+				exit( EXIT_FAILURE );
+
+			 if( trials )
+				{
+				  world->SetTrials( trials, jobs, sweep, results );
+				  if( ! world->SetTrialProperties( vary ) )
+					 exit( EXIT_FAILURE );
+				}
+
 			 world->Load( worldfilename );
+
+			 // the trials have all run in their own processes
+			 if( trials && world->GetTrial() < 0 )
+				exit( world->GetTrialFailures() ? EXIT_FAILURE : EXIT_SUCCESS );
+
 			 world->ShowClock( showclock );
 
+			 if( pace >= 0 )
+				world->SetPace( pace );
+
 			 if( ! world->paused ) 
 				world->Start();
 		  }
@@ -50,6 +50,7 @@
     map_resolution 0.1
     say ""
     alwayson 0
+    log_state 0
 
     stack_children 1
     )
@@ -83,7 +84,13 @@
     load libfoo.so, which will have its Init() function called with
     the entire string as an argument (including the library name). It
     is up to the controller to parse the string if it needs
-    arguments."
+    arguments." If the library also exports a non-zero int
+    ThreadSafeCallbacks, e.g. 'extern "C" int ThreadSafeCallbacks =
+    1;', the callbacks its Init() adds, to this model or any other,
+    are thread-safe, as if added with Model::AddCallback( ..., true ),
+    and CB_UPDATE callbacks run in worker threads when the world has
+    threads > 1.
+    See Model::AddCallback() for what such callbacks may do.
  
     - fiducial_return fiducial_id:<int>\n if non-zero, this model is
     detected by fiducialfinder sensors. The value is used as the
@@ -123,6 +130,11 @@
     - gui_move <int>\n if 1, the model can be moved by the mouse in
     the GUI window
 
+    - log_state <int>\n If non-zero, and the world is logging (see
+    log_file in the World docs), the output of this model's sensor,
+    e.g. ranger samples, fiducials or blobs, is recorded along with
+    the poses of all models.
+
     - stack_children <int>\n If non-zero (the default), the coordinate
     system of child models is offset in z so that its origin is on
     _top_ of this model, making it easy to stack models together. If
@@ -246,11 +258,11 @@ Model::Model( World* world,
 	      const std::string& name ) :
   Ancestor(), 	 
   mapped(false),
-  drawOptions(),
   alwayson(false),
   blockgroup(*this),
   boundary(false),
-  callbacks(__CB_TYPE_COUNT), // one slot in the vector for each type
+  callbacks(), // sized by the first AddCallback()
+  ctrl_args(),
   color( 1,0,0 ), // red
   data_fresh(false),
   disabled(false),
@@ -260,6 +272,7 @@ Model::Model( World* world,
   geom(),
   has_default_block(true),
   id(Model::count++),
+  index(world->models_created++),
   interval((usec_t)1e5), // 100msec
   interval_energy((usec_t)1e5), // 100msec
   last_update(0),
@@ -270,14 +283,15 @@ Model::Model( World* world,
   pose(),
   power_pack(NULL),
   pps_charging(),
-  rastervis(),
+  rastervis(NULL),
   rebuild_displaylist(true),
+  replica(false),
   say_string(),
   stack_children(true),
   stall(false),	 
   subs(0),
   thread_safe(false),
-  trail(trail_length),
+  trail(), // sized by the first UpdateTrail()
   trail_index(0),
   type(type),	
   event_queue_num(0),
@@ -347,8 +361,6 @@ Model::Model( World* world,
   // now we can add the basic square shape
   AddBlockRect( -0.5, -0.5, 1.0, 1.0, 1.0 );
 
-  AddVisualizer( &rastervis, false );
-
   PRINT_DEBUG2( "finished model %s @ %p", this->Token(), this );
 }
 
@@ -358,7 +370,10 @@ Model::~Model( void )
   
   if( world ) // if I'm not a worldless dummy model
     {
-      UnMap(); // remove from all layers
+      // remove from all layers now, while our contacts still exist.
+      // UnMap() clears the mapped flag after the first layer.
+      blockgroup.UnMap(0);
+      blockgroup.UnMap(1);
       
       // remove myself from my parent's child list, or the world's child
       // list if I have no parent		
@@ -368,6 +383,12 @@ Model::~Model( void )
       
       world->RemoveModel( this );
     }
+
+  if( rastervis )
+    {
+      RemoveVisualizer( rastervis );
+      delete rastervis;
+    }
 }
 
 
@@ -376,6 +397,12 @@ void Model::InitControllers()
   CallCallbacks( CB_INIT );
 }
 
+void Model::SetControllerArgs( const std::string& cmdline )
+{
+  FOR_EACH( it, ctrl_args )
+    (*it)->cmdline = cmdline;
+}
+
 
 void Model::AddFlag( Flag* flag )
 {
@@ -727,20 +754,26 @@ void Model::Update( void )
 	
   if( subs > 0 ) // no subscriptions means we don't need to be updated
     world->Enqueue( event_queue_num, interval, this, UpdateWrapper, NULL );
+
+  if( log_state )
+    world->Log( this );
 	
-  // if we updated the model then it needs to have its update
-  // callback called in series back in the main thread. It's
-  // not safe to run user callbacks in a worker thread, as
-  // they may make OpenGL calls or unsafe Stage API calls,
-  // etc. We queue up the callback into a queue specific to
+  if( callbacks.empty() || callbacks[Model::CB_UPDATE].cbs.empty() )
+    return;
 
-  if( ! callbacks[Model::CB_UPDATE].empty() )
+  // callbacks registered as thread-safe are called right here, in
+  // whichever thread updated the model. The rest need to be called
+  // in series back in the main thread. It's not safe to run them in
+  // a worker thread, as they may make OpenGL calls or unsafe Stage
+  // API calls, etc. We queue up the callback into a queue specific
+  // to this thread.
+  if( CallCallbacks( CB_UPDATE, true ) > 0 )
     world->pending_update_callbacks[event_queue_num].push(this);					
 }
 
 void Model::CallUpdateCallbacks( void )
 {
-  CallCallbacks( CB_UPDATE );
+  CallCallbacks( CB_UPDATE, false );
 }
 
 meters_t Model::ModelHeight() const
@@ -778,13 +811,59 @@ void Model::PlaceInFreeSpace( meters_t xmin, meters_t xmax,
 
 void Model::AppendTouchingModels( std::set<Model*>& touchers )
 {
-  blockgroup.AppendTouchingModels( touchers );
+  FOR_EACH( it, contacts[ world->updates % 2 ] )
+    if( ! IsRelated( it->first ))
+      touchers.insert( it->first );
+}
+
+void Model::AddContact( Model* other, unsigned int layer, unsigned int count )
+{
+  contacts[layer][other] += count;
+}
+
+void Model::RemoveContact( Model* other, unsigned int layer, unsigned int count )
+{
+  std::map<Model*,unsigned int>::iterator it( contacts[layer].find( other ));
+  assert( it != contacts[layer].end() && it->second >= count );
+
+  if( (it->second -= count) == 0 )
+    contacts[layer].erase( it );
 }
 
 
 Model* Model::TestCollision()
 {  
-  Model* hitmod( blockgroup.TestCollision() );
+  Model* hitmod( NULL );
+
+  if( vis.obstacle_return )
+    {
+      const unsigned int layer( world->updates % 2 );
+      const Bounds& z( mapped_z[layer] );
+
+      // broad phase: of the models sharing a cell with us, found while
+      // mapping, keep the unrelated obstacles that overlap us in z
+      std::vector<Model*>& candidates( world->collision_candidates );
+      candidates.clear();
+
+      FOR_EACH( it, contacts[layer] )
+	{
+	  Model* other( it->first );
+	  const Bounds& oz( other->mapped_z[layer] );
+
+	  if( other->vis.obstacle_return &&
+	      oz.min <= z.max && oz.max >= z.min &&
+	      ! IsRelated( other ))
+	    candidates.push_back( other );
+	}
+
+      World::CollisionStats& stats( world->collision_stats );
+      ++stats.tests;
+      stats.contacts += contacts[layer].size();
+      stats.candidates += candidates.size();
+
+      // narrow phase: compare our blocks with theirs cell by cell
+      hitmod = blockgroup.TestCollision( candidates );
+    }
   
   if( hitmod == NULL ) 	 
     FOR_EACH( it, children )
@@ -852,6 +931,17 @@ void Model::UpdateCharge()
 
 void Model::UpdateTrail()
 {
+  if( trail_length == 0 )
+    return;
+
+  // allocated here rather than in the constructor, since only the
+  // GUI draws trails. This also picks up changes to trail_length.
+  if( trail.size() != trail_length )
+    {
+      trail.resize( trail_length );
+      trail_index %= trail_length;
+    }
+
   // get the current item and increment the counter
   TrailItem* item = &trail[trail_index++];
 	
@@ -941,6 +1031,18 @@ void Model::Map( unsigned int layer )
       // render all blocks in the group at my global pose and size
       blockgroup.Map( layer );
       mapped = true;
+
+      // record our z extent for the collision broad phase
+      Bounds& z( mapped_z[layer] );
+      z = Bounds( billion, -billion );
+      FOR_EACH( it, blockgroup.blocks )
+	{
+	  z.min = std::min( z.min, it->global_z.min );
+	  z.max = std::max( z.max, it->global_z.max );
+	}
+
+      if( world->planner )
+	world->planner->ModelMapped( this );
     }
 } 
 
@@ -950,6 +1052,9 @@ void Model::UnMap( unsigned int layer )
     {
       blockgroup.UnMap(layer);
       mapped = false;
+
+      if( world->planner )
+	world->planner->ModelMapped( this );
     }
 }
 
@@ -963,6 +1068,9 @@ void Model::BecomeParentOf( Model* child )
   child->parent = this;
   
   this->AddChild( child );
+
+  if( world->planner )
+    world->planner->ModelReparented( child );
   
   world->dirty = true; 
 }
@@ -990,9 +1098,57 @@ void Model::Rasterize( uint8_t* data,
 		       meters_t cellwidth,
 		       meters_t cellheight )
 {
-  rastervis.ClearPts();
+  // the rasterization is only recorded for visualization
+  if( world_gui && ! rastervis )
+    {
+      rastervis = new RasterVis();
+      AddVisualizer( rastervis, false );
+    }
+
+  if( rastervis )
+    rastervis->ClearPts();
+
   blockgroup.Rasterize( data, width, height, cellwidth, cellheight );
-  rastervis.SetData( data, width, height, cellwidth, cellheight );
+
+  if( rastervis )
+    rastervis->SetData( data, width, height, cellwidth, cellheight );
+}
+
+// approximate heap cost of a node in a std::set or std::list holding T
+template <class T> static size_t node_size( void )
+{ return sizeof(T) + 4*sizeof(void*); }
+
+Model::MemoryReport Model::GetMemoryReport() const
+{
+  MemoryReport r;
+
+  r.object = sizeof(Model);
+
+  r.blocks = blockgroup.blocks.capacity() * sizeof(Block);
+  FOR_EACH( it, blockgroup.blocks )
+    r.blocks += ( it->rendered_cells[0].capacity() + 
+		  it->rendered_cells[1].capacity() ) * sizeof(Cell*);
+  r.blocks += ( contacts[0].size() + contacts[1].size() ) 
+    * node_size< std::pair<Model* const,unsigned int> >();
+  
+  r.callbacks = callbacks.capacity() * sizeof(CallbackList);
+  FOR_EACH( it, callbacks )
+    r.callbacks += it->cbs.capacity() * sizeof(cb_t);
+
+  r.gui = trail.capacity() * sizeof(TrailItem)
+    + cv_list.size() * node_size<Visualizer*>()
+    + flag_list.size() * ( node_size<Flag*>() + sizeof(Flag) );
+  if( rastervis )
+    r.gui += sizeof(RasterVis);
+
+  r.other = token.capacity() 
+    + children.capacity() * sizeof(Model*)
+    + say_string.capacity()
+    + props.size() * node_size<std::pair<std::string,void*> >()
+    + child_type_counts.size() * node_size<std::pair<std::string,unsigned int> >()
+    + pps_charging.size() * node_size<PowerPack*>();
+  
+  return r;
 }
 
 void Model::SetFriction( double friction )
@@ -1355,6 +1511,9 @@ int Model::SetParent( Model* newparent)
   else
     world->AddModel( this );
 
+  if( world->planner )
+    world->planner->ModelReparented( this );
+
   CallCallbacks( CB_PARENT );
 
   SetGlobalPose( oldPose ); // Needs to recalculate position due to change in parent
@@ -1469,8 +1628,9 @@ void Model::Load()
   
   debug = wf->ReadInt( wf_entity, "debug", debug );
   
+  // a replica's name is made by its replicate entity
   const std::string& name = wf->ReadString(wf_entity, "name", token );
-  if( name != token )
+  if( name != token && ! replica )
     SetToken( name );
   
   //PRINT_WARN1( "%s::Load", token );
@@ -1485,7 +1645,7 @@ void Model::Load()
   
   SetGeom( g );
 
-  if( wf->PropertyExists( wf_entity, "pose" ))
+  if( wf->PropertyExists( wf_entity, "pose" ) && ! replica )
     SetPose( GetPose().Load( wf, wf_entity, "pose" ) );
   
 
@@ -1595,13 +1755,14 @@ void Model::Load()
   Say( wf->ReadString(wf_entity, "say", "" ));
   
   trail_length = wf->ReadInt( wf_entity, "trail_length", trail_length );
-  trail.resize( trail_length );
 
   trail_interval = wf->ReadInt( wf_entity, "trail_interval", trail_interval );
 
   this->alwayson = wf->ReadInt( wf_entity, "alwayson",  alwayson );
   if( alwayson )
     Subscribe();
+
+  this->log_state = wf->ReadInt( wf_entity, "log_state", log_state );
 	
   // call any type-specific load callbacks
   this->CallCallbacks( CB_LOAD );
@@ -1625,8 +1786,9 @@ void Model::Save( void )
 {  
   //printf( "Model \"%s\" saving...\n", Token() );
 
-  // some models were not loaded, so have no worldfile. Just bail here.
-  if( wf == NULL )
+  // some models were not loaded, so have no worldfile. Just bail
+  // here. Replicas share their entity, so none of them saves into it
+  if( wf == NULL || replica )
     return;
 
   assert( wf_entity );
@@ -1659,6 +1821,79 @@ void Model::Save( void )
   PRINT_DEBUG1( "Model \"%s\" saving complete.", token.c_str() );
 }
 
+void Model::SaveState( StateWriter& out ) const
+{
+  out.PutPose( pose );
+  out.Put( last_update );
+  out.Put( stall );
+  out.Put( disabled );
+  out.Put( color.r ); out.Put( color.g ); out.Put( color.b ); out.Put( color.a );
+  out.PutString( say_string );
+
+  // only our own powerpack: a child's is saved with the child
+  out.Put( (uint8_t)( power_pack != NULL ));
+  if( power_pack )
+    {
+      out.Put( power_pack->GetStored() );
+      out.Put( power_pack->GetDissipated() );
+      out.Put( power_pack->GetCharging() );
+    }
+}
+
+void Model::LoadState( StateReader& in )
+{
+  Pose p;
+  in.GetPose( p );
+  SetPose( p );
+
+  in.Get( last_update );
+  in.Get( stall );
+  in.Get( disabled );
+
+  Color c;
+  in.Get( c.r ); in.Get( c.g ); in.Get( c.b ); in.Get( c.a );
+  SetColor( c );
+  say_string = in.GetString();
+
+  if( in.Get<uint8_t>() )
+    {
+      const joules_t stored( in.Get<joules_t>() );
+      const joules_t dissipated( in.Get<joules_t>() );
+      const bool charging( in.Get<bool>() );
+
+      if( power_pack )
+	{
+	  power_pack->SetStored( stored );
+	  power_pack->SetDissipated( dissipated );
+	  charging ? power_pack->ChargeStart() : power_pack->ChargeStop();
+	}
+    }
+}
+
+
+// the arguments for a thread-safe controller's Init()
+class ThreadSafeInitArgs
+{
+public:
+  model_callback_t initfunc;
+  CtrlArgs* args;
+
+  ThreadSafeInitArgs( model_callback_t initfunc, CtrlArgs* args )
+    : initfunc(initfunc), args(args) {}
+};
+
+int Model::ThreadSafeInit( Model* mod, void* arg )
+{
+  ThreadSafeInitArgs* tsi = (ThreadSafeInitArgs*)arg;
+  
+  // controllers often add their callbacks to their model's sensors,
+  // so the flag is the world's, not the model's
+  mod->world->thread_safe_init = true;
+  const int retval = tsi->initfunc( mod, tsi->args );
+  mod->world->thread_safe_init = false;
+
+  return retval;
+}
 
 void Model::LoadControllerModule( const char* lib )
 {
@@ -1701,7 +1936,17 @@ void Model::LoadControllerModule( const char* lib )
 	  exit(-1);
 	}
 		
-      AddCallback( CB_INIT, initfunc, new CtrlArgs(lib,World::ctrlargs) ); // pass complete string into initfunc
+      CtrlArgs* args = new CtrlArgs(lib,World::ctrlargs); // pass complete string into initfunc
+      ctrl_args.push_back( args );
+
+      // a controller declares that all its callbacks are thread-safe
+      // by exporting a non-zero int ThreadSafeCallbacks
+      const int* ts = (const int*)lt_dlsym( handle, "ThreadSafeCallbacks" );
+
+      if( ts && *ts )
+	AddCallback( CB_INIT, ThreadSafeInit, new ThreadSafeInitArgs( initfunc, args ));
+      else
+	AddCallback( CB_INIT, initfunc, args );
     }
   else
     {
@@ -309,6 +309,22 @@ void ModelActuator::Shutdown( void )
 	Model::Shutdown();
 }
 
+void ModelActuator::SaveState( StateWriter& out ) const
+{
+	Model::SaveState( out );
+
+	out.Put( goal );
+	out.Put( (int32_t)control_mode );
+}
+
+void ModelActuator::LoadState( StateReader& in )
+{
+	Model::LoadState( in );
+
+	in.Get( goal );
+	control_mode = (ControlMode)in.Get<int32_t>();
+}
+
 void ModelActuator::SetSpeed( double speed)
 {
 	control_mode = CONTROL_VELOCITY;
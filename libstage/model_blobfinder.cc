@@ -18,6 +18,7 @@
 #include "stage.hh"
 #include "option.hh"
 #include "worldfile.hh"
+#include "canvas.hh"
 using namespace Stg;
 
 static const watts_t DEFAULT_BLOBFINDERWATTS = 2.0;
@@ -308,37 +309,77 @@ ModelBlobfinder::Vis::Vis( World* world )
   //world->RegisterOption( &showBeams );		  
 }
 
+/** A copy of what a blobfinder's visualizer draws */
+class ModelBlobfinder::Snapshot : public DataSnapshot
+{
+public:
+  bool debug;
+  meters_t range;
+  radians_t fov, pan;
+  radians_t heading; ///< the blobfinder's angle on its parent
+  unsigned int scan_width, scan_height;
+  std::vector<Blob> blobs;
+  std::string menu_name; ///< of the blobfinder's visualizer
+
+  Snapshot( const ModelBlobfinder* bf ) :
+    DataSnapshot( bf ),
+    debug( bf->debug ),
+    range( bf->range ),
+    fov( bf->fov ),
+    pan( bf->pan ),
+    heading( bf->pose.a ),
+    scan_width( bf->scan_width ),
+    scan_height( bf->scan_height ),
+    blobs( bf->blobs ),
+    menu_name( bf->vis.GetMenuName() )
+  {}
+
+  virtual void Draw( World* world, Camera* cam ) const
+  {
+    WorldGui* wg( dynamic_cast<WorldGui*>( world ));
+    if( wg && wg->GetCanvas()->_custom_options[ menu_name ]->isEnabled() )
+      DrawBlobs( world, cam );
+  }
+
+  void DrawBlobs( World* world, Camera* cam ) const;
+};
+
+DataSnapshot* ModelBlobfinder::SnapshotData() const
+{
+  return new Snapshot( this );
+}
+
 void ModelBlobfinder::Vis::Visualize( Model* mod, Camera* cam )
 {
-  ModelBlobfinder* bf( dynamic_cast<ModelBlobfinder*>(mod) );
-  
-  if( bf->debug )
+  // the blobs are few, so copying them costs next to nothing
+  Snapshot( dynamic_cast<ModelBlobfinder*>(mod) ).DrawBlobs( mod->GetWorld(), cam );
+}
+
+void ModelBlobfinder::Snapshot::DrawBlobs( World* world, Camera* cam ) const
+{
+  if( debug )
 	{
 	  // draw the FOV
 	  GLUquadric* quadric = gluNewQuadric();
 	  
-	  bf->PushColor( 0,0,0,0.2  );
+	  world->PushColor( 0,0,0,0.2  );
 	  
 	  gluQuadricDrawStyle( quadric, GLU_SILHOUETTE );
 	  gluPartialDisk( quadric,
 							0, 
-							bf->range,
+							range,
 							20, // slices	
 							1, // loops
-							rtod( M_PI/2.0 + bf->fov/2.0 - bf->pan), // start angle
-							rtod(-bf->fov) ); // sweep angle
+							rtod( M_PI/2.0 + fov/2.0 - pan), // start angle
+							rtod(-fov) ); // sweep angle
 	  
 	  gluDeleteQuadric( quadric );
-	  bf->PopColor();
+	  world->PopColor();
 	}
   
-  if( bf->subs < 1 )
-	 return;
-  
   glPushMatrix();
 
 	// return to global rotation frame
-  Pose gpose( bf->GetGlobalPose() );
   glRotatef( rtod(-gpose.a),0,0,1 );
   
   // place the "screen" a little away from the robot
@@ -348,7 +389,7 @@ void ModelBlobfinder::Vis::Visualize( Model* mod, Camera* cam )
   float yaw, pitch;
   pitch = - cam->pitch();
   yaw = - cam->yaw();
-  float robotAngle = -rtod(bf->pose.a);
+  float robotAngle = -rtod(heading);
   glRotatef( robotAngle - yaw, 0,0,1 );
   glRotatef( -pitch, 1,0,0 );
   
@@ -356,30 +397,30 @@ void ModelBlobfinder::Vis::Visualize( Model* mod, Camera* cam )
   glScalef( 0.025, 0.025, 1 );
   
   // draw a white screen with a black border
-  bf->PushColor( 1,1,1,1 );
-  glRectf( 0,0, bf->scan_width, bf->scan_height );
-  bf->PopColor();
+  world->PushColor( 1,1,1,1 );
+  glRectf( 0,0, scan_width, scan_height );
+  world->PopColor();
   
   glTranslatef(0,0,0.01 );
   
   glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
-  bf->PushColor( 1,0,0,1 );
-  glRectf( 0,0, bf->scan_width, bf->scan_height );
-  bf->PopColor();
+  world->PushColor( 1,0,0,1 );
+  glRectf( 0,0, scan_width, scan_height );
+  world->PopColor();
   glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
   
   // draw the blobs on the screen
-  for( unsigned int s=0; s<bf->blobs.size(); s++ )
+  for( unsigned int s=0; s<blobs.size(); s++ )
 	 {
-		Blob* b = &bf->blobs[s];
+		const Blob* b = &blobs[s];
 		//blobfinder_blob_t* b = 
 		//&g_array_index( blobs, blobfinder_blob_t, s);
 		
-		bf->PushColor( b->color );
+		world->PushColor( b->color );
 		glRectf( b->left, b->top, b->right, b->bottom );
 
 		//printf( "%u l %u t%u r %u b %u\n", s, b->left, b->top, b->right, b->bottom );
-		bf->PopColor();
+		world->PopColor();
 	 }
   
   glPopMatrix();
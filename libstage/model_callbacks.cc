@@ -3,12 +3,40 @@ using namespace Stg;
 using namespace std;
 
 
-void Model::AddCallback( callback_type_t type, 
-												 model_callback_t cb, 
-												 void* user )
+void Model::CallbackList::Compact()
 {
-  //callbacks[address].insert( cb_t( cb, user ));	
-	callbacks[type].insert( cb_t( cb, user ));
+	if( dead == 0 || calling > 0 )
+		return;
+
+	// slide the live entries down over the dead ones, keeping their
+	// order. No memory is released, so the next add is cheap.
+	std::vector<cb_t>::iterator out = cbs.begin();
+	FOR_EACH( it, cbs )
+		if( it->callback )
+			*out++ = *it;
+
+	cbs.erase( out, cbs.end() );
+	dead = 0;
+}
+
+
+void Model::AddCallback( callback_type_t type,
+												 model_callback_t cb,
+												 void* user,
+												 bool thread_safe )
+{
+	if( callbacks.empty() ) // one slot in the vector for each type
+		callbacks.resize( __CB_TYPE_COUNT );
+
+	CallbackList& cbl = callbacks[type];
+
+	// each callback and argument pair is added once only
+	FOR_EACH( it, cbl.cbs )
+		if( it->callback == cb && it->arg == user )
+			return;
+
+	cbl.Compact();
+	cbl.cbs.push_back( cb_t( cb, user, thread_safe || world->thread_safe_init ));
 
 	// debug info - record the global number of registered callbacks
 	if( type == CB_UPDATE )
@@ -22,43 +50,79 @@ void Model::AddCallback( callback_type_t type,
 int Model::RemoveCallback( callback_type_t type,
 													 model_callback_t callback )
 {
-	set<cb_t>& callset = callbacks[type];	
-	callset.erase( cb_t( callback, NULL) );
+	if( callbacks.empty() ) // none were ever added
+		return 0;
+
+	CallbackList& cbl = callbacks[type];
+
+	FOR_EACH( it, cbl.cbs )
+		if( it->callback == callback )
+			{
+				it->callback = NULL; // mark dead
+				cbl.dead++;
+
+				if( type == CB_UPDATE )
+					{
+						world->update_cb_count--;
+						assert( world->update_cb_count >= 0 );
+					}
+			}
+
+	cbl.Compact();
 
-	
-	if( type == CB_UPDATE )
-		{
-			world->update_cb_count--;
-			assert( world->update_cb_count >= 0 );
-		}
-	
 	// return the number of callbacks remaining for this address. Useful
 	// for detecting when there are none.
-	return callset.size();
+	return cbl.Live();
 }
 
 
-int Model::CallCallbacks( callback_type_t type )
+int Model::CallCallbacks( callback_type_t type, bool thread_safe )
 {
-	// maintain a list of callbacks that should be cancelled
-	vector<cb_t> doomed;
-	
-	set<cb_t>& callset = callbacks[type];
-	
-	FOR_EACH( it, callset )
-	  {  
-			const cb_t& cba = *it;  
-			// callbacks return true if they should be cancelled
-			if( (cba.callback)( this, cba.arg ) )
-				doomed.push_back( cba );
-	  }      
-	
-	FOR_EACH( it, doomed )
-		callset.erase( *it );
+	if( callbacks.empty() || callbacks[type].cbs.empty() )
+		return 0;
 
-	// return the number of callbacks remaining for this address. Useful
-	// for detecting when there are none.
-	return callset.size();
+	return DispatchCallbacks( type, thread_safe ? 1 : 0 );
 }
 
 
+int Model::DispatchCallbacks( callback_type_t type, int thread_safe )
+{
+	CallbackList& cbl = callbacks[type];
+	int skipped = 0;
+
+	cbl.calling++;
+
+	// callbacks added by a callback are not called until next time, and
+	// may reallocate the vector, so index it
+	const size_t count = cbl.cbs.size();
+	for( size_t i=0; i<count; ++i )
+		{
+			const cb_t cba = cbl.cbs[i];
+
+			if( cba.callback == NULL ) // removed
+				continue;
+
+			if( thread_safe >= 0 && cba.thread_safe != (thread_safe > 0) )
+				{
+					++skipped; // called elsewhere
+					continue;
+				}
+
+			// callbacks return true if they should be cancelled. The
+			// callback may have removed itself already.
+			if( (cba.callback)( this, cba.arg ) && cbl.cbs[i].callback )
+				{
+					cbl.cbs[i].callback = NULL;
+					cbl.dead++;
+				}
+		}
+
+	cbl.calling--;
+	cbl.Compact();
+
+	// return the number of callbacks remaining for this address, or the
+	// number left for the other thread. Useful for detecting when there
+	// are none.
+	return( thread_safe >= 0 ? skipped : (int)cbl.Live() );
+}
+
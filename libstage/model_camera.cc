@@ -20,6 +20,8 @@ using namespace Stg;
 
 #include <sstream>
 #include <iomanip>
+#include <pthread.h>
+#include <unistd.h>
 
 //TODO make instance attempt to register an option (as customvisualizations do)
 Option ModelCamera::showCameraData( "Show Camera Data", "show_camera", "", true, NULL );
@@ -48,6 +50,8 @@ camera
   range [ 0.2 8.0 ]
   fov [ 70.0 40.0 ]
   pantilt [ 0.0 0.0 ]
+  render "opengl"
+  render_threads 0
 
   # model properties
   size [ 0.1 0.07 0.05 ]
@@ -67,6 +71,18 @@ camera
   angle, in degrees, for the horizontal and vertical field of view.
 - pantilt [ pan:<float> tilt:<float> ]
   angle, in degrees, where the camera is looking. pan is the left-right positioning, and tilt is the up-down positioning.
+- render "opengl" or "raytrace"\n
+  how frames are rendered. "opengl" draws the scene with the GUI's
+  OpenGL canvas, so it needs a GUI and runs in the GUI thread.
+  "raytrace" casts rays through the world's occupancy cells in
+  software, using the z extent of each block and the color of its
+  model, so it works in headless worlds (stage -g) without a display
+  or GPU, and can run in a worker thread. Defaults to "opengl" in a
+  GUI world and "raytrace" otherwise. A GUI world with sim_thread 1
+  always raytraces, as the OpenGL context belongs to the GUI thread.
+- render_threads <int>\n
+  the number of threads that share the work of raytracing each frame,
+  by image columns and rows. 0, the default, uses one per processor.
 */
 
 //caclulate the corss product, and store results in the first vertex
@@ -100,18 +116,25 @@ ModelCamera::ModelCamera( World* world,
   _camera_colors( NULL ),
   _camera(),
   _yaw_offset( 0.0 ),
-  _pitch_offset( 0.0 )  
+  _pitch_offset( 0.0 ),
+  _raytrace( false ),
+  _render_threads( 0 ),
+  _spans(),
+  _frame_pose()
 {
 	PRINT_DEBUG2( "Constructing ModelCamera %d (%s)\n", 
 			id, typestr );
 
 	WorldGui* world_gui = dynamic_cast< WorldGui* >( world );
 	
-	if( world_gui == NULL ) {
-		printf( "Unable to use Camera Model - it must be run with a GUI world\n" );
-		assert( 0 );
-	}
-	_canvas = world_gui->GetCanvas();
+	if( world_gui )
+		_canvas = world_gui->GetCanvas();
+	else
+		_raytrace = true; // no OpenGL without a GUI
+
+	// a raytraced camera doesn't touch OpenGL, so it can be updated in
+	// a worker thread. Load() may change its mind
+	thread_safe = _raytrace;
 	
 	_camera.setPitch( 90.0 );
 	
@@ -158,6 +181,37 @@ void ModelCamera::Load( void )
 	wf->ReadTuple( wf_entity, "pantilt", 0, 2, "ff", &_yaw_offset, &_pitch_offset );
 
 	wf->ReadTuple( wf_entity, "resolution", 0, 2, "ii", &_width, &_height );	
+
+	const std::string render = 
+		wf->ReadString( wf_entity, "render", _raytrace ? "raytrace" : "opengl" );
+
+	if( render == "raytrace" )
+		_raytrace = true;
+	else if( render == "opengl" ) {
+		if( _canvas == NULL )
+			PRINT_WARN1( "camera %s can't render with OpenGL without a GUI. Raytracing instead.", 
+									 Token() );
+		else
+			_raytrace = false;
+	}
+	else
+		PRINT_WARN2( "camera %s: unknown render \"%s\". Use \"opengl\" or \"raytrace\".",
+								 Token(), render.c_str() );
+
+	// the GL context belongs to the GUI thread. WorldGui reads
+	// sim_thread after the models are loaded, so look for it here
+	if( ! _raytrace && 
+			( world_gui->SimThreaded() || wf->ReadInt( 0, "sim_thread", 0 )) ) {
+		PRINT_WARN1( "camera %s can't render with OpenGL in a threaded world. Raytracing instead.", 
+								 Token() );
+		_raytrace = true;
+	}
+
+	// now the render method is settled, so is where we can run
+	thread_safe = _raytrace;
+	event_queue_num = thread_safe ? world->GetEventQueue( this ) : 0;
+
+	_render_threads = std::max( 0, wf->ReadInt( wf_entity, "render_threads", _render_threads ));
 }
 
 
@@ -191,6 +245,9 @@ bool ModelCamera::GetFrame( void )
 		_camera_colors = new GLubyte[ _camera_quads_size ];
 	}
 
+	if( _raytrace )
+		return RaytraceFrame();
+
 	//TODO overcome issue when glviewport is set LARGER than the window side
 	//currently it just clips and draws outside areas black - resulting in bad glreadpixel data
 	if( _width > _canvas->w() )
@@ -240,6 +297,294 @@ bool ModelCamera::GetFrame( void )
 	return true;
 }
 
+/** Runs a job of numbered pieces on a few helper threads, which are
+		shared by all raytraced cameras. The calling thread works too. If
+		the helpers are busy with another camera's job, the caller does
+		all the work itself rather than wait. */
+class RenderPool
+{
+public:
+	typedef void (*job_t)( void* arg, unsigned int piece );
+
+	/** Call job( arg, i ) for each i in [0,count), using up to [threads]
+			threads including the caller. Returns when all are done. */
+	static void Run( job_t job, void* arg, unsigned int count, unsigned int threads );
+
+private:
+	class HelperArgs
+	{
+	public:
+		unsigned int id;
+		uint64_t generation;
+	};
+
+	static void* Helper( void* arg );
+	static void Work();
+
+	static pthread_mutex_t busy; ///< held while a job is running
+	static pthread_mutex_t mutex; ///< guards the fields below
+	static pthread_cond_t start_cond, done_cond;
+	static unsigned int helpers; ///< helper threads created
+	static unsigned int wanted; ///< helpers wanted for this job
+	static unsigned int running; ///< helpers still working on this job
+	static uint64_t generation; ///< incremented for each job
+
+	static job_t job;
+	static void* arg;
+	static unsigned int count;
+	static volatile unsigned int next; ///< the next piece to do
+};
+
+pthread_mutex_t RenderPool::busy = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t RenderPool::mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t RenderPool::start_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t RenderPool::done_cond = PTHREAD_COND_INITIALIZER;
+unsigned int RenderPool::helpers = 0;
+unsigned int RenderPool::wanted = 0;
+unsigned int RenderPool::running = 0;
+uint64_t RenderPool::generation = 0;
+RenderPool::job_t RenderPool::job = NULL;
+void* RenderPool::arg = NULL;
+unsigned int RenderPool::count = 0;
+volatile unsigned int RenderPool::next = 0;
+
+void RenderPool::Run( job_t j, void* a, unsigned int c, unsigned int threads )
+{
+	if( threads < 2 || c < 2 || pthread_mutex_trylock( &busy ) != 0 ) {
+		for( unsigned int i=0; i<c; ++i )
+			j( a, i );
+		return;
+	}
+
+	pthread_mutex_lock( &mutex );
+
+	// start more helpers if this job wants them
+	while( helpers < threads-1 ) {
+		HelperArgs* ha = new HelperArgs;
+		ha->id = helpers;
+		ha->generation = generation;
+
+		pthread_t pt;
+		if( pthread_create( &pt, NULL, Helper, ha ) != 0 ) {
+			delete ha;
+			break;
+		}
+		pthread_detach( pt );
+		++helpers;
+	}
+
+	job = j;
+	arg = a;
+	count = c;
+	next = 0;
+	wanted = std::min( threads-1, helpers );
+	running = wanted;
+	++generation;
+	pthread_cond_broadcast( &start_cond );
+	pthread_mutex_unlock( &mutex );
+
+	Work();
+
+	pthread_mutex_lock( &mutex );
+	while( running > 0 )
+		pthread_cond_wait( &done_cond, &mutex );
+	pthread_mutex_unlock( &mutex );
+
+	pthread_mutex_unlock( &busy );
+}
+
+void RenderPool::Work()
+{
+	for(;;) {
+		const unsigned int i = __sync_fetch_and_add( &next, 1 );
+		if( i >= count )
+			break;
+		job( arg, i );
+	}
+}
+
+void* RenderPool::Helper( void* p )
+{
+	HelperArgs* ha = (HelperArgs*)p;
+	const unsigned int id = ha->id;
+	uint64_t seen = ha->generation;
+	delete ha;
+
+	pthread_mutex_lock( &mutex );
+	for(;;) {
+		while( generation == seen )
+			pthread_cond_wait( &start_cond, &mutex );
+		seen = generation;
+
+		if( id >= wanted ) // not needed this time
+			continue;
+
+		pthread_mutex_unlock( &mutex );
+		Work();
+		pthread_mutex_lock( &mutex );
+
+		if( --running == 0 )
+			pthread_cond_signal( &done_cond );
+	}
+	return NULL;
+}
+
+// the camera can't see itself, or the robot it's mounted on
+static bool camera_match( Model* hit, 
+													Model* finder,
+													const void* dummy )
+{
+	(void)dummy;
+
+	if( (hit == finder->Parent()) || (hit == finder) ) return false;
+	
+	return( ! hit->IsRelated( finder ) );
+}
+
+void ModelCamera::TraceColumn( void* cam, unsigned int col )
+{
+	ModelCamera* mod = (ModelCamera*)cam;
+
+	// the bearing of this column, as laid out by DataVisualize()
+	const double a_space = mod->_camera.horizFov() / mod->_width;
+	Pose pose = mod->_frame_pose;
+	pose.a = normalize( pose.a + 
+											dtor( mod->_camera.horizFov() / 2.0 - col * a_space - mod->_yaw_offset ));
+
+	// every block along the ray, whatever its height
+	std::vector<RaytraceResult> hits;
+	Ray ray( mod, pose, mod->_camera.farClip(), camera_match, NULL, false );
+	ray.hits = &hits;
+	mod->world->Raytrace( ray );
+
+	// merge the cells of each block that the ray passes through
+	// in succession into one span
+	const meters_t cell = 1.0 / mod->world->Resolution();
+
+	std::vector<Span>& spans = mod->_spans[col];
+	spans.clear();
+
+	FOR_EACH( it, hits ) {
+		Span* last = spans.empty() ? NULL : &spans.back();
+		
+		if( last && 
+				last->z.min == it->z.min && last->z.max == it->z.max &&
+				it->range - last->far < cell ) {
+			last->far = it->range + cell;
+			continue;
+		}
+		
+		Span span;
+		span.near = it->range;
+		span.far = it->range + cell;
+		span.z = it->z;
+		span.color[0] = (GLubyte)( it->color.r * 255.0 );
+		span.color[1] = (GLubyte)( it->color.g * 255.0 );
+		span.color[2] = (GLubyte)( it->color.b * 255.0 );
+		span.color[3] = (GLubyte)( it->color.a * 255.0 );
+		spans.push_back( span );
+	}
+}
+
+void ModelCamera::ShadeRow( void* cam, unsigned int row )
+{
+	ModelCamera* mod = (ModelCamera*)cam;
+
+	static const GLubyte background[4] = { 178, 178, 204, 255 }; // as the canvas
+	static const GLubyte floor[4] = { 255, 255, 255, 255 };
+
+	// the elevation of this row, as laid out by DataVisualize(). Row 0
+	// is the bottom of the image, as with glReadPixels().
+	const double vert_a_space = mod->_camera.vertFov() / mod->_height;
+	const double elevation = 
+		dtor( mod->_camera.vertFov() / 2.0 - ( mod->_height - row - 1 ) * vert_a_space 
+					- mod->_pitch_offset );
+
+	const double slope = tan( elevation ); // dz per meter travelled horizontally
+	const double stretch = sqrt( 1.0 + slope * slope ); // ray length per horizontal meter
+	const double z0 = mod->_frame_pose.z;
+
+	const meters_t near_clip = mod->_camera.nearClip();
+	const meters_t far_clip = mod->_camera.farClip();
+
+	// the ray hits the floor at this horizontal distance, if it is
+	// pointing down
+	const meters_t floor_dist = ( slope < 0.0 ? z0 / -slope : far_clip );
+
+	const double a_space = mod->_camera.horizFov() / mod->_width;
+	const bounds3d_t& extent = mod->world->GetExtent();
+
+	for( int col=0; col<mod->_width; ++col ) {
+		const int index = col + row * mod->_width;
+		float& depth = mod->_frame_data[ index ];
+		GLubyte* color = mod->_frame_color_data + 4 * index;
+
+		meters_t dist = far_clip;
+		const GLubyte* hitcolor = background;
+
+		FOR_EACH( it, mod->_spans[col] ) {
+			if( it->near > floor_dist ) // the floor is nearer
+				break;
+			
+			// the heights of the ray on entering and leaving the span
+			const double zn = z0 + slope * it->near;
+			const double zf = z0 + slope * it->far;
+
+			if( std::max( zn, zf ) < it->z.min || std::min( zn, zf ) > it->z.max )
+				continue; // passes over or under the block
+			
+			meters_t d = it->near;
+			if( zn < it->z.min ) // rises into the block
+				d = ( it->z.min - z0 ) / slope;
+			else if( zn > it->z.max ) // falls into the block
+				d = ( it->z.max - z0 ) / slope;
+
+			if( d * stretch < near_clip ) // clipped out, as in OpenGL
+				continue;
+
+			dist = d;
+			hitcolor = it->color;
+			break;
+		}
+		
+		if( hitcolor == background && floor_dist < far_clip ) {
+			// there's only floor where the world is
+			const double bearing = 
+				mod->_frame_pose.a + dtor( mod->_camera.horizFov() / 2.0 - col * a_space - mod->_yaw_offset );
+			const double fx = mod->_frame_pose.x + floor_dist * cos( bearing );
+			const double fy = mod->_frame_pose.y + floor_dist * sin( bearing );
+			
+			if( fx >= extent.x.min && fx <= extent.x.max && 
+					fy >= extent.y.min && fy <= extent.y.max ) {
+				dist = floor_dist;
+				hitcolor = floor;
+			}
+		}
+		
+		// the length of the ray, not its horizontal component
+		depth = std::min( dist * stretch, far_clip );
+		memcpy( color, hitcolor, 4 );
+	}
+}
+
+bool ModelCamera::RaytraceFrame()
+{
+	_frame_pose = GetGlobalPose();
+	_spans.resize( _width );
+
+	unsigned int threads = _render_threads;
+	if( threads == 0 ) {
+		const long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+		threads = cpus > 0 ? cpus : 1;
+	}
+
+	// walk the cells once per column, then work out where in the
+	// column each row's ray ends
+	RenderPool::Run( TraceColumn, this, _width, threads );
+	RenderPool::Run( ShadeRow, this, _height, threads );
+	return true;
+}
+
 //TODO create lines outlining camera frustrum, then iterate over each depth measurement and create a square
 void ModelCamera::DataVisualize( Camera* cam )
 {		
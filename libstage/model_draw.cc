@@ -125,17 +125,20 @@ void Model::DrawSelected()
 
 void Model::DrawTrailFootprint()
 {
+  // the trail may not have been sized to trail_length yet
+  const unsigned int len( trail.size() );
+
   double darkness = 0;
-  double fade = 0.5 / (double)(trail_length+1);
+  double fade = 0.5 / (double)(len+1);
 	
   PushColor( 0,0,0,1 ); // dummy push just saving the color
 	
   // this loop could be faster, but optimzing vis is not a priority
-  for( unsigned int i=0; i<trail_length; i++ )
+  for( unsigned int i=0; i<len; i++ )
     {
       // find correct offset inside ring buffer
       TrailItem& checkpoint = 
-	trail[ (i + trail_index) % trail_length ];
+	trail[ (i + trail_index) % len ];
 			
       // ignore invalid items
       if( checkpoint.time == 0 )
@@ -160,6 +163,32 @@ void Model::DrawTrailFootprint()
   PopColor();
 }
 
+void Model::AppendTrailFootprint( VertexBatch& batch )
+{
+  // as DrawTrailFootprint(), with the oldest items faintest
+  const unsigned int len( trail.size() );
+
+  double darkness = 0;
+  double fade = 0.5 / (double)(len+1);
+	
+  for( unsigned int i=0; i<len; i++ )
+    {
+      TrailItem& checkpoint = 
+	trail[ (i + trail_index) % len ];
+			
+      if( checkpoint.time == 0 )
+	continue;
+			
+      darkness += fade;
+      Color c = checkpoint.color;
+      c.a = darkness;
+
+      GLubyte rgba[4];
+      VertexBatch::Pack( c, rgba );
+      blockgroup.AppendFootPrint( checkpoint.pose, rgba, batch );
+    }
+}
+
 void Model::DrawTrailBlocks()
 {
   double timescale = 0.0000001;
@@ -236,6 +265,15 @@ void Model::DrawBlocksTree( )
   PopCoords();
 }
   
+void Model::AppendBlocksTree( VertexBatch& fill, VertexBatch& lines )
+{
+  if( blockgroup.GetCount() )
+    blockgroup.AppendBlocks( GetGlobalPose(), BlockColor(), fill, lines );
+
+  FOR_EACH( it, children )
+    (*it)->AppendBlocksTree( fill, lines );
+}
+  
 void Model::DrawPose( Pose pose )
 {
   PushColor( 0,0,0,1 );
@@ -633,7 +671,11 @@ void Model::DataVisualizeTree( Camera* cam )
 {
   PushLocalCoords();
 
-  if( subs > 0 )
+  // a threaded world's canvas draws some models' data from its
+  // snapshot instead
+  const WorldGui::RenderSnapshot* snap( world_gui->GetCanvas()->snapshot );
+
+  if( subs > 0 && ! ( snap && snap->data_models.count( this )))
     {
       DataVisualize( cam ); // virtual function overridden by some model types  
 		
@@ -652,6 +694,27 @@ void Model::DataVisualizeTree( Camera* cam )
   PopCoords();
 }
 
+void Model::SnapshotDataTree( std::vector<DataSnapshot*>& data ) const
+{
+  if( subs > 0 )
+    {
+      DataSnapshot* ds( SnapshotData() );
+      if( ds )
+	data.push_back( ds );
+    }
+
+  FOR_EACH( it, children )
+    (*it)->SnapshotDataTree( data );
+}
+
+DataSnapshot::DataSnapshot( const Model* mod ) :
+  lineage(),
+  gpose( mod->GetGlobalPose() )
+{
+  for( const Model* m( mod ); m; m = m->Parent() )
+    lineage.push_back( m );
+}
+
 void Model::DrawGrid( void )
 {
   if ( gui.grid ) 
@@ -280,6 +280,10 @@ void ModelFiducial::Update( void )
 												 vert.begin(), vert.end(),
 												 std::inserter( nearby, nearby.end() ) ); 
 	
+	// the sets were in order of address; report in order of id
+	// instead, which is the same in every run
+	std::sort( nearby.begin(), nearby.end(), World::ltid() );
+
 	//	printf( "cand sz %lu\n", nearby.size() );
 			
 	// create sets sorted by x and y position
@@ -315,9 +319,15 @@ void ModelFiducial::DataVisualize( Camera* cam )
 {
   (void)cam; // avoid warning about unused var
 
+  DrawData( world, max_range_anon, fov, fiducials );
+}
+
+void ModelFiducial::DrawData( World* world, meters_t range, radians_t fov,
+			      const std::vector<Fiducial>& fiducials )
+{
 	if( showFov )
 	  {
-		 PushColor( 1,0,1,0.2  ); // magenta, with a bit of alpha
+		 world->PushColor( 1,0,1,0.2  ); // magenta, with a bit of alpha
 
 		 GLUquadric* quadric = gluNewQuadric();
 		 
@@ -325,7 +335,7 @@ void ModelFiducial::DataVisualize( Camera* cam )
 		 
 		 gluPartialDisk( quadric,
 							  0, 
-							  max_range_anon,
+							  range,
 							  20, // slices	
 							  1, // loops
 							  rtod( M_PI/2.0 + fov/2.0), // start angle
@@ -333,12 +343,12 @@ void ModelFiducial::DataVisualize( Camera* cam )
 		 
 		 gluDeleteQuadric( quadric );
 
-		 PopColor();
+		 world->PopColor();
 	  }
 	
 	if( showData )
 	  {
-		 PushColor( 1,0,1,0.4  ); // magenta, with a bit of alpha
+		 world->PushColor( 1,0,1,0.4  ); // magenta, with a bit of alpha
 		 
 		 // draw fuzzy dotted lines	
 		 glLineWidth( 2.0 );
@@ -347,7 +357,7 @@ void ModelFiducial::DataVisualize( Camera* cam )
 		 // draw lines to the fiducials
 		 FOR_EACH( it, fiducials )
 			{
-			  Fiducial& fid = *it;
+			  const Fiducial& fid = *it;
 			  
 			  double dx = fid.range * cos( fid.bearing);
 			  double dy = fid.range * sin( fid.bearing);
@@ -375,11 +385,38 @@ void ModelFiducial::DataVisualize( Camera* cam )
 			  glPopMatrix();			
 			}
 		 
-		 PopColor();			 
+		 world->PopColor();			 
 		 glLineWidth( 1.0 );		
 	  }	 
 }
 	
+/** A copy of the fiducials found, drawn as DataVisualize() would */
+class ModelFiducial::Snapshot : public DataSnapshot
+{
+public:
+  meters_t range;
+  radians_t fov;
+  std::vector<Fiducial> fiducials;
+
+  Snapshot( const ModelFiducial* mod ) :
+    DataSnapshot( mod ),
+    range( mod->max_range_anon ),
+    fov( mod->fov ),
+    fiducials( mod->fiducials )
+  {}
+
+  virtual void Draw( World* world, Camera* cam ) const
+  {
+    (void)cam; // avoid warning about unused var
+    DrawData( world, range, fov, fiducials );
+  }
+};
+
+DataSnapshot* ModelFiducial::SnapshotData() const
+{
+  return new Snapshot( this );
+}
+
 void ModelFiducial::Shutdown( void )
 { 
   //PRINT_DEBUG( "fiducial shutdown" );
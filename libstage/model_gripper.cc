@@ -182,6 +182,43 @@ void ModelGripper::Save()
   
 }
 
+void ModelGripper::SaveState( StateWriter& out ) const
+{
+  Model::SaveState( out );
+
+  out.Put( (int32_t)cfg.paddles );
+  out.Put( (int32_t)cfg.lift );
+  out.Put( cfg.paddle_position );
+  out.Put( cfg.lift_position );
+  out.Put( cfg.paddles_stalled );
+  out.Put( cfg.close_limit );
+  out.Put( cfg.autosnatch );
+  out.Put( (int32_t)cmd );
+
+  // the gripped model is reparented to us, which the world restores,
+  // so only its name is needed here
+  out.PutString( cfg.gripped ? cfg.gripped->TokenStr() : std::string() );
+}
+
+void ModelGripper::LoadState( StateReader& in )
+{
+  Model::LoadState( in );
+
+  cfg.paddles = (paddle_state_t)in.Get<int32_t>();
+  cfg.lift = (lift_state_t)in.Get<int32_t>();
+  in.Get( cfg.paddle_position );
+  in.Get( cfg.lift_position );
+  in.Get( cfg.paddles_stalled );
+  in.Get( cfg.close_limit );
+  in.Get( cfg.autosnatch );
+  cmd = (cmd_t)in.Get<int32_t>();
+
+  const std::string gripped( in.GetString() );
+  cfg.gripped = gripped.empty() ? NULL : world->GetModel( gripped );
+
+  PositionPaddles();
+}
+
 void ModelGripper::FixBlocks()
 {
   // get rid of the default cube
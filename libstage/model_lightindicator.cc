@@ -44,3 +44,18 @@ void ModelLightIndicator::DrawBlocks()
 		this->SetColor( keep );
 	  }
 }
+
+Color ModelLightIndicator::BlockColor() const
+{
+	if( m_IsOn )
+		return GetColor();
+
+	// dimmed as in DrawBlocks()
+	const double scaleFactor = 0.8;
+
+	Color c = GetColor();
+	c.r *= scaleFactor;
+	c.g *= scaleFactor;
+	c.b *= scaleFactor;
+	return c;
+}
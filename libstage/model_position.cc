@@ -52,6 +52,8 @@ using namespace Stg;
     # only used if drive is set to "car"
     wheelbase 1.0
 
+    substep 0.5
+
     # [ xmin xmax ymin ymax zmin zmax amin amax ]				
     velocity_bounds [-1 1 -1 1 -1 1 -90 90 ]					
     acceleration_bounds [-1 1 -1 1 -1 1 -90 90]
@@ -81,7 +83,9 @@ using namespace Stg;
     - velocity [ x:<float> y:<float> z:<float> heading:<float>
     - velocity_bounds [ xmin xmax ymin ymax zmin zmax amin amax ] x,y,z in meters per second, a in degrees per second
     - wheelbase <float,meters>
-    The wheelbase used for the car steering model. Only used if drive is set to "car". Defaults to 1.0m\*/
+    The wheelbase used for the car steering model. Only used if drive is set to "car". Defaults to 1.0m
+    - substep <float>
+    the furthest the model may move in one step, as a fraction of the smaller side of its footprint, before the step is split into sub-moves that are each tested for collisions. This stops fast models passing through thin obstacles when interval_sim is large. A sub-move is never shorter than one cell of the world's resolution. Zero moves in one jump whatever the speed.\*/
 
 
 
@@ -105,11 +109,9 @@ ModelPosition::ModelPosition( World* world,
   control_mode( CONTROL_VELOCITY ),
   drive_mode( DRIVE_DIFFERENTIAL ),
   localization_mode( LOCALIZATION_GPS ),
-  integration_error( drand48() * INTEGRATION_ERROR_MAX_X - INTEGRATION_ERROR_MAX_X/2.0,
-		     drand48() * INTEGRATION_ERROR_MAX_Y - INTEGRATION_ERROR_MAX_Y/2.0,
-		     drand48() * INTEGRATION_ERROR_MAX_Z - INTEGRATION_ERROR_MAX_Z/2.0,
-		     drand48() * INTEGRATION_ERROR_MAX_A - INTEGRATION_ERROR_MAX_A/2.0 ),
+  integration_error(),
   wheelbase( 1.0 ),
+  substep( 0.5 ),
   acceleration_bounds(),
   velocity_bounds(),
   //public
@@ -139,6 +141,7 @@ ModelPosition::ModelPosition( World* world,
       acceleration_bounds[3].min = -M_PI/2.0;
       acceleration_bounds[3].max =  M_PI/2.0;
 
+  Reseed();
 
   this->SetBlobReturn( true );
   
@@ -147,6 +150,21 @@ ModelPosition::ModelPosition( World* world,
 }
 
 
+void ModelPosition::Reseed()
+{
+  // a random odometry error, the same in every run with the same
+  // world seed. One draw per statement keeps the order fixed.
+  Rng rng( GetRng( Rng::INTERNAL ));
+  integration_error.x = rng.Uniform() * INTEGRATION_ERROR_MAX_X - INTEGRATION_ERROR_MAX_X/2.0;
+  integration_error.y = rng.Uniform() * INTEGRATION_ERROR_MAX_Y - INTEGRATION_ERROR_MAX_Y/2.0;
+  integration_error.z = rng.Uniform() * INTEGRATION_ERROR_MAX_Z - INTEGRATION_ERROR_MAX_Z/2.0;
+  integration_error.a = rng.Uniform() * INTEGRATION_ERROR_MAX_A - INTEGRATION_ERROR_MAX_A/2.0;
+
+  // an error given in the worldfile is not random
+  if( wf && wf->PropertyExists( wf_entity, "odom_error" ))
+    integration_error.Load( wf, wf_entity, "odom_error" );
+}
+
 ModelPosition::~ModelPosition( void )
 {
   // nothing to do 
@@ -217,6 +235,8 @@ void ModelPosition::Load( void )
   
   // choose a wheelbase
   this->wheelbase = wf->ReadLength( wf_entity, "wheelbase", this->wheelbase );
+
+  this->substep = std::max( 0.0, wf->ReadFloat( wf_entity, "substep", this->substep ));
     
   // load odometry if specified
   if( wf->PropertyExists( wf_entity, "odom" ) )
@@ -291,6 +311,48 @@ void ModelPosition::Load( void )
 		 &velocity_bounds[3].max );
 }
 
+void ModelPosition::SaveState( StateWriter& out ) const
+{
+  Model::SaveState( out );
+
+  out.PutPose( velocity );
+  out.PutPose( goal );
+  out.Put( (int32_t)control_mode );
+  out.PutPose( integration_error );
+  out.PutPose( est_pose );
+  out.PutPose( est_pose_error );
+  out.PutPose( est_origin );
+
+  out.Put( (uint32_t)waypoints.size() );
+  FOR_EACH( it, waypoints )
+    {
+      out.PutPose( it->pose );
+      out.Put( it->color.r ); out.Put( it->color.g ); out.Put( it->color.b ); out.Put( it->color.a );
+    }
+}
+
+void ModelPosition::LoadState( StateReader& in )
+{
+  Model::LoadState( in );
+
+  Velocity v;
+  in.GetPose( v );
+  SetVelocity( v );
+  in.GetPose( goal );
+  control_mode = (ControlMode)in.Get<int32_t>();
+  in.GetPose( integration_error );
+  in.GetPose( est_pose );
+  in.GetPose( est_pose_error );
+  in.GetPose( est_origin );
+
+  waypoints.resize( std::min( in.Get<uint32_t>(), 1U<<20 ));
+  FOR_EACH( it, waypoints )
+    {
+      in.GetPose( it->pose );
+      in.Get( it->color.r ); in.Get( it->color.g ); in.Get( it->color.b ); in.Get( it->color.a );
+    }
+}
+
 void ModelPosition::Update( void  )
 { 
   PRINT_DEBUG1( "[%lu] position update", this->world->sim_time );
@@ -580,34 +642,54 @@ void ModelPosition::Move( void )
 		 velocity.y * interval,
 		 velocity.z * interval,
 		 normalize( velocity.a * interval ));
-  
-  // the pose we're trying to achieve (unless something stops us)
-  const Pose newpose( pose + dp );
-  
-  // stash the original pose so we can put things back if we hit
-  const Pose startpose( pose );
-  
-  pose = newpose; // do the move provisionally - we might undo it below
-  
-  const unsigned int layer( world->UpdateCount()%2 );
-  
-  UnMapWithChildren( layer ); // remove from all blocks
-  MapWithChildren( layer ); // render into new blocks
-  
-  if( TestCollision() ) // crunch!
+
+  // split a move that sweeps far compared to our size into sub-moves,
+  // so we can't jump over a thin obstacle. The sweep is the furthest
+  // any corner of the footprint travels.
+  unsigned int steps( 1 );
+  if( substep > 0.0 )
     {
-      // put things back the way they were
-      // this is expensive, but it happens _very_ rarely for most people
-      pose = startpose;
-      UnMapWithChildren( layer );
-      MapWithChildren( layer );
+      const meters_t side( std::min( geom.size.x, geom.size.y ));
+      const meters_t limit( std::max( substep * side, 1.0 / world->ppm ));
+      const meters_t sweep( hypot( dp.x, dp.y ) + 
+			    fabs( dp.a ) * hypot( geom.size.x, geom.size.y ) / 2.0 );
 
-      SetStall(true);
+      if( sweep > limit )
+	steps = (unsigned int)std::min( ceil( sweep / limit ), 1000.0 );
     }
-  else
+
+  const Pose ddp( dp.x / steps, dp.y / steps, dp.z / steps, dp.a / steps );
+  const unsigned int layer( world->UpdateCount()%2 );
+  
+  for( unsigned int s=0; s<steps; ++s )
     {
-      SetStall(false);
+      if( s > 0 )
+	++world->collision_stats.substeps;
+
+      // stash the pose so we can put things back if we hit
+      const Pose startpose( pose );
+  
+      // do the move provisionally - we might undo it below
+      pose = pose + ddp;
+  
+      UnMapWithChildren( layer ); // remove from all blocks
+      MapWithChildren( layer ); // render into new blocks
+  
+      if( TestCollision() ) // crunch!
+	{
+	  // put things back the way they were, stopping at the last
+	  // sub-move that was clear
+	  // this is expensive, but it happens _very_ rarely for most people
+	  pose = startpose;
+	  UnMapWithChildren( layer );
+	  MapWithChildren( layer );
+
+	  SetStall(true);
+	  return;
+	}
     }
+
+  SetStall(false);
 }
 
 
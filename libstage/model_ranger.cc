@@ -32,6 +32,7 @@
    size [  x y z ]
    fov a
    range [min max]
+   noise 0.0
    )
 
    # generic model properties with non-default values
@@ -59,6 +60,12 @@
    - minimum range and maximum range in meters, field of view angle in degrees. Currently fov has no effect on the sensor model, other than being shown in the confgiuration graphic for the ranger device.
    - sview[\<transducer index\>] [float float float]
    - per-transducer version of the sview property. Overrides the common setting.
+   - noise <float>\n
+   the standard deviation of the noise on each range, as a fraction
+   of the range. Ranges that hit nothing stay at the maximum. The
+   noise is drawn from the ranger's own random number stream, see
+   Model::GetRng(), so it repeats exactly in every run with the same
+   world seed. Defaults to 0, for no noise.
 
 */
 
@@ -66,7 +73,7 @@
 
 #include "stage.hh"
 #include "worldfile.hh"
-#include "option.hh"
+#include "canvas.hh"
 using namespace Stg;
 
 static const watts_t RANGER_WATTSPERSENSOR = 0.2;
@@ -112,6 +119,21 @@ ModelRanger::~ModelRanger()
 {
 }
 
+Model::MemoryReport ModelRanger::GetMemoryReport() const
+{
+  MemoryReport r( Model::GetMemoryReport() );
+  
+  r.object = sizeof(ModelRanger);
+
+  r.other += sensors.capacity() * sizeof(Sensor);
+  FOR_EACH( it, sensors )
+    r.other += it->ranges.capacity() * sizeof(meters_t)
+      + it->intensities.capacity() * sizeof(double)
+      + it->bearings.capacity() * sizeof(double);
+
+  return r;
+}
+
 void ModelRanger::Startup( void )
 {
   Model::Startup();
@@ -149,6 +171,7 @@ void ModelRanger::Sensor::Load( Worldfile* wf, int entity )
   col.Load( wf, entity );		
   fov = wf->ReadAngle( entity, "fov", fov );
   sample_count = wf->ReadInt( entity, "samples", sample_count );	
+  noise = std::max( 0.0, wf->ReadFloat( entity, "noise", noise ));
   //ranges.resize(sample_count);
   //intensities.resize(sample_count);
 }
@@ -158,6 +181,39 @@ void ModelRanger::Load( void )
   Model::Load();
 }
 
+void ModelRanger::SaveState( StateWriter& out ) const
+{
+  Model::SaveState( out );
+
+  out.Put( (uint32_t)sensors.size() );
+  FOR_EACH( it, sensors )
+    {
+      out.PutDoubles( it->ranges );
+      out.PutDoubles( it->intensities );
+      out.PutDoubles( it->bearings );
+    }
+}
+
+void ModelRanger::LoadState( StateReader& in )
+{
+  Model::LoadState( in );
+
+  const uint32_t count( in.Get<uint32_t>() );
+  if( count != sensors.size() )
+    {
+      PRINT_WARN3( "ranger %s: checkpoint has %u sensors, the worldfile %u. Ranges not restored.",
+		   Token(), count, (unsigned int)sensors.size() );
+      return;
+    }
+
+  FOR_EACH( it, sensors )
+    {
+      in.GetDoubles( it->ranges );
+      in.GetDoubles( it->intensities );
+      in.GetDoubles( it->bearings );
+    }
+}
+
 static bool ranger_match( Model* hit, 
 			  Model* finder,
 			  const void* dummy )
@@ -176,8 +232,13 @@ static bool ranger_match( Model* hit,
 void ModelRanger::Update( void )
 {     
   // raytrace new range data for all sensors
-  FOR_EACH( it, sensors )
-    it->Update( this );
+  for( size_t s(0); s<sensors.size(); ++s )
+    {
+      sensors[s].Update( this );
+
+      if( sensors[s].noise > 0.0 )
+	sensors[s].AddNoise( GetRng( Rng::INTERNAL + s ));
+    }
   
   Model::Update();
 }
@@ -226,6 +287,23 @@ void ModelRanger::Sensor::Update( ModelRanger* mod )
     }
 }
 
+void ModelRanger::Sensor::AddNoise( Rng rng )
+{
+  // draw the deviates in batches, on the stack so that sensors in
+  // different threads share nothing
+  double deviates[64];
+
+  for( size_t t(0); t<ranges.size(); t+=64 )
+    {
+      const size_t n( std::min( ranges.size() - t, (size_t)64 ));
+      rng.Normals( deviates, n, 1.0, noise );
+
+      for( size_t i(0); i<n; ++i )
+	if( ranges[t+i] < range.max )
+	  ranges[t+i] = std::min( range.max, std::max( 0.0, ranges[t+i] * deviates[i] ));
+    }
+}
+
 std::string ModelRanger::Sensor::String() const
 {
   char buf[256];
@@ -234,7 +312,7 @@ std::string ModelRanger::Sensor::String() const
   return( std::string( buf ) );
 }
 
-void ModelRanger::Sensor::Visualize( ModelRanger::Vis* vis, ModelRanger* rgr ) const
+void ModelRanger::Sensor::Visualize( World* world, const Pose& rgr_gpose ) const
 {
   size_t sample_count( this->sample_count );
 	
@@ -254,18 +332,18 @@ void ModelRanger::Sensor::Visualize( ModelRanger::Vis* vis, ModelRanger* rgr ) c
 
   Gl::pose_shift( pose );
 
-  if( vis->showTransducers )
+  if( Vis::showTransducers )
     {
       // draw the sensor body as a rectangle
-      rgr->PushColor( col );
+      world->PushColor( col );
       glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );			
       glRectf( -size.x/2.0, -size.y/2.0, size.x/2.0, size.y/2.0 );
-      rgr->PopColor();
+      world->PopColor();
     }
 
   Color c( col );
   c.a = 0.15; // transparent version of sensor color
-  rgr->PushColor( c );
+  world->PushColor( c );
   glPolygonMode( GL_FRONT, GL_FILL );			
 	
   if( ranges.size()  ) // if we have some data
@@ -295,16 +373,43 @@ void ModelRanger::Sensor::Visualize( ModelRanger::Vis* vis, ModelRanger* rgr ) c
 	}
     }
 			
-  if( vis->showArea )
+  // if the canvas is batching, the area and beams are added to its
+  // batches in world coordinates, instead of being drawn here
+  WorldGui* wg = dynamic_cast<WorldGui*>( world );
+  Canvas* canvas = ( wg && wg->GetCanvas()->Batching() ) ? wg->GetCanvas() : NULL;
+
+  const Pose gpose = canvas ? rgr_gpose + pose : Pose();
+  const double gcos = cos( gpose.a );
+  const double gsin = sin( gpose.a );
+
+  if( Vis::showArea )
     {
       if( sample_count > 1 )
-	// draw the filled polygon in transparent blue
-	glDrawArrays( GL_POLYGON, 0, sample_count );
+	{
+	  if( canvas )
+	    {
+	      // the polygon as a fan of triangles
+	      GLubyte rgba[4];
+	      VertexBatch::Pack( c, rgba );
+	      
+	      for( size_t v=1; v+1<sample_count; ++v )
+		{
+		  canvas->vis_fill.Vertex( gpose.x, gpose.y, gpose.z, rgba );
+		  for( size_t k=v; k<v+2; ++k )
+		    canvas->vis_fill.Vertex( gpose.x + gcos * pts[2*k] - gsin * pts[2*k+1],
+					     gpose.y + gsin * pts[2*k] + gcos * pts[2*k+1],
+					     gpose.z, rgba );
+		}
+	    }
+	  else
+	    // draw the filled polygon in transparent blue
+	    glDrawArrays( GL_POLYGON, 0, sample_count );
+	}
     }
 	
   glDepthMask( GL_TRUE );
 	
-  if( vis->showStrikes )
+  if( Vis::showStrikes )
     {
       // TODO - paint the stike point in a color based on intensity
       // 			// if the sample is unusually bright, draw a little blob
@@ -318,12 +423,12 @@ void ModelRanger::Sensor::Visualize( ModelRanger::Vis* vis, ModelRanger* rgr ) c
 			
       // draw the beam strike points
       c.a = 0.8;
-      rgr->PushColor( c );
+      world->PushColor( c );
       glDrawArrays( GL_POINTS, 0, sample_count+1 );
-      rgr->PopColor();
+      world->PopColor();
     }
 	
-  if( vis->showFov )
+  if( Vis::showFov )
     {
       for( size_t s(0); s<sample_count; s++ )
 	{
@@ -334,12 +439,12 @@ void ModelRanger::Sensor::Visualize( ModelRanger::Vis* vis, ModelRanger* rgr ) c
 			
       glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
       c.a = 0.5;
-      rgr->PushColor( c );		
+      world->PushColor( c );		
       glDrawArrays( GL_POLYGON, 0, sample_count+1 );
-      rgr->PopColor();
+      world->PopColor();
     }			 
 	
-  if( vis->showBeams )
+  if( Vis::showBeams )
     {
       // darker version of the same color
       c.r /= 2.0;
@@ -347,23 +452,44 @@ void ModelRanger::Sensor::Visualize( ModelRanger::Vis* vis, ModelRanger* rgr ) c
       c.b /= 2.0;
       c.a = 1.0;
 
-      rgr->PushColor( c );		
-      glBegin( GL_LINES );
-			
-      for( size_t s(0); s<sample_count; s++ )
+      if( canvas )
 	{
+	  GLubyte rgba[4];
+	  VertexBatch::Pack( c, rgba );
+
+	  const size_t beams = std::min( ranges.size(), (size_t)this->sample_count );
+	  for( size_t s(0); s<beams; s++ )
+	    {
+	      const double ray_angle( beams == 1 ? 0 : (s * (fov / (beams-1))) - fov/2.0 );
+	      const double lx = ranges[s] * cos(ray_angle);
+	      const double ly = ranges[s] * sin(ray_angle);
+
+	      canvas->vis_lines.Vertex( gpose.x, gpose.y, gpose.z, rgba );
+	      canvas->vis_lines.Vertex( gpose.x + gcos * lx - gsin * ly,
+					gpose.y + gsin * lx + gcos * ly,
+					gpose.z, rgba );
+	    }
+	}
+      else
+	{
+	  world->PushColor( c );		
+	  glBegin( GL_LINES );
+			
+	  for( size_t s(0); s<sample_count; s++ )
+	    {
 					
-	  glVertex2f( 0,0 );
-	  double ray_angle( sample_count == 1 ? 0 : (s * (fov / (sample_count-1))) - fov/2.0 );
-	  glVertex2f( ranges[s] * cos(ray_angle), 
-		      ranges[s] * sin(ray_angle) );
+	      glVertex2f( 0,0 );
+	      double ray_angle( sample_count == 1 ? 0 : (s * (fov / (sample_count-1))) - fov/2.0 );
+	      glVertex2f( ranges[s] * cos(ray_angle), 
+			  ranges[s] * sin(ray_angle) );
 					
+	    }
+	  glEnd();
+	  world->PopColor();
 	}
-      glEnd();
-      rgr->PopColor();
     }	
 	
-  rgr->PopColor();
+  world->PopColor();
 
   glPopMatrix();
 }
@@ -414,17 +540,21 @@ void ModelRanger::Vis::Visualize( Model* mod, Camera* cam )
 
   ModelRanger* ranger( dynamic_cast<ModelRanger*>(mod) );
 
-  const std::vector<Sensor>& sensors( ranger->GetSensors() );    
-	
+  DrawSensors( ranger->GetWorld(), ranger->GetGlobalPose(), ranger->GetSensors() );
+}
+
+void ModelRanger::DrawSensors( World* world, const Pose& gpose,
+			       const std::vector<Sensor>& sensors )
+{
   FOR_EACH( it, sensors )
-    it->Visualize( this, ranger );
+    it->Visualize( world, gpose );
 	
   const size_t sensor_count = sensors.size();
 
-  if( showTransducers )
+  if( Vis::showTransducers )
     {
       glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
-      ranger->PushColor( 0,0,0,1 );
+      world->PushColor( 0,0,0,1 );
 			
       for( size_t s(0); s<sensor_count; s++ ) 
 	{ 
@@ -440,8 +570,39 @@ void ModelRanger::Vis::Visualize( Model* mod, Camera* cam )
 	  Gl::draw_string( rngr.pose.x, rngr.pose.y, rngr.pose.z, buf );
 					
 	}
-      ranger->PopColor();
+      world->PopColor();
     }
 
 }
 
+// SNAPSHOT --------------------------------------------------------------
+
+/** A copy of a ranger's sensors, drawn as its visualizer would draw
+    them if it is enabled */
+class ModelRanger::Snapshot : public DataSnapshot
+{
+public:
+  std::vector<Sensor> sensors;
+  std::string menu_name; ///< of the ranger's visualizer
+
+  Snapshot( const ModelRanger* rgr ) :
+    DataSnapshot( rgr ),
+    sensors( rgr->sensors ),
+    menu_name( rgr->vis.GetMenuName() )
+  {}
+
+  virtual void Draw( World* world, Camera* cam ) const
+  {
+    (void)cam; // avoid warning about unused var
+
+    WorldGui* wg( dynamic_cast<WorldGui*>( world ));
+    if( wg && wg->GetCanvas()->_custom_options[ menu_name ]->isEnabled() )
+      DrawSensors( world, gpose, sensors );
+  }
+};
+
+DataSnapshot* ModelRanger::SnapshotData() const
+{
+  return new Snapshot( this );
+}
+
@@ -11,142 +11,339 @@
 //
 ///////////////////////////////////////////////////////////////////////////
 
-/**
-  @ingroup model
-  @defgroup model_wifi Wifi model 
-
-  @todo Fill this in
+#undef DEBUG
 
-  <h2>Worldfile properties</h2>
+#include "stage.hh"
+#include "option.hh"
+#include "worldfile.hh"
+using namespace Stg;
 
-  @todo Fill this in
+Option ModelWifi::showData( "Wifi links", "show_wifi", "", true, NULL );
 
+/**
+  @ingroup model
+  @defgroup model_wifi Wifi model
+
+  The wifi model simulates a radio that exchanges messages with the
+  other radios in reach. Controllers queue messages for one radio
+  with Send() or for all of them with Broadcast(), and at the end of
+  each update every queued message is delivered at once. The
+  messages that arrived are available from GetMessages() until the
+  next update replaces them.
+
+  Two radios are in reach of each other if each is within the
+  other's range, shortened by the obstacles between them: every wall
+  the straight line between them crosses, at the height of the
+  radio, multiplies the range by the obstruction factor. Radios are
+  found with a spatial hash whose cells are as large as the longest
+  range, so delivery takes time proportional to the number of radios
+  and links, not to its square.
+
+API: Stg::ModelWifi
+
+<h2>Worldfile properties</h2>
+
+@par Summary and default values
+
+@verbatim
+wifi
+(
+  # wifi properties
+  range 10.0
+  obstruction 0.5
+
+  # model properties
+  size [ 0 0 0 ]
+)
+@endverbatim
+
+@par Details
+
+- range <float>\n
+  the maximum range of the radio in free space, in meters.
+- obstruction <float>\n
+  the fraction of the range left after passing through each
+  wall, between 0 and 1. With 0 a single wall blocks the radio, and
+  with 1 walls have no effect and no ray tracing is needed.
  */
 
-
-#include <sys/time.h>
-#include "gui.h"
-
-// Number pulled directly from my ass
-#define STG_WIFI_WATTS 2.5
-
-//#define DEBUG
-
-#include "stage_internal.h"
-
-// defined in model.c
-int _model_update( model_t* mod, void* unused );
-
-// standard callbacks
-extern "C" {
-
-	// declare functions used as callbacks
-	static int wifi_update( model_t* mod, void* unused );
-	static int wifi_startup( model_t* mod, void* unused );
-	static int wifi_shutdown( model_t* mod, void* unused );
-	static int wifi_load( model_t* mod, void* unused );
-
-	// implented by the gui in some other file
-	void gui_wifi_init( model_t* mod );
-
-
-	int 
-		wifi_init( model_t* mod )
+ModelWifi::ModelWifi( World* world,
+		      Model* parent,
+		      const std::string& type ) :
+  Model( world, parent, type ),
+  outbox(),
+  inbox(),
+  neighbours(),
+  delivered_pose(),
+  sent(0),
+  received(0),
+  dropped(0),
+  range( 10.0 ),
+  obstruction( 0.5 )
+{
+  // assert that Update() is reentrant for this derived model
+  thread_safe = true;
+
+  // a radio takes up no space
+  this->ClearBlocks();
+
+  Geom geom;
+  geom.Zero();
+  SetGeom( geom );
+
+  RegisterOption( &showData );
+}
+
+ModelWifi::~ModelWifi( void )
+{
+  world->active_wifi.erase( this );
+
+  // links are symmetric, so nobody else refers to us
+  FOR_EACH( it, neighbours )
+    {
+      std::vector<ModelWifi*>& theirs( (*it)->neighbours );
+      theirs.erase( std::remove( theirs.begin(), theirs.end(), this ), theirs.end() );
+    }
+}
+
+void ModelWifi::Load( void )
+{
+  Model::Load();
+
+  range       = wf->ReadLength( wf_entity, "range",       range );
+  obstruction = wf->ReadFloat ( wf_entity, "obstruction", obstruction );
+
+  if( range < 0 )
+    {
+      PRINT_WARN2( "wifi %s: negative range %.2f, using zero",
+		   Token(), range );
+      range = 0;
+    }
+
+  obstruction = std::max( 0.0, std::min( 1.0, obstruction ));
+}
+
+void ModelWifi::Startup( void )
+{
+  Model::Startup();
+  world->active_wifi.insert( this );
+}
+
+void ModelWifi::Shutdown( void )
+{
+  world->active_wifi.erase( this );
+
+  FOR_EACH( it, neighbours )
+    {
+      std::vector<ModelWifi*>& theirs( (*it)->neighbours );
+      theirs.erase( std::remove( theirs.begin(), theirs.end(), this ), theirs.end() );
+    }
+
+  neighbours.clear();
+  outbox.clear();
+  inbox.clear();
+
+  Model::Shutdown();
+}
+
+void ModelWifi::Send( ModelWifi* to, const std::string& data )
+{
+  outbox.push_back( Message( this, to, world->SimTimeNow(), data ));
+  ++sent;
+}
+
+void ModelWifi::Broadcast( const std::string& data )
+{
+  Send( NULL, data );
+}
+
+static bool wifi_raytrace_match( Model* candidate,
+				 Model* finder,
+				 const void* arg )
+{
+  const Model* him( (const Model*)arg );
+  return( candidate->vis.obstacle_return &&
+	  ! finder->IsRelated( candidate ) &&
+	  ! him->IsRelated( candidate ) );
+}
+
+// every block along the line between two radios, reused to save
+// allocating it for every link. Delivery runs in series.
+static std::vector<RaytraceResult> wifi_hits;
+
+bool ModelWifi::Linked( ModelWifi* him, meters_t distance )
+{
+  if( distance > range || distance > him->range )
+    return false;
+
+  if( obstruction >= 1.0 && him->obstruction >= 1.0 )
+    return true;
+
+  const Pose& from( delivered_pose );
+  const Pose& to( him->delivered_pose );
+
+  wifi_hits.clear();
+  Ray ray( this,
+	   Pose( from.x, from.y, from.z, atan2( to.y - from.y, to.x - from.x )),
+	   distance,
+	   wifi_raytrace_match,
+	   him,
+	   true );
+  ray.hits = &wifi_hits;
+  world->Raytrace( ray );
+
+  // hits in adjacent cells are the same wall
+  const meters_t gap( 2.0 / world->Resolution() );
+  unsigned int walls( 0 );
+  meters_t last( -gap );
+
+  FOR_EACH( it, wifi_hits )
+    {
+      if( it->range > last + gap )
+	++walls;
+      last = it->range;
+    }
+
+  return( distance <= range * pow( obstruction, walls ) &&
+	  distance <= him->range * pow( him->obstruction, walls ));
+}
+
+// the cell of the spatial hash containing [x,y]
+static inline int64_t wifi_cell_key( int32_t cx, int32_t cy )
+{
+  return( ((int64_t)cx << 32) | (uint32_t)cy );
+}
+
+static bool wifi_id_less( const ModelWifi* a, const ModelWifi* b )
+{
+  return( a->GetId() < b->GetId() );
+}
+
+void ModelWifi::Deliver( World* world )
+{
+  // in order of id, so that delivery doesn't depend on memory layout
+  std::vector<ModelWifi*> radios( world->active_wifi.begin(),
+				  world->active_wifi.end() );
+  std::sort( radios.begin(), radios.end(), wifi_id_less );
+
+  // the hash cells are as large as the longest range, so every radio
+  // in reach is in the 3x3 cells around us
+  meters_t cell( 0 );
+  FOR_EACH( it, radios )
+    cell = std::max( cell, (*it)->range );
+  cell = std::max( cell, 1.0 / world->Resolution() );
+
+  std::vector<std::pair<int64_t,size_t> > hash;
+  std::vector<std::pair<int32_t,int32_t> > cells;
+  hash.reserve( radios.size() );
+  cells.reserve( radios.size() );
+
+  for( size_t i=0; i<radios.size(); ++i )
+    {
+      ModelWifi* radio( radios[i] );
+      radio->delivered_pose = radio->GetGlobalPose();
+      radio->neighbours.clear();
+      radio->inbox.clear();
+
+      const int32_t cx( (int32_t)floor( radio->delivered_pose.x / cell ));
+      const int32_t cy( (int32_t)floor( radio->delivered_pose.y / cell ));
+      cells.push_back( std::make_pair( cx, cy ));
+      hash.push_back( std::make_pair( wifi_cell_key( cx, cy ), i ));
+    }
+
+  std::sort( hash.begin(), hash.end() );
+
+  // find each link once, from the radio with the smaller index
+  for( size_t i=0; i<radios.size(); ++i )
+    {
+      ModelWifi* radio( radios[i] );
+      const Pose& here( radio->delivered_pose );
+
+      for( int32_t dx=-1; dx<=1; ++dx )
+	for( int32_t dy=-1; dy<=1; ++dy )
+	  {
+	    const int64_t key( wifi_cell_key( cells[i].first + dx,
+					      cells[i].second + dy ));
+
+	    for( std::vector<std::pair<int64_t,size_t> >::const_iterator it =
+		   std::lower_bound( hash.begin(), hash.end(), std::make_pair( key, (size_t)0 ));
+		 it != hash.end() && it->first == key;
+		 ++it )
+	      {
+		if( it->second <= i )
+		  continue;
+
+		ModelWifi* him( radios[it->second] );
+		const Pose& there( him->delivered_pose );
+
+		if( radio->Linked( him, hypot( there.x - here.x, there.y - here.y )))
+		  {
+		    radio->neighbours.push_back( him );
+		    him->neighbours.push_back( radio );
+		  }
+	      }
+	  }
+    }
+
+  // deliver the messages, sender by sender
+  FOR_EACH( it, radios )
+    {
+      ModelWifi* radio( *it );
+
+      FOR_EACH( msg, radio->outbox )
+	{
+	  if( msg->to == NULL )
+	    {
+	      FOR_EACH( nb, radio->neighbours )
 		{
-			// we don't consume any power until subscribed
-			mod->watts = 0.0;
-
-			// override the default methods; these will be called by the simualtion
-			// engine
-			model_add_callback( mod, &mod->startup, wifi_startup, NULL );
-			model_add_callback( mod, &mod->shutdown, wifi_shutdown, NULL );
-			model_add_callback( mod, &mod->load, wifi_load, NULL );
-
-			// sensible wifi defaults; it doesn't take up any physical space
-			Geom geom;
-			geom.pose.x = 0.0;
-			geom.pose.y = 0.0;
-			geom.pose.a = 0.0;
-			geom.size.x = 0.0;
-			geom.size.y = 0.0;
-			model_set_geom( mod, &geom );
-
-			// wifi is invisible
-			model_set_obstacle_return( mod, 0 );
-			model_set_laser_return( mod, LaserTransparent );
-			model_set_blob_return( mod, 0 );
-			model_set_color( mod, (color_t)0 );
-
-			gui_wifi_init(mod);
-
-			return 0;
+		  (*nb)->inbox.push_back( *msg );
+		  ++(*nb)->received;
 		}
-
-	int 
-		wifi_update( model_t* mod, void* unused )
-		{   
-			// no work to do if we're unsubscribed
-			if( mod->subs < 1 )
-				return 0;
-
-			puts("wifi_update");
-
-			// Retrieve current configuration
-			wifi_config_t cfg;
-			memcpy(&cfg, mod->cfg, sizeof(cfg));
-
-			// Retrieve current geometry
-			Geom geom;
-			model_get_geom( mod, &geom );
-
-			// get the sensor's pose in global coords
-			Pose pz;
-			memcpy( &pz, &geom.pose, sizeof(pz) );
-			model_local_to_global( mod, &pz );
-
-
-			// We'll store current data here
-			wifi_data_t data;
-
-			// DO RADIO PROPAGATION HERE, and fill in the data structure
-
-			// publish the new stuff
-			model_set_data( mod, &data, sizeof(data));
-
-			// inherit standard update behaviour
-			_model_update( mod, NULL );
-
-			return 0; //ok
-		}
-
-	int 
-		wifi_startup( model_t* mod, void* unused )
-		{ 
-			PRINT_DEBUG( "wifi startup" );
-			model_add_callback( mod, &mod->startup, wifi_startup, NULL );
-			model_set_watts( mod, STG_WIFI_WATTS );
-			return 0; // ok
-		}
-
-	int 
-		wifi_shutdown( model_t* mod, void* unused )
-		{
-			PRINT_DEBUG( "wifi shutdown" );
-			model_remove_callback( mod, &mod->startup, wifi_startup );
-			model_set_watts( mod, 0 );
-			return 0; // ok
-		}
-
-	int
-		wifi_load( model_t* mod, void* unused )
-		{
-			wifi_config_t cfg;
-
-			// TODO: read wifi params from the world file
-
-			model_set_cfg( mod, &cfg, sizeof(cfg));
-
-			return 0;
-		}
-
-} // ends extern "C"
+	    }
+	  else if( std::find( radio->neighbours.begin(), radio->neighbours.end(),
+			      msg->to ) != radio->neighbours.end() )
+	    {
+	      msg->to->inbox.push_back( *msg );
+	      ++msg->to->received;
+	    }
+	  else
+	    ++radio->dropped;
+	}
+
+      radio->outbox.clear();
+    }
+}
+
+void ModelWifi::DataVisualize( Camera* cam )
+{
+  (void)cam; // avoid warning about unused var
+
+  if( ! showData )
+    return;
+
+  PushColor( 0,0.5,1,0.4 ); // light blue, with a bit of alpha
+
+  // draw fuzzy dotted lines to the radios in reach
+  glLineStipple( 1, 0x0F0F );
+  glEnable( GL_LINE_STIPPLE );
+  glBegin( GL_LINES );
+
+  const Pose gp( GetGlobalPose() );
+  const double cosa( cos( -gp.a ));
+  const double sina( sin( -gp.a ));
+
+  FOR_EACH( it, neighbours )
+    {
+      const Pose& there( (*it)->delivered_pose );
+      const double dx( there.x - gp.x );
+      const double dy( there.y - gp.y );
+
+      glVertex2f( 0,0 );
+      glVertex2f( dx * cosa - dy * sina, dx * sina + dy * cosa );
+    }
+
+  glEnd();
+  glDisable( GL_LINE_STIPPLE );
+
+  PopColor();
+}
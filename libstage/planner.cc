@@ -0,0 +1,612 @@
+/*
+  planner.cc
+  Shared path planning with cached wavefront fields. See Planner in
+  stage.hh.
+*/
+
+#include <queue>
+
+#include "stage.hh"
+using namespace Stg;
+
+// step costs: straight and diagonal
+static const uint32_t COST_STRAIGHT = 10;
+static const uint32_t COST_DIAGONAL = 14;
+static const uint32_t UNREACHED = 0xFFFFFFFF;
+
+// the 8 neighbours of a cell
+static const int NEIGHBOURS = 8;
+static const int NX[NEIGHBOURS] = { 1, 1, 0, -1, -1, -1,  0,  1 };
+static const int NY[NEIGHBOURS] = { 0, 1, 1,  1,  0, -1, -1, -1 };
+
+/** Occupancy of the static obstacles. Shared by the fields computing
+    on it, and deleted when the last lets go. */
+class Planner::Grid
+{
+public:
+  meters_t x0, y0; ///< the global position of cell (0,0)
+  meters_t res;
+  int width, height;
+  std::vector<uint8_t> occupied;
+  /** steps from each occupied cell to the nearest free one, 0 for
+      free cells */
+  std::vector<uint32_t> depth;
+  unsigned int refs;
+
+  Grid( meters_t res ) : x0(0), y0(0), res(res), width(0), height(0),
+			 occupied(), depth(), refs(1) {}
+
+  /** Returns the index of the cell containing [x],[y], or -1 */
+  int32_t Cell( meters_t x, meters_t y ) const
+  {
+    const int cx( (int)floor( (x - x0) / res ));
+    const int cy( (int)floor( (y - y0) / res ));
+    if( cx < 0 || cy < 0 || cx >= width || cy >= height )
+      return -1;
+    return cx + cy * width;
+  }
+
+  void Mark( meters_t x, meters_t y )
+  {
+    const int32_t c( Cell( x, y ));
+    if( c >= 0 )
+      occupied[c] = 1;
+  }
+
+  /** Mark every cell the segment from [a] to [b] passes through */
+  void Line( const point_t& a, const point_t& b )
+  {
+    const double len( hypot( b.x - a.x, b.y - a.y ));
+    const int steps( std::max( 1, (int)ceil( 2.0 * len / res )));
+
+    for( int i=0; i<=steps; ++i )
+      Mark( a.x + (b.x - a.x) * i / steps,
+	    a.y + (b.y - a.y) * i / steps );
+  }
+
+  /** Mark every cell whose centre is inside the polygon [pts] */
+  void Fill( const std::vector<point_t>& pts )
+  {
+    std::vector<meters_t> xs;
+
+    for( int cy=0; cy<height; ++cy )
+      {
+	const meters_t y( y0 + (cy + 0.5) * res );
+
+	// where the edges cross this row, by the even-odd rule
+	xs.clear();
+	for( size_t i=0; i<pts.size(); ++i )
+	  {
+	    const point_t& a( pts[i] );
+	    const point_t& b( pts[ (i+1) % pts.size() ] );
+	    if( (a.y <= y) != (b.y <= y) )
+	      xs.push_back( a.x + (y - a.y) * (b.x - a.x) / (b.y - a.y) );
+	  }
+
+	std::sort( xs.begin(), xs.end() );
+
+	for( size_t i=0; i+1 < xs.size(); i+=2 )
+	  {
+	    const int first( std::max( 0, (int)ceil( (xs[i] - x0) / res - 0.5 )));
+	    const int last( std::min( width-1, (int)floor( (xs[i+1] - x0) / res - 0.5 )));
+	    for( int cx=first; cx<=last; ++cx )
+	      occupied[ cx + cy * width ] = 1;
+	  }
+      }
+  }
+
+  /** Grow the obstacles by [r] cells */
+  void Dilate( int r )
+  {
+    const std::vector<uint8_t> orig( occupied );
+
+    for( int y=0; y<height; ++y )
+      for( int x=0; x<width; ++x )
+	if( orig[ x + y * width ] )
+	  for( int dy=-r; dy<=r; ++dy )
+	    for( int dx=-r; dx<=r; ++dx )
+	      if( dx*dx + dy*dy <= r*r &&
+		  x+dx >= 0 && x+dx < width && y+dy >= 0 && y+dy < height )
+		occupied[ (x+dx) + (y+dy) * width ] = 1;
+  }
+
+  /** Fill in depth, by breadth first search from the free cells */
+  void Measure()
+  {
+    depth.assign( occupied.size(), UNREACHED );
+
+    std::queue<uint32_t> open;
+    for( uint32_t c=0; c<occupied.size(); ++c )
+      if( ! occupied[c] )
+	{
+	  depth[c] = 0;
+	  open.push( c );
+	}
+
+    while( ! open.empty() )
+      {
+	const uint32_t c( open.front() );
+	open.pop();
+
+	const int cx( c % width );
+	const int cy( c / width );
+
+	for( int k=0; k<NEIGHBOURS; ++k )
+	  {
+	    const int nx( cx + NX[k] );
+	    const int ny( cy + NY[k] );
+	    if( nx < 0 || ny < 0 || nx >= width || ny >= height )
+	      continue;
+
+	    const uint32_t nc( nx + ny * width );
+	    if( depth[nc] == UNREACHED )
+	      {
+		depth[nc] = depth[c] + 1;
+		open.push( nc );
+	      }
+	  }
+      }
+  }
+
+  /** Returns true if the diagonal step [k] from [cx],[cy] squeezes
+      between two occupied cells */
+  bool CutsCorner( int cx, int cy, int k ) const
+  {
+    return( NX[k] && NY[k] &&
+	    occupied[ (cx + NX[k]) + cy * width ] &&
+	    occupied[ cx + (cy + NY[k]) * width ] );
+  }
+};
+
+/** The distance of every cell to one goal cell, and the neighbour of
+    each cell on the way */
+class Planner::Field
+{
+public:
+  uint32_t goal; ///< the goal cell
+  uint64_t generation; ///< the planner's generation when requested
+  uint64_t last_use;
+  bool ready;
+  std::vector<uint32_t> dist;
+  std::vector<int8_t> next; ///< index into NX and NY, or -1
+
+  Field( uint32_t goal, uint64_t generation )
+    : goal(goal), generation(generation), last_use(0), ready(false),
+      dist(), next()
+  {}
+
+  /** Dijkstra's algorithm outward from the goal. A robot may only
+      move into an occupied cell to climb toward a goal among them,
+      or within them to get out, deeper to shallower, so no path
+      crosses an obstacle. */
+  void Compute( const Grid& g )
+  {
+    const size_t n( g.width * g.height );
+    dist.assign( n, UNREACHED );
+    next.assign( n, -1 );
+
+    // the occupied cells from which the goal can be reached going
+    // ever deeper
+    std::vector<uint8_t> approach( n, 0 );
+    if( g.occupied[goal] )
+      {
+	std::queue<uint32_t> open;
+	approach[goal] = 1;
+	open.push( goal );
+
+	while( ! open.empty() )
+	  {
+	    const uint32_t c( open.front() );
+	    open.pop();
+
+	    for( int k=0; k<NEIGHBOURS; ++k )
+	      {
+		const int nx( (int)(c % g.width) + NX[k] );
+		const int ny( (int)(c / g.width) + NY[k] );
+		if( nx < 0 || ny < 0 || nx >= g.width || ny >= g.height )
+		  continue;
+
+		const uint32_t nc( nx + ny * g.width );
+		if( g.occupied[nc] && ! approach[nc] && g.depth[nc] < g.depth[c] )
+		  {
+		    approach[nc] = 1;
+		    open.push( nc );
+		  }
+	      }
+	  }
+      }
+
+    typedef std::pair<uint32_t,uint32_t> Entry; // distance, cell
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > open;
+
+    dist[goal] = 0;
+    open.push( Entry( 0, goal ));
+
+    while( ! open.empty() )
+      {
+	const Entry e( open.top() );
+	open.pop();
+
+	const uint32_t c( e.second );
+	if( e.first > dist[c] )
+	  continue; // already reached more cheaply
+
+	const int cx( c % g.width );
+	const int cy( c / g.width );
+
+	for( int k=0; k<NEIGHBOURS; ++k )
+	  {
+	    const int nx( cx + NX[k] );
+	    const int ny( cy + NY[k] );
+	    if( nx < 0 || ny < 0 || nx >= g.width || ny >= g.height )
+	      continue;
+
+	    // a robot in nc would step into c
+	    const uint32_t nc( nx + ny * g.width );
+	    if( g.occupied[c] &&
+		! ( g.occupied[nc] && g.depth[c] < g.depth[nc] ) && // getting out
+		! ( approach[c] && g.depth[nc] < g.depth[c] )) // getting in
+	      continue;
+
+	    // between free cells, diagonals don't squeeze past obstacles
+	    if( ! g.occupied[c] && ! g.occupied[nc] && g.CutsCorner( cx, cy, k ))
+	      continue;
+
+	    const uint32_t cost( (NX[k] && NY[k]) ? COST_DIAGONAL : COST_STRAIGHT );
+	    if( dist[c] + cost < dist[nc] )
+	      {
+		dist[nc] = dist[c] + cost;
+		next[nc] = (k + NEIGHBOURS/2) % NEIGHBOURS; // back toward c
+		open.push( Entry( dist[nc], nc ));
+	      }
+	  }
+      }
+  }
+};
+
+Planner::Planner( World* world, meters_t resolution, meters_t clearance,
+		  unsigned int cache, unsigned int threadcount ) :
+  world( world ),
+  resolution( resolution ),
+  clearance( clearance ),
+  cache( std::max( 1U, cache )),
+  grid( NULL ),
+  generation( 0 ),
+  uses( 0 ),
+  stale( false ),
+  fields(),
+  queue(),
+  stats(),
+  is_static(),
+  quit( false ),
+  threads(),
+  mutex(),
+  work_cond(),
+  done_cond()
+{
+  pthread_mutex_init( &mutex, NULL );
+  pthread_cond_init( &work_cond, NULL );
+  pthread_cond_init( &done_cond, NULL );
+
+  grid = Build();
+
+  threads.resize( std::max( 1U, threadcount ));
+  FOR_EACH( it, threads )
+    pthread_create( &*it, NULL, ThreadEntry, this );
+}
+
+Planner::~Planner()
+{
+  pthread_mutex_lock( &mutex );
+  quit = true;
+  pthread_cond_broadcast( &work_cond );
+  pthread_mutex_unlock( &mutex );
+
+  FOR_EACH( it, threads )
+    pthread_join( *it, NULL );
+
+  FOR_EACH( it, fields )
+    delete it->second;
+
+  Release( grid );
+
+  pthread_mutex_destroy( &mutex );
+  pthread_cond_destroy( &work_cond );
+  pthread_cond_destroy( &done_cond );
+}
+
+bool Planner::IsStatic( Model* mod )
+{
+  std::map<Model*,bool>::iterator it( is_static.find( mod ));
+  if( it != is_static.end() )
+    return it->second;
+
+  bool result( mod->vis.obstacle_return && mod != world->GetGround() );
+  for( Model* m( mod ); result && m; m = m->Parent() )
+    if( dynamic_cast<ModelPosition*>( m ))
+      result = false;
+
+  is_static[mod] = result;
+  return result;
+}
+
+Planner::Grid* Planner::Build()
+{
+  // the global outline of every block of every static obstacle
+  std::vector<std::vector<point_t> > outlines;
+  bounds3d_t box( Bounds( billion, -billion ),
+		  Bounds( billion, -billion ),
+		  Bounds() );
+
+  FOR_EACH( mit, world->models )
+    {
+      Model* mod( *mit );
+      if( ! IsStatic( mod ))
+	continue;
+
+      const Pose gpose( mod->GetGlobalPose() + mod->geom.pose );
+
+      FOR_EACH( bit, mod->blockgroup.blocks )
+	{
+	  const std::vector<point_t>& pts( bit->GetGeom().pts );
+	  outlines.push_back( std::vector<point_t>() );
+
+	  FOR_EACH( pit, pts )
+	    {
+	      const Pose p( gpose + Pose( pit->x, pit->y, 0, 0 ));
+	      outlines.back().push_back( point_t( p.x, p.y ));
+
+	      box.x.min = std::min( box.x.min, p.x );
+	      box.x.max = std::max( box.x.max, p.x );
+	      box.y.min = std::min( box.y.min, p.y );
+	      box.y.max = std::max( box.y.max, p.y );
+	    }
+	}
+    }
+
+  if( outlines.empty() ) // nothing to avoid
+    box.x = box.y = Bounds( 0, 0 );
+
+  // leave room around the obstacles to plan a way round them
+  const int r( (int)ceil( clearance / resolution ));
+  const meters_t margin( (r + 2) * resolution );
+
+  Grid* g( new Grid( resolution ));
+  g->x0 = box.x.min - margin;
+  g->y0 = box.y.min - margin;
+  g->width = (int)ceil( (box.x.max + margin - g->x0) / resolution );
+  g->height = (int)ceil( (box.y.max + margin - g->y0) / resolution );
+  g->occupied.assign( g->width * g->height, 0 );
+
+  // the outline catches blocks thinner than a cell
+  FOR_EACH( it, outlines )
+    {
+      g->Fill( *it );
+      for( size_t i=0; i<it->size(); ++i )
+	g->Line( (*it)[i], (*it)[ (i+1) % it->size() ] );
+    }
+
+  if( r > 0 )
+    g->Dilate( r );
+
+  g->Measure();
+
+  ++stats.rebuilds;
+  return g;
+}
+
+void Planner::Release( Grid* g )
+{
+  // called with the mutex locked, except by the destructor, when the
+  // threads have gone
+  if( g && --g->refs == 0 )
+    delete g;
+}
+
+Planner::Field* Planner::Find( uint32_t goal )
+{
+  std::map<uint32_t,Field*>::iterator it( fields.find( goal ));
+  if( it != fields.end() )
+    return it->second;
+
+  // queue a new one
+  Field* f( new Field( goal, generation ));
+  fields[goal] = f;
+  queue.push_back( f );
+  pthread_cond_signal( &work_cond );
+  return f;
+}
+
+void Planner::Request( const Pose& goal )
+{
+  pthread_mutex_lock( &mutex );
+
+  const int32_t gc( grid->Cell( goal.x, goal.y ));
+  if( gc >= 0 )
+    Find( gc );
+
+  pthread_mutex_unlock( &mutex );
+}
+
+bool Planner::Direction( const Pose& goal, const Pose& from,
+			 radians_t& heading, meters_t* distance,
+			 bool wait )
+{
+  pthread_mutex_lock( &mutex );
+  ++stats.lookups;
+
+  const int32_t gc( grid->Cell( goal.x, goal.y ));
+  const int32_t fc( grid->Cell( from.x, from.y ));
+  if( gc < 0 || fc < 0 )
+    {
+      pthread_mutex_unlock( &mutex );
+      return false;
+    }
+
+  Field* f( Find( gc ));
+  if( ! f->ready )
+    {
+      ++stats.misses;
+
+      // not waiting would make where robots go depend on timing
+      if( ! wait && ! world->IsDeterministic() )
+	{
+	  pthread_mutex_unlock( &mutex );
+	  return false;
+	}
+
+      while( ! f->ready )
+	pthread_cond_wait( &done_cond, &mutex );
+    }
+
+  f->last_use = ++uses;
+
+  if( f->dist[fc] == UNREACHED ) // walled off from the goal
+    {
+      pthread_mutex_unlock( &mutex );
+      return false;
+    }
+
+  const int8_t k( f->next[fc] );
+  if( k < 0 ) // we're there
+    heading = atan2( goal.y - from.y, goal.x - from.x );
+  else
+    heading = atan2( (double)NY[k], (double)NX[k] );
+
+  if( distance )
+    *distance = f->dist[fc] * resolution / COST_STRAIGHT;
+
+  pthread_mutex_unlock( &mutex );
+  return true;
+}
+
+void Planner::Invalidate()
+{
+  stale = true;
+}
+
+void Planner::ModelMapped( Model* mod )
+{
+  if( ! stale && IsStatic( mod ))
+    stale = true;
+}
+
+void Planner::ModelRemoved( Model* mod )
+{
+  if( IsStatic( mod ))
+    stale = true;
+
+  // it may be reparented or replaced at the same address
+  is_static.clear();
+}
+
+void Planner::ModelReparented( Model* mod )
+{
+  // forget what we knew, and rebuild if it was or is now static
+  std::map<Model*,bool>::iterator it( is_static.find( mod ));
+  const bool was( it != is_static.end() && it->second );
+  if( it != is_static.end() )
+    is_static.erase( it );
+
+  if( was || IsStatic( mod ))
+    stale = true;
+
+  FOR_EACH( cit, mod->GetChildren() )
+    ModelReparented( *cit );
+}
+
+void Planner::Sync()
+{
+  if( ! stale && fields.size() <= cache )
+    return;
+
+  pthread_mutex_lock( &mutex );
+
+  if( stale )
+    {
+      stale = false;
+      ++generation;
+
+      // the fields being computed now are deleted by their threads
+      // when they find the generation has changed
+      FOR_EACH( it, fields )
+	if( it->second->ready )
+	  delete it->second;
+      FOR_EACH( it, queue )
+	delete *it;
+      fields.clear();
+      queue.clear();
+
+      Release( grid );
+      grid = Build();
+    }
+  else
+    {
+      // forget the fields used least recently
+      std::vector<std::pair<uint64_t,uint32_t> > ready;
+      FOR_EACH( it, fields )
+	if( it->second->ready )
+	  ready.push_back( std::make_pair( it->second->last_use, it->first ));
+
+      std::sort( ready.begin(), ready.end() );
+
+      for( size_t i=0; i<ready.size() && fields.size() > cache; ++i )
+	{
+	  delete fields[ ready[i].second ];
+	  fields.erase( ready[i].second );
+	}
+    }
+
+  pthread_mutex_unlock( &mutex );
+}
+
+Planner::Stats Planner::GetStats()
+{
+  pthread_mutex_lock( &mutex );
+  const Stats s( stats );
+  pthread_mutex_unlock( &mutex );
+  return s;
+}
+
+void* Planner::ThreadEntry( void* arg )
+{
+  static_cast<Planner*>(arg)->Thread();
+  return NULL;
+}
+
+void Planner::Thread()
+{
+  pthread_mutex_lock( &mutex );
+
+  while( true )
+    {
+      while( queue.empty() && ! quit )
+	pthread_cond_wait( &work_cond, &mutex );
+
+      if( quit )
+	break;
+
+      Field* f( queue.front() );
+      queue.pop_front();
+
+      Grid* g( grid );
+      ++g->refs;
+
+      pthread_mutex_unlock( &mutex );
+      f->Compute( *g );
+      pthread_mutex_lock( &mutex );
+
+      Release( g );
+
+      if( f->generation == generation )
+	{
+	  f->ready = true;
+	  ++stats.fields;
+	  pthread_cond_broadcast( &done_cond );
+	}
+      else // discarded while we worked
+	delete f;
+    }
+
+  pthread_mutex_unlock( &mutex );
+}
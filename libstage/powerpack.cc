@@ -241,6 +241,13 @@ void PowerPack::SetStored( joules_t j )
   global_stored += stored;  
 }
 
+void PowerPack::SetDissipated( joules_t j ) 
+{
+  global_dissipated -= dissipated;
+  dissipated = j;
+  global_dissipated += dissipated;  
+}
+
 void PowerPack::Dissipate( joules_t j )
 {
   joules_t amount = (stored < 0) ? j : std::min( stored, j );
@@ -266,6 +266,18 @@ void SuperRegion::DrawVoxels(unsigned int layer) const
 
 void Stg::Cell::AddBlock( Block* b, unsigned int layer )
 {			
+  // record a contact with every other model already here
+  Model* mod( &b->group->mod );
+  FOR_EACH( it, blocks[layer] )
+    {
+      Model* other( &(*it)->group->mod );
+      if( other != mod )
+	{
+	  mod->AddContact( other, layer, 1 );
+	  other->AddContact( mod, layer, 1 );
+	}
+    }
+
   blocks[layer].push_back( b );   
   b->rendered_cells[layer].push_back(this);
   region->AddBlock();
@@ -310,6 +322,23 @@ void Stg::Cell::RemoveBlock( Block* b, unsigned int layer )
 	}
       blks.resize( w-start );
 #endif
+
+      // every copy of b removed ends one contact with each block of
+      // another model left here
+      const unsigned int copies( len - blks.size() );
+      if( copies )
+	{
+	  Model* mod( &b->group->mod );
+	  FOR_EACH( it, blks )
+	    {
+	      Model* other( &(*it)->group->mod );
+	      if( other != mod )
+		{
+		  mod->RemoveContact( other, layer, copies );
+		  other->RemoveContact( mod, layer, copies );
+		}
+	    }
+	}
     }
   
   region->RemoveBlock();
@@ -0,0 +1,114 @@
+/*
+  rng.cc
+  Counter-based random numbers. See Rng in stage.hh.
+*/
+
+#include "stage.hh"
+using namespace Stg;
+
+const uint32_t Rng::INTERNAL;
+
+// Philox4x32 multipliers and Weyl key increments
+static const uint32_t PHILOX_M0 = 0xD2511F53;
+static const uint32_t PHILOX_M1 = 0xCD9E8D57;
+static const uint32_t PHILOX_W0 = 0x9E3779B9;
+static const uint32_t PHILOX_W1 = 0xBB67AE85;
+
+// deviates produced from each batch of blocks by Normals()
+static const size_t RNG_BATCH = 64;
+
+Rng::Rng( uint64_t seed, uint32_t id, uint64_t tick, uint32_t stream ) :
+  used(4)
+{
+  key[0] = (uint32_t)seed;
+  key[1] = (uint32_t)( seed >> 32 ) ^ (uint32_t)( tick >> 32 );
+
+  ctr[0] = 0;
+  ctr[1] = stream;
+  ctr[2] = id;
+  ctr[3] = (uint32_t)tick;
+}
+
+void Rng::Block( const uint32_t key[2], const uint32_t ctr[4], uint32_t out[4] )
+{
+  uint32_t k0( key[0] ), k1( key[1] );
+  uint32_t c0( ctr[0] ), c1( ctr[1] ), c2( ctr[2] ), c3( ctr[3] );
+
+  for( int round=0; round<10; ++round )
+    {
+      const uint64_t p0( (uint64_t)PHILOX_M0 * c0 );
+      const uint64_t p1( (uint64_t)PHILOX_M1 * c2 );
+
+      c0 = (uint32_t)( p1 >> 32 ) ^ c1 ^ k0;
+      c1 = (uint32_t)p1;
+      c2 = (uint32_t)( p0 >> 32 ) ^ c3 ^ k1;
+      c3 = (uint32_t)p0;
+
+      k0 += PHILOX_W0;
+      k1 += PHILOX_W1;
+    }
+
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+void Rng::Refill()
+{
+  Block( key, ctr, buf );
+  ++ctr[0];
+  used = 0;
+}
+
+// a uniform number in (0,1), never zero, for taking logs
+static inline double rng_open( uint32_t bits )
+{
+  return( ( bits + 0.5 ) * ( 1.0 / 4294967296.0 ));
+}
+
+double Rng::Normal( double mean, double stddev )
+{
+  // Box-Muller
+  const double r( sqrt( -2.0 * log( rng_open( Next() ))));
+  return( mean + stddev * r * cos( 2.0 * M_PI * rng_open( Next() )));
+}
+
+void Rng::Normals( double* out, size_t count, double mean, double stddev )
+{
+  // start on a fresh block, so the numbers depend only on how many
+  // blocks were used before, not on single draws
+  used = 4;
+
+  uint32_t bits[RNG_BATCH];
+
+  while( count > 0 )
+    {
+      const size_t n( std::min( count, RNG_BATCH ));
+      const size_t blocks( ( n + 3 ) / 4 );
+
+      // every block is independent of the others
+      for( size_t b=0; b<blocks; ++b )
+	{
+	  uint32_t c[4] = { ctr[0] + (uint32_t)b, ctr[1], ctr[2], ctr[3] };
+	  Block( key, c, &bits[4*b] );
+	}
+      ctr[0] += blocks;
+
+      // Box-Muller turns each pair of words into a pair of deviates
+      for( size_t i=0; i+1<n; i+=2 )
+	{
+	  const double r( stddev * sqrt( -2.0 * log( rng_open( bits[i] ))));
+	  const double t( 2.0 * M_PI * rng_open( bits[i+1] ));
+	  out[i] = mean + r * cos( t );
+	  out[i+1] = mean + r * sin( t );
+	}
+
+      if( n % 2 ) // odd one out
+	out[n-1] = mean + stddev * sqrt( -2.0 * log( rng_open( bits[n-1] )))
+	  * cos( 2.0 * M_PI * rng_open( bits[n] ));
+
+      out += n;
+      count -= n;
+    }
+}
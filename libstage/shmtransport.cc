@@ -0,0 +1,431 @@
+/*
+  shmtransport.cc
+  Serves a World's models to controllers in other processes through
+  shared memory. See stage_shm.h for the layout.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "shmtransport.hh"
+
+using namespace Stg;
+
+std::set<ShmTransport*> ShmTransport::open_transports;
+
+// rings are at least this big, so a big ranger scan fits
+static const size_t MIN_RING_BYTES = 4096;
+
+static size_t Align( size_t bytes, size_t to )
+{
+  return ( bytes + to - 1 ) & ~( to - 1 );
+}
+
+static uint32_t PackColor( const Color& c )
+{
+  return( ((uint32_t)(c.r * 255.0) << 24) |
+	  ((uint32_t)(c.g * 255.0) << 16) |
+	  ((uint32_t)(c.b * 255.0) << 8) |
+	  (uint32_t)(c.a * 255.0) );
+}
+
+static void CopyName( char* dest, size_t len, const std::string& src )
+{
+  strncpy( dest, src.c_str(), len-1 );
+  dest[len-1] = 0;
+}
+
+// sorts models by id, so the table is in the order they were created
+static bool IdLess( Model* a, Model* b ){ return a->GetId() < b->GetId(); }
+
+ShmTransport::ShmTransport( World* world,
+			    const std::string& segment,
+			    size_t ring_bytes ) :
+  world( world ),
+  name( segment[0] == '/' ? segment : "/" + segment ),
+  bytes( 0 ),
+  first_ring( 0 ),
+  ring_stride( 0 ),
+  ring_size( MIN_RING_BYTES ),
+  command_errors( 0 ),
+  base( NULL ),
+  hdr( NULL ),
+  table( NULL ),
+  models(),
+  subscribed()
+{
+  // a power of two, so positions can be masked
+  while( ring_size < ring_bytes )
+    ring_size *= 2;
+
+  const std::set<Model*> all = world->GetAllModels();
+  models.assign( all.begin(), all.end() );
+  std::sort( models.begin(), models.end(), IdLess );
+  subscribed.resize( models.size(), false );
+
+  ring_stride = Align( sizeof(stg_shm_ring_t) + ring_size, 64 );
+  first_ring =
+    Align( sizeof(stg_shm_header_t) + models.size() * sizeof(stg_shm_model_t), 64 );
+  bytes = first_ring + 2 * models.size() * ring_stride;
+
+  // replace any segment left behind by a Stage that crashed
+  shm_unlink( name.c_str() );
+
+  const int fd = shm_open( name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600 );
+  if( fd < 0 )
+    {
+      PRINT_ERR2( "failed to create shared memory segment %s: %s",
+		  name.c_str(), strerror(errno) );
+      return;
+    }
+
+  if( ftruncate( fd, bytes ) != 0 )
+    {
+      PRINT_ERR2( "failed to size shared memory segment %s: %s",
+		  name.c_str(), strerror(errno) );
+      close( fd );
+      shm_unlink( name.c_str() );
+      return;
+    }
+
+  void* mem = mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd ); // the mapping keeps the segment
+
+  if( mem == MAP_FAILED )
+    {
+      PRINT_ERR2( "failed to map shared memory segment %s: %s",
+		  name.c_str(), strerror(errno) );
+      shm_unlink( name.c_str() );
+      return;
+    }
+
+  // ftruncate() zeroed the segment
+  base = (uint8_t*)mem;
+  table = (stg_shm_model_t*)( base + sizeof(stg_shm_header_t) );
+
+  std::map<Model*,uint32_t> index;
+  for( unsigned int i=0; i<models.size(); ++i )
+    index[models[i]] = i;
+
+  size_t offset = first_ring;
+  for( unsigned int i=0; i<models.size(); ++i )
+    {
+      Model* mod = models[i];
+      stg_shm_model_t& entry = table[i];
+
+      CopyName( entry.name, sizeof(entry.name), mod->Token() );
+      CopyName( entry.type, sizeof(entry.type), mod->GetModelType() );
+      entry.id = mod->GetId();
+      entry.parent = mod->Parent() ? index[mod->Parent()] : 0xFFFFFFFF;
+
+      entry.data_ring = offset;
+      ((stg_shm_ring_t*)( base + offset ))->size = ring_size;
+      offset += ring_stride;
+
+      entry.cmd_ring = offset;
+      ((stg_shm_ring_t*)( base + offset ))->size = ring_size;
+      offset += ring_stride;
+    }
+
+  stg_shm_header_t* h = (stg_shm_header_t*)base;
+  h->version = STG_SHM_VERSION;
+  h->model_count = models.size();
+  h->header_bytes = first_ring;
+  h->segment_bytes = bytes;
+  h->sim_interval = world->sim_interval;
+  h->sim_time = world->SimTimeNow();
+  h->server_pid = getpid();
+
+  // clients check the magic number last
+  __sync_synchronize();
+  h->magic = STG_SHM_MAGIC;
+  hdr = h;
+
+  static bool registered = false;
+  if( ! registered )
+    {
+      atexit( CloseAll );
+      registered = true;
+    }
+
+  open_transports.insert( this );
+
+  printf( " [Serving %u models on %s]", (unsigned int)models.size(), name.c_str() );
+}
+
+ShmTransport::~ShmTransport()
+{
+  open_transports.erase( this );
+
+  if( hdr == NULL )
+    return;
+
+  if( command_errors )
+    printf( "[Shm \"%s\": %llu malformed command rings reset]\n",
+	    name.c_str(), (unsigned long long)command_errors );
+
+  for( unsigned int i=0; i<models.size(); ++i )
+    if( subscribed[i] )
+      models[i]->Unsubscribe();
+
+  // tell the clients we've gone
+  hdr->server_pid = 0;
+  __sync_fetch_and_add( &hdr->tick, 1 );
+
+#ifdef __linux__
+  syscall( SYS_futex, &hdr->tick, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+#endif
+
+  munmap( base, bytes );
+  shm_unlink( name.c_str() );
+}
+
+void ShmTransport::CloseAll()
+{
+  while( ! open_transports.empty() )
+    (*open_transports.begin())->world->StopShm();
+}
+
+void ShmTransport::ReadCommands()
+{
+  for( unsigned int i=0; i<models.size(); ++i )
+    {
+      stg_shm_ring_t* ring = CommandRing( i );
+
+      // cheap test for the usual case of no commands
+      if( ring->head == ring->tail )
+	continue;
+
+      // the client writes this ring, so nothing in it is believed
+      // until checked, and a bad ring is emptied rather than allowed
+      // to stall or crash us
+      if( ring->size != ring_size || ring->head - ring->tail > ring_size )
+	{
+	  ResetCommands( i );
+	  continue;
+	}
+
+      const stg_shm_msg_t* next;
+      while( (next = stg_shm_ring_peek( ring )) )
+	{
+	  // a copy, so the client can't change it once checked
+	  const stg_shm_msg_t msg = *next;
+	  if( ! stg_shm_msg_ok( ring, msg.bytes ))
+	    {
+	      ResetCommands( i );
+	      break;
+	    }
+
+	  Apply( i, msg, next + 1 );
+
+	  __sync_synchronize(); // the message is read before the tail moves
+	  ring->tail += msg.bytes;
+	}
+    }
+}
+
+void ShmTransport::ResetCommands( unsigned int index )
+{
+  stg_shm_ring_t* ring = CommandRing( index );
+
+  if( ring->errors == 0 )
+    PRINT_WARN1( "malformed shm commands for %s; discarding them",
+		 models[index]->Token() );
+
+  ring->size = ring_size;
+  ring->tail = ring->head;
+  __sync_fetch_and_add( &ring->errors, 1 );
+  ++command_errors;
+}
+
+void ShmTransport::Apply( unsigned int index, const stg_shm_msg_t& msg, const void* data )
+{
+  Model* mod = models[index];
+  const size_t payload = msg.bytes - sizeof(stg_shm_msg_t);
+  const double* v = (const double*)data;
+
+  switch( msg.type )
+    {
+    case STG_SHM_SUBSCRIBE:
+      if( ! subscribed[index] )
+	{
+	  mod->Subscribe();
+	  subscribed[index] = true;
+	}
+      break;
+
+    case STG_SHM_UNSUBSCRIBE:
+      if( subscribed[index] )
+	{
+	  mod->Unsubscribe();
+	  subscribed[index] = false;
+	}
+      break;
+
+    case STG_SHM_VELOCITY:
+      if( payload < 4 * sizeof(double) )
+	break;
+      if( ModelPosition* pos = dynamic_cast<ModelPosition*>(mod) )
+	pos->SetSpeed( Velocity( v[0], v[1], v[2], v[3] ));
+      else
+	PRINT_WARN1( "shm velocity command for %s, which is not a position model",
+		     mod->Token() );
+      break;
+
+    case STG_SHM_SETPOSE:
+      if( payload >= 4 * sizeof(double) )
+	mod->SetPose( Pose( v[0], v[1], v[2], v[3] ));
+      break;
+
+    default:
+      PRINT_WARN2( "unknown shm command %u for %s", msg.type, mod->Token() );
+    }
+}
+
+void ShmTransport::Publish()
+{
+  const usec_t now = world->SimTimeNow();
+
+  for( unsigned int i=0; i<models.size(); ++i )
+    if( subscribed[i] )
+      {
+	stg_shm_ring_t* ring = DataRing( i );
+	SendPose( ring, models[i] );
+	SendSensor( ring, models[i] );
+      }
+
+  hdr->sim_time = now;
+  __sync_fetch_and_add( &hdr->tick, 1 ); // a full barrier
+
+#ifdef __linux__
+  // waking nobody would still cost a system call
+  if( hdr->waiters )
+    syscall( SYS_futex, &hdr->tick, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+#endif
+}
+
+void ShmTransport::SendPose( stg_shm_ring_t* ring, Model* mod )
+{
+  stg_shm_pose_t* out = (stg_shm_pose_t*)
+    stg_shm_ring_reserve( ring, STG_SHM_POSE, world->SimTimeNow(), sizeof(stg_shm_pose_t) );
+  if( out == NULL )
+    return;
+
+  const Pose gpose = mod->GetGlobalPose();
+  out->pose[0] = gpose.x;
+  out->pose[1] = gpose.y;
+  out->pose[2] = gpose.z;
+  out->pose[3] = gpose.a;
+
+  if( ModelPosition* pos = dynamic_cast<ModelPosition*>(mod) )
+    {
+      const Velocity vel = pos->GetVelocity();
+      out->velocity[0] = vel.x;
+      out->velocity[1] = vel.y;
+      out->velocity[2] = vel.z;
+      out->velocity[3] = vel.a;
+      out->odom[0] = pos->est_pose.x;
+      out->odom[1] = pos->est_pose.y;
+      out->odom[2] = pos->est_pose.z;
+      out->odom[3] = pos->est_pose.a;
+    }
+  else
+    for( int k=0; k<4; ++k )
+      out->velocity[k] = out->odom[k] = 0.0;
+
+  out->stall = mod->Stalled();
+  out->pad = 0;
+
+  stg_shm_ring_commit( ring, sizeof(stg_shm_pose_t) );
+}
+
+void ShmTransport::SendSensor( stg_shm_ring_t* ring, Model* mod )
+{
+  const usec_t now = world->SimTimeNow();
+
+  if( ModelRanger* rgr = dynamic_cast<ModelRanger*>(mod) )
+    {
+      const std::vector<ModelRanger::Sensor>& sensors = rgr->GetSensors();
+
+      uint32_t count = 0;
+      FOR_EACH( it, sensors )
+	count += it->ranges.size();
+
+      const size_t payload = sizeof(stg_shm_count_t) + count * sizeof(float);
+      stg_shm_count_t* out = (stg_shm_count_t*)
+	stg_shm_ring_reserve( ring, STG_SHM_RANGER, now, payload );
+      if( out == NULL )
+	return;
+
+      out->count = count;
+      out->pad = 0;
+      float* ranges = (float*)( out + 1 );
+      FOR_EACH( it, sensors )
+	FOR_EACH( r, it->ranges )
+	*ranges++ = *r;
+
+      stg_shm_ring_commit( ring, payload );
+    }
+  else if( ModelFiducial* fid = dynamic_cast<ModelFiducial*>(mod) )
+    {
+      const std::vector<ModelFiducial::Fiducial>& fids = fid->GetFiducials();
+
+      const size_t payload = sizeof(stg_shm_count_t) + fids.size() * sizeof(stg_shm_fiducial_t);
+      stg_shm_count_t* out = (stg_shm_count_t*)
+	stg_shm_ring_reserve( ring, STG_SHM_FIDUCIAL, now, payload );
+      if( out == NULL )
+	return;
+
+      out->count = fids.size();
+      out->pad = 0;
+      stg_shm_fiducial_t* f = (stg_shm_fiducial_t*)( out + 1 );
+      FOR_EACH( it, fids )
+	{
+	  f->id = it->id;
+	  f->model_id = it->mod ? it->mod->GetId() : 0xFFFFFFFF;
+	  f->range = it->range;
+	  f->bearing = it->bearing;
+	  f->geom[0] = it->geom.x;
+	  f->geom[1] = it->geom.y;
+	  f->geom[2] = it->geom.z;
+	  f->geom[3] = it->geom.a;
+	  ++f;
+	}
+
+      stg_shm_ring_commit( ring, payload );
+    }
+  else if( ModelBlobfinder* bf = dynamic_cast<ModelBlobfinder*>(mod) )
+    {
+      const std::vector<ModelBlobfinder::Blob>& blobs = bf->GetBlobs();
+
+      const size_t payload = sizeof(stg_shm_count_t) + blobs.size() * sizeof(stg_shm_blob_t);
+      stg_shm_count_t* out = (stg_shm_count_t*)
+	stg_shm_ring_reserve( ring, STG_SHM_BLOBFINDER, now, payload );
+      if( out == NULL )
+	return;
+
+      out->count = blobs.size();
+      out->pad = 0;
+      stg_shm_blob_t* b = (stg_shm_blob_t*)( out + 1 );
+      FOR_EACH( it, blobs )
+	{
+	  b->color = PackColor( it->color );
+	  b->left = it->left;
+	  b->top = it->top;
+	  b->right = it->right;
+	  b->bottom = it->bottom;
+	  b->range = it->range;
+	  ++b;
+	}
+
+      stg_shm_ring_commit( ring, payload );
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+/*
+  shmtransport.hh
+  Serves a World's models to controllers in other processes through
+  shared memory. See stage_shm.h for the layout and the client library.
+*/
+
+#include "stage.hh"
+#include "stage_shm.h"
+
+namespace Stg
+{
+  /** Owns the shared memory segment of a World with shm_name set.
+      Everything here runs in the thread that calls World::Update(). */
+  class ShmTransport
+  {
+  public:
+    /** Creates the segment [name], with a data ring and a command
+	ring of [ring_bytes] for each model of [world]. An existing
+	segment of the same name is replaced. Check Ok() afterwards. */
+    ShmTransport( World* world, const std::string& name, size_t ring_bytes );
+
+    /** Wakes any waiting clients, and removes the segment */
+    ~ShmTransport();
+
+    bool Ok() const { return hdr != NULL; }
+
+    /** Remove all segments. Registered with atexit(3), since Stage
+	usually quits without destroying its worlds, and a segment left
+	behind would outlive the process. */
+    static void CloseAll();
+
+    /** Apply the commands waiting in every command ring. Called at the
+	start of each update. */
+    void ReadCommands();
+
+    /** Send the data of every subscribed model, then advance the tick
+	and wake the clients. Called at the end of each update. */
+    void Publish();
+
+  private:
+    /** Apply the command [msg], with [payload] following its header */
+    void Apply( unsigned int index, const stg_shm_msg_t& msg, const void* payload );
+
+    /** Discard everything in the command ring of model [index], which
+	the client has filled with something malformed */
+    void ResetCommands( unsigned int index );
+    void SendPose( stg_shm_ring_t* ring, Model* mod );
+    void SendSensor( stg_shm_ring_t* ring, Model* mod );
+
+    // from our own layout, not the table, which clients can write
+    stg_shm_ring_t* DataRing( unsigned int index ) const
+    { return (stg_shm_ring_t*)( base + first_ring + 2 * index * ring_stride ); }
+
+    stg_shm_ring_t* CommandRing( unsigned int index ) const
+    { return (stg_shm_ring_t*)( base + first_ring + ( 2 * index + 1 ) * ring_stride ); }
+
+    World* world;
+    std::string name;
+    size_t bytes;
+    size_t first_ring; ///< offset of the first ring
+    size_t ring_stride; ///< bytes from one ring to the next
+    uint32_t ring_size; ///< bytes of data in each ring
+    uint64_t command_errors; ///< times a command ring was reset
+
+    uint8_t* base; ///< the mapped segment
+    stg_shm_header_t* hdr; ///< NULL if the segment couldn't be created
+    stg_shm_model_t* table;
+
+    /** the model for each table entry */
+    std::vector<Model*> models;
+
+    /** true for each table entry a client has subscribed */
+    std::vector<bool> subscribed;
+
+    static std::set<ShmTransport*> open_transports;
+  };
+
+}; // namespace Stg
@@ -520,6 +520,160 @@ namespace Stg
     { return ((x == other.x) && (y == other.y) ); }
   };
   
+  /** A counter-based random number generator, Philox4x32-10 (Salmon
+      et al., "Parallel random numbers: as easy as 1, 2, 3", SC 2011).
+      Every number is a pure function of the key and the counter, so a
+      stream needs no shared state or locks, and gives the same numbers
+      whichever thread draws them, in whatever order. Models get a
+      stream keyed by the world seed, their index in the world and the
+      update count from Model::GetRng(). */
+  class Rng
+  {
+  public:
+    /** The first stream used by Stage's own models. Controllers
+	should use streams below this. */
+    static const uint32_t INTERNAL = 0x80000000;
+
+    /** A stream for [stream] of the model numbered [id] in update
+	[tick] of a world seeded with [seed]. */
+    Rng( uint64_t seed, uint32_t id, uint64_t tick, uint32_t stream = 0 );
+
+    /** Return the next 32 random bits */
+    uint32_t Next()
+    {
+      if( used == 4 )
+	Refill();
+      return buf[used++];
+    }
+
+    /** Return a number uniformly distributed in [0,1) */
+    double Uniform() { return Next() * (1.0 / 4294967296.0); }
+
+    /** Return a normally distributed number */
+    double Normal( double mean, double stddev );
+
+    /** Fill [out] with [count] normally distributed numbers. Whole
+	blocks are generated at once, in loops without dependencies
+	between iterations, which is much faster than calling
+	Normal() for each. */
+    void Normals( double* out, size_t count, double mean, double stddev );
+
+    /** Compute the Philox4x32-10 block for [ctr] under [key] */
+    static void Block( const uint32_t key[2], const uint32_t ctr[4], uint32_t out[4] );
+
+  private:
+    uint32_t key[2];
+    uint32_t ctr[4]; ///< block number, stream, id, tick
+    uint32_t buf[4];
+    unsigned int used;
+
+    void Refill();
+  };
+
+  /** Appends values to a byte buffer in native byte order, for
+      Model::SaveState(). Put() is only for plain numbers and bools:
+      Pose and its relatives have a vtable, so use PutPose(). */
+  class StateWriter
+  {
+  public:
+    std::vector<uint8_t> bytes;
+
+    StateWriter() : bytes() {}
+
+    template <class T> void Put( const T& v )
+    {
+      const uint8_t* p( (const uint8_t*)&v );
+      bytes.insert( bytes.end(), p, p + sizeof(T) );
+    }
+
+    void PutPose( const Pose& p )
+    { Put( p.x ); Put( p.y ); Put( p.z ); Put( p.a ); }
+
+    void PutString( const std::string& s )
+    {
+      Put( (uint32_t)s.size() );
+      bytes.insert( bytes.end(), s.begin(), s.end() );
+    }
+
+    void PutDoubles( const std::vector<double>& v )
+    {
+      Put( (uint32_t)v.size() );
+      const uint8_t* p( (const uint8_t*)( v.empty() ? NULL : &v[0] ));
+      bytes.insert( bytes.end(), p, p + v.size() * sizeof(double) );
+    }
+  };
+
+  /** Reads back the values written by a StateWriter, in the same
+      order. Reading past the end returns zeros and makes Ok() false,
+      so a short record can't crash the reader. */
+  class StateReader
+  {
+  public:
+    StateReader( const uint8_t* data, size_t len )
+      : data(data), len(len), pos(0), ok(true) {}
+
+    bool Ok() const { return ok; }
+
+    /** Returns true if every byte has been read */
+    bool AtEnd() const { return pos == len; }
+
+    template <class T> T Get()
+    {
+      T v;
+      if( ! Read( &v, sizeof(T) ))
+	memset( &v, 0, sizeof(T) );
+      return v;
+    }
+
+    template <class T> void Get( T& v ){ v = Get<T>(); }
+
+    void GetPose( Pose& p )
+    { p.x = Get<double>(); p.y = Get<double>(); p.z = Get<double>(); p.a = Get<double>(); }
+
+    std::string GetString()
+    {
+      const uint32_t n( Get<uint32_t>() );
+      if( n > len - pos )
+	{
+	  ok = false;
+	  return std::string();
+	}
+      std::string s( (const char*)data + pos, n );
+      pos += n;
+      return s;
+    }
+
+    void GetDoubles( std::vector<double>& v )
+    {
+      const uint32_t n( Get<uint32_t>() );
+      if( n > ( len - pos ) / sizeof(double) )
+	{
+	  ok = false;
+	  return;
+	}
+      v.resize( n );
+      if( n )
+	Read( &v[0], n * sizeof(double) );
+    }
+
+  private:
+    const uint8_t* data;
+    size_t len, pos;
+    bool ok;
+
+    bool Read( void* out, size_t n )
+    {
+      if( ! ok || n > len - pos )
+	{
+	  ok = false;
+	  return false;
+	}
+      memcpy( out, data + pos, n );
+      pos += n;
+      return true;
+    }
+  };
+
   /** create an array of 4 points containing the corners of a unit
       square.  */
   point_t* unit_square_points_create();
@@ -549,6 +703,39 @@ namespace Stg
     /** Draws a rectangle with center at x,y, with sides of length dx,dy */
     void draw_centered_rect( float x, float y, float dx, float dy );
   } // namespace Gl
+
+  /** A list of colored vertices in world coordinates, collected during
+      a frame and drawn with a single glDrawArrays() call. Drawing many
+      small things this way is much faster than giving each its own
+      matrix push and glBegin()/glEnd(). */
+  class VertexBatch
+  {
+  public:
+    std::vector<GLfloat> verts; ///< x, y, z of each vertex
+    std::vector<GLubyte> colors; ///< r, g, b, a of each vertex
+
+    VertexBatch() : verts(), colors() {}
+
+    void Clear(){ verts.clear(); colors.clear(); }
+    bool Empty() const { return verts.empty(); }
+    size_t Count() const { return verts.size() / 3; }
+
+    void Vertex( GLfloat x, GLfloat y, GLfloat z, const GLubyte rgba[4] )
+    {
+      verts.push_back( x ); verts.push_back( y ); verts.push_back( z );
+      colors.insert( colors.end(), rgba, rgba+4 );
+    }
+
+    /** Append [local], a list of x, y, z vertices, transformed from the
+	frame of [pose] into world coordinates, all colored [rgba]. */
+    void Append( const Pose& pose, const std::vector<GLfloat>& local, const GLubyte rgba[4] );
+    
+    /** Draw the vertices as primitives of type [mode], e.g. GL_LINES */
+    void Draw( GLenum mode ) const;
+
+    /** Pack [c] into 4 bytes, as used by Vertex() and Append() */
+    static void Pack( const Color& c, GLubyte rgba[4] );
+  };
   
   void RegisterModels();
   
@@ -569,8 +756,30 @@ namespace Stg
     virtual ~Visualizer( void ) { }
     virtual void Visualize( Model* mod, Camera* cam ) = 0;
 	 
-    const std::string& GetMenuName() { return menu_name; }
-    const std::string& GetWorldfileName() { return worldfile_name; }	 
+    const std::string& GetMenuName() const { return menu_name; }
+    const std::string& GetWorldfileName() const { return worldfile_name; }	 
+  };
+
+  /** A copy of the data a model's visualizations draw, made by
+      Model::SnapshotData() while the world is locked, so that the
+      canvas of a threaded world can draw it while the simulation
+      carries on. */
+  class DataSnapshot
+  {
+  public:
+    /** The model, its parent, and so on up. Only compared with the
+	canvas's selection, as the models may be gone by the time the
+	snapshot is drawn. */
+    std::vector<const Model*> lineage;
+    Pose gpose; ///< the model's global pose
+
+    DataSnapshot( const Model* mod );
+    virtual ~DataSnapshot() {}
+
+    /** Draw the data in the model's coordinates, as
+	Model::DataVisualizeTree() would. [world] is the model's
+	world. */
+    virtual void Draw( World* world, Camera* cam ) const = 0;
   };
 
 
@@ -760,21 +969,22 @@ namespace Stg
     meters_t range; ///< range to beam hit in meters
     Model* mod; ///< the model struck by this beam
     Color color; ///< the color struck by this beam
+    Bounds z; ///< the global z extent of the block struck
 	 
-    RaytraceResult() : pose(), range(0), mod(NULL), color() {}
+    RaytraceResult() : pose(), range(0), mod(NULL), color(), z() {}
     RaytraceResult( const Pose& pose, 
 		    meters_t range ) 
-      : pose(pose), range(range), mod(NULL), color() {}	 
+      : pose(pose), range(range), mod(NULL), color(), z() {}	 
   };
 	
   class Ray
   {
   public:
     Ray( const Model* mod, const Pose& origin, const meters_t range, const ray_test_func_t func, const void* arg, const bool ztest ) :
-      mod(mod), origin(origin), range(range), func(func), arg(arg), ztest(ztest)
+      mod(mod), origin(origin), range(range), func(func), arg(arg), ztest(ztest), hits(NULL)
     {}
 
-    Ray() : mod(NULL), origin(0,0,0,0), range(0), func(NULL), arg(NULL), ztest(true)
+    Ray() : mod(NULL), origin(0,0,0,0), range(0), func(NULL), arg(NULL), ztest(true), hits(NULL)
     {}
 		
     const Model* mod;
@@ -783,6 +993,10 @@ namespace Stg
     ray_test_func_t func;
     const void* arg;
     bool ztest;		
+    /** If set, World::Raytrace() does not stop at the first hit, but
+	appends every block it finds, in each cell along the whole
+	ray, to this vector, nearest first. */
+    std::vector<RaytraceResult>* hits;
   };
 		
 
@@ -790,7 +1004,13 @@ namespace Stg
   class Region;
   class SuperRegion;
   class BlockGroup;
+  class BlockGeom;
   class PowerPack;
+  class TrajectoryLog;
+  class ShmTransport;
+  class TrajectoryReplay;
+  class Checkpoint;
+  class CheckpointWriter;
 
   class LogEntry
   {
@@ -824,6 +1044,114 @@ namespace Stg
   };
 
   class ModelPosition;
+  class ModelRanger;
+  class ModelWifi;
+
+  /** Shared path planning over the static obstacles of a World: the
+      obstacle models that are not position models or carried by one.
+      The obstacles are rasterized into a grid, and for each goal the
+      distance from every cell to the goal, and the direction to the
+      next cell on the way, is computed once, in the planner's own
+      threads, and cached. Then any number of robots heading for the
+      same goal find their way in constant time. Fields are discarded
+      when a static obstacle moves, appears or disappears. Get a
+      world's planner with World::GetPlanner(). */
+  class Planner
+  {
+  public:
+    /** Plans over the static obstacles of [world] in cells of
+	[resolution] meters, keeping [clearance] meters from obstacles
+	where possible and caching at most [cache] fields, which are
+	computed in [threads] threads. */
+    Planner( World* world, meters_t resolution, meters_t clearance,
+	     unsigned int cache, unsigned int threads );
+    ~Planner();
+
+    /** Find the way from [from] to [goal]. Returns true, and sets
+	[heading] to the global direction of the next cell on a
+	shortest path, and [distance], if not NULL, to the length of
+	the path, if the field for [goal] is ready. Otherwise starts
+	computing it and returns false, or, if [wait] is true or the
+	world is deterministic, waits for it. Also returns false if
+	[from] or [goal] is outside the grid, or there is no way from
+	one to the other. Paths never cross obstacles or their
+	clearance, but a robot that starts inside the clearance is led
+	out of it, and a goal inside it can be reached from its edge. */
+    bool Direction( const Pose& goal, const Pose& from, 
+		    radians_t& heading, meters_t* distance = NULL,
+		    bool wait = false );
+
+    /** Start computing the field for [goal], if it is not cached, and
+	return without waiting */
+    void Request( const Pose& goal );
+
+    /** Discard all fields and the grid, which are rebuilt at the next
+	Sync() */
+    void Invalidate();
+
+    /** Called when [mod] is mapped or unmapped, and so may have moved.
+	Invalidates if [mod] is a static obstacle. */
+    void ModelMapped( Model* mod );
+
+    /** Called when [mod] is removed from the world */
+    void ModelRemoved( Model* mod );
+
+    /** Called when [mod] is given a new parent, which can change
+	whether it and its descendants are static obstacles */
+    void ModelReparented( Model* mod );
+
+    /** Rebuild after an invalidation, and trim the cache. Called by
+	World::Update() when no controllers are running. */
+    void Sync();
+
+    class Stats
+    {
+    public:
+      uint64_t lookups; ///< calls of Direction()
+      uint64_t misses; ///< lookups that found no ready field
+      uint64_t fields; ///< fields computed
+      uint64_t rebuilds; ///< grids built
+      
+      Stats() : lookups(0), misses(0), fields(0), rebuilds(0) {}
+    };
+
+    /** Returns counts of the planner's work so far */
+    Stats GetStats();
+
+  private:
+    class Grid;
+    class Field;
+
+    World* world;
+    meters_t resolution;
+    meters_t clearance;
+    unsigned int cache;
+
+    Grid* grid; ///< the current grid, shared with the fields computing on it
+    uint64_t generation; ///< incremented when the fields are discarded
+    uint64_t uses; ///< incremented by each lookup, to find old fields
+    bool stale; ///< the grid must be rebuilt at the next Sync()
+
+    std::map<uint32_t,Field*> fields; ///< by goal cell
+    std::list<Field*> queue; ///< fields waiting for a thread
+    Stats stats;
+
+    /** Whether each model seen by ModelMapped() is a static obstacle */
+    std::map<Model*,bool> is_static;
+
+    bool quit;
+    std::vector<pthread_t> threads;
+    pthread_mutex_t mutex; ///< protects everything the threads share
+    pthread_cond_t work_cond; ///< signalled when a field is queued
+    pthread_cond_t done_cond; ///< signalled when a field is ready
+
+    bool IsStatic( Model* mod );
+    Grid* Build();
+    void Release( Grid* g );
+    Field* Find( uint32_t goal ); ///< call with the mutex locked
+    static void* ThreadEntry( void* arg );
+    void Thread();
+  };
 
   /// %World class
   class World : public Ancestor
@@ -831,7 +1159,10 @@ namespace Stg
   public:
     friend class Block;
     friend class Model; // allow access to private members
+    friend class ModelPosition;
+    friend class Planner;
     friend class ModelFiducial;
+    friend class ModelWifi;
     friend class Canvas;
     friend class WorkerThread;
 
@@ -841,6 +1172,39 @@ namespace Stg
     static std::vector<std::string> args;
     static std::string ctrlargs;
 
+    /** Counts of the work done testing for collisions */
+    class CollisionStats
+    {
+    public:
+      uint64_t tests; ///< models tested
+      uint64_t contacts; ///< models sharing a cell with those tested
+      uint64_t candidates; ///< contacts passed to the narrow phase
+      uint64_t block_checks; ///< blocks compared by the narrow phase
+      uint64_t substeps; ///< extra sub-moves taken by fast position models
+
+      CollisionStats() : tests(0), contacts(0), candidates(0), block_checks(0), substeps(0) {}
+    };
+
+    /** Timing of the updates of a world kept to real time with the
+	worldfile property "pace" or World::SetPace() */
+    class PaceStats
+    {
+    public:
+      static const unsigned int BINS = 24;
+
+      uint64_t ticks; ///< paced updates
+      uint64_t overruns; ///< updates that finished after their deadline
+      uint64_t resyncs; ///< times pacing fell so far behind it gave up catching up
+      usec_t max_late; ///< the latest an update has finished
+      /** late[0] counts updates that finished less than 1 usec after
+	  their deadline, and late[i] those between 2^(i-1) and 2^i
+	  usec late. The last bin takes everything later. */
+      uint64_t late[BINS];
+
+      PaceStats() : ticks(0), overruns(0), resyncs(0), max_late(0)
+      { memset( late, 0, sizeof(late) ); }
+    };
+
   private:
 	
     static std::set<World*> world_set; ///< all the worlds that exist
@@ -850,6 +1214,11 @@ namespace Stg
 	 
     bool destroy;
     bool dirty; ///< iff true, a gui redraw would be required
+
+    /** While true, new callbacks are registered as thread-safe,
+	whichever model they are added to. Set while the Init() of a
+	controller that exports ThreadSafeCallbacks is running. */
+    bool thread_safe_init;
 	 
     /** Pointers to all the models in this world. */
     std::set<Model*> models;
@@ -859,6 +1228,54 @@ namespace Stg
 
     /** pointers to the models that make up the world, indexed by worldfile entry index */
     std::map<int,Model*> models_by_wfentity;
+
+    /** The position models and rangers in the order used by the bulk
+	state methods, sorted by id, and the index of each ranger's first
+	sample, plus the total. Rebuilt when models are added or
+	removed. */
+    std::vector<ModelPosition*> bulk_positions;
+    std::vector<ModelRanger*> bulk_rangers;
+    std::vector<size_t> bulk_range_offsets;
+    bool bulk_stale;
+
+    void BuildBulkIndex();
+
+    /** Collision testing in this update so far, and in the last */
+    CollisionStats collision_stats;
+    CollisionStats last_collision_stats;
+
+    /** Real time pacing of headless updates: the multiple of real
+	time to run at, or 0 to run as fast as possible, the time to
+	spin rather than sleep before each deadline, the next deadline
+	on the monotonic clock, in nanoseconds, and the timing so far */
+    double pace;
+    usec_t pace_spin;
+    uint64_t pace_deadline;
+    PaceStats pace_stats;
+
+    /** Wait until the deadline of the update just done */
+    void Pace();
+
+    /** The broad phase's output for the model being tested, reused to
+	save allocating it for every test */
+    std::vector<Model*> collision_candidates;
+
+    /** Block geometry in use by any block in this world, interned by
+	value so that identical blocks share one copy. Indexed by
+	BlockGeom::Hash(), so looking one up allocates nothing. */
+    std::multimap<uint64_t,BlockGeom*> block_geoms;
+
+    /** Return the shared geometry for polygon [pts] with z extent [z],
+	creating it if necessary, and take a reference to it. */
+    const BlockGeom* InternBlockGeom( const std::vector<point_t>& pts, 
+				      const Bounds& z );
+
+    /** Take another reference to [geom]. */
+    void RetainBlockGeom( const BlockGeom* geom );
+
+    /** Drop a reference to [geom], destroying it if it is no longer
+	used by any block. */
+    void ReleaseBlockGeom( const BlockGeom* geom );
 		
     /** Keep a list of all models with detectable fiducials. This
 	avoids searching the whole world for fiducials. */
@@ -873,6 +1290,13 @@ namespace Stg
     {
       bool operator()(const Model* a, const Model* b) const;
     };
+
+    /** Orders models by id, which unlike their addresses is the same
+	in every run */
+    struct ltid
+    {
+      bool operator()(const Model* a, const Model* b) const;
+    };
 		
     /** maintain a set of models with fiducials sorted by pose.x, for
 	quickly finding nearby fidcucials */
@@ -903,6 +1327,7 @@ namespace Stg
     //--- thread sync ----
     pthread_mutex_t sync_mutex; ///< protect the worker thread management stuff
     unsigned int threads_working; ///< the number of worker threads not yet finished
+    uint64_t threads_round; ///< incremented to start the worker threads on each update
     pthread_cond_t threads_start_cond; ///< signalled to unblock worker threads
     pthread_cond_t threads_done_cond; ///< signalled by last worker thread to unblock main thread
     int total_subs; ///< the total number of subscriptions to all models
@@ -923,8 +1348,71 @@ namespace Stg
     std::map<point_int_t,SuperRegion*> superregions;
 	 
     uint64_t updates; ///< the number of simulated time steps executed so far
+    uint64_t seed; ///< keys the random number streams of the models
+    uint32_t models_created; ///< numbers the models, see Model::GetIndex()
+    bool deterministic; ///< if true, results do not depend on the number of threads
     Worldfile* wf; ///< If set, points to the worldfile used to create this world
 
+    TrajectoryLog* trajlog; ///< If set, records model state to a file
+    unsigned int log_interval; ///< the number of updates between logged updates
+    TrajectoryReplay* replay; ///< If set, model state is read from a log instead of simulated
+    ShmTransport* shm; ///< If set, serves models to other processes through shared memory
+    CheckpointWriter* checkpointer; ///< If set, writes checkpoints in the background
+    double checkpoint_interval; ///< wall-clock seconds between checkpoints
+    uint64_t checkpoint_due; ///< monotonic clock time of the next checkpoint, in nanoseconds
+    Checkpoint* restore; ///< If set, Load() restores the state in this checkpoint
+
+    unsigned int trial_count; ///< if non-zero, Load() forks this many trials
+    unsigned int trial_jobs; ///< the most trials run at once
+    std::vector<std::string> trial_args; ///< controller arguments of the trials, in turn
+    /** world properties of the trials, in turn, by name, in the
+	worldfile's units */
+    std::vector<std::map<std::string,double> > trial_props;
+    std::string trial_results; ///< trial i writes its results here, with ".i" appended
+    int trial; ///< the trial this process runs, or -1
+    unsigned int trial_failures; ///< in the parent, the number of trials that failed
+    uint64_t trial_start; ///< monotonic clock time this trial started, in nanoseconds
+    std::map<std::string,double> trial_values; ///< results reported with SetTrialResult()
+
+    Planner* planner; ///< Created by the first call of GetPlanner()
+    meters_t plan_resolution; ///< cell size of the planner's grid
+    meters_t plan_clearance; ///< distance the planner keeps from obstacles
+    unsigned int plan_cache; ///< the most fields the planner keeps
+
+    /** Advance the clock and apply the replayed state for the new
+	time. Used by Update() instead of simulating. */
+    bool UpdateReplay();
+
+    /** Copy the state of the world at the end of this update */
+    Checkpoint* TakeCheckpoint() const;
+
+    /** Give the models their parents and state from the checkpoint
+	being restored. Called by Load() before the controllers are
+	initialized. */
+    void RestoreModels();
+
+    /** Set the models' subscriptions and the event queues from the
+	checkpoint being restored, and discard it. Called by Load()
+	after the controllers are initialized. */
+    void RestoreEvents();
+
+    /** Fork the trials set by SetTrials(), running at most trial_jobs
+	at once. Returns true in each trial, set up to run it, and
+	false in the parent, once all the trials have finished. */
+    bool ForkTrials();
+
+    /** Returns the world properties trial [t] sets, or NULL */
+    const std::map<std::string,double>* TrialProperties( unsigned int t ) const;
+
+    /** Write this trial's results. Called once, when the world
+	reaches its quit_time. Exits with EXIT_FAILURE if they can't be
+	written, so the parent counts the trial as failed. */
+    void FinishTrial();
+
+    /** Returns [name], with ".i" appended in trial i, so the trials
+	don't share files */
+    std::string TrialName( const std::string& name ) const;
+
     void CallUpdateCallbacks(); ///< Call all calbacks in cb_list, removing any that return true;
 
   public:
@@ -957,9 +1445,160 @@ namespace Stg
 	AddUpdateCallback is not automatically freed. */
     int RemoveUpdateCallback( world_callback_t cb, void* user );
 
-    /** Log the state of a Model */
+    /** If the world is logging, and this update is logged, copy the
+	sensor output of the Model into the log. Called at the end of
+	Model::Update() for models with log_state set, in the thread
+	that updated the model. */
     void Log( Model* mod );
 
+    /** Start logging the poses and velocities of all models, and the
+	sensor output of models with log_state set, to [filename]
+	every log_interval updates. The file is written by a
+	background thread, compressed if [compress] is true and
+	Stage has zlib. Each thread buffers up to [buffer_bytes] of
+	data for the writer. Stops any log already running. Returns
+	false if the file could not be opened. */
+    bool StartLog( const std::string& filename, 
+		   bool compress = true,
+		   size_t buffer_bytes = 4<<20 );
+
+    /** Stop logging, waiting for the log to be written out. */
+    void StopLog();
+
+    /** Returns true if the world is logging */
+    bool IsLogging() const { return trajlog != NULL; }
+
+    /** Replay the log [filename], written by StartLog(), instead of
+	simulating. Each Update() advances the clock and sets the
+	poses, velocities and sensor data of the models from the log,
+	without updating any models or calling controllers. Call before
+	Load() to stop the controllers being initialized at all; the
+	worldfile should be the one that was logged. Stops any replay
+	already running. Returns false if the file could not be
+	read. */
+    bool StartReplay( const std::string& filename );
+
+    /** Stop replaying. The models keep their replayed state. */
+    void StopReplay();
+
+    /** Returns true if the world is replaying a log */
+    bool IsReplaying() const { return replay != NULL; }
+
+    /** Set the clock to [time] and apply the replayed state for that
+	time. Returns false if the world is not replaying, or [time] is
+	after the end of the log. */
+    bool SeekReplay( usec_t time );
+
+    /** Write a checkpoint of the state of the world to [filename]
+	now, waiting for it to be written. See Checkpoint. Returns
+	false if it could not be written. */
+    bool SaveCheckpoint( const std::string& filename );
+
+    /** Write a checkpoint to [filename] at the end of the first update
+	after each [interval] seconds of wall-clock time, replacing the
+	last one. The state is copied in the simulation thread and
+	written to disk by a background thread; if the last checkpoint
+	is still being written when the next is due, it is put off
+	until the next update. Stops any checkpoints already
+	running. */
+    void StartCheckpoints( const std::string& filename, double interval );
+
+    /** Stop writing checkpoints, waiting for the one being written */
+    void StopCheckpoints();
+
+    /** Returns true if the world writes checkpoints */
+    bool IsCheckpointing() const { return checkpointer != NULL; }
+
+    /** Restore the checkpoint [filename] when the world is loaded.
+	Call before Load(), which then loads the models and their
+	controllers from the worldfile as usual, but takes the bitmaps'
+	polygons from the checkpoint rather than reading and tracing
+	the images, and sets the clock, seed, models' state and
+	subscriptions and pending events from the checkpoint. The
+	controllers are initialized on the restored world. The
+	worldfile should be the one that was checkpointed, since
+	models are matched by name. Returns false if the file could not
+	be read. */
+    bool StartRestore( const std::string& filename );
+
+    /** Run [count] trials of the world in separate processes, at most
+	[jobs] at once, e.g. for parameter sweeps. Call before
+	Load(). Load() parses the worldfile and creates and maps the
+	models once, then forks a process for each trial, so the
+	trials share the parsed worldfile, the models and the world's
+	bitmap copy-on-write and only pay for the memory their own runs
+	change. Trial i is seeded with the worldfile's seed plus i, its
+	controllers get [args][i % args.size()] as their argument
+	string if [args] is not empty, and any log, checkpoint or
+	shared memory name gets ".i" appended. In a trial, Load()
+	carries on as usual, and when the world reaches its quit_time,
+	which must be set, the trial writes its results to [results]
+	with ".i" appended. In the parent, Load() returns once every
+	trial has finished, without initializing any controllers. The
+	trials' world properties can be varied with
+	SetTrialProperties(). */
+    void SetTrials( unsigned int count, 
+		    unsigned int jobs, 
+		    const std::vector<std::string>& args, 
+		    const std::string& results );
+
+    /** Vary world properties between the trials set by SetTrials():
+	trial i sets those in [props][i % props.size()], if [props] is
+	not empty. Each is a line of name value pairs, in the units of
+	the worldfile, e.g. "seed 7 interval_sim 50 quit_time 600". The
+	seed, interval_sim and quit_time properties can vary. A seed
+	given here replaces the worldfile's seed plus i. Returns false,
+	and sets nothing, if a line can't be parsed. */
+    bool SetTrialProperties( const std::vector<std::string>& props );
+
+    /** Returns the trial this process runs, or -1 if it isn't running
+	one of a batch of trials */
+    int GetTrial() const { return trial; }
+
+    /** In the process that ran a batch of trials, returns the number
+	that failed */
+    unsigned int GetTrialFailures() const { return trial_failures; }
+
+    /** Record [value] as the result [key] of this trial, to be written
+	with its results. Controllers use this to report what a sweep
+	measures. Does nothing outside a trial. */
+    void SetTrialResult( const std::string& key, double value );
+
+    /** Serve the world's models to controllers in other processes
+	through the shared memory segment [name], with rings of
+	[ring_bytes] for each model's data and commands. See
+	stage_shm.h. Call after Load(), since only the models that exist
+	now are served. Stops any transport already running. Returns
+	false if the segment could not be created. */
+    bool StartShm( const std::string& name, size_t ring_bytes = 64<<10 );
+
+    /** Remove the shared memory segment */
+    void StopShm();
+
+    /** Returns true if the world is served through shared memory */
+    bool IsServingShm() const { return shm != NULL; }
+
+    /** Returns the world's shared path planner, creating it on the
+	first call, which should be from the main thread, e.g. in a
+	controller's init function. */
+    Planner* GetPlanner();
+
+    /** Fill [grid], [width] by [height] cells of [resolution] meters
+	with its bottom left corner at [x],[y], row by row from the
+	bottom, with the occupancy of the world's bitmap as sensors see
+	it. Each cell gets the share of the bitmap cells within it that
+	hold a block, scaled to 255 and rounded up, so a cell is
+	non-zero if anything is there, and the values serve as a cost
+	map. Only blocks overlapping [z] in height count, and only those
+	of obstacles if [obstacles_only] is true. Empty bitmap regions
+	are skipped whole, and large grids are filled in worker
+	threads. Call between updates. */
+    void GetOccupancy( meters_t x, meters_t y, 
+		       unsigned int width, unsigned int height,
+		       meters_t resolution, uint8_t* grid,
+		       bool obstacles_only = true,
+		       const Bounds& z = Bounds( -billion, billion ));
+
     /** hint that the world needs to be redrawn if a GUI is attached */
     void NeedRedraw(){ dirty = true; };
     
@@ -977,6 +1616,15 @@ namespace Stg
     void LoadBlockGroup( Worldfile* wf, int entity );
     void LoadSensor(     Worldfile* wf, int entity );
 
+    /** Create whatever worldfile entity [entity] describes. Returns
+	the last entity consumed, which is past [entity] if its children
+	were loaded too, e.g. by a replicate entity. */
+    int LoadEntity(      Worldfile* wf, int entity );
+
+    /** Instantiate the template model of a replicate entity
+	[count] times. Returns the last entity of the template. */
+    int LoadReplicate(   Worldfile* wf, int entity );
+
     virtual Model* RecentlySelectedModel() const { return NULL; }
     
     /** Add the block to every raytrace bitmap cell that intersects
@@ -1032,6 +1680,29 @@ namespace Stg
 		
     /** Enlarge the bounding volume to include this point */
     inline void Extend( point3_t pt );
+
+    /** The parameters of a GetOccupancy() call, shared by the threads
+	filling the grid */
+    class OccupancyQuery
+    {
+    public:
+      World* world;
+      uint8_t* grid;
+      unsigned int width, height;
+      bool obstacles_only;
+      Bounds z;
+      unsigned int layer;
+      /** the bitmap cells covered by each column and row of the grid,
+	  from [0] up to but not including [1] */
+      std::vector<int32_t> cols[2], rows[2];
+      /** the next band of rows for a thread to take */
+      unsigned int next_band;
+      unsigned int band_rows;
+    };
+
+    /** Fill the rows of bands of [q] until there are none left */
+    void OccupancyBands( OccupancyQuery* q );
+    static void* OccupancyThread( void* q );
   
     virtual void AddModel( Model* mod );
     virtual void RemoveModel( Model* mod );
@@ -1064,7 +1735,7 @@ namespace Stg
       model_callback_t cb;
       void* arg;
 			
-      /** order by time. Break ties by value of Model*, then cb*. 
+      /** order by time. Break ties by model id, then cb*. 
 	  @param event to compare with this one. */
       bool operator<( const Event& other ) const;
     };
@@ -1090,12 +1761,15 @@ namespace Stg
     {  event_queues[queue_num].push( Event( sim_time + delay, mod, cb, arg ) ); }
 		
     /** Set of models that require energy calculations at each World::Update(). */
-    std::set<Model*> active_energy;
+    std::set<Model*,ltid> active_energy;
     void EnableEnergy( Model* m ) { active_energy.insert( m ); };
     void DisableEnergy( Model* m ) { active_energy.erase( m ); };
     
     /** Set of models that require their positions to be recalculated at each World::Update(). */
-    std::set<ModelPosition*> active_velocity;
+    std::set<ModelPosition*,ltid> active_velocity;
+
+    /** Set of radios that exchange messages at each World::Update(). */
+    std::set<ModelWifi*> active_wifi;
     
     /** The amount of simulated time to run for each call to Update() */
     usec_t sim_interval;
@@ -1190,6 +1864,56 @@ namespace Stg
 
     /** Returns a const reference to the set of models in the world. */
     const std::set<Model*> GetAllModels() const { return models; };
+
+    /** @name Bulk state
+
+	For learning and other workloads that read and drive thousands
+	of robots every step. Each call copies one quantity for every
+	position model, or every ranger, to or from a contiguous array
+	supplied by the caller, in one loop with no per-model virtual
+	calls or containers. Models are ordered by id, which is their
+	order of creation, so the order only changes when models are
+	added or removed. Arrays are indexed by that order; any array
+	pointer may be NULL to skip it. Call between updates. */
+    //@{
+
+    /** Returns the number of position models */
+    size_t BulkPositionCount(){ BuildBulkIndex(); return bulk_positions.size(); }
+
+    /** Returns the position model at [index] in the bulk order */
+    ModelPosition* BulkPosition( size_t index ){ BuildBulkIndex(); return bulk_positions[index]; }
+
+    /** Returns the number of rangers */
+    size_t BulkRangerCount(){ BuildBulkIndex(); return bulk_rangers.size(); }
+
+    /** Returns the ranger at [index] in the bulk order */
+    ModelRanger* BulkRanger( size_t index ){ BuildBulkIndex(); return bulk_rangers[index]; }
+
+    /** Returns the offsets of each ranger's samples in the array
+	filled by GetBulkRanges(): ranger i's samples, all its sensors
+	in order, are from offsets[i] up to offsets[i+1]. The last
+	entry is the total number of samples. */
+    const std::vector<size_t>& BulkRangeOffsets(){ BuildBulkIndex(); return bulk_range_offsets; }
+
+    /** Copy the global pose of every position model into [x], [y]
+	and [a] */
+    void GetBulkPoses( double* x, double* y, double* a );
+
+    /** Copy the velocity of every position model, in its own frame,
+	into [x], [y] and [a] */
+    void GetBulkVelocities( double* x, double* y, double* a );
+
+    /** Copy the latest ranges of every ranger into [ranges], laid out
+	as described by BulkRangeOffsets(). Samples a ranger has not
+	produced yet are zero. */
+    void GetBulkRanges( float* ranges );
+
+    /** Set the speed of every position model, as with
+	ModelPosition::SetSpeed(), from [x], [y] and [a]. A NULL array
+	sets that component to zero. */
+    void SetBulkSpeeds( const double* x, const double* y, const double* a );
+
+    //@}
   
     /** Return the 3D bounding box of the world, in meters */
     const bounds3d_t& GetExtent() const { return extent; };
@@ -1197,6 +1921,50 @@ namespace Stg
     /** Return the number of times the world has been updated. */
     uint64_t GetUpdateCount() const { return updates; }
 
+    /** Return the seed of the models' random number streams */
+    uint64_t GetSeed() const { return seed; }
+
+    /** Return true iff the world runs in deterministic mode, where
+	every run with the same seed gives the same results with any
+	number of threads */
+    bool IsDeterministic() const { return deterministic; }
+
+    /** Return a hash of the state of the world: the simulation time,
+	the pose of every model, the velocity of every position model
+	and the ranges of every ranger. Runs that give the same digest
+	at every update almost certainly gave the same results. Takes
+	time linear in the number of models and samples, so it is cheap
+	enough to check at every update. */
+    uint64_t Digest();
+
+    /** Set the seed of the models' random number streams. Models
+	that drew noise when they were created, such as the odometry
+	error of position models, draw it again with the new seed. */
+    void SetSeed( uint64_t s );
+
+    /** Keep headless updates to [factor] times real time, or run as
+	fast as possible if [factor] is 0. Each World::Update() waits
+	until its absolute deadline, sleeping until shortly before it
+	and spinning the rest of the way, so updates start with
+	microseconds of jitter rather than milliseconds. An update that
+	ends past its deadline doesn't wait, and pacing starts afresh
+	after falling ten updates behind. WorldGui keeps to its own
+	speedup instead. */
+    void SetPace( double factor );
+
+    /** Spin for the last [spin] usec before each paced deadline,
+	rather than sleeping. Defaults to 100. */
+    void SetPaceSpin( usec_t spin ) { pace_spin = spin; }
+
+    /** Return the multiple of real time headless updates keep to, or 0 */
+    double GetPace() const { return pace; }
+
+    /** Return the timing of the paced updates so far */
+    const PaceStats& GetPaceStats() const { return pace_stats; }
+
+    /** Return the collision testing done in the last update */
+    const CollisionStats& GetCollisionStats() const { return last_collision_stats; }
+
     /// Register an Option for pickup by the GUI
     void RegisterOption( Option* opt );	
 	 
@@ -1209,6 +1977,33 @@ namespace Stg
   };
   
 
+  /** The polygon and local z extent of a block, in model
+      coordinates. This never changes once created, so blocks with
+      identical geometry, e.g. the bodies of many robots of the same
+      type, share one instance owned by their World. */
+  class BlockGeom
+  {
+    friend class World;
+  public:
+    const std::vector<point_t> pts; ///< points defining a polygon.
+    const Bounds z; ///< z extent in local coords.
+
+    BlockGeom( const std::vector<point_t>& pts, const Bounds& z ) :
+      pts(pts), z(z), refs(0) {}
+
+    /** Returns a hash of polygon [pts] with z extent [z], the same
+	for any geometry Same() would match, to intern these by */
+    static uint64_t Hash( const std::vector<point_t>& pts, const Bounds& z );
+
+    /** Returns true if this is polygon [pts] with z extent [z]. NaN
+	coordinates, e.g. from scaling a block of zero height, match
+	each other, so such a geometry can still be found. */
+    bool Same( const std::vector<point_t>& pts, const Bounds& z ) const;
+
+  private:
+    mutable unsigned int refs; ///< number of blocks using this geometry
+  };
+
   class Block
   {
     friend class BlockGroup;
@@ -1228,6 +2023,10 @@ namespace Stg
     
     /** A from-file  constructor */
     Block( BlockGroup* group, Worldfile* wf, int entity);
+
+    /** Copies share the original's geometry */
+    Block( const Block& other );
+    Block& operator=( const Block& other );
     
     ~Block();
     
@@ -1263,11 +2062,11 @@ namespace Stg
 
     /** Set the extent in Z of the block */
     void SetZ( double min, double max );
-		
-    void AppendTouchingModels( std::set<Model*>& touchers );
 	 
-    /** Returns the first model that shares a bitmap cell with this model */
-    Model* TestCollision(); 
+    /** Returns the ground if the block is below it, or else the first
+	of [candidates] with a block that shares a bitmap cell and
+	overlaps in z with this one. */
+    Model* TestCollision( const std::vector<Model*>& candidates ); 
 
     void Load( Worldfile* wf, int entity );  
     
@@ -1275,11 +2074,17 @@ namespace Stg
 		    unsigned int width, unsigned int height,		
 		    meters_t cellwidth, meters_t cellheight );
     
+    /** Return the polygon and local z extent of the block. */
+    const BlockGeom& GetGeom() const { return *geom; }
+    
   private:
     BlockGroup* group; ///< The BlockGroup to which this Block belongs.
-    std::vector<point_t> pts; ///< points defining a polygon.
-    Bounds local_z; ///<  z extent in local coords.
+    const BlockGeom* geom; ///< polygon and local z extent, shared.
     Bounds global_z; ///< z extent in global coordinates.
+
+    /** Replace the block's geometry. Other blocks that shared the old
+	geometry keep it. */
+    void SetGeom( const std::vector<point_t>& pts, const Bounds& z );
 		
     /** record the cells into which this block has been rendered so we
 	can remove them very quickly. One vector for each of the two
@@ -1297,22 +2102,39 @@ namespace Stg
     friend class Block;
     friend class World;
     friend class SuperRegion;
+    friend class Cell;
+    friend class Planner;
 
   private:
     std::vector<Block> blocks; ///< Contains the blocks in this group.
     int displaylist; ///< OpenGL displaylist that renders this blockgroup.
     Model& mod;
 
+    /** True if the display list must be rebuilt before use */
+    bool displaylist_stale;
+
+    /** The blocks as x,y,z vertices in the model's frame, for batched
+	rendering: tesselated tops and sides as triangles, outlines as
+	lines, and the footprint at z=0 as triangles. */
+    std::vector<GLfloat> mesh_fill, mesh_lines, mesh_foot;
+    bool mesh_valid;
+
+    /** Mark the display list and mesh stale if the model asked for a
+	rebuild */
+    void CheckRebuild();
+
+    /** Re-create the meshes used for batched rendering */
+    void BuildMesh();
+
     void AppendBlock( const Block& block );
 
     void CalcSize();	 
     void Clear() ; /** deletes all blocks from the group */
 	 
-    void AppendTouchingModels( std::set<Model*>& touchers );
-	 
-    /** Returns a pointer to the first model detected to be colliding
-	with a block in this group, or NULL, if none are detected. */
-    Model* TestCollision();
+    /** Returns a pointer to the first of [candidates] detected to be
+	colliding with a block in this group, or NULL, if none are
+	detected. */
+    Model* TestCollision( const std::vector<Model*>& candidates );
  
     /** Renders all blocks into the bitmap at the indicated layer.*/
     void Map( unsigned int layer );
@@ -1323,6 +2145,12 @@ namespace Stg
 	as blocks to this group.*/
     void LoadBitmap( const std::string& bitmapfile, Worldfile *wf );
 
+    /** The polygons traced from each bitmap loaded so far, by full
+	path. LoadBitmap() uses these instead of reading and tracing a
+	bitmap again, so a bitmap used by several models, or restored
+	from a checkpoint, is only traced once. */
+    static std::map<std::string,std::vector<std::vector<point_t> > > bitmap_polys;
+
     /** Add a new block decribed by a worldfile entry. */
     void LoadBlock( Worldfile* wf, int entity );
     
@@ -1355,6 +2183,16 @@ namespace Stg
 
     /** Draw the projection of the block group onto the z=0 plane. */
     void DrawFootPrint( const Geom &geom);
+
+    /** Add the blocks, as seen from [pose] in world coordinates, to
+	the batches: filled triangles colored [color] to [fill], and
+	their outlines in a darker shade to [lines]. */
+    void AppendBlocks( const Pose& pose, const Color& color,
+		       VertexBatch& fill, VertexBatch& lines );
+
+    /** Add the footprint of the blocks at [pose], as triangles colored
+	[rgba], to [batch]. */
+    void AppendFootPrint( const Pose& pose, const GLubyte rgba[4], VertexBatch& batch );
   };
 
   class Camera 
@@ -1527,6 +2365,86 @@ namespace Stg
     /** Number of updates between measuring elapsed real time. */
     uint64_t timing_interval;
 
+    /** What the canvas needs to draw one frame without touching the
+	models, built by the simulation thread. */
+    class RenderSnapshot
+    {
+    public:
+      usec_t sim_time;
+      std::string clock; ///< ClockString() when the snapshot was built
+      VertexBatch block_fill, block_lines, trail_fill;
+
+      /** The sensor data of the subscribed models that can copy it,
+	  drawn in place of their visualizations */
+      std::vector<DataSnapshot*> data;
+      std::set<const Model*> data_models; ///< the models in data
+
+      RenderSnapshot() : sim_time(0), clock(), block_fill(), block_lines(), trail_fill(),
+			 data(), data_models() {}
+      ~RenderSnapshot(){ ClearData(); }
+
+      void ClearData()
+      {
+	FOR_EACH( it, data )
+	  delete *it;
+	data.clear();
+	data_models.clear();
+      }
+
+    private:
+      // owns the data, so not copied
+      RenderSnapshot( const RenderSnapshot& );
+      RenderSnapshot& operator=( const RenderSnapshot& );
+    };
+
+    /** A change to a model's pose requested by the GUI, applied by
+	the simulation thread between updates */
+    class PoseEdit
+    {
+    public:
+      Model* mod;
+      Pose delta;
+      PoseEdit( Model* mod, const Pose& delta ) : mod(mod), delta(delta) {}
+    };
+
+    /** If true, the world is updated by its own thread instead of
+	FLTK timeouts, and the canvas draws from RenderSnapshots. */
+    bool sim_threaded;
+    bool sim_running; ///< true while the simulation thread exists
+    pthread_t sim_thread;
+
+    /** Held by the simulation thread while it updates the world, and
+	by the GUI thread while it reads or changes models. */
+    pthread_mutex_t sim_mutex;
+
+    /** Protects the fields below, and paused, for sim_cond */
+    pthread_mutex_t sim_control_mutex;
+    pthread_cond_t sim_cond; ///< wakes the simulation thread
+    bool sim_quit; ///< stop the simulation thread
+    bool sim_step; ///< do a single update, even if paused
+    std::vector<PoseEdit> pose_edits;
+
+    /** snapshots[snapshot_front] is being drawn; the other is built
+	by the simulation thread and swapped in when complete */
+    RenderSnapshot snapshots[2];
+    int snapshot_front;
+    pthread_mutex_t snapshot_mutex; ///< held by the canvas while it draws the front snapshot
+    unsigned int snapshot_misses; ///< consecutive swaps skipped while the canvas was drawing
+
+    static void* SimThreadEntry( void* arg );
+    void SimThread();
+
+    /** Fill in [snap] from the current state of the world. Called
+	with sim_mutex held. */
+    void BuildSnapshot( RenderSnapshot& snap );
+
+    /** Make the back snapshot the front one. If [wait] is false and
+	the canvas is drawing, give up and return false. */
+    bool PublishSnapshot( bool wait );
+
+    void StartSimThread();
+    void StopSimThread();
+
     // static callback functions
     static void windowCb( Fl_Widget* w, WorldGui* wg );	
     static void fileLoadCb( Fl_Widget* w, WorldGui* wg );
@@ -1538,6 +2456,8 @@ namespace Stg
     static void helpAboutCb( Fl_Widget* w, WorldGui* wg );
     static void pauseCb( Fl_Widget* w, WorldGui* wg );
     static void onceCb( Fl_Widget* w, WorldGui* wg );
+    static void skipBackCb( Fl_Widget* w, WorldGui* wg );
+    static void skipForwardCb( Fl_Widget* w, WorldGui* wg );
     static void fasterCb( Fl_Widget* w, WorldGui* wg );
     static void slowerCb( Fl_Widget* w, WorldGui* wg );
     static void realtimeCb( Fl_Widget* w, WorldGui* wg );
@@ -1590,6 +2510,24 @@ namespace Stg
     /** show the window - need to call this if you don't Load(). */
     void Show(); 
 
+    /** Returns true if the world is updated by its own thread */
+    bool SimThreaded() const { return sim_threaded; }
+
+    /** Lock the models against the simulation thread, before reading
+	or changing them from the GUI thread. Does nothing if the world
+	is not threaded. */
+    void LockSim(){ if( sim_running ) pthread_mutex_lock( &sim_mutex ); }
+    void UnlockSim(){ if( sim_running ) pthread_mutex_unlock( &sim_mutex ); }
+
+    /** Returns the latest snapshot and keeps it from being replaced
+	until ReleaseSnapshot(), or NULL if the world is not threaded. */
+    const RenderSnapshot* AcquireSnapshot();
+    void ReleaseSnapshot();
+
+    /** Add [delta] to the pose of [mod], as if by Model::AddToPose(),
+	between updates. Used for changes made with the mouse. */
+    void EditPose( Model* mod, const Pose& delta );
+
     /** Get human readable string that describes the current global energy state. */
     std::string EnergyString( void ) const;	
     virtual void RemoveChild( Model* mod );	 
@@ -1719,6 +2657,7 @@ namespace Stg
     joules_t GetDissipated() const;
     void SetCapacity( joules_t j );
     void SetStored( joules_t j );	
+    void SetDissipated( joules_t j );
 
     /** Returns true iff the device received energy at the last timestep */
     bool GetCharging() const { return charging; }
@@ -1748,6 +2687,8 @@ namespace Stg
     friend class PowerPack;
     friend class Ray;
     friend class ModelFiducial;
+    friend class Cell;
+    friend class Planner;
 		
   private:
     /** the number of models instatiated - used to assign unique sequential IDs */
@@ -1757,8 +2698,8 @@ namespace Stg
     /** records if this model has been mapped into the world bitmap*/
     bool mapped;
 
-    std::vector<Option*> drawOptions;
-    const std::vector<Option*>& getOptions() const { return drawOptions; }
+    /** the global z extent of our blocks as last mapped in each layer */
+    Bounds mapped_z[2];
 	 
   protected:
 
@@ -1781,14 +2722,15 @@ namespace Stg
     public:
       model_callback_t callback;
       void* arg;
+      bool thread_safe; ///< may be called in a worker thread
 			
-      cb_t( model_callback_t cb, void* arg ) 
-	: callback(cb), arg(arg) {}
+      cb_t( model_callback_t cb, void* arg, bool thread_safe=false ) 
+	: callback(cb), arg(arg), thread_safe(thread_safe) {}
 			
       cb_t( world_callback_t cb, void* arg ) 
-	: callback(NULL), arg(arg) { (void)cb; }
+	: callback(NULL), arg(arg), thread_safe(false) { (void)cb; }
 			
-      cb_t() : callback(NULL), arg(NULL) {}
+      cb_t() : callback(NULL), arg(NULL), thread_safe(false) {}
 			
       /** for placing in a sorted container */
       bool operator<( const cb_t& other ) const
@@ -1844,10 +2786,35 @@ namespace Stg
     } callback_type_t;
 		
   protected:
-    /** A list of callback functions can be attached to any
-	address. When Model::CallCallbacks( void*) is called, the
-	callbacks are called.*/
-    std::vector<std::set<cb_t> > callbacks;
+    /** The callbacks of one type, in the order they were added. A
+	callback being removed is only marked dead (its callback is
+	set to NULL), and dead entries are compacted away when no call
+	of this type is in progress, so calling the callbacks never
+	allocates and callbacks may add or remove callbacks. */
+    class CallbackList
+    {
+    public:
+      std::vector<cb_t> cbs;
+      unsigned int dead; ///< number of entries marked dead
+      unsigned int calling; ///< nesting depth of calls in progress
+
+      CallbackList() : cbs(), dead(0), calling(0) {}
+
+      /** number of callbacks not marked dead */
+      size_t Live() const { return cbs.size() - dead; }
+			
+      /** Remove the dead entries, if no call is in progress. */
+      void Compact();
+    };
+
+    /** A list of callback functions for each callback_type_t. When
+	Model::CallCallbacks( type ) is called, the callbacks are
+	called. Most models have no callbacks, so this stays empty
+	until the first one is added.*/
+    std::vector<CallbackList> callbacks;
+
+    /** The arguments of each controller loaded, passed to its Init() */
+    std::vector<CtrlArgs*> ctrl_args;
 		
     /** Default color of the model's blocks.*/
     Color color;
@@ -1893,6 +2860,8 @@ namespace Stg
 				  
     /** unique process-wide identifier for this model */
     uint32_t id;	
+    /** this model's number in its world, counting in order of creation */
+    uint32_t index;
     usec_t interval; ///< time between updates in usec	 
     usec_t interval_energy; ///< time between updates of powerpack in usec
     usec_t last_update; ///< time of last update in us  
@@ -1913,6 +2882,17 @@ namespace Stg
     /** list of powerpacks that this model is currently charging,
 	initially NULL. */
     std::list<PowerPack*> pps_charging;
+
+    /** For each layer, the other models with a block in a cell that
+	also holds one of our blocks, with the number of such block
+	pairs. Kept up to date by Cell as blocks are mapped and unmapped,
+	so contacts are found without walking any cells. */
+    std::map<Model*,unsigned int> contacts[2];
+
+    /** Record [count] more, or fewer, block pairs shared with [other]
+	in [layer] */
+    void AddContact( Model* other, unsigned int layer, unsigned int count );
+    void RemoveContact( Model* other, unsigned int layer, unsigned int count );
 		
     /** Visualize the most recent rasterization operation performed by this model */
     class RasterVis : public Visualizer
@@ -1940,9 +2920,16 @@ namespace Stg
       void AddPoint( meters_t x, meters_t y );
       void ClearPts();
 	  
-    } rastervis;
+    };
+
+    /** Created by the first Rasterize() in a GUI world, otherwise NULL. */
+    RasterVis* rastervis;
 	 
     bool rebuild_displaylist; ///< iff true, regenerate block display list before redraw
+    /** Iff true, this model is a copy made by a replicate entity, or
+	a child of one, and its worldfile entity is shared by all the
+	copies. Its name and pose are not reloaded or saved. */
+    bool replica;
     std::string say_string;   ///< if non-empty, this string is displayed in the GUI 
 		
     bool stack_children; ///< whether child models should be stacked on top of this model or not
@@ -1970,7 +2957,8 @@ namespace Stg
       //: time(time), pose(pose), color(color){}
     };
 	
-    /** a ring buffer for storing recent poses */
+    /** a ring buffer for storing recent poses. Empty until the GUI
+	records the first one. */
     std::vector<TrailItem> trail;
 
     /** current position in the ring buffer */
@@ -2053,6 +3041,35 @@ namespace Stg
 	 
     usec_t GetUpdateInterval() const { return interval; }
     usec_t GetEnergyInterval() const { return interval_energy; }
+
+    /** Approximate memory used by a model, in bytes. Block geometry
+	shared with other models is not counted. */
+    class MemoryReport
+    {
+    public:
+      size_t object; ///< the model object itself
+      size_t blocks; ///< the model's blocks and their mapping state
+      size_t callbacks; ///< registered callbacks
+      size_t gui; ///< trail, visualizers and flags
+      size_t other; ///< names, children and type-specific data, e.g. sensor samples
+
+      MemoryReport() : object(0), blocks(0), callbacks(0), gui(0), other(0) {}
+
+      size_t Total() const
+      { return object + blocks + callbacks + gui + other; }
+
+      MemoryReport& operator+=( const MemoryReport& r )
+      { 
+	object += r.object; blocks += r.blocks; callbacks += r.callbacks; 
+	gui += r.gui; other += r.other; 
+	return *this; 
+      }
+    };
+
+    /** Report approximately how much memory this model uses, not
+	including its children. Models with large buffers of their own
+	extend this. */
+    virtual MemoryReport GetMemoryReport() const;
     //    usec_t GetPoseInterval() const { return interval_pose; }
 	 
     /** Render the model's blocks as an occupancy grid into the
@@ -2075,6 +3092,9 @@ namespace Stg
     /** Register an Option for pickup by the GUI. */
     void RegisterOption( Option* opt );
 
+    /** Add the models whose blocks share a cell with ours in the
+	current layer, excluding our ancestors and descendents, to
+	[touchers]. Reads the contacts recorded during mapping. */
     void AppendTouchingModels( std::set<Model*>& touchers );
 		
     /** Check to see if the current pose will yield a collision with
@@ -2140,13 +3160,36 @@ namespace Stg
 		
     static int UpdateWrapper( Model* mod, void* arg ){ mod->Update(); return 0; }
 
-    /** Calls CallCallback( CB_UPDATE ) */
+    /** Calls the CB_UPDATE callbacks that are not thread-safe. The
+	thread-safe ones were already called by Update(). */
     void CallUpdateCallbacks( void );
 
+    /** Call the callbacks of [type] registered with the indicated
+	thread safety, and return the number of callbacks of [type]
+	with the other thread safety, i.e. those not called. */
+    int CallCallbacks( callback_type_t type, bool thread_safe );
+
+    /** Does the work of CallCallbacks(). If [thread_safe] is 0 or
+	1, only callbacks with that thread safety are called, and the
+	number skipped is returned. Otherwise all are called and the
+	number remaining is returned. */
+    int DispatchCallbacks( callback_type_t type, int thread_safe );
+
+    /** Calls a thread-safe controller's Init() with
+	World::thread_safe_init set. */
+    static int ThreadSafeInit( Model* mod, void* arg );
+
     meters_t ModelHeight() const;
 
     void DrawBlocksTree();
     virtual void DrawBlocks();
+
+    /** Add the blocks of this model and its descendants, in world
+	coordinates, to the batches drawn by the Canvas. */
+    void AppendBlocksTree( VertexBatch& fill, VertexBatch& lines );
+
+    /** The color the blocks are drawn in when batched */
+    virtual Color BlockColor() const { return color; }
     void DrawBoundingBox();
     void DrawBoundingBoxTree();
     virtual void DrawStatus( Camera* cam );
@@ -2166,11 +3209,21 @@ namespace Stg
     virtual void DrawSelected(void);
 	
     void DrawTrailFootprint();
+    void AppendTrailFootprint( VertexBatch& batch );
     void DrawTrailBlocks();
     void DrawTrailArrows();
     void DrawGrid();
     //	void DrawBlinkenlights();
     void DataVisualizeTree( Camera* cam );
+
+    /** Returns a copy of what DataVisualize() and the model's
+	visualizers draw, or NULL if they must read the model itself,
+	which is the default */
+    virtual DataSnapshot* SnapshotData() const { return NULL; }
+
+    /** Add SnapshotData() of this model and its descendants that are
+	subscribed to [data] */
+    void SnapshotDataTree( std::vector<DataSnapshot*>& data ) const;
     void DrawFlagList();
     void DrawPose( Pose pose );
 	
@@ -2207,7 +3260,7 @@ namespace Stg
     /** Alternate constructor that creates dummy models with only a pose */
 	 Model() 
 	   : mapped(false), alwayson(false), blockgroup(*this),
-		  boundary(false), data_fresh(false), disabled(true), friction(0), has_default_block(false), log_state(false), map_resolution(0), mass(0), parent(NULL), rebuild_displaylist(false), stack_children(true), stall(false), subs(0), thread_safe(false),trail_index(0), event_queue_num(0), used(false), watts(0), watts_give(0),watts_take(0),wf(NULL), wf_entity(0), world(NULL)
+		  boundary(false), data_fresh(false), disabled(true), friction(0), has_default_block(false), log_state(false), map_resolution(0), mass(0), parent(NULL), rastervis(NULL), rebuild_displaylist(false), replica(false), stack_children(true), stall(false), subs(0), thread_safe(false),trail_index(0), event_queue_num(0), used(false), watts(0), watts_give(0),watts_take(0),wf(NULL), wf_entity(0), world(NULL)
 	 {}
 		
     void Say( const std::string& str );
@@ -2237,10 +3290,24 @@ namespace Stg
 	
     /** save the state of the model to the current world file */
     virtual void Save();
-	
+
+    /** Append the state the model builds up as it runs, which is not
+	in the worldfile, to [out], for World::SaveCheckpoint(). Models
+	with more state override this, calling their parent class's
+	version first. */
+    virtual void SaveState( StateWriter& out ) const;
+
+    /** Restore the state written by SaveState(), in the same order */
+    virtual void LoadState( StateReader& in );
+
     /** Call Init() for all attached controllers. */
     void InitControllers();
 
+    /** Replace the argument string passed to the Init() of each of
+	our controllers, which is World::ctrlargs when they are
+	loaded. Call before InitControllers(). */
+    void SetControllerArgs( const std::string& cmdline );
+
     void AddFlag(  Flag* flag );
     void RemoveFlag( Flag* flag );
 	
@@ -2346,6 +3413,21 @@ namespace Stg
 	 
     /** return a model's unique process-wide identifier */
     uint32_t GetId()  const { return id; }
+
+    /** Return the model's number in its world, counting from 0 in the
+	order models were created. Unlike the id, it doesn't depend on
+	how many other worlds the process has made. */
+    uint32_t GetIndex() const { return index; }
+
+    /** Return random number stream [stream] of this model in the
+	current update. The numbers depend only on the world seed, this
+	model's index, the update count and [stream], so they are the
+	same in every run, with any number of threads, and in every
+	world loaded from the same file. Asking again in the same update
+	gives the same numbers, so keep the Rng for all the numbers
+	wanted. */
+    Rng GetRng( uint32_t stream = 0 ) const
+    { return Rng( world->GetSeed(), index, world->GetUpdateCount(), stream ); }
 	 
     /** Get the total mass of a model and it's children recursively */
     kg_t GetTotalMass() const;
@@ -2394,16 +3476,52 @@ namespace Stg
 	indicated model method is called, and passed the user
 	data.  @param cb Pointer the function to be called.  @param
 	user Pointer to arbitrary user data, passed to the callback
-	when called.
+	when called. 
+
+	@param thread_safe If true, a CB_UPDATE callback is called
+	straight after the model updates, in the same thread, instead
+	of later in the main thread. Models with thread_safe set (e.g.
+	rangers) update in worker threads when the world has threads >
+	1, so expensive controllers run in parallel too. A thread-safe
+	callback may:
+	- read the model it is attached to, e.g. ranger samples;
+	- read and write the controller's own data;
+	- command a position model with SetSpeed() and friends. The
+	  new goal is read in the position model's next update, which
+	  runs in the main thread.
+	.
+	It must not:
+	- read the pose or data of other models, including its own
+	  pose, which may be changing in other threads;
+	- move models with SetPose(), add or remove models or
+	  callbacks, Subscribe() or Unsubscribe(), or otherwise change
+	  the world;
+	- make OpenGL or GUI calls, or call World::AddUpdateCallback();
+	- share unlocked state with callbacks on other models.
+	.
+	Callbacks of other types are always called in the thread that
+	triggers them, and thread_safe is ignored.
     */
     void AddCallback( callback_type_t type, 
 		      model_callback_t cb, 
-		      void* user );
+		      void* user,
+		      bool thread_safe = false );
 		
+    /** Remove every callback of [type] that calls [callback],
+	whatever its user data. Returns the number of callbacks of
+	[type] remaining. */
     int RemoveCallback( callback_type_t type,
 			model_callback_t callback );
 		
-    int CallCallbacks(  callback_type_t type );
+    /** Call the callbacks of [type], removing any that return
+	true. Returns the number of callbacks remaining. Cheap when
+	there are none, as is usually the case. */
+    int CallCallbacks( callback_type_t type )
+    {
+      if( callbacks.empty() || callbacks[type].cbs.empty() )
+	return 0;
+      return DispatchCallbacks( type, -1 );
+    }
 		
 		
     virtual void Print( char* prefix ) const;
@@ -2459,6 +3577,11 @@ namespace Stg
     virtual void Startup();
     virtual void Shutdown();
     virtual void Update();	 						
+
+    /** Draw again any noise drawn from our random number streams
+	when we were created, because the world's seed has changed.
+	Called by World::SetSeed(). Does nothing by default. */
+    virtual void Reseed() {}
   };
 
 
@@ -2500,6 +3623,9 @@ namespace Stg
     // predicate for ray tracing
     static bool BlockMatcher( Block* testblock, Model* finder );
 
+    class Snapshot;
+    virtual DataSnapshot* SnapshotData() const;
+
   public:
     radians_t fov; ///< Horizontal field of view in radians, in the range 0 to pi.
     radians_t pan; ///< Horizontal pan angle in radians, in the range -pi to +pi.
@@ -2557,6 +3683,7 @@ namespace Stg
 
   protected:
     virtual void DrawBlocks();
+    virtual Color BlockColor() const;
 
   private:
     bool m_IsOn;
@@ -2640,6 +3767,9 @@ namespace Stg
     virtual void Load();
     virtual void Save();
 
+    virtual void SaveState( StateWriter& out ) const;
+    virtual void LoadState( StateReader& in );
+
     /** Configure the gripper */
     void SetConfig( config_t & newcfg ){ this->cfg = newcfg; FixBlocks(); }
 	 
@@ -2699,11 +3829,19 @@ namespace Stg
 
     virtual void Update();
     virtual void DataVisualize( Camera* cam );
+    virtual DataSnapshot* SnapshotData() const;
+
+    /** Draw [fiducials] found within [range] and [fov], in the
+	finder's coordinates */
+    static void DrawData( World* world, meters_t range, radians_t fov,
+			  const std::vector<Fiducial>& fiducials );
 
     static Option showData;
     static Option showFov;
 	 
     std::vector<Fiducial> fiducials;
+
+    class Snapshot;
 		
   public:		
     ModelFiducial( World* world, 
@@ -2734,6 +3872,90 @@ namespace Stg
   };
 	
 	
+  // WIFI MODEL --------------------------------------------------------
+
+  /// %ModelWifi class
+  class ModelWifi : public Model
+  {
+  public:
+    /** A message between radios */
+    class Message
+    {
+    public:
+      ModelWifi* from; ///< the sender
+      ModelWifi* to; ///< the recipient, or NULL if broadcast
+      usec_t time; ///< the simulation time it was sent
+      std::string data; ///< the payload
+
+      Message( ModelWifi* from, ModelWifi* to, usec_t time, const std::string& data ) :
+	from(from), to(to), time(time), data(data) {}
+    };
+
+  private:
+    virtual void DataVisualize( Camera* cam );
+
+    static Option showData;
+
+    /** Messages sent since the last delivery */
+    std::vector<Message> outbox;
+
+    /** Messages delivered at the last update */
+    std::vector<Message> inbox;
+
+    /** Radios we could reach at the last update */
+    std::vector<ModelWifi*> neighbours;
+
+    /** Our global pose at the last update, for drawing the links */
+    Pose delivered_pose;
+
+    uint64_t sent, received, dropped;
+
+    /** True iff we can talk to [him], [distance] away. */
+    bool Linked( ModelWifi* him, meters_t distance );
+
+  public:
+    ModelWifi( World* world,
+	       Model* parent,
+	       const std::string& type );
+    virtual ~ModelWifi();
+
+    virtual void Load();
+    virtual void Startup();
+    virtual void Shutdown();
+
+    meters_t range; ///< maximum range in free space
+    double obstruction; ///< fraction of the range that survives each wall
+
+    /** Queue [data] for [to], delivered at the end of this update if
+	[to] is in reach, and dropped otherwise. Call this only from
+	this radio's own controllers. */
+    void Send( ModelWifi* to, const std::string& data );
+
+    /** Queue [data] for every radio in reach at the end of this
+	update. */
+    void Broadcast( const std::string& data );
+
+    /** Access the messages delivered at the last update, in the order
+	they were sent, sender by sender in order of id. They are
+	replaced at each update. */
+    const std::vector<Message>& GetMessages() const { return inbox; }
+
+    /** Access the radios that were in reach at the last update */
+    const std::vector<ModelWifi*>& GetNeighbours() const { return neighbours; }
+
+    /** Counts of the messages this radio has sent and received, and of
+	unicast messages it sent to a radio out of reach */
+    uint64_t GetSentCount() const { return sent; }
+    uint64_t GetReceivedCount() const { return received; }
+    uint64_t GetDroppedCount() const { return dropped; }
+
+    /** Find the links between all the active radios in [world] and
+	deliver their queued messages. Called by World::Update() after
+	the models have updated. */
+    static void Deliver( World* world );
+  };
+
+
   // RANGER MODEL --------------------------------------------------------
 	
   /// %ModelRanger class
@@ -2770,6 +3992,7 @@ namespace Stg
       radians_t fov;
       unsigned int sample_count;
       Color col;
+      double noise; ///< standard deviation of the noise, as a fraction of the range
 			
       std::vector<meters_t> ranges;
       std::vector<double> intensities;
@@ -2781,17 +4004,28 @@ namespace Stg
 		 fov( 0.1 ), 
 		 sample_count(1),
 		 col( 0,1,0,0.3 ),
+		 noise( 0.0 ),
 		 ranges(),
 		 intensities(),
 		 bearings()
       {}
 			
       void Update( ModelRanger* rgr );			
-      void Visualize( Vis* vis, ModelRanger* rgr ) const;
+      /** Multiply each range that hit something by a normal deviate
+	  of mean 1 and standard deviation [noise], drawn from [rng] */
+      void AddNoise( Rng rng );
+      /** Draw the sensor in the ranger's coordinates, the ranger's
+	  global pose being [rgr_gpose] */
+      void Visualize( World* world, const Pose& rgr_gpose ) const;
       std::string String() const;			
       void Load( Worldfile* wf, int entity );
     };
 
+    /** Draw [sensors], the visualization of a ranger in [world] at
+	global pose [gpose], in the ranger's coordinates */
+    static void DrawSensors( World* world, const Pose& gpose,
+			     const std::vector<Sensor>& sensors );
+
     /** returns a const reference to a vector of range and reflectance samples */
     const std::vector<Sensor>& GetSensors() const
     { return sensors; }
@@ -2801,12 +4035,20 @@ namespace Stg
     { return sensors; }
 	 
     void LoadSensor( Worldfile* wf, int entity );
+
+    virtual MemoryReport GetMemoryReport() const;
+
+    virtual void SaveState( StateWriter& out ) const;
+    virtual void LoadState( StateReader& in );
 		
   private:
     std::vector<Sensor> sensors;		
+
+    class Snapshot;
     
   protected:
 		
+    virtual DataSnapshot* SnapshotData() const;
     virtual void Startup();
     virtual void Shutdown();
     virtual void Update();		
@@ -2869,9 +4111,37 @@ namespace Stg
     PerspectiveCamera _camera;
     double _yaw_offset; //position camera is mounted at
     double _pitch_offset;
+
+    /// if true, render by casting rays through the world's cells instead of with OpenGL
+    bool _raytrace;
+    /// the number of threads used to render a raytraced frame
+    unsigned int _render_threads;
+
+    /// the stretch of an image column's ray that passes through one block
+    class Span
+    {
+    public:
+      meters_t near, far; ///< horizontal distances from the camera
+      Bounds z; ///< z extent of the block
+      GLubyte color[4];
+    };
+
+    /// the spans along the ray of each image column, nearest first
+    std::vector< std::vector<Span> > _spans;
+    /// the camera's global pose for the frame being raytraced
+    Pose _frame_pose;
 		
     ///Take a screenshot from the camera's perspective. return: true for sucess, and data is available via FrameDepth() / FrameColor()
     bool GetFrame();
+
+    ///Render the frame by raytracing, without OpenGL
+    bool RaytraceFrame();
+
+    ///Find the spans of image column [col] of [cam]; a RenderPool job
+    static void TraceColumn( void* cam, unsigned int col );
+
+    ///Fill image row [row] of [cam] from the spans; a RenderPool job
+    static void ShadeRow( void* cam, unsigned int row );
 	
   public:
     ModelCamera( World* world,
@@ -2905,6 +4175,9 @@ namespace Stg
 	
     ///get a reference to camera color image. 4 bytes (RGBA) per pixel
     const GLubyte* FrameColor() const { return _frame_color_data; }
+
+    ///true if frames are raytraced in software rather than rendered with OpenGL
+    bool IsRaytraced( void ) const { return _raytrace; }
 	
     ///change the pitch
     void setPitch( double pitch ) { _pitch_offset = pitch; _valid_vertexbuf_cache = false; }
@@ -2950,6 +4223,11 @@ namespace Stg
     LocalizationMode localization_mode; ///< global or local mode
     Velocity integration_error; ///< errors to apply in simple odometry model
     double wheelbase;
+
+    /** The most a move may sweep, as a fraction of the smaller side of
+	our footprint, before it is split into sub-moves. Zero never
+	splits. */
+    double substep;
     
   public:
     /** Set the min and max acceleration in all 4 DOF */
@@ -3036,12 +4314,16 @@ namespace Stg
     Pose est_pose_error; ///< estimated error in position estimate
     Pose est_origin; ///< global origin of the local coordinate system
 
+    virtual void SaveState( StateWriter& out ) const;
+    virtual void LoadState( StateReader& in );
+
   protected:
     virtual void Move();
     virtual void Startup();
     virtual void Shutdown();
     virtual void Update();
     virtual void Load();
+    virtual void Reseed();
   };
 
 
@@ -3089,6 +4371,9 @@ namespace Stg
     virtual void Shutdown();
     virtual void Update();
     virtual void Load();
+
+    virtual void SaveState( StateWriter& out ) const;
+    virtual void LoadState( StateReader& in );
   
     /** Sets the control_mode to CONTROL_VELOCITY and sets
 	the goal velocity. */
@@ -0,0 +1,312 @@
+#ifndef STAGE_SHM_H
+#define STAGE_SHM_H
+/*
+  stage_shm.h
+  Shared memory transport between Stage and controllers in other
+  processes. Shared by the server (shmtransport.cc) and the C client
+  library (stage_shm_client.c).
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @defgroup shm Shared memory transport
+
+A World with the worldfile property shm_name set creates a POSIX
+shared memory segment of that name. For each model the segment holds
+two single-producer, single-consumer rings: a data ring written by
+Stage and read by one client, and a command ring written by that
+client and read by Stage. Neither side ever blocks on the other: a
+message that does not fit in its ring is dropped and counted.
+
+At the start of each update Stage applies the commands waiting in
+every command ring. At the end of the update it writes a pose message,
+and a sensor message if the model has a sensor of a known type, into
+the data ring of every model subscribed by a client. It then
+increments the segment's tick counter. Clients wait for the counter to
+change with stg_shm_wait_tick(), which sleeps on a futex on Linux, so
+waking them costs Stage one system call per update, and only when
+someone is waiting.
+
+Each model has one client at a time. The layout is in native byte
+order, so server and clients must run on the same machine.
+*/
+
+#define STG_SHM_MAGIC 0x4d485347 /* "GSHM" */
+#define STG_SHM_VERSION 1
+#define STG_SHM_NAME_LEN 64
+#define STG_SHM_TYPE_LEN 32
+
+/** Messages are aligned to this many bytes */
+#define STG_SHM_ALIGN 16
+
+/** Message types. Data messages go from Stage to clients, commands from
+    clients to Stage. */
+typedef enum {
+  STG_SHM_PAD = 0, /**< fills the end of a ring, skipped by readers */
+  /* data */
+  STG_SHM_POSE, /**< stg_shm_pose_t */
+  STG_SHM_RANGER, /**< stg_shm_count_t, then float ranges[count] */
+  STG_SHM_FIDUCIAL, /**< stg_shm_count_t, then stg_shm_fiducial_t[count] */
+  STG_SHM_BLOBFINDER, /**< stg_shm_count_t, then stg_shm_blob_t[count] */
+  /* commands */
+  STG_SHM_SUBSCRIBE = 64, /**< no payload */
+  STG_SHM_UNSUBSCRIBE, /**< no payload */
+  STG_SHM_VELOCITY, /**< double[4]: x, y, z, a. Position models only. */
+  STG_SHM_SETPOSE /**< double[4]: x, y, z, a in the parent's frame */
+} stg_shm_msg_type_t;
+
+/** A ring of bytes. head and tail count the bytes ever written and
+    read, modulo 2^32, and are on their own cache lines. The data
+    follows the ring. */
+typedef struct {
+  uint32_t size; /**< bytes of data, a power of two */
+  volatile uint32_t drops; /**< messages the producer found no room for */
+  volatile uint32_t errors; /**< times the consumer found a malformed
+			       message and emptied the ring */
+  uint32_t reserved[13];
+  volatile uint32_t head; /**< written by the producer */
+  uint32_t pad0[15];
+  volatile uint32_t tail; /**< written by the consumer */
+  uint32_t pad1[15];
+} stg_shm_ring_t;
+
+/** The header of each message in a ring. [bytes] includes the header
+    and padding to a multiple of STG_SHM_ALIGN. */
+typedef struct {
+  uint32_t bytes;
+  uint32_t type;
+  uint64_t sim_time; /**< microseconds, for data messages */
+} stg_shm_msg_t;
+
+/** One model in the segment's table */
+typedef struct {
+  char name[STG_SHM_NAME_LEN];
+  char type[STG_SHM_TYPE_LEN];
+  uint32_t id;
+  uint32_t parent; /**< index of the parent model, or 0xFFFFFFFF */
+  uint64_t data_ring; /**< offset of the data ring from the segment start */
+  uint64_t cmd_ring; /**< offset of the command ring */
+  volatile uint32_t attached; /**< pid of the client that has the model, or 0 */
+  uint32_t pad;
+} stg_shm_model_t;
+
+/** The start of the segment, followed by model_count stg_shm_model_t */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t model_count;
+  uint32_t header_bytes; /**< bytes up to the first ring */
+  uint64_t segment_bytes;
+  uint64_t sim_interval; /**< microseconds per update */
+  volatile uint64_t sim_time; /**< microseconds, at the last tick */
+  volatile uint32_t tick; /**< incremented after each update; the futex word */
+  volatile uint32_t waiters; /**< clients sleeping in stg_shm_wait_tick() */
+  volatile uint32_t server_pid; /**< zero once Stage has closed the segment */
+  uint32_t pad[5];
+} stg_shm_header_t;
+
+/** Payload of a STG_SHM_POSE message */
+typedef struct {
+  double pose[4]; /**< global x, y, z, a */
+  double velocity[4]; /**< x, y, z, a in the model's frame, position models only */
+  double odom[4]; /**< odometry estimate x, y, z, a, position models only */
+  uint32_t stall;
+  uint32_t pad;
+} stg_shm_pose_t;
+
+/** Leads the payload of a STG_SHM_RANGER, STG_SHM_FIDUCIAL or
+    STG_SHM_BLOBFINDER message */
+typedef struct {
+  uint32_t count;
+  uint32_t pad;
+} stg_shm_count_t;
+
+typedef struct {
+  int32_t id; /**< fiducial id */
+  uint32_t model_id; /**< id of the detected model */
+  float range, bearing;
+  float geom[4]; /**< size x, y, z and heading of the detected model */
+} stg_shm_fiducial_t;
+
+typedef struct {
+  uint32_t color; /**< packed RGBA, 8 bits each */
+  uint32_t left, top, right, bottom;
+  float range;
+} stg_shm_blob_t;
+
+/** Returns the total size of a message of [payload] bytes in a ring */
+static inline uint32_t stg_shm_msg_bytes( size_t payload )
+{
+  return (uint32_t)(( sizeof(stg_shm_msg_t) + payload + STG_SHM_ALIGN - 1 ) & ~(size_t)( STG_SHM_ALIGN - 1 ));
+}
+
+/* Ring access, used by both sides. Only the producer may call
+   stg_shm_ring_reserve() and stg_shm_ring_commit(), and only the
+   consumer stg_shm_ring_peek() and stg_shm_ring_pop(). */
+
+static inline uint8_t* stg_shm_ring_data( stg_shm_ring_t* r )
+{
+  return (uint8_t*)( r + 1 );
+}
+
+/** Returns a pointer to room for [payload] bytes after a new message
+    header in [r], or NULL if the ring is full. Nothing is visible to
+    the consumer until stg_shm_ring_commit(). */
+static inline void* stg_shm_ring_reserve( stg_shm_ring_t* r, uint32_t type,
+					  uint64_t sim_time, size_t payload )
+{
+  const uint32_t bytes = stg_shm_msg_bytes( payload );
+  const uint32_t head = r->head;
+  uint32_t offset = head & ( r->size - 1 );
+  uint32_t pad = 0;
+  stg_shm_msg_t* msg;
+
+  /* messages don't wrap: skip to the start if this one won't fit
+     before the end */
+  if( offset + bytes > r->size )
+    pad = r->size - offset;
+
+  if( bytes > r->size || ( head + pad + bytes ) - r->tail > r->size )
+    {
+      __sync_fetch_and_add( &r->drops, 1 );
+      return NULL;
+    }
+
+  if( pad )
+    {
+      msg = (stg_shm_msg_t*)( stg_shm_ring_data( r ) + offset );
+      msg->bytes = pad;
+      msg->type = STG_SHM_PAD;
+      msg->sim_time = 0;
+      __sync_synchronize();
+      r->head = head + pad;
+      offset = 0;
+    }
+
+  msg = (stg_shm_msg_t*)( stg_shm_ring_data( r ) + offset );
+  msg->bytes = bytes;
+  msg->type = type;
+  msg->sim_time = sim_time;
+  return msg + 1;
+}
+
+/** Publish the message of [payload] bytes reserved last */
+static inline void stg_shm_ring_commit( stg_shm_ring_t* r, size_t payload )
+{
+  __sync_synchronize(); /* the message is written before the head moves */
+  r->head += stg_shm_msg_bytes( payload );
+}
+
+/** Returns non-zero if a message of [bytes] at the tail of [r] is
+    well formed: at least a header, a multiple of STG_SHM_ALIGN, and
+    inside both the ring and what the producer has committed. A
+    consumer that doesn't trust its producer checks every message. */
+static inline int stg_shm_msg_ok( const stg_shm_ring_t* r, uint32_t bytes )
+{
+  const uint32_t offset = r->tail & ( r->size - 1 );
+  return( bytes >= sizeof(stg_shm_msg_t) &&
+	  bytes % STG_SHM_ALIGN == 0 &&
+	  bytes <= r->size - offset &&
+	  bytes <= r->head - r->tail );
+}
+
+/** Returns the next message in [r], or NULL if there is none. Padding
+    is skipped, unless it is malformed, when it is returned for the
+    caller's stg_shm_msg_ok() to catch. */
+static inline const stg_shm_msg_t* stg_shm_ring_peek( stg_shm_ring_t* r )
+{
+  while( r->tail != r->head )
+    {
+      const stg_shm_msg_t* msg;
+      uint32_t bytes;
+      __sync_synchronize(); /* the head is read before the message */
+      msg = (const stg_shm_msg_t*)
+	( stg_shm_ring_data( r ) + ( r->tail & ( r->size - 1 )));
+
+      /* read once, so it can't change between the check and the use */
+      bytes = msg->bytes;
+      if( msg->type != STG_SHM_PAD || ! stg_shm_msg_ok( r, bytes ))
+	return msg;
+
+      __sync_synchronize();
+      r->tail += bytes;
+    }
+  return NULL;
+}
+
+/** Release the message returned by stg_shm_ring_peek() */
+static inline void stg_shm_ring_pop( stg_shm_ring_t* r, const stg_shm_msg_t* msg )
+{
+  __sync_synchronize(); /* the message is read before the tail moves */
+  r->tail += msg->bytes;
+}
+
+/* ---- client library, libstageshm ---- */
+
+typedef struct stg_shm_client stg_shm_client_t;
+
+/** Map the segment [name] created by Stage. Returns NULL on failure,
+    with errno set. */
+stg_shm_client_t* stg_shm_open( const char* name );
+
+/** Detach from all models and unmap the segment */
+void stg_shm_close( stg_shm_client_t* cli );
+
+/** Returns the number of models in the segment */
+int stg_shm_model_count( const stg_shm_client_t* cli );
+
+/** Returns the index of the model called [name], or -1 */
+int stg_shm_find_model( const stg_shm_client_t* cli, const char* name );
+
+/** Returns the name, or type, of model [index] */
+const char* stg_shm_model_name( const stg_shm_client_t* cli, int index );
+const char* stg_shm_model_type( const stg_shm_client_t* cli, int index );
+
+/** Claim model [index] and ask Stage to update it and send its data.
+    Returns 0, or -1 if the index is bad, another client has the
+    model, or its command ring is full. */
+int stg_shm_subscribe( stg_shm_client_t* cli, int index );
+
+/** Stop receiving data for model [index], and release it */
+int stg_shm_unsubscribe( stg_shm_client_t* cli, int index );
+
+/** Set the velocity of position model [index]. Returns 0, or -1 if
+    the command ring is full. */
+int stg_shm_set_velocity( stg_shm_client_t* cli, int index,
+			  double x, double y, double z, double a );
+
+/** Set the pose of model [index]. Returns 0, or -1 if the command
+    ring is full. */
+int stg_shm_set_pose( stg_shm_client_t* cli, int index,
+		      double x, double y, double z, double a );
+
+/** Copy the next message from the data ring of model [index] into
+    [msg], and up to [len] bytes of its payload into [buf]. Returns
+    the payload size, 0 if there is no message, or -1 if [len] is too
+    small, in which case the message is skipped. */
+int stg_shm_read( stg_shm_client_t* cli, int index,
+		  stg_shm_msg_t* msg, void* buf, size_t len );
+
+/** Returns the number of messages dropped because the data ring of
+    model [index] was full */
+uint32_t stg_shm_drops( const stg_shm_client_t* cli, int index );
+
+/** Returns the current tick and simulation time */
+uint32_t stg_shm_tick( const stg_shm_client_t* cli );
+uint64_t stg_shm_sim_time( const stg_shm_client_t* cli );
+
+/** Wait until the tick is no longer [last], for at most [timeout_ms]
+    milliseconds, or forever if negative. Returns 1 if it changed, 0
+    on timeout, or -1 if Stage has closed the segment. */
+int stg_shm_wait_tick( stg_shm_client_t* cli, uint32_t last, int timeout_ms );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,327 @@
+/*
+  stage_shm_client.c
+  C client library for Stage's shared memory transport. See
+  stage_shm.h.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "stage_shm.h"
+
+struct stg_shm_client
+{
+  uint8_t* base;
+  size_t bytes;
+  stg_shm_header_t* hdr;
+  stg_shm_model_t* table;
+  uint32_t pid;
+};
+
+static stg_shm_ring_t* data_ring( const stg_shm_client_t* cli, int index )
+{
+  return (stg_shm_ring_t*)( cli->base + cli->table[index].data_ring );
+}
+
+static stg_shm_ring_t* cmd_ring( const stg_shm_client_t* cli, int index )
+{
+  return (stg_shm_ring_t*)( cli->base + cli->table[index].cmd_ring );
+}
+
+static int valid( const stg_shm_client_t* cli, int index )
+{
+  return( cli && index >= 0 && (uint32_t)index < cli->hdr->model_count );
+}
+
+stg_shm_client_t* stg_shm_open( const char* name )
+{
+  char path[256];
+  struct stat st;
+  stg_shm_client_t* cli;
+  void* mem;
+  int fd;
+
+  snprintf( path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name );
+
+  fd = shm_open( path, O_RDWR, 0 );
+  if( fd < 0 )
+    return NULL;
+
+  if( fstat( fd, &st ) != 0 || (size_t)st.st_size < sizeof(stg_shm_header_t) )
+    {
+      close( fd );
+      errno = EINVAL;
+      return NULL;
+    }
+
+  mem = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  if( mem == MAP_FAILED )
+    return NULL;
+
+  cli = (stg_shm_client_t*)calloc( 1, sizeof(stg_shm_client_t) );
+  if( cli == NULL )
+    {
+      munmap( mem, st.st_size );
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  cli->base = (uint8_t*)mem;
+  cli->bytes = st.st_size;
+  cli->hdr = (stg_shm_header_t*)mem;
+  cli->table = (stg_shm_model_t*)( cli->base + sizeof(stg_shm_header_t) );
+  cli->pid = getpid();
+
+  /* Stage writes the magic number after everything else */
+  if( cli->hdr->magic != STG_SHM_MAGIC ||
+      cli->hdr->version != STG_SHM_VERSION ||
+      cli->hdr->segment_bytes != cli->bytes )
+    {
+      stg_shm_close( cli );
+      errno = EPROTO;
+      return NULL;
+    }
+  __sync_synchronize();
+
+  return cli;
+}
+
+void stg_shm_close( stg_shm_client_t* cli )
+{
+  uint32_t i;
+
+  if( cli == NULL )
+    return;
+
+  if( cli->hdr->magic == STG_SHM_MAGIC )
+    for( i=0; i<cli->hdr->model_count; ++i )
+      if( cli->table[i].attached == cli->pid )
+	stg_shm_unsubscribe( cli, i );
+
+  munmap( cli->base, cli->bytes );
+  free( cli );
+}
+
+int stg_shm_model_count( const stg_shm_client_t* cli )
+{
+  return cli->hdr->model_count;
+}
+
+int stg_shm_find_model( const stg_shm_client_t* cli, const char* name )
+{
+  uint32_t i;
+  for( i=0; i<cli->hdr->model_count; ++i )
+    if( strncmp( cli->table[i].name, name, STG_SHM_NAME_LEN ) == 0 )
+      return i;
+  return -1;
+}
+
+const char* stg_shm_model_name( const stg_shm_client_t* cli, int index )
+{
+  return valid( cli, index ) ? cli->table[index].name : NULL;
+}
+
+const char* stg_shm_model_type( const stg_shm_client_t* cli, int index )
+{
+  return valid( cli, index ) ? cli->table[index].type : NULL;
+}
+
+/* Queue a command with [len] bytes of payload */
+static int command( stg_shm_client_t* cli, int index, uint32_t type,
+		    const void* payload, size_t len )
+{
+  stg_shm_ring_t* r;
+  void* out;
+
+  if( ! valid( cli, index ) || cli->table[index].attached != cli->pid )
+    return -1;
+
+  r = cmd_ring( cli, index );
+  out = stg_shm_ring_reserve( r, type, 0, len );
+  if( out == NULL )
+    return -1;
+
+  if( len )
+    memcpy( out, payload, len );
+  stg_shm_ring_commit( r, len );
+  return 0;
+}
+
+int stg_shm_subscribe( stg_shm_client_t* cli, int index )
+{
+  stg_shm_model_t* entry;
+  stg_shm_ring_t* r;
+  uint32_t owner;
+
+  if( ! valid( cli, index ) )
+    return -1;
+
+  entry = &cli->table[index];
+
+  /* claim the model, taking it from a client that has died */
+  for( ;; )
+    {
+      owner = entry->attached;
+
+      if( owner == cli->pid )
+	break;
+
+      if( owner != 0 && ( kill( owner, 0 ) == 0 || errno != ESRCH ))
+	return -1; /* someone else's */
+
+      if( __sync_bool_compare_and_swap( &entry->attached, owner, cli->pid ))
+	break;
+    }
+
+  /* skip whatever was left for the last client */
+  r = data_ring( cli, index );
+  __sync_synchronize();
+  r->tail = r->head;
+
+  return command( cli, index, STG_SHM_SUBSCRIBE, NULL, 0 );
+}
+
+int stg_shm_unsubscribe( stg_shm_client_t* cli, int index )
+{
+  int result;
+
+  if( ! valid( cli, index ) || cli->table[index].attached != cli->pid )
+    return -1;
+
+  result = command( cli, index, STG_SHM_UNSUBSCRIBE, NULL, 0 );
+  __sync_bool_compare_and_swap( &cli->table[index].attached, cli->pid, 0 );
+  return result;
+}
+
+int stg_shm_set_velocity( stg_shm_client_t* cli, int index,
+			  double x, double y, double z, double a )
+{
+  const double v[4] = { x, y, z, a };
+  return command( cli, index, STG_SHM_VELOCITY, v, sizeof(v) );
+}
+
+int stg_shm_set_pose( stg_shm_client_t* cli, int index,
+		      double x, double y, double z, double a )
+{
+  const double v[4] = { x, y, z, a };
+  return command( cli, index, STG_SHM_SETPOSE, v, sizeof(v) );
+}
+
+int stg_shm_read( stg_shm_client_t* cli, int index,
+		  stg_shm_msg_t* msg, void* buf, size_t len )
+{
+  stg_shm_ring_t* r;
+  const stg_shm_msg_t* next;
+  size_t payload;
+
+  if( ! valid( cli, index ) )
+    return -1;
+
+  r = data_ring( cli, index );
+  next = stg_shm_ring_peek( r );
+  if( next == NULL )
+    return 0;
+
+  *msg = *next;
+
+  /* the payload size includes padding to STG_SHM_ALIGN */
+  payload = next->bytes - sizeof(stg_shm_msg_t);
+  if( payload > len )
+    {
+      stg_shm_ring_pop( r, next );
+      return -1;
+    }
+
+  memcpy( buf, next + 1, payload );
+  stg_shm_ring_pop( r, next );
+  return (int)payload;
+}
+
+uint32_t stg_shm_drops( const stg_shm_client_t* cli, int index )
+{
+  return valid( cli, index ) ? data_ring( cli, index )->drops : 0;
+}
+
+uint32_t stg_shm_tick( const stg_shm_client_t* cli )
+{
+  return cli->hdr->tick;
+}
+
+uint64_t stg_shm_sim_time( const stg_shm_client_t* cli )
+{
+  return cli->hdr->sim_time;
+}
+
+static uint64_t now_usec( void )
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int stg_shm_wait_tick( stg_shm_client_t* cli, uint32_t last, int timeout_ms )
+{
+  stg_shm_header_t* hdr = cli->hdr;
+  const uint64_t deadline = now_usec() + (uint64_t)( timeout_ms < 0 ? 0 : timeout_ms ) * 1000;
+  int result = 1;
+
+  /* Stage wakes sleepers only if it can see them */
+  __sync_fetch_and_add( &hdr->waiters, 1 );
+
+  while( hdr->tick == last )
+    {
+      uint64_t now;
+
+      if( hdr->server_pid == 0 )
+	break;
+
+      now = now_usec();
+      if( timeout_ms >= 0 && now >= deadline )
+	{
+	  result = 0;
+	  break;
+	}
+
+#ifdef __linux__
+      {
+	/* sleep until the tick changes. The kernel checks it is still
+	   [last] first, so a tick between our test and the call isn't
+	   missed. */
+	struct timespec ts;
+	const uint64_t left = timeout_ms < 0 ? 0 : deadline - now;
+	ts.tv_sec = left / 1000000;
+	ts.tv_nsec = ( left % 1000000 ) * 1000;
+	syscall( SYS_futex, &hdr->tick, FUTEX_WAIT, last,
+		 timeout_ms < 0 ? NULL : &ts, NULL, 0 );
+      }
+#else
+      usleep( 100 );
+#endif
+    }
+
+  __sync_fetch_and_sub( &hdr->waiters, 1 );
+
+  if( hdr->server_pid == 0 )
+    return -1;
+
+  return result;
+}
@@ -0,0 +1,1063 @@
+/*
+  trajlog.cc
+  Binary trajectory and sensor logging with a background writer thread.
+  See trajlog.hh for the file format.
+*/
+
+#include <errno.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "trajlog.hh"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace Stg;
+
+// the largest number of poses copied into a ring in one record
+static const uint32_t POSE_BATCH = 1024;
+
+// rings are at least this big, so that a full pose batch always fits
+static const size_t MIN_RING_BYTES = 256 * 1024;
+
+std::set<TrajectoryLog*> TrajectoryLog::open_logs;
+
+TrajectoryLog::Ring::Ring( size_t bytes ) :
+  buf( NULL ),
+  size( MIN_RING_BYTES ),
+  head( 0 ),
+  tail( 0 ),
+  stalls( 0 ),
+  dropped( 0 ),
+  pending( 0 )
+{
+  // a power of two, so positions can be masked
+  while( size < bytes )
+    size *= 2;
+
+  buf = new uint8_t[size];
+}
+
+TrajectoryLog::Ring::~Ring()
+{
+  delete[] buf;
+}
+
+// helpers for writing the file
+static void Put( std::vector<uint8_t>& v, const void* data, size_t bytes )
+{
+  const uint8_t* p = (const uint8_t*)data;
+  v.insert( v.end(), p, p + bytes );
+}
+
+static void Put32( std::vector<uint8_t>& v, uint32_t val ){ Put( v, &val, 4 ); }
+static void Put64( std::vector<uint8_t>& v, uint64_t val ){ Put( v, &val, 8 ); }
+
+static void PutString( std::vector<uint8_t>& v, const std::string& str )
+{
+  const uint16_t len = (uint16_t)std::min( str.size(), (size_t)0xFFFF );
+  Put( v, &len, 2 );
+  Put( v, str.data(), len );
+}
+
+static bool IdLess( const Model* a, const Model* b )
+{
+  return a->GetId() < b->GetId();
+}
+
+static uint32_t PackColor( const Color& c )
+{
+  return( ((uint32_t)(c.r * 255.0) << 24) |
+	  ((uint32_t)(c.g * 255.0) << 16) |
+	  ((uint32_t)(c.b * 255.0) << 8) |
+	  (uint32_t)(c.a * 255.0) );
+}
+
+TrajectoryLog::TrajectoryLog( World* world,
+			      const std::string& filename,
+			      unsigned int ringcount,
+			      size_t ring_bytes,
+			      bool compress,
+			      usec_t interval ) :
+  world( world ),
+  fp( NULL ),
+  filename( filename ),
+  compress( compress ),
+  rings(),
+  frames(),
+  spare_frames(),
+  last_tick( 0 ),
+  have_tick( false ),
+  raw(),
+  packed(),
+  index(),
+  raw_bytes( 0 ),
+  stored_bytes( 0 ),
+  thread(),
+  mutex(),
+  cond(),
+  wake( false ),
+  quit( false )
+{
+#ifndef HAVE_ZLIB
+  if( compress )
+    PRINT_WARN1( "log \"%s\" will not be compressed: Stage was built without zlib",
+		 filename.c_str() );
+  this->compress = false;
+#endif
+
+  if( (fp = fopen( filename.c_str(), "wb" )) == NULL )
+    {
+      PRINT_ERR2( "failed to open log file \"%s\": %s",
+		  filename.c_str(), strerror(errno) );
+      return;
+    }
+
+  // the writer makes few, large writes
+  setvbuf( fp, NULL, _IOFBF, 1<<20 );
+
+  for( unsigned int i=0; i<ringcount; ++i )
+    rings.push_back( new Ring( ring_bytes ));
+
+  WriteHeader( interval );
+
+  pthread_mutex_init( &mutex, NULL );
+  pthread_cond_init( &cond, NULL );
+  pthread_create( &thread, NULL, WriterThreadEntry, this );
+
+  // Stage usually exits without destroying its worlds, so make sure
+  // the logs are finished anyway
+  static bool registered = false;
+  if( ! registered )
+    {
+      atexit( CloseAll );
+      registered = true;
+    }
+
+  open_logs.insert( this );
+}
+
+TrajectoryLog::~TrajectoryLog()
+{
+  open_logs.erase( this );
+
+  if( fp == NULL ) // never started
+    return;
+
+  pthread_mutex_lock( &mutex );
+  quit = true;
+  pthread_cond_signal( &cond );
+  pthread_mutex_unlock( &mutex );
+
+  pthread_join( thread, NULL );
+  pthread_mutex_destroy( &mutex );
+  pthread_cond_destroy( &cond );
+
+  // frames later than the last LogPoses() are incomplete, so they
+  // are dropped
+  WriteIndex();
+  fclose( fp );
+
+  uint64_t stalls = 0, dropped = 0;
+  FOR_EACH( it, rings )
+    {
+      stalls += (*it)->stalls;
+      dropped += (*it)->dropped;
+      delete *it;
+    }
+
+  FOR_EACH( it, frames )
+    delete it->second;
+  FOR_EACH( it, spare_frames )
+    delete *it;
+
+  printf( "[Log \"%s\": %lu frames, %.2f MB (%.2f MB raw)",
+	  filename.c_str(),
+	  (unsigned long)index.size(),
+	  stored_bytes / 1e6,
+	  raw_bytes / 1e6 );
+  if( stalls )
+    printf( " %lu stalls", (unsigned long)stalls );
+  if( dropped )
+    printf( " %lu oversize records dropped", (unsigned long)dropped );
+  puts( "]" );
+}
+
+void TrajectoryLog::CloseAll()
+{
+  while( ! open_logs.empty() )
+    (*open_logs.begin())->world->StopLog();
+}
+
+void TrajectoryLog::WriteHeader( usec_t interval )
+{
+  // the model table, in id order
+  const std::set<Model*> all = world->GetAllModels();
+  std::vector<Model*> models( all.begin(), all.end() );
+  std::sort( models.begin(), models.end(), IdLess );
+
+  raw.clear();
+  Put( raw, "STGTRAJ", 8 );
+  Put32( raw, TRAJLOG_VERSION );
+  Put32( raw, compress ? TRAJLOG_COMPRESSED : 0 );
+  Put64( raw, interval );
+  Put32( raw, models.size() );
+
+  FOR_EACH( it, models )
+    {
+      Put32( raw, (*it)->GetId() );
+      Put32( raw, (*it)->Parent() ? (*it)->Parent()->GetId() : 0xFFFFFFFF );
+      PutString( raw, (*it)->GetModelType() );
+      PutString( raw, (*it)->Token() );
+    }
+
+  fwrite( &raw[0], 1, raw.size(), fp );
+  stored_bytes += raw.size();
+}
+
+void* TrajectoryLog::Begin( unsigned int ring,
+			    log_kind_t kind,
+			    uint32_t id,
+			    uint32_t count,
+			    uint16_t fields,
+			    usec_t time )
+{
+  if( ring >= rings.size() ) // the world added threads after we started
+    return NULL;
+
+  Ring* r = rings[ring];
+
+  const size_t bytes =
+    ( sizeof(RecordHeader) + (size_t)count * fields * 4 + 7 ) & ~(size_t)7;
+
+  if( bytes > r->size / 4 ) // would hog the ring
+    {
+      ++r->dropped;
+      return NULL;
+    }
+
+  size_t pos = r->head & (r->size-1);
+  const size_t contiguous = r->size - pos;
+
+  // records are never split, so pad to the end of the ring if it
+  // won't fit there
+  const size_t need = bytes + ( contiguous < bytes ? contiguous : 0 );
+
+  if( r->size - (r->head - r->tail) < need )
+    {
+      ++r->stalls;
+      do
+	WaitForSpace( r );
+      while( r->size - (r->head - r->tail) < need );
+    }
+
+  // don't write into the space until we've seen that it is free
+  __sync_synchronize();
+
+  if( contiguous < bytes )
+    {
+      // the padding is at least 8 bytes, enough for the size and kind
+      *(uint32_t*)(r->buf + pos) = contiguous;
+      *(uint16_t*)(r->buf + pos + 4) = LOG_SKIP;
+      __sync_synchronize();
+      r->head += contiguous;
+      pos = 0;
+    }
+
+  RecordHeader* h = (RecordHeader*)(r->buf + pos);
+  h->bytes = bytes;
+  h->kind = kind;
+  h->fields = fields;
+  h->id = id;
+  h->count = count;
+  h->time = time;
+
+  r->pending = bytes;
+  return h + 1;
+}
+
+void TrajectoryLog::Commit( unsigned int ring )
+{
+  // the record must be complete before the writer can see it
+  __sync_synchronize();
+  Ring* r = rings[ring];
+  r->head += r->pending;
+}
+
+void TrajectoryLog::WaitForSpace( Ring* )
+{
+  pthread_mutex_lock( &mutex );
+  wake = true;
+  pthread_cond_signal( &cond );
+  pthread_mutex_unlock( &mutex );
+
+  usleep( 100 );
+}
+
+void TrajectoryLog::LogModel( unsigned int ring, Model* mod, usec_t time )
+{
+  if( ModelRanger* rgr = dynamic_cast<ModelRanger*>(mod) )
+    {
+      const std::vector<ModelRanger::Sensor>& sensors = rgr->GetSensors();
+
+      uint32_t count = 0;
+      FOR_EACH( it, sensors )
+	count += it->ranges.size();
+
+      float* out = (float*)Begin( ring, LOG_RANGER, mod->GetId(), count, 1, time );
+      if( out == NULL )
+	return;
+
+      FOR_EACH( it, sensors )
+	FOR_EACH( r, it->ranges )
+	*out++ = *r;
+
+      Commit( ring );
+    }
+  else if( ModelFiducial* fid = dynamic_cast<ModelFiducial*>(mod) )
+    {
+      const std::vector<ModelFiducial::Fiducial>& fids = fid->GetFiducials();
+
+      FiducialRecord* out = (FiducialRecord*)
+	Begin( ring, LOG_FIDUCIAL, mod->GetId(), fids.size(),
+	       sizeof(FiducialRecord)/4, time );
+      if( out == NULL )
+	return;
+
+      FOR_EACH( it, fids )
+	{
+	  out->model_id = it->mod ? it->mod->GetId() : 0xFFFFFFFF;
+	  out->id = it->id;
+	  out->range = it->range;
+	  out->bearing = it->bearing;
+	  out->geom_x = it->geom.x;
+	  out->geom_y = it->geom.y;
+	  out->geom_z = it->geom.z;
+	  out->geom_a = it->geom.a;
+	  out->pose_x = it->pose.x;
+	  out->pose_y = it->pose.y;
+	  out->pose_z = it->pose.z;
+	  out->pose_a = it->pose.a;
+	  ++out;
+	}
+
+      Commit( ring );
+    }
+  else if( ModelBlobfinder* bf = dynamic_cast<ModelBlobfinder*>(mod) )
+    {
+      const std::vector<ModelBlobfinder::Blob>& blobs = bf->GetBlobs();
+
+      BlobRecord* out = (BlobRecord*)
+	Begin( ring, LOG_BLOBFINDER, mod->GetId(), blobs.size(),
+	       sizeof(BlobRecord)/4, time );
+      if( out == NULL )
+	return;
+
+      FOR_EACH( it, blobs )
+	{
+	  out->color = PackColor( it->color );
+	  out->left = it->left;
+	  out->top = it->top;
+	  out->right = it->right;
+	  out->bottom = it->bottom;
+	  out->range = it->range;
+	  ++out;
+	}
+
+      Commit( ring );
+    }
+}
+
+void TrajectoryLog::LogPoses( const std::set<Model*>& models, usec_t time )
+{
+  std::set<Model*>::const_iterator it = models.begin();
+  size_t remaining = models.size();
+
+  while( remaining > 0 )
+    {
+      const uint32_t n = std::min( remaining, (size_t)POSE_BATCH );
+
+      PoseRecord* out = (PoseRecord*)
+	Begin( 0, LOG_POSES, 0, n, sizeof(PoseRecord)/4, time );
+      assert( out ); // the ring is always big enough for a batch
+
+      for( uint32_t i=0; i<n; ++i, ++it, ++out )
+	{
+	  Model* mod = *it;
+	  const Pose p = mod->GetPose();
+
+	  out->id = mod->GetId();
+	  out->x = p.x;
+	  out->y = p.y;
+	  out->z = p.z;
+	  out->a = p.a;
+
+	  if( ModelPosition* pos = dynamic_cast<ModelPosition*>(mod) )
+	    {
+	      const Velocity v = pos->GetVelocity();
+	      out->vx = v.x;
+	      out->vy = v.y;
+	      out->vz = v.z;
+	      out->va = v.a;
+	    }
+	  else
+	    out->vx = out->vy = out->vz = out->va = 0;
+	}
+
+      Commit( 0 );
+      remaining -= n;
+    }
+
+  // mark the end of the update
+  Begin( 0, LOG_TICK, 0, 0, 0, time );
+  Commit( 0 );
+
+  pthread_mutex_lock( &mutex );
+  wake = true;
+  pthread_cond_signal( &cond );
+  pthread_mutex_unlock( &mutex );
+}
+
+TrajectoryLog::Frame* TrajectoryLog::GetFrame( usec_t time )
+{
+  std::map<usec_t,Frame*>::iterator it = frames.find( time );
+  if( it != frames.end() )
+    return it->second;
+
+  Frame* frame;
+  if( spare_frames.empty() )
+    frame = new Frame();
+  else
+    {
+      frame = spare_frames.back();
+      spare_frames.pop_back();
+    }
+
+  frame->time = time;
+  frames[time] = frame;
+  return frame;
+}
+
+size_t TrajectoryLog::DrainRing( Ring* r )
+{
+  size_t count = 0;
+  size_t tail = r->tail;
+  const size_t head = r->head;
+
+  // don't read the records before we've seen that they are complete
+  __sync_synchronize();
+
+  while( tail != head )
+    {
+      const RecordHeader* h = (const RecordHeader*)(r->buf + (tail & (r->size-1)));
+      const uint32_t bytes = h->bytes; // SKIP records may be too short to hold more
+
+      switch( *(const uint16_t*)((const uint8_t*)h + 4) )
+	{
+	case LOG_SKIP:
+	  break;
+
+	case LOG_TICK:
+	  if( ! have_tick || h->time > last_tick )
+	    last_tick = h->time;
+	  have_tick = true;
+	  ++count;
+	  break;
+
+	default:
+	  {
+	    Section& s = GetFrame( h->time )->sections[h->kind];
+	    s.fields = h->fields;
+
+	    if( h->kind != LOG_POSES )
+	      {
+		s.ids.push_back( h->id );
+		s.counts.push_back( h->count );
+	      }
+
+	    const uint32_t* words = (const uint32_t*)(h + 1);
+	    s.words.insert( s.words.end(), words, words + h->count * h->fields );
+	    ++count;
+	  }
+	}
+
+      tail += bytes;
+    }
+
+  // finish reading before the producer can reuse the space
+  __sync_synchronize();
+  r->tail = tail;
+
+  return count;
+}
+
+size_t TrajectoryLog::Drain()
+{
+  // read ring 0 first: once we have seen the end of an update there,
+  // the workers' records for that update are already in their rings
+  size_t count = 0;
+  FOR_EACH( it, rings )
+    count += DrainRing( *it );
+
+  while( have_tick && ! frames.empty() && frames.begin()->first <= last_tick )
+    {
+      Frame* frame = frames.begin()->second;
+      frames.erase( frames.begin() );
+
+      WriteFrame( frame );
+
+      for( int k=0; k<=LOG_BLOBFINDER; ++k )
+	frame->sections[k].Clear();
+      spare_frames.push_back( frame );
+    }
+
+  return count;
+}
+
+void TrajectoryLog::WriteFrame( Frame* frame )
+{
+  raw.clear();
+
+  for( int k=LOG_POSES; k<=LOG_BLOBFINDER; ++k )
+    {
+      const Section& s = frame->sections[k];
+      if( s.words.empty() && s.ids.empty() )
+	continue;
+
+      const uint32_t rows = s.fields ? s.words.size() / s.fields : 0;
+
+      Put32( raw, k );
+      Put32( raw, s.ids.size() );
+      Put32( raw, rows );
+      Put32( raw, s.fields );
+
+      if( ! s.ids.empty() )
+	{
+	  Put( raw, &s.ids[0], s.ids.size() * 4 );
+	  Put( raw, &s.counts[0], s.counts.size() * 4 );
+	}
+
+      // store by column: values in a column are alike, so they
+      // compress well
+      size_t out = raw.size();
+      raw.resize( out + s.words.size() * 4 );
+      for( uint32_t f=0; f<s.fields; ++f )
+	for( uint32_t r=0; r<rows; ++r, out += 4 )
+	  memcpy( &raw[out], &s.words[ r * s.fields + f ], 4 );
+    }
+
+  uint32_t flags = 0;
+  const uint8_t* data = raw.empty() ? NULL : &raw[0];
+  uint32_t stored = raw.size();
+
+#ifdef HAVE_ZLIB
+  if( compress && ! raw.empty() )
+    {
+      uLongf len = compressBound( raw.size() );
+      packed.resize( len );
+      if( compress2( &packed[0], &len, &raw[0], raw.size(), Z_BEST_SPEED ) == Z_OK
+	  && len < raw.size() )
+	{
+	  flags |= TRAJLOG_COMPRESSED;
+	  data = &packed[0];
+	  stored = len;
+	}
+    }
+#endif
+
+  index.push_back( std::make_pair( (uint64_t)frame->time,
+				   (uint64_t)ftello( fp ) ));
+
+  const uint64_t time = frame->time;
+  const uint32_t rawsize = raw.size();
+  fwrite( "FRAM", 1, 4, fp );
+  fwrite( &flags, 4, 1, fp );
+  fwrite( &time, 8, 1, fp );
+  fwrite( &rawsize, 4, 1, fp );
+  fwrite( &stored, 4, 1, fp );
+  if( stored )
+    fwrite( data, 1, stored, fp );
+
+  raw_bytes += 24 + rawsize;
+  stored_bytes += 24 + stored;
+}
+
+void TrajectoryLog::WriteIndex()
+{
+  const uint64_t offset = ftello( fp );
+  const uint32_t count = index.size();
+
+  fwrite( "INDX", 1, 4, fp );
+  fwrite( &count, 4, 1, fp );
+  FOR_EACH( it, index )
+    {
+      fwrite( &it->first, 8, 1, fp );
+      fwrite( &it->second, 8, 1, fp );
+    }
+  fwrite( &offset, 8, 1, fp );
+  fwrite( "STGTIDX", 1, 8, fp );
+}
+
+void* TrajectoryLog::WriterThreadEntry( void* arg )
+{
+  ((TrajectoryLog*)arg)->WriterThread();
+  return NULL;
+}
+
+void TrajectoryLog::WriterThread()
+{
+  pthread_mutex_lock( &mutex );
+
+  while( true )
+    {
+      const bool quitting = quit;
+      wake = false;
+      pthread_mutex_unlock( &mutex );
+
+      const size_t count = Drain();
+
+      pthread_mutex_lock( &mutex );
+
+      // the producers have stopped, and we have everything
+      if( quitting && count == 0 )
+	break;
+
+      // sleep until an update ends or a producer runs out of room, but
+      // check the rings now and then anyway
+      if( count == 0 && ! wake && ! quit )
+	{
+	  struct timeval now;
+	  gettimeofday( &now, NULL );
+	  struct timespec until;
+	  until.tv_sec = now.tv_sec;
+	  until.tv_nsec = (now.tv_usec + 50000) * 1000; // 50 msec
+	  if( until.tv_nsec >= 1000000000 )
+	    {
+	      until.tv_sec += 1;
+	      until.tv_nsec -= 1000000000;
+	    }
+	  pthread_cond_timedwait( &cond, &mutex, &until );
+	}
+    }
+
+  pthread_mutex_unlock( &mutex );
+}
+
+// helpers for reading the file
+static bool Get( FILE* fp, void* data, size_t bytes )
+{
+  return( fread( data, 1, bytes, fp ) == bytes );
+}
+
+static bool GetString( FILE* fp, std::string& str )
+{
+  uint16_t len;
+  if( ! Get( fp, &len, 2 ) )
+    return false;
+
+  str.resize( len );
+  return( len == 0 || Get( fp, &str[0], len ) );
+}
+
+static float Float( uint32_t word )
+{
+  float f;
+  memcpy( &f, &word, 4 );
+  return f;
+}
+
+TrajectoryReplay::TrajectoryReplay( const std::string& filename ) :
+  fp( NULL ),
+  ok( false ),
+  filename( filename ),
+  interval( 0 ),
+  names(),
+  models(),
+  index(),
+  current( -1 ),
+  packed(),
+  raw()
+{
+  if( (fp = fopen( filename.c_str(), "rb" )) == NULL )
+    {
+      PRINT_ERR2( "failed to open log file \"%s\": %s",
+		  filename.c_str(), strerror(errno) );
+      return;
+    }
+
+  char magic[8];
+  uint32_t version, flags, count;
+  uint64_t ival;
+
+  if( ! Get( fp, magic, 8 ) || memcmp( magic, "STGTRAJ", 8 ) != 0 ||
+      ! Get( fp, &version, 4 ) || ! Get( fp, &flags, 4 ) ||
+      ! Get( fp, &ival, 8 ) || ! Get( fp, &count, 4 ) )
+    {
+      PRINT_ERR1( "\"%s\" is not a Stage log file", filename.c_str() );
+      return;
+    }
+
+  if( version != TrajectoryLog::TRAJLOG_VERSION )
+    {
+      PRINT_ERR2( "log file \"%s\" has unsupported version %u",
+		  filename.c_str(), version );
+      return;
+    }
+
+  interval = ival;
+
+  for( uint32_t i=0; i<count; ++i )
+    {
+      uint32_t id, parent;
+      std::string type, name;
+      if( ! Get( fp, &id, 4 ) || ! Get( fp, &parent, 4 ) ||
+	  ! GetString( fp, type ) || ! GetString( fp, name ) )
+	{
+	  PRINT_ERR1( "log file \"%s\" is truncated", filename.c_str() );
+	  return;
+	}
+      names[id] = name;
+    }
+
+  const off_t frames_start = ftello( fp );
+
+  // read the index at the end of the file
+  uint64_t index_offset;
+  char trailer[8];
+  uint32_t frames = 0;
+
+  if( fseeko( fp, -16, SEEK_END ) == 0 &&
+      Get( fp, &index_offset, 8 ) && Get( fp, trailer, 8 ) &&
+      memcmp( trailer, "STGTIDX", 8 ) == 0 &&
+      fseeko( fp, index_offset, SEEK_SET ) == 0 &&
+      Get( fp, magic, 4 ) && memcmp( magic, "INDX", 4 ) == 0 &&
+      Get( fp, &frames, 4 ) )
+    {
+      for( uint32_t i=0; i<frames; ++i )
+	{
+	  uint64_t entry[2];
+	  if( ! Get( fp, entry, 16 ) )
+	    break;
+	  index.push_back( std::make_pair( entry[0], entry[1] ));
+	}
+    }
+  else
+    {
+      PRINT_WARN1( "log file \"%s\" has no index, so it was not closed properly. Scanning it.",
+		   filename.c_str() );
+
+      fseeko( fp, 0, SEEK_END );
+      const off_t end = ftello( fp );
+
+      off_t pos = frames_start;
+      while( pos + 24 <= end )
+	{
+	  uint8_t header[24];
+	  fseeko( fp, pos, SEEK_SET );
+	  if( ! Get( fp, header, 24 ) || memcmp( header, "FRAM", 4 ) != 0 )
+	    break;
+
+	  uint64_t time;
+	  uint32_t stored;
+	  memcpy( &time, header + 8, 8 );
+	  memcpy( &stored, header + 20, 4 );
+
+	  if( pos + 24 + (off_t)stored > end ) // the last frame was cut short
+	    break;
+
+	  index.push_back( std::make_pair( time, (uint64_t)pos ));
+	  pos += 24 + stored;
+	}
+    }
+
+  if( index.empty() )
+    {
+      PRINT_ERR1( "log file \"%s\" contains no frames", filename.c_str() );
+      return;
+    }
+
+  ok = true;
+}
+
+TrajectoryReplay::~TrajectoryReplay()
+{
+  if( fp )
+    fclose( fp );
+}
+
+void TrajectoryReplay::Bind( World* world )
+{
+  models.clear();
+  current = -1;
+
+  unsigned int missing = 0;
+  FOR_EACH( it, names )
+    {
+      Model* mod = world->GetModel( it->second );
+      if( mod == NULL )
+	{
+	  ++missing;
+	  continue;
+	}
+
+      if( it->first >= models.size() )
+	models.resize( it->first + 1, NULL );
+      models[it->first] = mod;
+    }
+
+  if( missing )
+    PRINT_WARN2( "%u models in log file \"%s\" are not in this world",
+		 missing, filename.c_str() );
+}
+
+bool TrajectoryReplay::Seek( usec_t time )
+{
+  if( ! ok )
+    return false;
+
+  // the last frame at or before [time]
+  size_t f = 0;
+  size_t hi = index.size();
+  while( hi - f > 1 )
+    {
+      const size_t mid = (f + hi) / 2;
+      if( index[mid].first <= time )
+	f = mid;
+      else
+	hi = mid;
+    }
+
+  if( (long)f != current )
+    {
+      Apply( f );
+      current = f;
+    }
+
+  return( time <= index.back().first );
+}
+
+bool TrajectoryReplay::Apply( size_t f )
+{
+  uint8_t header[24];
+  if( fseeko( fp, index[f].second, SEEK_SET ) != 0 ||
+      ! Get( fp, header, 24 ) || memcmp( header, "FRAM", 4 ) != 0 )
+    {
+      PRINT_ERR2( "bad frame %lu in log file \"%s\"", 
+		  (unsigned long)f, filename.c_str() );
+      return false;
+    }
+
+  uint32_t flags, rawsize, stored;
+  memcpy( &flags, header + 4, 4 );
+  memcpy( &rawsize, header + 16, 4 );
+  memcpy( &stored, header + 20, 4 );
+
+  packed.resize( stored );
+  if( stored && ! Get( fp, &packed[0], stored ) )
+    {
+      PRINT_ERR2( "frame %lu in log file \"%s\" is truncated", 
+		  (unsigned long)f, filename.c_str() );
+      return false;
+    }
+
+  const uint8_t* data = packed.empty() ? NULL : &packed[0];
+
+  if( flags & TrajectoryLog::TRAJLOG_COMPRESSED )
+    {
+#ifdef HAVE_ZLIB
+      raw.resize( rawsize );
+      uLongf len = rawsize;
+      if( uncompress( &raw[0], &len, &packed[0], stored ) != Z_OK || len != rawsize )
+	{
+	  PRINT_ERR2( "frame %lu in log file \"%s\" is corrupt", 
+		      (unsigned long)f, filename.c_str() );
+	  return false;
+	}
+      data = &raw[0];
+#else
+      PRINT_ERR1( "log file \"%s\" is compressed, but Stage was built without zlib",
+		  filename.c_str() );
+      return false;
+#endif
+    }
+
+  // read the sections
+  size_t pos = 0;
+  while( pos + 16 <= rawsize )
+    {
+      const uint32_t* h = (const uint32_t*)(data + pos);
+      const uint32_t kind = h[0], modcount = h[1], rows = h[2], fields = h[3];
+
+      const uint32_t* ids = h + 4;
+      const uint32_t* counts = ids + modcount;
+      const uint32_t* words = counts + modcount;
+
+      pos += 16 + 8 * (size_t)modcount + 4 * (size_t)rows * fields;
+      if( pos > rawsize )
+	{
+	  PRINT_ERR2( "frame %lu in log file \"%s\" is corrupt", 
+		      (unsigned long)f, filename.c_str() );
+	  return false;
+	}
+
+      if( kind == TrajectoryLog::LOG_POSES )
+	{
+	  ApplyPoses( words, rows, fields );
+	  continue;
+	}
+
+      uint32_t first = 0;
+      for( uint32_t m=0; m<modcount; first += counts[m], ++m )
+	{
+	  Model* mod = Lookup( ids[m] );
+	  if( mod == NULL || first + counts[m] > rows )
+	    continue;
+
+	  switch( kind )
+	    {
+	    case TrajectoryLog::LOG_RANGER:
+	      ApplyRanger( mod, words, first, counts[m] );
+	      break;
+	    case TrajectoryLog::LOG_FIDUCIAL:
+	      if( fields * 4 >= sizeof(TrajectoryLog::FiducialRecord) )
+		ApplyFiducial( mod, words, rows, first, counts[m] );
+	      break;
+	    case TrajectoryLog::LOG_BLOBFINDER:
+	      if( fields * 4 >= sizeof(TrajectoryLog::BlobRecord) )
+		ApplyBlobfinder( mod, words, rows, first, counts[m] );
+	      break;
+	    default: // from a later version
+	      break;
+	    }
+	}
+    }
+
+  return true;
+}
+
+void TrajectoryReplay::ApplyPoses( const uint32_t* words, uint32_t rows, uint32_t fields )
+{
+  if( fields * 4 < sizeof(TrajectoryLog::PoseRecord) )
+    return;
+
+  // columns id, x, y, z, a, vx, vy, vz, va
+  for( uint32_t r=0; r<rows; ++r )
+    {
+      Model* mod = Lookup( words[r] );
+      if( mod == NULL )
+	continue;
+
+      mod->SetPose( Pose( Float( words[ 1*rows + r ] ),
+			  Float( words[ 2*rows + r ] ),
+			  Float( words[ 3*rows + r ] ),
+			  Float( words[ 4*rows + r ] )));
+
+      if( ModelPosition* pos = dynamic_cast<ModelPosition*>(mod) )
+	pos->SetVelocity( Velocity( Float( words[ 5*rows + r ] ),
+				    Float( words[ 6*rows + r ] ),
+				    Float( words[ 7*rows + r ] ),
+				    Float( words[ 8*rows + r ] )));
+    }
+}
+
+void TrajectoryReplay::ApplyRanger( Model* mod, 
+				    const uint32_t* words, 
+				    uint32_t first, 
+				    uint32_t count )
+{
+  ModelRanger* rgr = dynamic_cast<ModelRanger*>(mod);
+  if( rgr == NULL )
+    return;
+
+  // the samples of all the sensors, in order
+  uint32_t i = first;
+  const uint32_t end = first + count;
+
+  FOR_EACH( it, rgr->GetSensorsMutable() )
+    {
+      ModelRanger::Sensor& s = *it;
+
+      s.ranges.resize( s.sample_count );
+      s.intensities.resize( s.sample_count );
+      s.bearings.resize( s.sample_count );
+
+      // as ModelRanger::Sensor::Update() does
+      const double incr = s.fov / std::max( s.sample_count-1, (unsigned int)1 );
+      const double start = ( s.sample_count > 1 ? -s.fov/2.0 : 0.0 );
+
+      for( unsigned int t=0; t<s.sample_count; ++t )
+	{
+	  s.ranges[t] = ( i < end ? Float( words[i++] ) : s.range.max );
+	  s.intensities[t] = 0.0; // not logged
+	  s.bearings[t] = start + t * incr;
+	}
+    }
+}
+
+void TrajectoryReplay::ApplyFiducial( Model* mod, 
+				      const uint32_t* words, 
+				      uint32_t rows,
+				      uint32_t first, 
+				      uint32_t count )
+{
+  ModelFiducial* fid = dynamic_cast<ModelFiducial*>(mod);
+  if( fid == NULL )
+    return;
+
+  std::vector<ModelFiducial::Fiducial>& fids = fid->GetFiducials();
+  fids.resize( count );
+
+  // columns as in TrajectoryLog::FiducialRecord
+  for( uint32_t k=0; k<count; ++k )
+    {
+      const uint32_t r = first + k;
+      ModelFiducial::Fiducial& out = fids[k];
+
+      out.mod = Lookup( words[ 0*rows + r ] );
+      out.id = (int32_t)words[ 1*rows + r ];
+      out.range = Float( words[ 2*rows + r ] );
+      out.bearing = Float( words[ 3*rows + r ] );
+      out.geom = Pose( Float( words[ 4*rows + r ] ),
+		       Float( words[ 5*rows + r ] ),
+		       Float( words[ 6*rows + r ] ),
+		       Float( words[ 7*rows + r ] ));
+      out.pose = Pose( Float( words[ 8*rows + r ] ),
+		       Float( words[ 9*rows + r ] ),
+		       Float( words[ 10*rows + r ] ),
+		       Float( words[ 11*rows + r ] ));
+    }
+}
+
+void TrajectoryReplay::ApplyBlobfinder( Model* mod, 
+					const uint32_t* words, 
+					uint32_t rows,
+					uint32_t first, 
+					uint32_t count )
+{
+  ModelBlobfinder* bf = dynamic_cast<ModelBlobfinder*>(mod);
+  if( bf == NULL )
+    return;
+
+  std::vector<ModelBlobfinder::Blob>& blobs = bf->GetBlobsMutable();
+  blobs.resize( count );
+
+  // columns as in TrajectoryLog::BlobRecord
+  for( uint32_t k=0; k<count; ++k )
+    {
+      const uint32_t r = first + k;
+      ModelBlobfinder::Blob& out = blobs[k];
+
+      const uint32_t c = words[ 0*rows + r ];
+      out.color = Color( ((c >> 24) & 0xFF) / 255.0,
+			 ((c >> 16) & 0xFF) / 255.0,
+			 ((c >> 8) & 0xFF) / 255.0,
+			 (c & 0xFF) / 255.0 );
+      out.left = words[ 1*rows + r ];
+      out.top = words[ 2*rows + r ];
+      out.right = words[ 3*rows + r ];
+      out.bottom = words[ 4*rows + r ];
+      out.range = Float( words[ 5*rows + r ] );
+    }
+}
@@ -0,0 +1,311 @@
+#pragma once
+/*
+  trajlog.hh
+  Binary trajectory and sensor logging with a background writer thread.
+*/
+
+#include "stage.hh"
+
+namespace Stg
+{
+  /** Records model poses and velocities, and the outputs of selected
+      sensors, for every logged update of a World.
+
+      Producers never block on I/O. Each event queue (the main thread
+      is queue 0, worker thread t is queue t) has its own fixed-size
+      single-producer, single-consumer ring buffer, and the thread
+      that updates a model copies that model's data into its queue's
+      ring. A background writer thread drains the rings, collects
+      the records for each update into a frame, and writes the frame
+      to the file column by column, optionally compressed with
+      zlib. Memory use is bounded by the ring sizes: a producer that
+      finds its ring full waits for the writer to catch up, and
+      counts a stall.
+
+      The file is written in native byte order:
+
+      @verbatim
+      header:  "STGTRAJ\0" u32 version, u32 flags, u64 interval_usec,
+               u32 model_count, then for each model
+               u32 id, u32 parent_id (or 0xFFFFFFFF),
+               u16 length + type string, u16 length + name string
+      frame:   "FRAM" u32 flags, u64 sim_time, u32 raw_bytes, u32 stored_bytes,
+               then stored_bytes of sections, zlib-compressed if
+               flags & TRAJLOG_COMPRESSED
+      section: u32 kind, u32 models, u32 rows, u32 fields,
+               u32 id[models], u32 count[models],
+               then [fields] columns of [rows] 4-byte words
+      index:   "INDX" u32 frame_count, {u64 sim_time, u64 offset}[frame_count]
+      trailer: u64 index_offset, "STGTIDX\0"
+      @endverbatim
+
+      A POSES section has no per-model ids or counts: each of its rows
+      is one model, with columns id, x, y, z, a, vx, vy, vz, va. A
+      sensor section has one row per range sample, fiducial or blob;
+      model id[i] contributed the next count[i] rows. If the index
+      and trailer are missing, e.g. because the process was killed,
+      the frames can still be read in sequence.
+  */
+  class TrajectoryLog
+  {
+  public:
+    /** Section and record kinds */
+    typedef enum {
+      LOG_SKIP = 0, ///< ring padding, never written to file
+      LOG_TICK, ///< end of a logged update, never written to file
+      LOG_POSES,
+      LOG_RANGER,
+      LOG_FIDUCIAL,
+      LOG_BLOBFINDER
+    } log_kind_t;
+
+    /** Frame flag bits */
+    static const uint32_t TRAJLOG_COMPRESSED = 1;
+
+    static const uint32_t TRAJLOG_VERSION = 1;
+
+    /** One row of a LOG_POSES section: a model's local pose, as used
+	by Model::SetPose(), and its velocity if it is a position
+	model. */
+    class PoseRecord
+    {
+    public:
+      uint32_t id;
+      float x, y, z, a;
+      float vx, vy, vz, va;
+    };
+
+    /** One row of a LOG_FIDUCIAL section */
+    class FiducialRecord
+    {
+    public:
+      uint32_t model_id; ///< Model::GetId() of the detected model
+      int32_t id; ///< fiducial id
+      float range, bearing;
+      float geom_x, geom_y, geom_z, geom_a;
+      float pose_x, pose_y, pose_z, pose_a;
+    };
+
+    /** One row of a LOG_BLOBFINDER section */
+    class BlobRecord
+    {
+    public:
+      uint32_t color; ///< packed RGBA, 8 bits each
+      uint32_t left, top, right, bottom;
+      float range;
+    };
+
+    /** Opens [filename] for writing and starts the writer thread,
+	with one ring of [ring_bytes] for each of [rings] event
+	queues. Check Ok() afterwards. */
+    TrajectoryLog( World* world,
+		   const std::string& filename,
+		   unsigned int rings,
+		   size_t ring_bytes,
+		   bool compress,
+		   usec_t interval );
+
+    /** Waits for the writer to drain the rings, writes the index and
+	closes the file. */
+    ~TrajectoryLog();
+
+    /** Returns true if the file was opened successfully */
+    bool Ok() const { return fp != NULL; }
+
+    /** Copy the sensor output of [mod], if it is of a type that has
+	any, into [ring]. Must be called only by the thread that owns
+	[ring]. */
+    void LogModel( unsigned int ring, Model* mod, usec_t time );
+
+    /** Copy the poses of [models] into ring 0 and mark the end of the
+	update at [time]. Called in the main thread at the end of each
+	logged update, after the workers have finished. */
+    void LogPoses( const std::set<Model*>& models, usec_t time );
+
+    /** Finish all open logs. Registered with atexit(3), since Stage
+	usually quits without destroying its worlds. */
+    static void CloseAll();
+
+  private:
+    /** A single-producer, single-consumer byte ring */
+    class Ring
+    {
+    public:
+      uint8_t* buf;
+      size_t size; ///< a power of two
+      volatile size_t head; ///< total bytes written, by the producer
+      volatile size_t tail; ///< total bytes read, by the writer
+      uint64_t stalls; ///< records the producer had to wait to write
+      uint64_t dropped; ///< records too big to log
+      size_t pending; ///< size of the record begun by the producer
+
+      Ring( size_t size );
+      ~Ring();
+    };
+
+    /** The header of each record in a ring. [bytes] includes the
+	header and padding to a multiple of 8. */
+    class RecordHeader
+    {
+    public:
+      uint32_t bytes;
+      uint16_t kind;
+      uint16_t fields; ///< 4-byte words per row
+      uint32_t id;
+      uint32_t count; ///< rows
+      uint64_t time;
+    };
+
+    /** Records of one kind collected for a frame */
+    class Section
+    {
+    public:
+      std::vector<uint32_t> ids, counts;
+      std::vector<uint32_t> words; ///< rows, row-major
+      uint32_t fields;
+
+      Section() : ids(), counts(), words(), fields(0) {}
+      void Clear(){ ids.clear(); counts.clear(); words.clear(); }
+    };
+
+    /** The records for one update, waiting to be written */
+    class Frame
+    {
+    public:
+      usec_t time;
+      Section sections[LOG_BLOBFINDER+1];
+    };
+
+    /** Reserve room for a record of [count] rows of [fields] words
+	in [ring], waiting if the ring is full. Returns a pointer to
+	the rows, or NULL if the record can never fit. */
+    void* Begin( unsigned int ring, log_kind_t kind, uint32_t id,
+		 uint32_t count, uint16_t fields, usec_t time );
+
+    /** Publish the record reserved by the last Begin() on [ring] */
+    void Commit( unsigned int ring );
+
+    /** Wake the writer and sleep the producer briefly, while it
+	waits for space in [r] */
+    void WaitForSpace( Ring* r );
+
+    void WriteHeader( usec_t interval );
+    void WriteFrame( Frame* frame );
+    void WriteIndex();
+
+    /** Read every complete record from the rings into frames, and
+	write out the frames that are complete. Returns the number of
+	records read. */
+    size_t Drain();
+
+    /** Read the records in one ring. Returns the number read. */
+    size_t DrainRing( Ring* r );
+
+    Frame* GetFrame( usec_t time );
+
+    static void* WriterThreadEntry( void* arg );
+    void WriterThread();
+
+    World* world;
+    FILE* fp;
+    std::string filename;
+    bool compress;
+    std::vector<Ring*> rings;
+
+    /** Frames being collected, by time */
+    std::map<usec_t,Frame*> frames;
+    std::vector<Frame*> spare_frames;
+
+    /** the latest update marked complete by LogPoses() */
+    usec_t last_tick;
+    bool have_tick;
+
+    /** buffers reused for every frame written */
+    std::vector<uint8_t> raw, packed;
+
+    /** (time, offset) of each frame written */
+    std::vector<std::pair<uint64_t,uint64_t> > index;
+
+    uint64_t raw_bytes, stored_bytes;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool wake; ///< set with mutex held to wake the writer
+    bool quit; ///< set with mutex held to stop the writer
+
+    static std::set<TrajectoryLog*> open_logs;
+  };
+
+  /** Reads a file written by TrajectoryLog and sets the poses,
+      velocities and sensor data of a World's models from it. Models
+      are matched with the logged ones by name, so the world should
+      be loaded from the worldfile that was logged. Nothing is
+      simulated: models are not updated, so no rays are traced and no
+      controllers are called. */
+  class TrajectoryReplay
+  {
+  public:
+    /** Opens [filename] and reads its header and index. If the index
+	is missing, e.g. because the logging process was killed, the
+	frames are scanned instead. Check Ok() afterwards. */
+    TrajectoryReplay( const std::string& filename );
+    ~TrajectoryReplay();
+
+    /** Returns true if the file was read successfully */
+    bool Ok() const { return ok; }
+
+    /** Match the logged models with the models of [world]. Must be
+	called before Seek(), after the world is loaded. */
+    void Bind( World* world );
+
+    /** The simulated time between logged frames */
+    usec_t Interval() const { return interval; }
+
+    size_t FrameCount() const { return index.size(); }
+
+    /** The simulated time of the first and last frames */
+    usec_t StartTime() const { return index.empty() ? 0 : index.front().first; }
+    usec_t EndTime() const { return index.empty() ? 0 : index.back().first; }
+
+    /** Apply the last frame logged at or before [time], if it is not
+	the frame applied last. Returns false if [time] is after the
+	last frame. */
+    bool Seek( usec_t time );
+
+  private:
+    /** Read frame [f] and apply it to the bound world */
+    bool Apply( size_t f );
+
+    void ApplyPoses( const uint32_t* words, uint32_t rows, uint32_t fields );
+    void ApplyRanger( Model* mod, const uint32_t* words, uint32_t first, uint32_t count );
+    void ApplyFiducial( Model* mod, const uint32_t* words, uint32_t rows,
+			uint32_t first, uint32_t count );
+    void ApplyBlobfinder( Model* mod, const uint32_t* words, uint32_t rows,
+			  uint32_t first, uint32_t count );
+
+    Model* Lookup( uint32_t id ) const
+    { return id < models.size() ? models[id] : NULL; }
+
+    FILE* fp;
+    bool ok;
+    std::string filename;
+    usec_t interval;
+
+    /** name of each logged model, by logged id */
+    std::map<uint32_t,std::string> names;
+
+    /** the bound world's model for each logged id, or NULL */
+    std::vector<Model*> models;
+
+    /** (time, offset) of each frame */
+    std::vector<std::pair<uint64_t,uint64_t> > index;
+
+    /** the frame applied last, or -1 */
+    long current;
+
+    /** buffers reused for every frame read */
+    std::vector<uint8_t> packed, raw;
+  };
+
+}; // namespace Stg
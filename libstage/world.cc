@@ -25,6 +25,41 @@
     show_clock_interval     100
     threads                   1
 
+    log_file                 ""
+    log_interval              1
+    log_compress              1
+    log_buffer             4096
+
+    shm_name                 ""
+    shm_buffer               64
+
+    plan_resolution         0.1
+    plan_clearance            0
+    plan_cache               64
+
+    seed                      0
+    deterministic             0
+
+    pace                      0
+    pace_spin               100
+
+    checkpoint_file          ""
+    checkpoint_interval     600
+
+    replicate
+    (
+      count                   1
+      name                   <template name>
+      pose               [ 0 0 0 0 ]
+      step               [ 1 0 0 0 ]
+      columns                 0
+      row_step           [ 0 1 0 0 ]
+      region             [ xmin xmax ymin ymax ]
+      seed                    0
+
+      <template model>
+    )
+
     @endverbatim
 
     @par Details
@@ -70,6 +105,121 @@
     parallel-enabled high-resolution models, e.g. a laser with
     hundreds or thousands of samples, or lots of models. Defaults to
     1. Values of less than 1 will be forced to 1.
+
+    - log_file <string>\n
+    If set, record the pose and velocity of every model, and the
+    sensor output of models with log_state set, into this binary
+    file. The file is written by a background thread, so logging
+    costs the simulation little. See trajlog.hh for the format.
+
+    - log_interval <int>\n
+    The number of updates between logged updates. Defaults to 1, to
+    log every update.
+
+    - log_compress <int>\n
+    If non-zero (the default), compress the log with zlib, if Stage
+    was built with it.
+
+    - log_buffer <int>\n
+    The size in KB of each thread's log buffer. If the writer falls
+    behind and a buffer fills, the simulation waits for it. Defaults
+    to 4096.
+
+    A log can be replayed with World::StartReplay(), or with Stage's
+    --replay option. Each update then sets the poses, velocities and
+    sensor data of the models from the log, and nothing is simulated:
+    no rays are traced and no controllers are run, so replay can be
+    much faster than the original simulation. The world must be loaded
+    from the logged worldfile, since models are matched by name.
+
+    - shm_name <string>\n
+    If set, serve the models to controllers in other processes through
+    a POSIX shared memory segment of this name. Clients use the C
+    library libstageshm: see stage_shm.h. Much faster than going
+    through Player, so a controller can keep up with updates of a
+    millisecond or less.
+
+    - shm_buffer <int>\n
+    The size in KB of each model's data and command rings in the
+    shared memory segment. Messages that don't fit are dropped.
+    Defaults to 64.
+
+    - plan_resolution <float>\n
+    The cell size in meters of the grid used by the shared path
+    planner, World::GetPlanner(). Each cached field takes 5 bytes per
+    cell of a grid covering all the static obstacles.
+
+    - plan_clearance <float>\n
+    The distance in meters the planner keeps from obstacles where it
+    can, usually a robot's radius. Defaults to 0.
+
+    - plan_cache <int>\n
+    The most goals the planner keeps fields for. Those used least
+    recently are discarded first. Defaults to 64.
+
+    - seed <int>\n
+    Keys the random number streams of the models, see
+    Model::GetRng(). Noise such as the odometry error of position
+    models and the noise of rangers depends only on the seed, the
+    model and the update, so a run repeats exactly with the same seed,
+    whatever the number of threads. Defaults to 0.
+
+    - deterministic <int>\n
+    If non-zero, the results of a run depend only on the worldfile
+    and seed, not on the number of threads: controllers' update
+    callbacks are called in order of model id rather than thread by
+    thread, and the path planner is waited for instead of letting
+    robots move on while it works. Models are always assigned to
+    threads by id, and events at the same time always run in order of
+    id. Use it for regression runs, checking World::Digest() at each
+    update. Defaults to 0.
+
+    - pace <float>\n
+    If greater than 0, Stage without a GUI keeps to this multiple of
+    real time, e.g. to run against controllers on real hardware. Each
+    update waits for an absolute deadline, so timing errors don't
+    accumulate, and the timing is reported by World::GetPaceStats().
+    Defaults to 0, to run as fast as possible. The GUI uses its own
+    speedup property instead. Stage's --pace option overrides this.
+
+    - pace_spin <int>\n
+    The number of microseconds before each paced deadline to stop
+    sleeping and spin instead. Spinning keeps the jitter to a few
+    microseconds, at the cost of a busy CPU for this long per
+    update. Defaults to 100.
+
+    - checkpoint_file <string>\n
+    If set, periodically write a checkpoint of the complete state of
+    the world to this binary file: the clock, every model's pose,
+    velocity, odometry, sensor data, charge and gripper state, and the
+    pending events. Each checkpoint replaces the last, and is copied
+    at the end of an update and written to disk by a background
+    thread. See checkpoint.hh for the format. A checkpoint is restored
+    with World::StartRestore(), or with Stage's --restore option,
+    loading the same worldfile; the controllers start afresh on the
+    restored world.
+
+    - checkpoint_interval <float>\n
+    The number of seconds of wall-clock time between checkpoints.
+    Defaults to 600.
+
+    - replicate ( ... )\n
+    Creates [count] copies of the single model (with its children)
+    nested inside it, without pasting a copy of the model into the
+    worldfile for each, as worldgen.sh does. Every copy is configured
+    from the one parsed template, so this loads much faster than the
+    equivalent generated worldfile. If [name] or the template's own
+    name is set, copy i is named with i appended, e.g. "robot0",
+    "robot1", ...; otherwise copies get the usual generated
+    names. Copies are placed in a grid: copy i is at [pose] plus
+    (i % [columns]) * [step] plus (i / [columns]) * [row_step], and
+    [columns] of 0 puts them all in one row. If [region] is given
+    instead, copies are placed uniformly at random inside it with a
+    random heading, using a generator seeded from [seed], so the
+    placement is repeatable. The copy's pose replaces any pose set in
+    the template. Saving the world leaves the template as it was: the
+    copies share it, so none of their poses is saved, and reloading
+    the world keeps their names and poses.
 	 
     @par More examples
     The Stage source distribution contains several example world files in
@@ -89,12 +239,20 @@
 #include <locale.h> 
 #include <limits.h>
 #include <libgen.h> // for dirname(3)
+#include <errno.h>
+#include <time.h> // for clock_nanosleep(2)
+#include <sys/wait.h> // for waitpid(2)
+
+#include <sstream>
 
 #include "stage.hh"
 #include "file_manager.hh"
 #include "worldfile.hh"
 #include "region.hh"
 #include "option.hh"
+#include "trajlog.hh"
+#include "shmtransport.hh"
+#include "checkpoint.hh"
 using namespace Stg;
 
 // // function objects for comparing model positions
@@ -102,17 +260,20 @@ bool World::ltx::operator()(const Model* a, const Model* b) const
 {
   const meters_t ax( a->GetGlobalPose().x );
   const meters_t bx( b->GetGlobalPose().x );  
-  // break ties using the pointer value to give a unique ordering
-  return ( ax == bx ? a < b : ax < bx ); 
+  // break ties using the id to give a unique ordering
+  return ( ax == bx ? a->GetId() < b->GetId() : ax < bx ); 
 }
 bool World::lty::operator()(const Model* a, const Model* b) const
 {
   const meters_t ay( a->GetGlobalPose().y );
   const meters_t by( b->GetGlobalPose().y );  
-  // break ties using the pointer value ro give a unique ordering
-  return ( ay == by ? a < b : ay < by ); 
+  // break ties using the id to give a unique ordering
+  return ( ay == by ? a->GetId() < b->GetId() : ay < by ); 
+}
+bool World::ltid::operator()(const Model* a, const Model* b) const
+{
+  return( a->GetId() < b->GetId() );
 }
-
 // static data members
 unsigned int World::next_id(0);
 bool World::quit_all(false);
@@ -126,8 +287,20 @@ World::World( const std::string& name,
   // private
   destroy( false ),
   dirty( true ),
+  thread_safe_init( false ),
   models(),
   models_by_name(),
+  bulk_positions(),
+  bulk_rangers(),
+  bulk_range_offsets(),
+  bulk_stale( true ),
+  collision_stats(),
+  last_collision_stats(),
+  pace( 0.0 ),
+  pace_spin( 100 ),
+  pace_deadline( 0 ),
+  pace_stats(),
+  collision_candidates(),
   models_with_fiducials(),
   models_with_fiducials_byx(),
   models_with_fiducials_byy(),
@@ -137,6 +310,7 @@ World::World( const std::string& name,
   show_clock_interval( 100 ), // 10 simulated seconds using defaults
   sync_mutex(),
   threads_working( 0 ),
+  threads_round( 0 ),
   threads_start_cond(),
   threads_done_cond(),
   total_subs( 0 ), 
@@ -153,12 +327,37 @@ World::World( const std::string& name,
   sim_time( 0 ),
   superregions(),
   updates( 0 ),
+  seed( 0 ),
+  models_created( 0 ),
+  deterministic( false ),
   wf( NULL ),
+  trajlog( NULL ),
+  log_interval( 1 ),
+  replay( NULL ),
+  shm( NULL ),
+  checkpointer( NULL ),
+  checkpoint_interval( 600.0 ),
+  checkpoint_due( 0 ),
+  restore( NULL ),
+  trial_count( 0 ),
+  trial_jobs( 1 ),
+  trial_args(),
+  trial_props(),
+  trial_results(),
+  trial( -1 ),
+  trial_failures( 0 ),
+  trial_start( 0 ),
+  trial_values(),
+  planner( NULL ),
+  plan_resolution( 0.1 ),
+  plan_clearance( 0.0 ),
+  plan_cache( 64 ),
   paused( false ),
   event_queues(1), // use 1 thread by default
   pending_update_callbacks(),
   active_energy(),
   active_velocity(),
+  active_wifi(),
   sim_interval( 1e5 ), // 100 msec has proved a good default
   update_cb_count(0)
 {
@@ -185,11 +384,77 @@ World::World( const std::string& name,
 World::~World( void )
 {
   PRINT_DEBUG2( "destroying world %d %s", id, Token() );
-  if( ground ) delete ground;
+  StopShm();
+
+  // before the models go, so it needn't hear about each one
+  if( planner )
+    {
+      delete planner;
+      planner = NULL;
+    }
+
+  StopLog();
+  StopReplay();
+  StopCheckpoints();
+  if( restore ) delete restore;
+
+  // delete the models, the ground among them, while the world they
+  // take themselves out of is whole. ~Ancestor() would be too late.
+  while( ! children.empty() )
+    delete children.back();
+  ground = NULL;
+
   if( wf ) delete wf;
   World::world_set.erase( this );
 }
 
+const BlockGeom* World::InternBlockGeom( const std::vector<point_t>& pts, 
+					 const Bounds& z )
+{
+  typedef std::multimap<uint64_t,BlockGeom*>::iterator iterator;
+
+  const uint64_t hash( BlockGeom::Hash( pts, z ));
+  const std::pair<iterator,iterator> range( block_geoms.equal_range( hash ));
+
+  BlockGeom* geom( NULL );
+  for( iterator it( range.first ); it != range.second && ! geom; ++it )
+    if( it->second->Same( pts, z ))
+      geom = it->second; // we already have this one
+
+  if( geom == NULL )
+    {
+      geom = new BlockGeom( pts, z );
+      block_geoms.insert( range.second, std::make_pair( hash, geom ));
+    }
+  
+  ++geom->refs;
+  return geom;
+}
+
+void World::RetainBlockGeom( const BlockGeom* geom )
+{
+  ++geom->refs;
+}
+
+void World::ReleaseBlockGeom( const BlockGeom* geom )
+{
+  assert( geom->refs > 0 );
+  if( --geom->refs == 0 )
+    {
+      typedef std::multimap<uint64_t,BlockGeom*>::iterator iterator;
+
+      const std::pair<iterator,iterator> range
+	( block_geoms.equal_range( BlockGeom::Hash( geom->pts, geom->z )));
+      for( iterator it( range.first ); it != range.second; ++it )
+	if( it->second == geom )
+	  {
+	    block_geoms.erase( it );
+	    break;
+	  }
+      delete geom;
+    }
+}
+
 SuperRegion* World::CreateSuperRegion( point_int_t origin )
 {
   SuperRegion* sr( new SuperRegion( this, origin ) );
@@ -252,13 +517,21 @@ void* World::update_thread_entry( std::pair<World*,int> *thread_info )
 
   pthread_mutex_lock( &world->sync_mutex );  
 
+  // tell Load() we're ready, then wait for the next round. The lock
+  // is held until we wait, so no round can start unseen
+  uint64_t round( world->threads_round );
+  if( --world->threads_working == 0 )
+    pthread_cond_signal( &world->threads_done_cond );
+
   while( 1 )
     {
       //printf( "thread ID %d waiting for start\n", thread_instance );
       // wait until the main thread signals us
       //puts( "worker waiting for start signal" );
       
-      pthread_cond_wait( &world->threads_start_cond, &world->sync_mutex );
+      while( world->threads_round == round )
+	pthread_cond_wait( &world->threads_start_cond, &world->sync_mutex );
+      round = world->threads_round;
       pthread_mutex_unlock( &world->sync_mutex );
 		
       //printf( "worker %u thread awakes for task %u\n", thread_instance, task );
@@ -285,6 +558,7 @@ void World::AddModel( Model*  mod )
 {
   models.insert( mod );
   models_by_name[mod->token] = mod;
+  bulk_stale = true;
 }
 
 void World::AddModelName( Model* mod, const std::string& name )
@@ -298,6 +572,172 @@ void World::RemoveModel( Model* mod )
   models_by_name.erase( mod->token );
 
   models.erase( mod );
+  bulk_stale = true;
+
+  if( planner )
+    planner->ModelRemoved( mod );
+}
+
+// sorts models by id, which is the order they were created
+static bool IdLess( const Model* a, const Model* b )
+{
+  return a->GetId() < b->GetId();
+}
+
+void World::BuildBulkIndex()
+{
+  if( ! bulk_stale )
+    return;
+
+  // the type is known only once a model is fully constructed, which
+  // is why this isn't kept up to date in AddModel()
+  bulk_positions.clear();
+  bulk_rangers.clear();
+
+  FOR_EACH( it, models )
+    {
+      if( ModelPosition* pos = dynamic_cast<ModelPosition*>(*it) )
+	bulk_positions.push_back( pos );
+      else if( ModelRanger* rgr = dynamic_cast<ModelRanger*>(*it) )
+	bulk_rangers.push_back( rgr );
+    }
+
+  std::sort( bulk_positions.begin(), bulk_positions.end(), IdLess );
+  std::sort( bulk_rangers.begin(), bulk_rangers.end(), IdLess );
+
+  bulk_range_offsets.resize( bulk_rangers.size() + 1 );
+  size_t offset = 0;
+  for( size_t i=0; i<bulk_rangers.size(); ++i )
+    {
+      bulk_range_offsets[i] = offset;
+      FOR_EACH( s, bulk_rangers[i]->GetSensors() )
+	offset += s->sample_count;
+    }
+  bulk_range_offsets.back() = offset;
+
+  bulk_stale = false;
+}
+
+void World::GetBulkPoses( double* x, double* y, double* a )
+{
+  BuildBulkIndex();
+
+  const size_t count = bulk_positions.size();
+  ModelPosition* const* pos = count ? &bulk_positions[0] : NULL;
+
+  for( size_t i=0; i<count; ++i )
+    {
+      const Pose p = pos[i]->GetGlobalPose();
+      if( x ) x[i] = p.x;
+      if( y ) y[i] = p.y;
+      if( a ) a[i] = p.a;
+    }
+}
+
+void World::GetBulkVelocities( double* x, double* y, double* a )
+{
+  BuildBulkIndex();
+
+  const size_t count = bulk_positions.size();
+  ModelPosition* const* pos = count ? &bulk_positions[0] : NULL;
+
+  for( size_t i=0; i<count; ++i )
+    {
+      const Velocity v = pos[i]->GetVelocity();
+      if( x ) x[i] = v.x;
+      if( y ) y[i] = v.y;
+      if( a ) a[i] = v.a;
+    }
+}
+
+void World::GetBulkRanges( float* ranges )
+{
+  BuildBulkIndex();
+
+  if( ranges == NULL )
+    return;
+
+  for( size_t i=0; i<bulk_rangers.size(); ++i )
+    {
+      float* out = ranges + bulk_range_offsets[i];
+
+      FOR_EACH( s, bulk_rangers[i]->GetSensors() )
+	{
+	  // a sensor has no ranges until its first update
+	  const size_t n = std::min( s->ranges.size(), (size_t)s->sample_count );
+	  const meters_t* in = n ? &s->ranges[0] : NULL;
+
+	  for( size_t k=0; k<n; ++k )
+	    out[k] = (float)in[k];
+	  for( size_t k=n; k<s->sample_count; ++k )
+	    out[k] = 0.0f;
+
+	  out += s->sample_count;
+	}
+    }
+}
+
+void World::SetBulkSpeeds( const double* x, const double* y, const double* a )
+{
+  BuildBulkIndex();
+
+  const size_t count = bulk_positions.size();
+  ModelPosition* const* pos = count ? &bulk_positions[0] : NULL;
+
+  for( size_t i=0; i<count; ++i )
+    pos[i]->SetSpeed( x ? x[i] : 0.0,
+		      y ? y[i] : 0.0,
+		      a ? a[i] : 0.0 );
+}
+
+// FNV-1a, folding [len] bytes into [hash]
+static inline void digest_mix( uint64_t& hash, const void* data, size_t len )
+{
+  const uint8_t* bytes( (const uint8_t*)data );
+  for( size_t i(0); i<len; ++i )
+    hash = ( hash ^ bytes[i] ) * 1099511628211ULL;
+}
+
+static inline void digest_pose( uint64_t& hash, const Pose& p )
+{
+  const double v[4] = { p.x, p.y, p.z, p.a };
+  digest_mix( hash, v, sizeof(v) );
+}
+
+uint64_t World::Digest()
+{
+  BuildBulkIndex();
+
+  uint64_t hash( 14695981039346656037ULL );
+  digest_mix( hash, &sim_time, sizeof(sim_time) );
+
+  // in order of id, as the set is in order of address
+  std::vector<Model*> sorted( models.begin(), models.end() );
+  std::sort( sorted.begin(), sorted.end(), ltid() );
+
+  FOR_EACH( it, sorted )
+    {
+      const uint32_t id( (*it)->GetId() );
+      digest_mix( hash, &id, sizeof(id) );
+      digest_pose( hash, (*it)->GetGlobalPose() );
+    }
+
+  FOR_EACH( it, bulk_positions )
+    digest_pose( hash, (*it)->GetVelocity() );
+
+  FOR_EACH( it, bulk_rangers )
+    FOR_EACH( s, (*it)->GetSensors() )
+      if( s->ranges.size() )
+	digest_mix( hash, &s->ranges[0], s->ranges.size() * sizeof(meters_t) );
+
+  return hash;
+}
+
+void World::SetSeed( uint64_t s )
+{
+  seed = s;
+  FOR_EACH( it, models )
+    (*it)->Reseed();
 }
 
 void World::LoadBlock( Worldfile* wf, int entity )
@@ -322,6 +762,7 @@ void World::LoadSensor( Worldfile* wf, int entity )
     PRINT_ERR( "block has no ranger model for a parent" );
   
   rgr->LoadSensor( wf, entity );
+  bulk_stale = true; // the ranger's sample offsets have changed
 }
 
 
@@ -385,6 +826,147 @@ void World::LoadModel( Worldfile* wf, int entity )
   models_by_wfentity[entity] = mod;
 }
 
+// Return one past the last entity in the subtree rooted at
+// [entity]. Entities are numbered in parse order, so a subtree is
+// contiguous and parents always come before their children.
+static int SubtreeEnd( Worldfile* wf, int entity )
+{
+  int end( entity+1 );
+  for( ; end < wf->GetEntityCount(); ++end )
+    {
+      int ancestor( wf->GetEntityParent( end ));
+      while( ancestor > entity )
+	ancestor = wf->GetEntityParent( ancestor );
+
+      if( ancestor != entity )
+	break;
+    }
+  return end;
+}
+
+int World::LoadReplicate( Worldfile* wf, int entity )
+{
+  const int end( SubtreeEnd( wf, entity ));
+  const int templ( entity+1 );
+
+  if( templ == end )
+    {
+      PRINT_WARN1( "replicate entity %d has no model to replicate", entity );
+      return entity;
+    }
+
+  if( SubtreeEnd( wf, templ ) != end )
+    PRINT_WARN1( "replicate entity %d has more than one model; "
+		 "only the first is replicated", entity );
+	
+  const int count( wf->ReadInt( entity, "count", 1 ));
+  const std::string name( wf->ReadString( entity, "name", 
+					  wf->ReadString( templ, "name", "" )));
+
+  Pose origin;
+  if( wf->PropertyExists( entity, "pose" ))
+    origin.Load( wf, entity, "pose" );
+
+  Pose step( 1,0,0,0 );
+  if( wf->PropertyExists( entity, "step" ))
+    step.Load( wf, entity, "step" );
+
+  Pose row_step( 0,1,0,0 );
+  if( wf->PropertyExists( entity, "row_step" ))
+    row_step.Load( wf, entity, "row_step" );
+
+  const int columns( wf->ReadInt( entity, "columns", 0 ));
+
+  const bool random( wf->PropertyExists( entity, "region" ));
+  meters_t xmin(0), xmax(0), ymin(0), ymax(0);
+  if( random )
+    wf->ReadTuple( entity, "region", 0, 4, "llll", &xmin, &xmax, &ymin, &ymax );
+
+  // seed a private generator as srand48() would, so that placement
+  // does not depend on, or disturb, other users of drand48()
+  const unsigned int seed( wf->ReadInt( entity, "seed", 0 ));
+  unsigned short xsubi[3] = { 0x330E, 
+			      (unsigned short)(seed & 0xFFFF), 
+			      (unsigned short)(seed >> 16) };
+  
+  // the template's parent is the replicate's parent
+  models_by_wfentity[entity] = models_by_wfentity[ wf->GetEntityParent( entity )];
+  
+  for( int i(0); i<count; ++i )
+    {
+      const int first( LoadEntity( wf, templ ));
+
+      Model* mod( models_by_wfentity[templ] );
+      if( ! mod )
+	continue;
+
+      // rename the copy before its children are made, as they are
+      // named after it. The template's name would point at the last
+      // copy, so it goes
+      if( name.size() )
+	{
+	  const std::string old( mod->token );
+	  char buf[32];
+	  snprintf( buf, sizeof(buf), "%d", i );
+	  mod->SetToken( name + buf );
+	  
+	  std::map<std::string,Model*>::iterator it( models_by_name.find( old ));
+	  if( it != models_by_name.end() && it->second == mod )
+	    models_by_name.erase( it );
+	}
+
+      for( int e(first+1); e < end; ++e )
+	e = LoadEntity( wf, e );
+
+      for( int e(templ); e < end; ++e )
+	if( models_by_wfentity[e] )
+	  models_by_wfentity[e]->replica = true;
+      
+      Pose pose( origin );
+      if( random )
+	{
+	  pose.x = xmin + erand48( xsubi ) * (xmax-xmin);
+	  pose.y = ymin + erand48( xsubi ) * (ymax-ymin);
+	  pose.a = normalize( erand48( xsubi ) * 2.0 * M_PI );
+	}
+      else
+	{
+	  const int col( columns > 0 ? i % columns : i );
+	  const int row( columns > 0 ? i / columns : 0 );
+	  
+	  pose.x += col * step.x + row * row_step.x;
+	  pose.y += col * step.y + row * row_step.y;
+	  pose.z += col * step.z + row * row_step.z;
+	  pose.a = normalize( pose.a + col * step.a + row * row_step.a );
+	}
+      
+      mod->SetPose( pose );
+    }
+  
+  return end-1;
+}
+
+int World::LoadEntity( Worldfile* wf, int entity )
+{
+  const char *typestr = (char*)wf->GetEntityType(entity);      	  
+  
+  // don't load window entries here
+  if( strcmp( typestr, "window" ) == 0 )
+    {
+      /* do nothing here */
+    }
+  else if( strcmp( typestr, "replicate" ) == 0 )
+    return LoadReplicate( wf, entity );
+  else if( strcmp( typestr, "block" ) == 0 )
+    LoadBlock( wf, entity );
+  else if( strcmp( typestr, "sensor" ) == 0 )
+    LoadSensor( wf, entity );
+  else
+    LoadModel( wf, entity );
+
+  return entity;
+}
+
 void World::Load( const std::string& worldfile_path )
 {
   // note: must call Unload() before calling Load() if a world already
@@ -421,6 +1003,41 @@ void World::Load( const std::string& worldfile_path )
   this->sim_interval =
     1e3 * wf->ReadFloat( entity, "interval_sim", this->sim_interval / 1e3 );
   
+  this->plan_resolution = 
+    std::max( 0.001, wf->ReadLength( entity, "plan_resolution", this->plan_resolution ));
+  this->plan_clearance = 
+    std::max( 0.0, wf->ReadLength( entity, "plan_clearance", this->plan_clearance ));
+  this->plan_cache = 
+    std::max( 1, wf->ReadInt( entity, "plan_cache", this->plan_cache ));
+
+  // before any model exists, as they may draw from their streams
+  this->seed = 
+    (uint64_t)wf->ReadInt( entity, "seed", (int)this->seed );
+
+  this->deterministic = 
+    wf->ReadInt( entity, "deterministic", this->deterministic );
+
+  SetPace( wf->ReadFloat( entity, "pace", this->pace ));
+  SetPaceSpin( std::max( 0, wf->ReadInt( entity, "pace_spin", (int)this->pace_spin )));
+
+  // carry on from the checkpoint's clock, with its seed, so the
+  // models draw the same noise as they would have
+  if( restore )
+    {
+      if( restore->worldfile != wf->filename )
+	PRINT_WARN2( "restoring a checkpoint of \"%s\" into \"%s\"",
+		     restore->worldfile.c_str(), wf->filename.c_str() );
+
+      this->sim_time = restore->sim_time;
+      this->updates = restore->updates;
+      this->seed = restore->seed;
+      this->sim_interval = restore->interval;
+
+      // the bitmaps needn't be read and traced again
+      BlockGroup::bitmap_polys.insert( restore->bitmaps.begin(),
+				       restore->bitmaps.end() );
+    }
+
   this->worker_threads = wf->ReadInt( entity, "threads",  this->worker_threads );  
   if( this->worker_threads < 1 )
     {
@@ -433,7 +1050,37 @@ void World::Load( const std::string& worldfile_path )
   
   //printf( "worker threads %d\n", worker_threads );
   
-  // kick off the threads
+  // Iterate through entitys and create objects of the appropriate type
+  for( int entity(1); entity < wf->GetEntityCount(); ++entity )
+    entity = LoadEntity( wf, entity );
+  
+  FOR_EACH( it, models )
+    {
+      // all this is a hack and shouldn't be necessary
+      (*it)->blockgroup.CalcSize();
+      (*it)->UnMap(updates%2);
+      (*it)->Map(updates%2);
+      // to here
+    }
+
+  // so the controllers start on the restored world
+  if( restore )
+    RestoreModels();
+
+  // everything so far is shared by all the trials, copy-on-write.
+  // The parent just waits for them.
+  if( trial_count && ! ForkTrials() )
+    {
+      putchar( '\n' );
+      return;
+    }
+
+  // kick off the threads. Only after forking, as a trial is a copy
+  // of the forking thread alone
+  pthread_mutex_lock( &sync_mutex );
+  threads_working = worker_threads;
+  pthread_mutex_unlock( &sync_mutex );
+
   for( unsigned int t(0); t<worker_threads; ++t )
     {      
       //normal posix pthread C function pointer
@@ -448,45 +1095,73 @@ void World::Load( const std::string& worldfile_path )
 		      (func_ptr)World::update_thread_entry, 
 		      new std::pair<World*,int>( this, t+1 ) );
     }
+
+  // wait for them all to be waiting, so they see the first update
+  pthread_mutex_lock( &sync_mutex );
+  while( threads_working > 0 )
+    pthread_cond_wait( &threads_done_cond, &sync_mutex );
+  pthread_mutex_unlock( &sync_mutex );
   
   if( worker_threads > 1 ) 
     printf( "[threads %u]", worker_threads );	
   
-  // Iterate through entitys and create objects of the appropriate type
-  for( int entity(1); entity < wf->GetEntityCount(); ++entity )
+  // call all controller init functions. A replayed world has no
+  // controllers to run
+  if( ! replay )
+    FOR_EACH( it, models )
+      (*it)->InitControllers();
+
+  // the controllers' subscriptions start models, which queues them
+  // for their first updates, so this must come after
+  if( restore )
+    RestoreEvents();
+
+  if( replay )
     {
-      const char *typestr = (char*)wf->GetEntityType(entity);      	  
-      
-      // don't load window entries here
-      if( strcmp( typestr, "window" ) == 0 )
-	{
-	  /* do nothing here */
-	}
-      else if( strcmp( typestr, "block" ) == 0 )
-	LoadBlock( wf, entity );
-      else if( strcmp( typestr, "sensor" ) == 0 )
-	LoadSensor( wf, entity );
-      else
-	LoadModel( wf, entity );
+      // replay at the logged rate, starting from the first frame
+      sim_interval = replay->Interval();
+      replay->Bind( this );
+      SeekReplay( replay->StartTime() );
     }
-  
-  // call all controller init functions
-  FOR_EACH( it, models )
-    {
-      // all this is a hack and shouldn't be necessary
-      (*it)->blockgroup.CalcSize();
-      (*it)->UnMap(updates%2);
-      (*it)->Map(updates%2);
-      // to here
 
-      (*it)->InitControllers();
-    }
+  // start logging once all the models exist, so they are all in the
+  // log's table of models
+  this->log_interval = 
+    std::max( 1, wf->ReadInt( entity, "log_interval", this->log_interval ));
+
+  const std::string logfile( wf->ReadString( entity, "log_file", "" ));
+  if( logfile.size() && ! replay ) // don't overwrite the log being replayed
+    StartLog( TrialName( logfile ), 
+	      wf->ReadInt( entity, "log_compress", 1 ),
+	      1024 * wf->ReadInt( entity, "log_buffer", 4096 ) );
+
+  const std::string shmname( wf->ReadString( entity, "shm_name", "" ));
+  if( shmname.size() )
+    StartShm( TrialName( shmname ), 1024 * wf->ReadInt( entity, "shm_buffer", 64 ) );
+
+  const std::string ckptfile( wf->ReadString( entity, "checkpoint_file", "" ));
+  if( ckptfile.size() && ! replay )
+    StartCheckpoints( TrialName( ckptfile ),
+		      wf->ReadFloat( entity, "checkpoint_interval", checkpoint_interval ));
 
   putchar( '\n' );
 }
 
 void World::UnLoad()
 {
+  StopShm();
+
+  // before the models go, so it needn't hear about each one
+  if( planner )
+    {
+      delete planner;
+      planner = NULL;
+    }
+
+  StopLog();
+  StopReplay();
+  StopCheckpoints();
+
   if( wf ) delete wf;
 
   FOR_EACH( it, children )
@@ -567,6 +1242,24 @@ void World::CallUpdateCallbacks()
   // call model CB_UPDATE callbacks queued up by worker threads
   size_t threads( pending_update_callbacks.size() );
   int cbcount( 0 );
+
+  if( deterministic && threads > 1 )
+    {
+      // merge the queues and call back in order of id, so the order
+      // doesn't depend on which thread updated which model
+      std::vector<Model*> pending;
+      for( size_t t(0); t<threads; ++t )
+	{
+	  std::queue<Model*>& q( pending_update_callbacks[t] );
+	  for( ; ! q.empty(); q.pop() )
+	    pending.push_back( q.front() );
+	}
+      std::sort( pending.begin(), pending.end(), ltid() );
+
+      cbcount += pending.size();
+      FOR_EACH( it, pending )
+	(*it)->CallUpdateCallbacks();
+    }
 	
   for( size_t t(0); t<threads; ++t )
     {
@@ -621,20 +1314,39 @@ void World::ConsumeQueue( unsigned int queue_num )
   while( !queue.empty() );
 }
 
+// the monotonic clock, in nanoseconds
+static uint64_t pace_clock()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return( (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec );
+}
+
 bool World::Update()
 {
   //puts( "World::Update()" );
 	
   // if we've run long enough, exit
   if( PastQuitTime() ) 
-    return true;		
+    {
+      if( trial >= 0 && trial_count )
+	FinishTrial();
+      return true;		
+    }
 	
   if( show_clock && ((this->updates % show_clock_interval) == 0) )
     {
       printf( "\r[Stage: %s]", ClockString().c_str() );
       fflush( stdout );
     }
+
+  if( replay )
+    return UpdateReplay();
 	
+  // commands from other processes take effect in this update
+  if( shm )
+    shm->ReadCommands();
+
   sim_time += sim_interval; 
 	
   // rebuild the sets sorted by position on x,y axis
@@ -656,6 +1368,7 @@ bool World::Update()
   // handle all the remaining queues asynchronously in worker threads
   pthread_mutex_lock( &sync_mutex );
   threads_working = worker_threads; 
+  ++threads_round;
   // unblock the workers - they are waiting on this condition var
   //puts( "main thread signalling workers" );
   pthread_cond_broadcast( &threads_start_cond );
@@ -677,32 +1390,122 @@ bool World::Update()
   pthread_mutex_unlock( &sync_mutex );		 
   //puts( "main thread awakes" );
   
-  // TODO: allow threadsafe callbacks to be called in worker
-  // threads		
+  // callbacks registered as thread-safe were already called in the
+  // worker threads
   
   dirty = true; // need redraw 
   
   // this stuff must be done in series here
+
+  // apply changes to static obstacles before controllers plan again
+  if( planner )
+    planner->Sync();
+
+  // hand over the messages the controllers queued
+  if( ! active_wifi.empty() )
+    ModelWifi::Deliver( this );
   
   // world callbacks
   CallUpdateCallbacks();
   
   FOR_EACH( it, active_energy )
     (*it)->UpdateCharge();
+
+  // the workers have finished, so it's safe to read all the poses
+  if( trajlog && (updates % log_interval == 0) )
+    trajlog->LogPoses( models, sim_time );
+
+  if( shm )
+    shm->Publish();
+
+  last_collision_stats = collision_stats;
+  collision_stats = CollisionStats();
   
   ++updates;  
+
+  // every model is done with this update, so the state is consistent
+  if( checkpointer && pace_clock() >= checkpoint_due && ! checkpointer->Busy() )
+    {
+      checkpointer->Write( TakeCheckpoint() );
+      checkpoint_due = pace_clock() + (uint64_t)( checkpoint_interval * 1e9 );
+    }
+
+  // the GUI keeps to its own speedup
+  if( pace > 0.0 && ! IsGUI() )
+    Pace();
     
   return false;
 }
 
-unsigned int World::GetEventQueue( Model* mod ) const
+void World::SetPace( double factor )
 {
-  // todo: there should be a policy that works faster than random, but
-  // random should do a good core load balancing.
+  pace = std::max( 0.0, factor );
+  pace_deadline = 0; // start afresh from the next update
+}
+
+void World::Pace()
+{
+  const uint64_t period( (uint64_t)( sim_interval * 1e3 / pace ));
+  uint64_t now( pace_clock() );
+
+  // deadlines are absolute, so the error of one wait isn't carried
+  // into the next
+  pace_deadline = pace_deadline ? pace_deadline + period : now + period;
+  ++pace_stats.ticks;
 
+  if( now > pace_deadline )
+    {
+      ++pace_stats.overruns;
+
+      // don't try to catch up after falling well behind, e.g. after
+      // the process was stopped
+      if( now - pace_deadline > 10 * period )
+	{
+	  pace_deadline = now;
+	  ++pace_stats.resyncs;
+	}
+    }
+  else
+    {
+      // sleep to shortly before the deadline, then spin, as waking up
+      // can take tens of microseconds
+      const uint64_t spin( pace_spin * 1000ULL );
+      if( pace_deadline - now > spin )
+	{
+	  const uint64_t wake( pace_deadline - spin );
+#ifdef __linux__
+	  struct timespec ts;
+	  ts.tv_sec = wake / 1000000000ULL;
+	  ts.tv_nsec = wake % 1000000000ULL;
+	  while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR )
+	    ;
+#else
+	  usleep( ( wake - now ) / 1000 );
+#endif
+	}
+
+      while( (now = pace_clock()) < pace_deadline )
+	;
+    }
+
+  // record how late we are
+  const usec_t late( ( now - std::min( now, pace_deadline )) / 1000 );
+  pace_stats.max_late = std::max( pace_stats.max_late, late );
+
+  unsigned int bin( 0 );
+  for( usec_t l( late ); l > 0 && bin < PaceStats::BINS-1; l >>= 1 )
+    ++bin;
+  ++pace_stats.late[bin];
+}
+
+unsigned int World::GetEventQueue( Model* mod ) const
+{
   if( worker_threads < 1 )
     return 0;
-  return( (random() % worker_threads) + 1);
+
+  // spread by index rather than at random, so that each model lands
+  // in the same queue in every run
+  return( (mod->GetIndex() % worker_threads) + 1);
 }
 
 Model* World::GetModel( const std::string& name ) const
@@ -885,6 +1688,15 @@ RaytraceResult World::Raytrace( const Ray& r )
 			sample.range = fabs((globx-startx) / cosa) / ppm;
 		      else
 			sample.range = fabs((globy-starty) / sina) / ppm;
+
+		      sample.z = block->global_z;
+
+		      if( r.hits ) // collecting everything along the ray
+			{
+			  r.hits->push_back( sample );
+			  sample = RaytraceResult( r.origin, r.range ); // still a miss
+			  continue;
+			}
 											
 		      return sample;
 		    }				  
@@ -1146,6 +1958,161 @@ void World::Extend( point3_t pt )
   extent.z.max = std::max( extent.z.max, pt.z );
 }
 
+// the bitmap cells whose centers fall in each of [count] cells of
+// [res] meters starting at [origin], or if none do, the one holding
+// the cell's center
+static void CoverCells( meters_t origin, meters_t res, unsigned int count, 
+			double ppm, std::vector<int32_t> cover[2] )
+{
+  cover[0].resize( count );
+  cover[1].resize( count );
+
+  for( unsigned int i=0; i<count; ++i )
+    {
+      const meters_t lo( origin + i * res );
+      int32_t first( (int32_t)ceil( lo * ppm - 0.5 ));
+      int32_t last( (int32_t)ceil( (lo + res) * ppm - 0.5 ));
+
+      if( last <= first )
+	{
+	  first = (int32_t)floor( (lo + res/2.0) * ppm );
+	  last = first + 1;
+	}
+
+      cover[0][i] = first;
+      cover[1][i] = last;
+    }
+}
+
+void World::GetOccupancy( meters_t x, meters_t y, 
+			  unsigned int width, unsigned int height,
+			  meters_t resolution, uint8_t* grid,
+			  bool obstacles_only, const Bounds& z )
+{
+  if( width == 0 || height == 0 )
+    return;
+
+  OccupancyQuery q;
+  q.world = this;
+  q.grid = grid;
+  q.width = width;
+  q.height = height;
+  q.obstacles_only = obstacles_only;
+  q.z = z;
+  q.layer = (updates+1) % 2; // the layer the sensors read
+  q.next_band = 0;
+
+  CoverCells( x, resolution, width, ppm, q.cols );
+  CoverCells( y, resolution, height, ppm, q.rows );
+
+  // bands of about a million bitmap cells
+  const double cells_per_row( (double)( q.cols[1][width-1] - q.cols[0][0] ) *
+			      std::max( 1.0, resolution * ppm ));
+  q.band_rows = (unsigned int)std::max( 1.0, 1e6 / cells_per_row );
+
+  const unsigned int bands( (height + q.band_rows - 1) / q.band_rows );
+  const unsigned int threadcount( std::min( worker_threads, bands ));
+
+  if( threadcount < 2 )
+    {
+      OccupancyBands( &q );
+      return;
+    }
+
+  std::vector<pthread_t> threads( threadcount - 1 );
+  FOR_EACH( it, threads )
+    pthread_create( &*it, NULL, OccupancyThread, &q );
+
+  OccupancyBands( &q ); // this thread helps too
+
+  FOR_EACH( it, threads )
+    pthread_join( *it, NULL );
+}
+
+void* World::OccupancyThread( void* arg )
+{
+  OccupancyQuery* q( static_cast<OccupancyQuery*>( arg ));
+  q->world->OccupancyBands( q );
+  return NULL;
+}
+
+void World::OccupancyBands( OccupancyQuery* q )
+{
+  std::vector<uint8_t> bitmap;
+
+  while( true )
+    {
+      const unsigned int band( __sync_fetch_and_add( &q->next_band, 1 ));
+      const unsigned int row0( band * q->band_rows );
+      if( row0 >= q->height )
+	break;
+      const unsigned int row1( std::min( q->height, row0 + q->band_rows ));
+
+      // the bitmap cells under this band of rows
+      const int32_t bx0( q->cols[0][0] );
+      const int32_t bx1( q->cols[1][q->width-1] );
+      const int32_t by0( q->rows[0][row0] );
+      const int32_t by1( q->rows[1][row1-1] );
+      const int32_t bw( bx1 - bx0 );
+
+      bitmap.assign( (size_t)bw * (by1 - by0), 0 );
+
+      // visit each region overlapping the band once, skipping the empty
+      for( int32_t ry( by0 & ~CELLMASK ); ry < by1; ry += REGIONWIDTH )
+	for( int32_t rx( bx0 & ~CELLMASK ); rx < bx1; rx += REGIONWIDTH )
+	  {
+	    SuperRegion* sr( GetSuperRegion( point_int_t( GETSREG(rx), GETSREG(ry) )));
+	    Region* reg( sr ? sr->GetRegion( GETREG(rx), GETREG(ry) ) : NULL );
+	    if( reg == NULL || reg->count == 0 || reg->cells.empty() )
+	      continue;
+
+	    const int32_t cy0( std::max( ry, by0 )), cy1( std::min( ry + REGIONWIDTH, by1 ));
+	    const int32_t cx0( std::max( rx, bx0 )), cx1( std::min( rx + REGIONWIDTH, bx1 ));
+
+	    for( int32_t cy( cy0 ); cy < cy1; ++cy )
+	      {
+		const Cell* cell( &reg->cells[ GETCELL(cx0) + GETCELL(cy) * REGIONWIDTH ] );
+		uint8_t* out( &bitmap[ (size_t)(cy - by0) * bw + (cx0 - bx0) ] );
+
+		for( int32_t cx( cx0 ); cx < cx1; ++cx, ++cell, ++out )
+		  FOR_EACH( it, cell->blocks[q->layer] )
+		    {
+		      const Block* blk( *it );
+		      if( ( ! q->obstacles_only || blk->group->mod.vis.obstacle_return ) &&
+			  blk->global_z.min <= q->z.max && blk->global_z.max >= q->z.min )
+			{
+			  *out = 1;
+			  break;
+			}
+		    }
+	      }
+	  }
+
+      // count the occupied bitmap cells under each grid cell
+      for( unsigned int r( row0 ); r < row1; ++r )
+	{
+	  const int32_t y0( q->rows[0][r] - by0 ), y1( q->rows[1][r] - by0 );
+	  uint8_t* out( q->grid + (size_t)r * q->width );
+
+	  for( unsigned int c( 0 ); c < q->width; ++c )
+	    {
+	      const int32_t x0( q->cols[0][c] - bx0 ), x1( q->cols[1][c] - bx0 );
+	      unsigned int count( 0 );
+
+	      for( int32_t by( y0 ); by < y1; ++by )
+		{
+		  const uint8_t* in( &bitmap[ (size_t)by * bw ] );
+		  for( int32_t bx( x0 ); bx < x1; ++bx )
+		    count += in[bx];
+		}
+
+	      const unsigned int total( (y1 - y0) * (x1 - x0) );
+	      out[c] = (uint8_t)(( count * 255 + total - 1 ) / total );
+	    }
+	}
+    }
+}
+
 
 void World::AddPowerPack( PowerPack* pp )
 {
@@ -1166,13 +2133,548 @@ void World:: RegisterOption( Option* opt )
 
 void World::Log( Model* mod )
 {
-  //LogEntry( sim_time, mod);
-  //printf( "log entry count %u\n", (unsigned int)LogEntry::Count() );
-  //LogEntry::Print();
+  // each thread writes into the log's buffer for its own queue
+  if( trajlog && (updates % log_interval == 0) )
+    trajlog->LogModel( mod->event_queue_num, mod, sim_time );
+}
+
+bool World::StartLog( const std::string& filename, 
+		      bool compress,
+		      size_t buffer_bytes )
+{
+  StopLog();
+
+  trajlog = new TrajectoryLog( this, 
+			       filename,
+			       event_queues.size(), // one buffer per thread
+			       buffer_bytes,
+			       compress,
+			       sim_interval * log_interval );
+  if( ! trajlog->Ok() )
+    {
+      delete trajlog;
+      trajlog = NULL;
+      return false;
+    }
+  
+  printf( " [Logging to %s]", filename.c_str() );
+  return true;
+}
+
+void World::StopLog()
+{
+  if( trajlog )
+    {
+      delete trajlog;
+      trajlog = NULL;
+    }
+}
+
+bool World::StartShm( const std::string& name, size_t ring_bytes )
+{
+  StopShm();
+
+  shm = new ShmTransport( this, name, ring_bytes );
+  if( ! shm->Ok() )
+    {
+      delete shm;
+      shm = NULL;
+      return false;
+    }
+
+  return true;
+}
+
+void World::StopShm()
+{
+  if( shm )
+    {
+      delete shm;
+      shm = NULL;
+    }
+}
+
+Planner* World::GetPlanner()
+{
+  if( planner == NULL )
+    planner = new Planner( this, plan_resolution, plan_clearance, 
+			   plan_cache, worker_threads );
+  return planner;
+}
+
+bool World::StartReplay( const std::string& filename )
+{
+  StopReplay();
+
+  replay = new TrajectoryReplay( filename );
+  if( ! replay->Ok() )
+    {
+      delete replay;
+      replay = NULL;
+      return false;
+    }
+
+  printf( " [Replaying %s: %lu frames]", 
+	  filename.c_str(), (unsigned long)replay->FrameCount() );
+
+  // if the world is already loaded, start replaying now, otherwise
+  // Load() will
+  if( wf )
+    {
+      sim_interval = replay->Interval();
+      replay->Bind( this );
+      SeekReplay( replay->StartTime() );
+    }
+
+  return true;
+}
+
+void World::StopReplay()
+{
+  if( replay )
+    {
+      delete replay;
+      replay = NULL;
+    }
+}
+
+bool World::SeekReplay( usec_t time )
+{
+  if( ! replay )
+    return false;
+
+  sim_time = time;
+  const bool ok = replay->Seek( time );
+
+  // moving models doesn't mark the world dirty
+  dirty = true;
+  return ok;
+}
+
+bool World::UpdateReplay()
+{
+  const bool more = SeekReplay( sim_time + sim_interval );
+  ++updates;
+
+  if( ! more )
+    {
+      // stay on the last frame
+      sim_time = replay->EndTime();
+      return true;
+    }
+
+  return false;
+}
+
+Checkpoint* World::TakeCheckpoint() const
+{
+  Checkpoint* ckpt( new Checkpoint );
+
+  ckpt->sim_time = sim_time;
+  ckpt->updates = updates;
+  ckpt->seed = seed;
+  ckpt->interval = sim_interval;
+  ckpt->worldfile = wf ? wf->filename : std::string();
+  ckpt->bitmaps = BlockGroup::bitmap_polys;
+
+  // in order of id, so the same state always gives the same file
+  std::vector<Model*> byid( models.begin(), models.end() );
+  std::sort( byid.begin(), byid.end(), ltid() );
+
+  ckpt->models.resize( byid.size() );
+  for( size_t i=0; i<byid.size(); ++i )
+    {
+      const Model* mod( byid[i] );
+      Checkpoint::ModelRecord& rec( ckpt->models[i] );
+
+      rec.name = mod->TokenStr();
+      rec.type = mod->GetModelType();
+      rec.parent = mod->parent ? mod->parent->TokenStr() : std::string();
+      rec.subs = mod->subs;
+
+      StateWriter out;
+      mod->SaveState( out );
+      rec.state.swap( out.bytes );
+    }
+
+  FOR_EACH( q, event_queues )
+    {
+      std::priority_queue<Event> queue( *q );
+      for( ; ! queue.empty(); queue.pop() )
+	{
+	  const Event& ev( queue.top() );
+	  if( ev.cb == Model::UpdateWrapper )
+	    ckpt->events.push_back( Checkpoint::EventRecord( ev.mod->TokenStr(), ev.time ));
+	  else
+	    PRINT_WARN1( "model %s has an event that can't be checkpointed",
+			 ev.mod->Token() );
+	}
+    }
+
+  return ckpt;
+}
+
+bool World::SaveCheckpoint( const std::string& filename )
+{
+  Checkpoint* ckpt( TakeCheckpoint() );
+  const bool ok( ckpt->Write( filename ));
+  delete ckpt;
+  return ok;
+}
+
+void World::StartCheckpoints( const std::string& filename, double interval )
+{
+  StopCheckpoints();
+
+  checkpoint_interval = std::max( 0.0, interval );
+  checkpoint_due = pace_clock() + (uint64_t)( checkpoint_interval * 1e9 );
+  checkpointer = new CheckpointWriter( this, filename );
+
+  printf( " [Checkpointing to %s every %.0f s]", filename.c_str(), checkpoint_interval );
+}
+
+void World::StopCheckpoints()
+{
+  if( checkpointer )
+    {
+      delete checkpointer;
+      checkpointer = NULL;
+    }
+}
+
+bool World::StartRestore( const std::string& filename )
+{
+  if( restore )
+    delete restore;
+
+  restore = new Checkpoint;
+  if( ! restore->Read( filename ))
+    {
+      delete restore;
+      restore = NULL;
+      return false;
+    }
+
+  printf( " [Restoring %s at %.3f s]", filename.c_str(), restore->sim_time / 1e6 );
+  return true;
+}
+
+void World::RestoreModels()
+{
+  // parents first, as a model's pose is relative to its parent
+  FOR_EACH( it, restore->models )
+    {
+      Model* mod( GetModel( it->name ));
+      if( mod == NULL )
+	{
+	  PRINT_WARN1( "checkpointed model %s is not in the worldfile", it->name.c_str() );
+	  continue;
+	}
+
+      Model* parent( it->parent.empty() ? NULL : GetModel( it->parent ));
+      if( parent != mod->parent )
+	mod->SetParent( parent );
+    }
+
+  FOR_EACH( it, restore->models )
+    {
+      Model* mod( GetModel( it->name ));
+      if( mod == NULL )
+	continue;
+
+      if( mod->GetModelType() != it->type )
+	{
+	  PRINT_WARN3( "checkpointed model %s is a %s, not a %s. Not restored.",
+		       it->name.c_str(), it->type.c_str(), mod->GetModelType().c_str() );
+	  continue;
+	}
+
+      StateReader in( it->state.empty() ? NULL : &it->state[0], it->state.size() );
+      mod->LoadState( in );
+
+      if( ! in.Ok() )
+	PRINT_WARN1( "checkpointed state of model %s is incomplete", it->name.c_str() );
+    }
+}
+
+void World::RestoreEvents()
+{
+  FOR_EACH( it, restore->models )
+    {
+      Model* mod( GetModel( it->name ));
+      if( mod == NULL )
+	continue;
+
+      while( mod->subs < it->subs )
+	mod->Subscribe();
+      while( mod->subs > it->subs && mod->subs > 0 )
+	mod->Unsubscribe();
+    }
+
+  // replace the events queued by starting the models with the ones
+  // that were pending
+  FOR_EACH( q, event_queues )
+    *q = std::priority_queue<Event>();
+
+  FOR_EACH( it, restore->events )
+    {
+      Model* mod( GetModel( it->name ));
+      if( mod == NULL )
+	continue;
+
+      // a model shut down since its last event has not been started
+      // here, so give it the queue it would have had
+      mod->event_queue_num = mod->thread_safe ? GetEventQueue( mod ) : 0;
+      event_queues[mod->event_queue_num].push( Event( it->time, mod, Model::UpdateWrapper, NULL ));
+    }
+
+  delete restore;
+  restore = NULL;
+}
+
+void World::SetTrials( unsigned int count, 
+			unsigned int jobs,
+			const std::vector<std::string>& args,
+			const std::string& results )
+{
+  trial_count = count;
+  trial_jobs = std::max( 1U, jobs );
+  trial_args = args;
+  trial_results = results;
+}
+
+bool World::SetTrialProperties( const std::vector<std::string>& props )
+{
+  std::vector<std::map<std::string,double> > parsed;
+
+  FOR_EACH( it, props )
+    {
+      std::map<std::string,double> values;
+      std::istringstream in( *it );
+      std::string name, value;
+
+      while( in >> name )
+	{
+	  char* end( NULL );
+	  double v( 0 );
+	  if( in >> value )
+	    v = strtod( value.c_str(), &end );
+
+	  if( end == NULL || *end != '\0' || end == value.c_str() )
+	    {
+	      PRINT_ERR2( "trial properties \"%s\": expected a number after %s",
+			  it->c_str(), name.c_str() );
+	      return false;
+	    }
+
+	  if( name != "seed" && name != "interval_sim" && name != "quit_time" )
+	    {
+	      PRINT_ERR1( "trial properties: can't vary world property \"%s\" "
+			  "(only seed, interval_sim and quit_time)", name.c_str() );
+	      return false;
+	    }
+
+	  if( v < 0 || ( name == "interval_sim" && v == 0 ))
+	    {
+	      PRINT_ERR2( "trial properties: bad %s %s", name.c_str(), value.c_str() );
+	      return false;
+	    }
+
+	  values[name] = v;
+	}
+
+      parsed.push_back( values );
+    }
+
+  trial_props = parsed;
+  return true;
+}
+
+const std::map<std::string,double>* World::TrialProperties( unsigned int t ) const
+{
+  return( trial_props.empty() ? NULL : &trial_props[ t % trial_props.size() ] );
+}
+
+void World::SetTrialResult( const std::string& key, double value )
+{
+  if( trial >= 0 )
+    trial_values[key] = value;
+}
+
+std::string World::TrialName( const std::string& name ) const
+{
+  if( trial < 0 || name.empty() )
+    return name;
+
+  char suffix[16];
+  snprintf( suffix, sizeof(suffix), ".%d", trial );
+  return name + suffix;
+}
+
+bool World::ForkTrials()
+{
+  // every trial must stop, by the worldfile or its own quit_time
+  for( unsigned int t=0; t<trial_count; ++t )
+    {
+      const std::map<std::string,double>* props( TrialProperties( t ));
+      const bool own( props && props->count( "quit_time" ));
+
+      if( own ? props->find( "quit_time" )->second == 0 : quit_time == 0 )
+	{
+	  PRINT_ERR1( "trials need the world's quit_time to be set (trial %u)", t );
+	  trial_failures = trial_count;
+	  return false;
+	}
+    }
+
+  const uint64_t base_seed( seed );
+  const uint64_t start( pace_clock() );
+
+  std::map<pid_t,unsigned int> running;
+  unsigned int next( 0 );
+
+  printf( " [Trials %u, %u at once]", trial_count, trial_jobs );
+  
+  // the children inherit stdio's buffers
+  fflush( stdout );
+  fflush( stderr );
+
+  while( next < trial_count || ! running.empty() )
+    {
+      if( next < trial_count && running.size() < trial_jobs )
+	{
+	  const pid_t pid( fork() );
+
+	  if( pid == 0 )
+	    {
+	      trial = next;
+	      SetSeed( base_seed + next );
+
+	      const std::map<std::string,double>* props( TrialProperties( next ));
+	      if( props )
+		FOR_EACH( it, *props )
+		  {
+		    if( it->first == "seed" )
+		      SetSeed( (uint64_t)it->second );
+		    else if( it->first == "interval_sim" )
+		      sim_interval = (usec_t)( 1e3 * it->second ); // msec, as in the worldfile
+		    else if( it->first == "quit_time" )
+		      quit_time = (usec_t)( million * it->second );
+		  }
+
+	      if( ! trial_args.empty() )
+		{
+		  ctrlargs = trial_args[ next % trial_args.size() ];
+		  FOR_EACH( it, models )
+		    (*it)->SetControllerArgs( ctrlargs );
+		}
+
+	      trial_start = pace_clock();
+	      printf( "\n [Trial %d: seed %llu]", trial, (unsigned long long)seed );
+	      return true;
+	    }
+
+	  if( pid < 0 )
+	    {
+	      PRINT_ERR2( "failed to fork trial %u: %s", next, strerror(errno) );
+	      ++trial_failures;
+	    }
+	  else
+	    running[pid] = next;
+
+	  ++next;
+	  continue;
+	}
+
+      int status;
+      const pid_t pid( waitpid( -1, &status, 0 ));
+      if( pid < 0 )
+	{
+	  if( errno == EINTR )
+	    continue;
+	  PRINT_ERR1( "failed waiting for trials: %s", strerror(errno) );
+	  break;
+	}
+
+      std::map<pid_t,unsigned int>::iterator it( running.find( pid ));
+      if( it == running.end() )
+	continue;
+
+      const bool ok( WIFEXITED(status) && WEXITSTATUS(status) == 0 );
+      if( ! ok )
+	{
+	  ++trial_failures;
+	  if( WIFSIGNALED(status) )
+	    printf( "\n [Trial %u failed: signal %d]", it->second, WTERMSIG(status) );
+	  else
+	    printf( "\n [Trial %u failed: status %d]", it->second, WEXITSTATUS(status) );
+	  fflush( stdout );
+	}
+
+      running.erase( it );
+    }
+
+  printf( "\n [Trials: %u of %u succeeded in %.3f s]",
+	  trial_count - trial_failures, trial_count,
+	  (pace_clock() - start) / 1e9 );
+
+  trial_count = 0;
+  return false;
+}
+
+void World::FinishTrial()
+{
+  // only once, however often Update() is called after quit_time
+  trial_count = 0;
+
+  const std::string filename( TrialName( trial_results ));
+  FILE* fp( fopen( filename.c_str(), "w" ));
+  if( fp == NULL )
+    {
+      PRINT_ERR2( "failed to open trial results file \"%s\": %s",
+		  filename.c_str(), strerror(errno) );
+      exit( EXIT_FAILURE ); // so the parent counts this trial as failed
+    }
+
+  fprintf( fp, "trial %d\n", trial );
+  fprintf( fp, "seed %llu\n", (unsigned long long)seed );
+  fprintf( fp, "args %s\n", ctrlargs.c_str() );
+  fprintf( fp, "interval_sim %.3f\n", sim_interval / 1e3 );
+  fprintf( fp, "sim_time %.6f\n", sim_time / 1e6 );
+  fprintf( fp, "updates %llu\n", (unsigned long long)updates );
+  fprintf( fp, "wall_time %.6f\n", (pace_clock() - trial_start) / 1e9 );
+  fprintf( fp, "digest %016llx\n", (unsigned long long)Digest() );
+
+  FOR_EACH( it, trial_values )
+    fprintf( fp, "result %s %.17g\n", it->first.c_str(), it->second );
+
+  // in order of id, so the same trial always gives the same file
+  BuildBulkIndex();
+
+  FOR_EACH( it, bulk_positions )
+    {
+      const ModelPosition* pos( *it );
+      const Pose p( pos->GetGlobalPose() );
+      fprintf( fp, "pose %s %.6f %.6f %.6f %.6f %d\n",
+	       pos->Token(), p.x, p.y, p.z, p.a, pos->Stalled() ? 1 : 0 );
+    }
+
+  const bool failed( ferror( fp ) != 0 );
+  if( fclose( fp ) != 0 || failed )
+    {
+      PRINT_ERR2( "failed to write trial results file \"%s\": %s",
+		  filename.c_str(), strerror(errno) );
+      exit( EXIT_FAILURE );
+    }
 }
 
 bool World::Event::operator<( const Event& other ) const 
 {
-  return( time > other.time );
+  // the earliest event, then the lowest id, is on top
+  if( time != other.time )
+    return( time > other.time );
+  if( mod != other.mod )
+    return( mod->GetId() > other.mod->GetId() );
+  return( cb > other.cb );
 }
 
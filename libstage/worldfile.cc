@@ -37,6 +37,8 @@
 #include <unistd.h>
 #include <math.h>
 #include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 //#define DEBUG
 
@@ -63,9 +65,17 @@ using namespace Stg;
 // Default constructor
 Worldfile::Worldfile() :
   tokens(),
+  mappings(),
+  includes(),
+  pool(),
+  pool_next( NULL ),
+  pool_free( 0 ),
   macros(),
   entities(),
-	properties(),
+  properties(),
+  atoms(),
+  atom_table(),
+  property_table(),
   filename(),
   unit_length( 1.0 ),
   unit_angle( M_PI / 180.0 )
@@ -138,16 +148,21 @@ bool Worldfile::Load(const std::string& filename )
 
   ClearTokens();
 
+  // Map the whole file into memory; the tokens refer to it directly
+  const char *buf = NULL;
+  size_t len = 0;
+  const bool mapped = MapFile(file, &buf, &len);
+  fclose(file);
+  if (!mapped)
+    return false;
+
   // Read tokens from the file
-  if (!LoadTokens(file, 0))
+  if (!LoadTokens(buf, len, 0))
     {
       //DumpTokens();
-      fclose(file);
       return false;
     }
 
-  fclose(file);
-
   // Parse the tokens to identify entities
   if (!ParseTokens())
     {
@@ -227,10 +242,10 @@ bool Worldfile::WarnUnused()
   
   FOR_EACH( it, properties )
     {
-      if( ! it->second->used )
+      if( ! (*it)->used )
 	{
 	  PRINT_WARN3("worldfile %s:%d : property [%s] is defined but not used",
-		      this->filename.c_str(), it->second->line, it->second->name.c_str());
+		      this->filename.c_str(), (*it)->line, (*it)->name.c_str());
 	  unused = true;
 	}
     }
@@ -240,90 +255,78 @@ bool Worldfile::WarnUnused()
 
 
 ///////////////////////////////////////////////////////////////////////////
-// Load tokens from a file.
-bool Worldfile::LoadTokens(FILE *file, int include)
+// Load tokens from a memory buffer. This is a single pass over the
+// buffer: whitespace and comment tokens point straight into it, while
+// word, number and string values are copied into the string pool so
+// they can be handed out as C strings.
+bool Worldfile::LoadTokens(const char *buf, size_t len, int include)
 {
-  int ch;
-  int line;
-  char token[256];
+  const char *pos = buf;
+  const char *end = buf + len;
+  int line = 1;
 
-  line = 1;
-
-  while (true)
+  while (pos < end)
     {
-      ch = fgetc(file);
-      if (ch == EOF)
-	break;
+      const int ch = (unsigned char)*pos;
 
-      if ((char) ch == '#')
+      if (ch == '#')
 	{
-	  ungetc(ch, file);
-	  if (!LoadTokenComment(file, &line, include))
+	  if (!LoadTokenComment(&pos, end, &line, include))
 	    return false;
 	}
       else if (isalpha(ch))
 	{
-	  ungetc(ch, file);
-	  if (!LoadTokenWord(file, &line, include))
+	  if (!LoadTokenWord(&pos, end, &line, include))
 	    return false;
 	}
-      else if (strchr("+-.0123456789", ch))
+      else if (ch && strchr("+-.0123456789", ch))
 	{
-	  ungetc(ch, file);
-	  if (!LoadTokenNum(file, &line, include))
+	  if (!LoadTokenNum(&pos, end, &line, include))
 	    return false;
 	}
       else if (isblank(ch))
 	{
-	  ungetc(ch, file);
-	  if (!LoadTokenSpace(file, &line, include))
+	  if (!LoadTokenSpace(&pos, end, &line, include))
 	    return false;
 	}
       else if (ch == '"')
 	{
-	  ungetc(ch, file);
-	  if (!LoadTokenString(file, &line, include))
+	  if (!LoadTokenString(&pos, end, &line, include))
 	    return false;
 	}
-      else if (strchr("(", ch))
+      else if (ch == '(')
 	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenOpenEntity, token, include);
+	  AddToken(TokenOpenEntity, "(", 1, include);
+	  pos++;
 	}
-      else if (strchr(")", ch))
+      else if (ch == ')')
 	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenCloseEntity, token, include);
+	  AddToken(TokenCloseEntity, ")", 1, include);
+	  pos++;
 	}
-      else if (strchr("[", ch))
+      else if (ch == '[')
 	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenOpenTuple, token, include);
+	  AddToken(TokenOpenTuple, "[", 1, include);
+	  pos++;
 	}
-      else if (strchr("]", ch))
+      else if (ch == ']')
 	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenCloseTuple, token, include);
+	  AddToken(TokenCloseTuple, "]", 1, include);
+	  pos++;
 	}
       else if ( 0x0d == ch )
 	{
-	  ch = fgetc(file);
-	  if ( 0x0a != ch )
-	    ungetc(ch, file);
+	  if (++pos < end && 0x0a == *pos)
+	    pos++;
 	  line++;
-	  AddToken(TokenEOL, "\n", include);
+	  AddToken(TokenEOL, "\n", 1, include);
 	}
       else if ( 0x0a == ch )
 	{
-	  ch = fgetc(file);
-	  if ( 0x0d != ch )
-	    ungetc(ch, file);
+	  if (++pos < end && 0x0d == *pos)
+	    pos++;
 	  line++;
-	  AddToken(TokenEOL, "\n", include);
+	  AddToken(TokenEOL, "\n", 1, include);
 	}
       else
 	{
@@ -338,280 +341,211 @@ bool Worldfile::LoadTokens(FILE *file, int include)
 
 ///////////////////////////////////////////////////////////////////////////
 // Read in a comment token
-bool Worldfile::LoadTokenComment(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenComment(const char **pos, const char *end, int *line, int include)
 {
-  char token[256];
-  int len;
-  int ch;
+  const char *start = *pos;
 
-  len = 0;
-  memset(token, 0, sizeof(token));
-
-  while (true)
-    {
-      ch = fgetc(file);
+  while (*pos < end && 0x0a != **pos && 0x0d != **pos)
+    (*pos)++;
 
-      if (ch == EOF)
-	{
-	  AddToken(TokenComment, token, include);
-	  return true;
-	}
-      else if ( 0x0a == ch || 0x0d == ch )
-	{
-	  ungetc(ch, file);
-	  AddToken(TokenComment, token, include);
-	  return true;
-	}
-      else
-	token[len++] = ch;
-    }
+  AddToken(TokenComment, start, *pos - start, include);
   return true;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Read in a word token
-bool Worldfile::LoadTokenWord(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenWord(const char **pos, const char *end, int *line, int include)
 {
-  char token[256];
-  int len;
-  int ch;
-
-  len = 0;
-  memset(token, 0, sizeof(token));
+  const char *start = *pos;
 
-  while (true)
+  while (*pos < end)
     {
-      ch = fgetc(file);
-
-      if (ch == EOF)
-	{
-	  AddToken(TokenWord, token, include);
-	  return true;
-	}
-      else if (isalpha(ch) || isdigit(ch) || strchr(".-_[]", ch))
-	{
-	  token[len++] = ch;
-	}
-      else
-	{
-	  if (strcmp(token, "include") == 0)
-	    {
-	      ungetc(ch, file);
-	      AddToken(TokenWord, token, include);
-	      if (!LoadTokenInclude(file, line, include))
-		return false;
-	    }
-	  else
-	    {
-	      ungetc(ch, file);
-	      AddToken(TokenWord, token, include);
-	    }
-	  return true;
-	}
+      const int ch = (unsigned char)**pos;
+      if (!(isalpha(ch) || isdigit(ch) || (ch && strchr(".-_[]", ch))))
+	break;
+      (*pos)++;
     }
-  assert(false);
-  return false;
+
+  const size_t len = *pos - start;
+  AddToken(TokenWord, PoolString(start, len), len, include);
+
+  // an include needs something after it; at the end of the file the
+  // word is left for the parser to complain about
+  if (*pos < end && len == 7 && strncmp(start, "include", 7) == 0)
+    return LoadTokenInclude(pos, end, line, include);
+
+  return true;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Load an include token; this will load the include file.
-bool Worldfile::LoadTokenInclude(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenInclude(const char **pos, const char *end, int *line, int include)
 {
-  int ch;
-  const char *filename;
-  char *fullpath;
-
-  ch = fgetc(file);
-
-  if (ch == EOF)
+  if (*pos >= end)
     {
       TOKEN_ERR("incomplete include statement", *line);
       return false;
     }
-  else if (!isblank(ch))
+  else if (!isblank(**pos))
     {
       TOKEN_ERR("syntax error in include statement", *line);
       return false;
     }
 
-  ungetc(ch, file);
-  if (!LoadTokenSpace(file, line, include))
+  if (!LoadTokenSpace(pos, end, line, include))
     return false;
 
-  ch = fgetc(file);
-
-  if (ch == EOF)
+  if (*pos >= end)
     {
       TOKEN_ERR("incomplete include statement", *line);
       return false;
     }
-  else if (ch != '"')
+  else if (**pos != '"')
     {
       TOKEN_ERR("syntax error in include statement", *line);
       return false;
     }
 
-  ungetc(ch, file);
-  if (!LoadTokenString(file, line, include))
+  if (!LoadTokenString(pos, end, line, include))
     return false;
 
   // This is the basic filename
-  filename = GetTokenValue(this->tokens.size() - 1);
+  const std::string filename = GetTokenValue(this->tokens.size() - 1);
+  std::string fullpath;
 
   // Now do some manipulation.  If its a relative path,
   // we append the path of the world file.
   if (filename[0] == '/' || filename[0] == '~')
     {
-      fullpath = strdup(filename);
+      fullpath = filename;
     }
   else if (this->filename[0] == '/' || this->filename[0] == '~')
     {
       // Note that dirname() modifies the contents, so
       // we need to make a copy of the filename.
-      // There's no bounds-checking, but what the heck.
       char *tmp = strdup(this->filename.c_str());
-      fullpath = new char[PATH_MAX];
-      memset(fullpath, 0, PATH_MAX);
-      strcat( fullpath, dirname(tmp));
-      strcat( fullpath, "/" );
-      strcat( fullpath, filename );
-      assert(strlen(fullpath) + 1 < PATH_MAX);
+      fullpath = std::string(dirname(tmp)) + "/" + filename;
       free(tmp);
     }
   else
     {
       // Note that dirname() modifies the contents, so
       // we need to make a copy of the filename.
-      // There's no bounds-checking, but what the heck.
+      char cwd[PATH_MAX];
+      if (!getcwd(cwd, PATH_MAX))
+	{
+	  PRINT_ERR2("unable to get cwd %d: %s", errno, strerror(errno));
+	  return false;
+	}
       char *tmp = strdup(this->filename.c_str());
-      fullpath = new char[PATH_MAX];
-      char* dummy = getcwd(fullpath, PATH_MAX);
-      if (!dummy)
-		  {
-			 PRINT_ERR2("unable to get cwd %d: %s", errno, strerror(errno));
-			 if(tmp) free(tmp);
-			 delete[] fullpath;
-			 return false;
-      }
-      strcat( fullpath, "/" );
-      strcat( fullpath, dirname(tmp));
-      strcat( fullpath, "/" );
-      strcat( fullpath, filename );
-      assert(strlen(fullpath) + 1 < PATH_MAX);
+      fullpath = std::string(cwd) + "/" + dirname(tmp) + "/" + filename;
       free(tmp);
     }
 
-  printf( "[Include %s]", filename );
+  printf( "[Include %s]", filename.c_str() );
   fflush( stdout );
 
-  // Open the include file
-  FILE *infile = FileOpen(fullpath, "r");
-  if (!infile)
+  std::map<std::string,CInclude>::iterator it = this->includes.find(fullpath);
+  if (it != this->includes.end())
     {
-      PRINT_ERR2("unable to open include file %s : %s",
-		 fullpath, strerror(errno));
-      //free(fullpath);
-		delete[] fullpath;
-      return false;
+      // We have lexed this file before, so copy its tokens instead of
+      // reading it again. Reserve first: the source range is in the
+      // same vector we append to.
+      const CInclude inc = it->second;
+      this->tokens.reserve(this->tokens.size() + 1 + inc.last - inc.first);
+
+      // Terminate the include line
+      AddToken(TokenEOL, "\n", 1, include);
+
+      for (int i = inc.first; i < inc.last; i++)
+	{
+	  CToken token = this->tokens[i];
+	  token.include += (include + 1) - inc.include;
+	  this->tokens.push_back(token);
+	}
     }
+  else
+    {
+      // Open the include file
+      FILE *infile = FileOpen(fullpath, "r");
+      if (!infile)
+	{
+	  PRINT_ERR2("unable to open include file %s : %s",
+		     fullpath.c_str(), strerror(errno));
+	  return false;
+	}
 
-  // Terminate the include line
-  AddToken(TokenEOL, "\n", include);
+      const char *buf = NULL;
+      size_t len = 0;
+      const bool mapped = MapFile(infile, &buf, &len);
+      fclose( infile );
+      if (!mapped)
+	return false;
 
-  //DumpTokens();
+      // Terminate the include line
+      AddToken(TokenEOL, "\n", 1, include);
 
-  // Read tokens from the file
-  if (!LoadTokens(infile, include + 1))
-    {
-		fclose( infile );
-      //DumpTokens();
-      //free(fullpath);
-		delete[] fullpath;
-      return false;
-    }
+      // Read tokens from the file
+      const int first = this->tokens.size();
+      if (!LoadTokens(buf, len, include + 1))
+	return false;
 
-  // done with the include file
-  fclose( infile );
+      this->includes.insert(std::make_pair(fullpath, CInclude(first, this->tokens.size(), include + 1)));
+    }
 
   // consume the rest of the include line XX a bit of a hack - assumes
   // that an include is the last thing on a line
-  while ( ch != '\n' )
-    ch = fgetc(file);
+  while (*pos < end && **pos != '\n')
+    (*pos)++;
+  if (*pos < end)
+    {
+      (*pos)++;
+      (*line)++;
+    }
 
-  delete[] fullpath;
   return true;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Read in a number token
-bool Worldfile::LoadTokenNum(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenNum(const char **pos, const char *end, int *line, int include)
 {
-  char token[256];
-  int len;
-  int ch;
+  const char *start = *pos;
 
-  len = 0;
-  memset(token, 0, sizeof(token));
+  while (*pos < end && **pos && strchr("+-.0123456789", **pos))
+    (*pos)++;
 
-  while (true)
-    {
-      ch = fgetc(file);
-
-      if (ch == EOF)
-	{
-	  AddToken(TokenNum, token, include);
-	  return true;
-	}
-      else if (strchr("+-.0123456789", ch))
-	{
-	  token[len++] = ch;
-	}
-      else
-	{
-	  AddToken(TokenNum, token, include);
-	  ungetc(ch, file);
-	  return true;
-	}
-    }
-  assert(false);
-  return false;
+  const size_t len = *pos - start;
+  AddToken(TokenNum, PoolString(start, len), len, include);
+  return true;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Read in a string token
-bool Worldfile::LoadTokenString(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenString(const char **pos, const char *end, int *line, int include)
 {
-  int ch;
-  int len;
-  char token[256];
-
-  len = 0;
-  memset(token, 0, sizeof(token));
-
-  ch = fgetc(file);
+  // skip the opening quote
+  const char *start = ++(*pos);
 
   while (true)
     {
-      ch = fgetc(file);
-
-      if ( EOF == ch || 0x0a == ch || 0x0d == ch )
+      if (*pos >= end || 0x0a == **pos || 0x0d == **pos)
 	{
 	  TOKEN_ERR("unterminated string constant", *line);
 	  return false;
 	}
-      else if (ch == '"')
+      else if (**pos == '"')
 	{
-	  AddToken(TokenString, token, include);
+	  const size_t len = *pos - start;
+	  AddToken(TokenString, PoolString(start, len), len, include);
+	  (*pos)++; // skip the closing quote
 	  return true;
 	}
-      else
-	{
-	  token[len++] = ch;
-	}
+      (*pos)++;
     }
   assert(false);
   return false;
@@ -620,37 +554,101 @@ bool Worldfile::LoadTokenString(FILE *file, int *line, int include)
 
 ///////////////////////////////////////////////////////////////////////////
 // Read in a whitespace token
-bool Worldfile::LoadTokenSpace(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenSpace(const char **pos, const char *end, int *line, int include)
 {
-  int ch;
-  int len;
-  char token[256];
+  const char *start = *pos;
 
-  len = 0;
-  memset(token, 0, sizeof(token));
+  while (*pos < end && isblank(**pos))
+    (*pos)++;
 
-  while (true)
+  AddToken(TokenSpace, start, *pos - start, include);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Map the contents of an open file into memory
+bool Worldfile::MapFile(FILE *file, const char **buf, size_t *len)
+{
+  const int fd = fileno(file);
+  struct stat st;
+
+  if (fstat(fd, &st) != 0)
     {
-      ch = fgetc(file);
+      PRINT_ERR1("unable to stat world file : %s", strerror(errno));
+      return false;
+    }
 
-      if (ch == EOF)
-	{
-	  AddToken(TokenSpace, token, include);
-	  return true;
-	}
-      else if (isblank(ch))
-	{
-	  token[len++] = ch;
-	}
-      else
+  *buf = "";
+  *len = 0;
+
+  if (S_ISREG(st.st_mode))
+    {
+      if (st.st_size == 0)
+	return true; // mmap() refuses zero-length files
+
+      void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED)
 	{
-	  AddToken(TokenSpace, token, include);
-	  ungetc(ch, file);
+#ifdef MADV_SEQUENTIAL
+	  madvise(addr, st.st_size, MADV_SEQUENTIAL);
+#endif
+	  this->mappings.push_back(CMapping(addr, st.st_size, true));
+	  *buf = (const char*)addr;
+	  *len = st.st_size;
 	  return true;
 	}
     }
-  assert(false);
-  return false;
+
+  // Not a regular file, or it could not be mapped: read the whole
+  // thing into memory instead.
+  std::vector<char> data;
+  char chunk[BUFSIZ];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    data.insert(data.end(), chunk, chunk + n);
+
+  if (ferror(file))
+    {
+      PRINT_ERR1("unable to read world file : %s", strerror(errno));
+      return false;
+    }
+
+  if (data.empty())
+    return true;
+
+  char *copy = new char[data.size()];
+  memcpy(copy, &data[0], data.size());
+  this->mappings.push_back(CMapping(copy, data.size(), false));
+  *buf = copy;
+  *len = data.size();
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Copy a string into the token string pool
+const char *Worldfile::PoolString(const char *str, size_t len)
+{
+  // the pool grows in blocks big enough for a typical worldfile's
+  // values, so most files need only a handful of allocations
+  const size_t block_size = 64 * 1024;
+
+  if (len + 1 > this->pool_free)
+    {
+      const size_t size = std::max(block_size, len + 1);
+      this->pool.push_back(new char[size]);
+      this->pool_next = this->pool.back();
+      this->pool_free = size;
+    }
+
+  char *value = this->pool_next;
+  memcpy(value, str, len);
+  value[len] = 0;
+
+  this->pool_next += len + 1;
+  this->pool_free -= len + 1;
+  return value;
 }
 
 
@@ -668,9 +666,9 @@ bool Worldfile::SaveTokens(FILE *file)
       if (token->include > 0)
 	continue;
       if (token->type == TokenString)
-				fprintf(file, "\"%s\"", token->value.c_str());
+	fprintf(file, "\"%.*s\"", (int)token->len, token->value);
       else
-				fprintf(file, "%s", token->value.c_str());
+	fwrite(token->value, 1, token->len, file);
     }
   return true;
 }
@@ -680,15 +678,32 @@ bool Worldfile::SaveTokens(FILE *file)
 // Clear the token list
 void Worldfile::ClearTokens()
 {
-	tokens.clear();
+  tokens.clear();
+  includes.clear();
+
+  // the tokens pointed into these, so they can go now
+  FOR_EACH( it, mappings )
+    {
+      if( it->mapped )
+	munmap( it->addr, it->len );
+      else
+	delete[] (char*)it->addr;
+    }
+  mappings.clear();
+
+  FOR_EACH( it, pool )
+    delete[] *it;
+  pool.clear();
+  pool_next = NULL;
+  pool_free = 0;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Add a token to the token list
-bool Worldfile::AddToken(int type, const char *value, int include)
+bool Worldfile::AddToken(int type, const char *value, size_t len, int include)
 {
-	tokens.push_back( CToken( include, type, value ));
+  tokens.push_back( CToken( include, type, value, len ));
   return true;
 }
 
@@ -698,7 +713,11 @@ bool Worldfile::AddToken(int type, const char *value, int include)
 bool Worldfile::SetTokenValue(int index, const char *value)
 {
   assert(index >= 0 && index < (int)this->tokens.size() );
-	tokens[index].value = value;
+  const size_t len = strlen(value);
+  tokens[index].value = PoolString(value, len);
+  tokens[index].len = len;
+  if( tokens[index].type == TokenNum )
+    tokens[index].num = atof(value);
   return true;
 }
 
@@ -708,7 +727,7 @@ bool Worldfile::SetTokenValue(int index, const char *value)
 const char *Worldfile::GetTokenValue(int index)
 {
   assert(index >= 0 && index < (int)this->tokens.size());
-  return this->tokens[index].value.c_str();
+  return this->tokens[index].value;
 }
 
 
@@ -725,16 +744,15 @@ void Worldfile::DumpTokens()
 	FOR_EACH( it, tokens )
   //for (int i = 0; i < this->token_count; i++)
     {
-      if ( it->value[0] == '\n')
+      if ( it->type == TokenEOL )
 				printf("[\\n]\n## %4d : %02d ", ++line, it->include);
       else
-				printf("[%s] ", it->value.c_str());
+				printf("[%.*s] ", (int)it->len, it->value);
     }
   printf("\n");
   printf("## end tokens\n");
 }
 
-
 ///////////////////////////////////////////////////////////////////////////
 // Parse tokens into entities and properties.
 bool Worldfile::ParseTokens()
@@ -758,12 +776,12 @@ bool Worldfile::ParseTokens()
       switch (token->type)
 				{
 				case TokenWord:
-					if ( token->value == "include") 
+					if ( strcmp( token->value, "include" ) == 0 )
 						{
 							if (!ParseTokenInclude(&i, &line))
 								return false;
 						}
-					else if ( token->value == "define" )
+					else if ( strcmp( token->value, "define" ) == 0 )
 						{
 							if (!ParseTokenDefine(&i, &line))
 								return false;
@@ -1149,7 +1167,7 @@ void Worldfile::DumpMacros()
 	  if (this->tokens[j].type == TokenEOL)
 	    printf("[\\n]");
 	  else
-	    printf("[%s]", GetTokenValue(j));
+	    printf("[%.*s]", (int)this->tokens[j].len, GetTokenValue(j));
 	}
       printf("\n");
     }
@@ -1246,7 +1264,11 @@ void Worldfile::DumpEntities()
   printf("\n## begin entities\n");
 
 	FOR_EACH( it, properties )
-		PrintProp( it->first.c_str(), it->second );
+	  {
+		 char key[128];
+		 snprintf( key, 127, "%d%s", (*it)->entity, (*it)->name.c_str() );
+		 PrintProp( key, *it );
+	  }
 
   printf("## end entities\n");
 }
@@ -1257,8 +1279,98 @@ void Worldfile::DumpEntities()
 void Worldfile::ClearProperties()
 {
 	FOR_EACH( it, properties )
-		delete it->second;	
+		delete *it;	
 	properties.clear();
+	property_table.clear();
+	atoms.clear();
+	atom_table.clear();
+}
+
+
+// FNV-1a hash of a property name
+static inline uint32_t HashName( const char* name )
+{
+  uint32_t hash = 2166136261u;
+  while( *name )
+    hash = (hash ^ (uint8_t)*name++) * 16777619u;
+  return hash;
+}
+
+// Mix an (entity, atom) pair into a table index
+static inline uint32_t HashKey( int entity, int atom )
+{
+  uint32_t hash = (uint32_t)entity * 0x9E3779B1u ^ (uint32_t)atom * 0x85EBCA77u;
+  hash ^= hash >> 16;
+  hash *= 0x7FEB352Du;
+  hash ^= hash >> 15;
+  return hash;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Look up the atom for a property name
+int Worldfile::LookupAtom(const char *name) const
+{
+  if( atom_table.empty() )
+    return -1;
+
+  const size_t mask = atom_table.size() - 1;
+  for( size_t i = HashName(name) & mask;; i = (i+1) & mask )
+    {
+      const int atom = atom_table[i];
+      if( atom < 0 || atoms[atom] == name )
+	return atom;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Intern a property name
+int Worldfile::InternAtom(const char *name)
+{
+  int atom = LookupAtom( name );
+  if( atom >= 0 )
+    return atom;
+
+  // keep the table at most half full so probes stay short
+  if( 2 * (atoms.size()+1) > atom_table.size() )
+    {
+      atom_table.assign( std::max( (size_t)64, 2 * atom_table.size() ), -1 );
+      const size_t mask = atom_table.size() - 1;
+      for( size_t a=0; a<atoms.size(); a++ )
+	{
+	  size_t i = HashName( atoms[a].c_str() ) & mask;
+	  while( atom_table[i] >= 0 )
+	    i = (i+1) & mask;
+	  atom_table[i] = a;
+	}
+    }
+
+  atom = atoms.size();
+  atoms.push_back( name );
+
+  const size_t mask = atom_table.size() - 1;
+  size_t i = HashName(name) & mask;
+  while( atom_table[i] >= 0 )
+    i = (i+1) & mask;
+  atom_table[i] = atom;
+
+  return atom;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Find the property table slot for (entity, atom)
+size_t Worldfile::PropertySlot(int entity, int atom) const
+{
+  const size_t mask = property_table.size() - 1;
+  for( size_t i = HashKey(entity, atom) & mask;; i = (i+1) & mask )
+    {
+      const int index = property_table[i];
+      if( index < 0 || 
+	  (properties[index]->entity == entity && properties[index]->atom == atom) )
+	return i;
+    }
 }
 
 
@@ -1266,12 +1378,28 @@ void Worldfile::ClearProperties()
 // Add an property
 CProperty* Worldfile::AddProperty(int entity, const char *name, int line)
 {
-  char key[128];
-  snprintf( key, 127, "%d%s", entity, name );
+  const int atom = InternAtom( name );
+
+  if( 2 * (properties.size()+1) > property_table.size() )
+    {
+      property_table.assign( std::max( (size_t)256, 2 * property_table.size() ), -1 );
+      for( size_t p=0; p<properties.size(); p++ )
+	property_table[ PropertySlot( properties[p]->entity, properties[p]->atom ) ] = p;
+    }
 
-  CProperty *property = new CProperty( entity, name, line );
+  CProperty *property = new CProperty( entity, name, atom, line );
 
-	properties[ key ] = property;
+  const size_t slot = PropertySlot( entity, atom );
+  if( property_table[slot] < 0 )
+    {
+      property_table[slot] = properties.size();
+      properties.push_back( property );
+    }
+  else // a redefinition, e.g. a macro instance overriding the macro
+    {
+      delete properties[ property_table[slot] ];
+      properties[ property_table[slot] ] = property;
+    }
 
 	return property;
 }
@@ -1294,31 +1422,16 @@ void Worldfile::AddPropertyValue( CProperty* property, int index, int value_toke
 
 
 ///////////////////////////////////////////////////////////////////////////
-// Get an property
+// Get an property. This only reads the tables, so it is safe to call
+// from several threads once the file is loaded.
 CProperty* Worldfile::GetProperty(int entity, const char *name)
 {
-  char key[128];
-  snprintf( key, 127, "%d%s", entity, name );
-  
-  //printf( "looking up key %s for entity %d name %s\n", key, entity, name );
-  
-  static char cache_key[128] = { 0 }; 
-  static CProperty* cache_property = NULL;
-  
-  if( strncmp( key, cache_key, 128 ) != 0 ) // different to last time
-	 {		
-		strncpy( cache_key, key, 128 ); // remember for next time		
-		
-		std::map<std::string,CProperty*>::iterator it = properties.find( key );	
-		if( it == properties.end() ) // not found
-		  cache_property = NULL;
-		else
-		  cache_property = it->second;		
-	 }
-  //else
-  // printf( "cache hit with %s\n", cache_key );
-	
-  return cache_property;
+  const int atom = LookupAtom( name );
+  if( atom < 0 || property_table.empty() )
+    return NULL;
+
+  const int index = property_table[ PropertySlot( entity, atom ) ];
+  return index < 0 ? NULL : properties[index];
 }
 
 bool Worldfile::PropertyExists( int section, const char* token )
@@ -1345,10 +1458,20 @@ void Worldfile::SetPropertyValue( CProperty* property, int index, const char *va
 const char *Worldfile::GetPropertyValue(CProperty* property, int index)
 {
   assert(property);
-  property->used = true;
+  MarkUsed( property );
   return GetTokenValue(property->values[index]);
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Get the value of an property as a number
+double Worldfile::GetPropertyFloat(CProperty* property, int index)
+{
+  assert(property);
+  MarkUsed( property );
+  const CToken& token = this->tokens[ property->values[index] ];
+  return( token.type == TokenNum ? token.num : atof(token.value) );
+}
+
 
 ///////////////////////////////////////////////////////////////////////////
 // Dump the property list for debugging
@@ -1436,7 +1559,7 @@ double Worldfile::ReadFloat(int entity, const char *name, double value)
   CProperty* property = GetProperty(entity, name);
   if (property == NULL )
     return value;
-  return atof(GetPropertyValue(property, 0));
+  return GetPropertyFloat(property, 0);
 }
 
 
@@ -1542,15 +1665,15 @@ int Worldfile::ReadTuple( const int entity, const char *name,
 	  break;
 
 	case 'f': // float
-	  *va_arg( args, double* ) = atof(val);
+	  *va_arg( args, double* ) = GetPropertyFloat(property, first+i);
 	  break;
 	  
 	case 'l': //length
-	  *va_arg( args, double* ) = atof(val) * unit_length;
+	  *va_arg( args, double* ) = GetPropertyFloat(property, first+i) * unit_length;
 	  break;
 	  
 	case 'a': // angle
-	  *va_arg( args, double* ) = atof(val) * unit_angle;
+	  *va_arg( args, double* ) = GetPropertyFloat(property, first+i) * unit_angle;
 	  break;
 	  
 	case 's': // string
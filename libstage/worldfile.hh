@@ -30,6 +30,7 @@
 
 #include <stdint.h> // for portable int types eg. uint32_t
 #include <stdio.h> // for FILE ops
+#include <stdlib.h> // for atof
 
 namespace Stg {
 
@@ -42,6 +43,9 @@ namespace Stg {
 
     /// Name of property
 	 std::string name;
+
+    /// Interned name, unique within the owning Worldfile
+    int atom;
     
     /// A list of token indexes
 	 std::vector<int> values;
@@ -49,12 +53,14 @@ namespace Stg {
     /// Line this property came from
     int line;
 
-    /// Flag set if property has been used
+    /// Flag set if property has been used. Only ever set, see
+    /// Worldfile::MarkUsed().
     bool used;
 		
-	 CProperty( int entity, const char* name, int line ) :
+	 CProperty( int entity, const char* name, int atom, int line ) :
 		entity(entity), 
 		name(name),
+		atom(atom),
 		values(),
 		line(line),
 		used(false) {}
@@ -141,26 +147,33 @@ namespace Stg {
 	 ////////////////////////////////////////////////////////////////////////////
 	 // Private methods used to load stuff from the world file
   
-	 // Load tokens from a file.
-  private: bool LoadTokens(FILE *file, int include);
+	 // Load tokens from a memory buffer (usually a mapped file).
+  private: bool LoadTokens(const char *buf, size_t len, int include);
 
 	 // Read in a comment token
-  private: bool LoadTokenComment(FILE *file, int *line, int include);
+  private: bool LoadTokenComment(const char **pos, const char *end, int *line, int include);
 
 	 // Read in a word token
-  private: bool LoadTokenWord(FILE *file, int *line, int include);
+  private: bool LoadTokenWord(const char **pos, const char *end, int *line, int include);
 
 	 // Load an include token; this will load the include file.
-  private: bool LoadTokenInclude(FILE *file, int *line, int include);
+  private: bool LoadTokenInclude(const char **pos, const char *end, int *line, int include);
 
 	 // Read in a number token
-  private: bool LoadTokenNum(FILE *file, int *line, int include);
+  private: bool LoadTokenNum(const char **pos, const char *end, int *line, int include);
 
 	 // Read in a string token
-  private: bool LoadTokenString(FILE *file, int *line, int include);
+  private: bool LoadTokenString(const char **pos, const char *end, int *line, int include);
 
 	 // Read in a whitespace token
-  private: bool LoadTokenSpace(FILE *file, int *line, int include);
+  private: bool LoadTokenSpace(const char **pos, const char *end, int *line, int include);
+
+	 // Map the contents of an open file into memory. The mapping
+	 // lives until ClearTokens() is called.
+  private: bool MapFile(FILE *file, const char **buf, size_t *len);
+
+	 // Copy a string into the token string pool, adding a terminator
+  private: const char *PoolString(const char *str, size_t len);
 
 	 // Save tokens to a file.
   private: bool SaveTokens(FILE *file);
@@ -168,8 +181,8 @@ namespace Stg {
 	 // Clear the token list
   private: void ClearTokens();
 
-	 // Add a token to the token list
-  private: bool AddToken(int type, const char *value, int include);
+	 // Add a token to the token list. The value is not copied.
+  private: bool AddToken(int type, const char *value, size_t len, int include);
 
 	 // Set a token in the token list
   private: bool SetTokenValue(int index, const char *value);
@@ -261,6 +274,28 @@ namespace Stg {
 	 // Get the value of an property.
   public:  const char *GetPropertyValue( CProperty* property, int index);
 
+	 // Get the value of an property as a number. Numeric tokens are
+	 // converted once when they are lexed, so this avoids atof().
+  private: double GetPropertyFloat( CProperty* property, int index);
+
+	 // Record that a property was read, for WarnUnused(). The flag is
+	 // only written while it is false, so once a property is read no
+	 // lookup writes to it. Readers in several threads may all store
+	 // true to a property read for the first time; that race is
+	 // benign, as they store the same value.
+  private: static void MarkUsed( CProperty* property )
+	 { if( ! property->used ) property->used = true; }
+
+	 // Intern a property name, returning its atom
+  private: int InternAtom(const char *name);
+
+	 // Look up the atom for a property name; -1 if it was never interned
+  private: int LookupAtom(const char *name) const;
+
+	 // Find the property table slot for (entity, atom): either the slot
+	 // holding that property or the empty slot where it would go
+  private: size_t PropertySlot(int entity, int atom) const;
+
 	 // Dump the property list for debugging
   private: void DumpProperties();
 
@@ -285,11 +320,20 @@ namespace Stg {
 		// Token type (enumerated value).
 		int type;
 		
-		// Token value
-		std::string value;
+		// Token value. Word, number and string values live in the
+		// string pool and are zero-terminated; the rest point straight
+		// into the mapped file or a string constant.
+		const char* value;
+
+		// Length of the token value
+		size_t len;
+
+		// Numeric value of a TokenNum token
+		double num;
 		
-		CToken( int include, int type, const char* value ) :
-		  include(include), type(type), value(value) {}
+		CToken( int include, int type, const char* value, size_t len ) :
+		  include(include), type(type), value(value), len(len),
+		  num( type == TokenNum ? atof(value) : 0.0 ) {}
 	 };
 	 
 	 // A list of tokens loaded from the file.
@@ -297,6 +341,42 @@ namespace Stg {
 	 //private: int token_size, token_count;
   private:  std::vector<CToken> tokens;
 
+	 // A file mapped (or read) into memory, referenced by the tokens
+  private:
+	 class CMapping
+	 {
+	 public:
+		void* addr;
+		size_t len;
+		bool mapped; // false if addr was allocated with new[]
+
+		CMapping( void* addr, size_t len, bool mapped ) :
+		  addr(addr), len(len), mapped(mapped) {}
+	 };
+
+  private: std::vector<CMapping> mappings;
+
+	 // Range of tokens produced by an include file, so that repeated
+	 // includes of the same file can be copied instead of re-lexed.
+  private:
+	 class CInclude
+	 {
+	 public:
+		int first, last; // token index range [first,last)
+		int include; // include depth the tokens were lexed at
+
+		CInclude( int first, int last, int include ) :
+		  first(first), last(last), include(include) {}
+	 };
+
+	 // Include cache, indexed by full path
+  private: std::map<std::string,CInclude> includes;
+
+	 // Blocks of zero-terminated token values
+  private: std::vector<char*> pool;
+  private: char* pool_next;
+  private: size_t pool_free;
+
 	 // Private macro class
   private: 
 	 class CMacro
@@ -343,8 +423,18 @@ namespace Stg {
 	 // Entity list
   private: std::vector<CEntity> entities;
 	 
-	 // Property list
-  private: std::map<std::string,CProperty*> properties;	
+	 // Property list, in the order the properties were parsed
+  private: std::vector<CProperty*> properties;
+
+	 // Interned property names, indexed by atom, and an open-addressed
+	 // hash from name to atom
+  private: std::vector<std::string> atoms;
+  private: std::vector<int> atom_table;
+
+	 // Open-addressed hash from (entity, atom) to an index into the
+	 // property list. Tables are a power of two in size and at most
+	 // half full; empty slots hold -1.
+  private: std::vector<int> property_table;
 	 
 	 // Name of the file we loaded
   public: std::string filename;
@@ -25,6 +25,7 @@ API: Stg::WorldGui
 @par Summary and default values
 
 speedup 1
+sim_thread 0
 
 @verbatim
 window
@@ -54,6 +55,7 @@ window
   show_tree 0
   pcam_on 0
   screenshots 0
+  batch_render 1
 )
 @endverbatim
 
@@ -63,6 +65,17 @@ window
  Stage will run as fast as it can go, and not attempt to track real
  time at all. 
 
+ - sim_thread <int>\n
+ If 1, the world is updated by its own thread, so drawing, menus and
+ window resizes don't hold up the simulation, or vice versa. The
+ canvas draws blocks, footprints and ranger, fiducial and blobfinder
+ data from a snapshot taken by the simulation thread at the window
+ refresh rate, and models moved with the mouse are moved between
+ updates. Other models' visualizations are still drawn from the
+ models, pausing the simulation briefly. Cameras raytrace, as they
+ can't use the window's OpenGL context. If 0 (the default), the world
+ is updated by timers in the GUI thread.
+
 - size [ <width:int> <height:int> ]\n
 size of the window in pixels
 - center [ <x:float> <y:float> ]\n
@@ -77,6 +90,10 @@ location of the perspective camera (meters)
 verticle and horizontal angle of the perspective camera
 - pcam_on <int>\n
 whether to start with the perspective camera enabled (0/1)
+- batch_render <int>\n
+whether to draw blocks, trail footprints and ranger beams in a few
+large vertex array calls (1, the default), or model by model (0).
+Batching is much faster with many models.
 
 
 <h2>Using the Stage window</h2>
@@ -197,8 +214,25 @@ WorldGui::WorldGui(int W,int H,const char* L) :
   real_time_interval( sim_interval ),
   real_time_now( RealTimeNow() ),
   real_time_recorded( real_time_now ),
-  timing_interval( 20 )
+  timing_interval( 20 ),
+  sim_threaded( false ),
+  sim_running( false ),
+  sim_thread(),
+  sim_mutex(),
+  sim_control_mutex(),
+  sim_cond(),
+  sim_quit( false ),
+  sim_step( false ),
+  pose_edits(),
+  snapshot_front( 0 ),
+  snapshot_mutex(),
+  snapshot_misses( 0 )
 {
+  pthread_mutex_init( &sim_mutex, NULL );
+  pthread_mutex_init( &sim_control_mutex, NULL );
+  pthread_cond_init( &sim_cond, NULL );
+  pthread_mutex_init( &snapshot_mutex, NULL );
+
   Fl::scheme( "" );
   resizable(canvas);
   label( PROJECT );
@@ -229,7 +263,9 @@ WorldGui::WorldGui(int W,int H,const char* L) :
   mbar->add( "Run/Faster", ']', (Fl_Callback*)fasterCb, this );
   mbar->add( "Run/Slower", '[', (Fl_Callback*)slowerCb, this, FL_MENU_DIVIDER  );
   mbar->add( "Run/Realtime", '{', (Fl_Callback*)realtimeCb, this );
-  mbar->add( "Run/Fast", '}', (Fl_Callback*)fasttimeCb, this );
+  mbar->add( "Run/Fast", '}', (Fl_Callback*)fasttimeCb, this, FL_MENU_DIVIDER );
+  mbar->add( "Run/Skip back", '<', (Fl_Callback*)skipBackCb, this );
+  mbar->add( "Run/Skip forward", '>', (Fl_Callback*)skipForwardCb, this );
   
   mbar->add( "&Help", 0, 0, 0, FL_SUBMENU );
   mbar->add( "Help/Getting help...", 0,  (Fl_Callback*)moreHelptCb, this, FL_MENU_DIVIDER );
@@ -242,6 +278,8 @@ WorldGui::WorldGui(int W,int H,const char* L) :
 
 WorldGui::~WorldGui()
 {
+  StopSimThread();
+
 	if( mbar ) delete mbar;
   if( oDlg ) delete oDlg;
   if( canvas ) delete canvas;
@@ -270,6 +308,7 @@ void WorldGui::Load( const std::string& filename )
   const int world_section = 0; 
   speedup = wf->ReadFloat( world_section, "speedup", speedup );    
   paused = wf->ReadInt( world_section, "paused", paused );
+  sim_threaded = wf->ReadInt( world_section, "sim_thread", sim_threaded );
   
   // use the window section for the rest
   const int window_section = wf->LookupEntity( "window" );
@@ -313,6 +352,7 @@ void WorldGui::Load( const std::string& filename )
 
 void WorldGui::UnLoad() 
 {
+  StopSimThread();
   World::UnLoad();
 }
 
@@ -324,6 +364,7 @@ bool WorldGui::Save( const char* filename )
   const int world_section = 0; 
   wf->WriteFloat( world_section, "speedup", speedup );    
   wf->WriteInt( world_section, "paused", paused );
+  wf->WriteInt( world_section, "sim_thread", sim_threaded );
 
   // use the window section for the rest
   const int window_section = wf->LookupEntity( "window" );
@@ -340,7 +381,9 @@ bool WorldGui::Save( const char* filename )
 	(*it)->Save( wf, window_section );
     }
 	
+  LockSim();
 	World::Save( filename );
+  UnlockSim();
 	
   // TODO - error checking
   return true;
@@ -353,7 +396,7 @@ static void UpdateCallback( WorldGui* world )
 
 bool WorldGui::Update()
 { 
-  if( speedup > 0 )
+  if( speedup > 0 && ! sim_running )
 	 Fl::repeat_timeout( (sim_interval/1e6) / speedup, (Fl_Timeout_Handler)UpdateCallback, this );
   // else we're called by an idle callback
 
@@ -378,12 +421,222 @@ bool WorldGui::Update()
   if( done )
     {
       quit_time = 0; // allows us to continue by un-pausing
-      Stop();
+
+      if( sim_running )
+	paused = true; // no FLTK calls outside the GUI thread
+      else
+	Stop();
     }
   
   return done;
 }
 
+void* WorldGui::SimThreadEntry( void* arg )
+{
+  ((WorldGui*)arg)->SimThread();
+  return NULL;
+}
+
+void WorldGui::SimThread()
+{
+  // real time at which the next update is due, and the next snapshot
+  usec_t next_update = RealTimeNow();
+  usec_t next_snapshot = next_update;
+
+  while( true )
+    {
+      pthread_mutex_lock( &sim_control_mutex );
+
+      while( ! sim_quit && paused && ! sim_step && pose_edits.empty() )
+	pthread_cond_wait( &sim_cond, &sim_control_mutex );
+
+      if( sim_quit )
+	{
+	  pthread_mutex_unlock( &sim_control_mutex );
+	  break;
+	}
+
+      const bool step = sim_step || ! paused;
+      const bool running = ! paused;
+      sim_step = false;
+
+      std::vector<PoseEdit> edits;
+      edits.swap( pose_edits );
+
+      pthread_mutex_unlock( &sim_control_mutex );
+
+      pthread_mutex_lock( &sim_mutex );
+
+      FOR_EACH( it, edits )
+	it->mod->AddToPose( it->delta );
+
+      if( step )
+	Update();
+
+      // don't build snapshots faster than the canvas draws them,
+      // unless something changed while paused
+      const usec_t now = RealTimeNow();
+      const bool publish = ! running || now >= next_snapshot;
+
+      if( publish )
+	{
+	  BuildSnapshot( snapshots[1-snapshot_front] );
+	  next_snapshot = now + canvas->interval * thousand;
+	}
+
+      pthread_mutex_unlock( &sim_mutex );
+
+      if( publish && ! PublishSnapshot( ! running ) )
+	next_snapshot = now; // try again after the next update
+
+      if( ! running )
+	{
+	  next_update = RealTimeNow();
+	  continue;
+	}
+
+      // keep to speedup times real time, but don't try to catch up
+      // after falling well behind, e.g. after a slow update
+      if( speedup > 0 )
+	{
+	  next_update += (usec_t)( sim_interval / speedup );
+	  const usec_t then = RealTimeNow();
+
+	  if( then < next_update )
+	    usleep( next_update - then );
+	  else if( then - next_update > 10 * sim_interval )
+	    next_update = then;
+	}
+    }
+}
+
+void WorldGui::BuildSnapshot( RenderSnapshot& snap )
+{
+  snap.sim_time = sim_time;
+  snap.clock = ClockString();
+
+  snap.block_fill.Clear();
+  snap.block_lines.Clear();
+  snap.trail_fill.Clear();
+  snap.ClearData();
+
+  // the canvas draws from the models directly if it isn't batching
+  if( ! canvas->batchRender )
+    return;
+
+  FOR_EACH( it, World::children )
+    (*it)->AppendBlocksTree( snap.block_fill, snap.block_lines );
+
+  if( canvas->showFootprints )
+    FOR_EACH( it, World::children )
+      (*it)->AppendTrailFootprint( snap.trail_fill );
+
+  if( canvas->showData )
+    {
+      FOR_EACH( it, World::children )
+	(*it)->SnapshotDataTree( snap.data );
+
+      FOR_EACH( it, snap.data )
+	snap.data_models.insert( (*it)->lineage.front() );
+    }
+}
+
+bool WorldGui::PublishSnapshot( bool wait )
+{
+  // a snapshot that misses its turn is rebuilt after the next update,
+  // but we wait rather than miss too many in a row
+  if( wait || snapshot_misses > 10 )
+    pthread_mutex_lock( &snapshot_mutex );
+  else if( pthread_mutex_trylock( &snapshot_mutex ) != 0 )
+    {
+      ++snapshot_misses;
+      return false;
+    }
+
+  snapshot_front = 1 - snapshot_front;
+  snapshot_misses = 0;
+  NeedRedraw();
+
+  pthread_mutex_unlock( &snapshot_mutex );
+  return true;
+}
+
+const WorldGui::RenderSnapshot* WorldGui::AcquireSnapshot()
+{
+  if( ! sim_running )
+    return NULL;
+
+  pthread_mutex_lock( &snapshot_mutex );
+  return &snapshots[snapshot_front];
+}
+
+void WorldGui::ReleaseSnapshot()
+{
+  if( sim_running )
+    pthread_mutex_unlock( &snapshot_mutex );
+}
+
+void WorldGui::EditPose( Model* mod, const Pose& delta )
+{
+  if( ! sim_running )
+    {
+      mod->AddToPose( delta );
+      return;
+    }
+
+  pthread_mutex_lock( &sim_control_mutex );
+  pose_edits.push_back( PoseEdit( mod, delta ));
+  pthread_cond_signal( &sim_cond );
+  pthread_mutex_unlock( &sim_control_mutex );
+}
+
+void WorldGui::StartSimThread()
+{
+  if( sim_running )
+    {
+      // wake it up, in case it was paused
+      pthread_mutex_lock( &sim_control_mutex );
+      pthread_cond_signal( &sim_cond );
+      pthread_mutex_unlock( &sim_control_mutex );
+      return;
+    }
+
+  sim_quit = false;
+  sim_step = false;
+  snapshot_misses = 0;
+
+  // the first frame is drawn from a complete snapshot
+  BuildSnapshot( snapshots[snapshot_front] );
+
+  if( pthread_create( &sim_thread, NULL, SimThreadEntry, this ) != 0 )
+    {
+      PRINT_ERR( "failed to start the simulation thread. Updating from the GUI instead." );
+      sim_threaded = false;
+      return;
+    }
+
+  sim_running = true;
+}
+
+void WorldGui::StopSimThread()
+{
+  if( ! sim_running )
+    return;
+
+  pthread_mutex_lock( &sim_control_mutex );
+  sim_quit = true;
+  pthread_cond_signal( &sim_cond );
+  pthread_mutex_unlock( &sim_control_mutex );
+
+  pthread_join( sim_thread, NULL );
+  sim_running = false;
+
+  // anything not yet applied is applied now
+  FOR_EACH( it, pose_edits )
+    it->mod->AddToPose( it->delta );
+  pose_edits.clear();
+}
+
 std::string WorldGui::ClockString() const
 {
   std::string str = World::ClockString();
@@ -591,19 +844,34 @@ void WorldGui::Redraw()
 
 void WorldGui::Start()
 {
+  if( sim_threaded )
+    pthread_mutex_lock( &sim_control_mutex );
+
   World::Start();
+
+  if( sim_threaded )
+    pthread_mutex_unlock( &sim_control_mutex );
   
   // start the timer that causes regular redraws
+  Fl::remove_timeout( (Fl_Timeout_Handler)Canvas::TimerCallback, canvas );
   Fl::add_timeout( ((double)canvas->interval/1000), 
 						 (Fl_Timeout_Handler)Canvas::TimerCallback, 
 						 canvas );
   
-  SetTimeouts();
+  if( sim_threaded )
+    StartSimThread();
+
+  // if the thread failed to start, sim_threaded was cleared
+  if( ! sim_running )
+    SetTimeouts();
 }
 
 
 void WorldGui::SetTimeouts()
 {
+  if( sim_running ) // the simulation thread keeps its own time
+    return;
+
   // remove the old callback, wherever it was
   Fl::remove_idle( (Fl_Timeout_Handler)UpdateCallback, this );	  
   Fl::remove_timeout( (Fl_Timeout_Handler)UpdateCallback, this );	  
@@ -618,6 +886,17 @@ void WorldGui::SetTimeouts()
 
 void WorldGui::Stop()
 {
+  if( sim_running )
+    {
+      // the thread waits for Start(), but keeps applying edits, so
+      // the redraw timer keeps going
+      pthread_mutex_lock( &sim_control_mutex );
+      World::Stop();
+      pthread_mutex_unlock( &sim_control_mutex );
+      canvas->redraw();
+      return;
+    }
+
   World::Stop();
   
   Fl::remove_timeout( (Fl_Timeout_Handler)Canvas::TimerCallback );	
@@ -639,10 +918,45 @@ void WorldGui::onceCb( Fl_Widget* w, WorldGui* wg )
   //wg->paused = true;
   wg->Stop();
 
+  if( wg->sim_running )
+    {
+      // the simulation thread runs exactly once
+      pthread_mutex_lock( &wg->sim_control_mutex );
+      wg->sim_step = true;
+      pthread_cond_signal( &wg->sim_cond );
+      pthread_mutex_unlock( &wg->sim_control_mutex );
+      return;
+    }
+
   // run exactly once
   wg->World::Update();
 }
 
+// replayed worlds only: jump this far through the log
+static const usec_t REPLAY_SKIP = 10 * million;
+
+void WorldGui::skipBackCb( Fl_Widget* w, WorldGui* wg )
+{
+  if( ! wg->IsReplaying() )
+    return;
+
+  wg->LockSim();
+  wg->SeekReplay( wg->sim_time > REPLAY_SKIP ? wg->sim_time - REPLAY_SKIP : 0 );
+  wg->UnlockSim();
+  wg->canvas->redraw();
+}
+
+void WorldGui::skipForwardCb( Fl_Widget* w, WorldGui* wg )
+{
+  if( ! wg->IsReplaying() )
+    return;
+
+  wg->LockSim();
+  wg->SeekReplay( wg->sim_time + REPLAY_SKIP );
+  wg->UnlockSim();
+  wg->canvas->redraw();
+}
+
 void WorldGui::viewOptionsCb( OptionsDlg* oDlg, WorldGui* wg ) 
 {
   // sort the vector by option label alphabetically
@@ -0,0 +1,120 @@
+/////////////////////////////////
+// File: benchworld.hh
+// Desc: Timing and world generation shared by the benchmarks
+// License: GPL
+//
+// A benchmark writes its world to a temporary file with CreateWorld(),
+// adds its global settings and its robot's definition, made with
+// WriteRobotType(), then places the robots with WriteRobots() and
+// finishes with CloseWorld(). The robots are replicated from one
+// template, as a user would write a large world, rather than pasted
+// once each.
+/////////////////////////////////
+
+#ifndef BENCHWORLD_HH
+#define BENCHWORLD_HH
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <string>
+
+// Returns the wall clock time in seconds
+static inline double Now()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Create a temporary worldfile for the benchmark [prog], returning it
+// open for writing with its name in [filename], or NULL on failure
+static inline FILE* CreateWorld( const char* prog, std::string& filename )
+{
+  char name[64];
+  snprintf( name, sizeof(name), "/tmp/%s-XXXXXX", prog );
+
+  const int fd = mkstemp( name );
+  FILE* fp = ( fd < 0 ? NULL : fdopen( fd, "w" ));
+  if( fp == NULL )
+    {
+      fprintf( stderr, "%s: unable to create generated world: ", prog );
+      perror( NULL );
+      if( fd >= 0 )
+	{
+	  close( fd );
+	  unlink( name );
+	}
+      return NULL;
+    }
+
+  filename = name;
+  fprintf( fp, "# generated by %s\n", prog );
+  return fp;
+}
+
+// Close the worldfile [fp] made by CreateWorld(), deleting it if it
+// couldn't be written. Returns true on success.
+static inline bool CloseWorld( FILE* fp, const std::string& filename )
+{
+  const bool failed( ferror( fp ) != 0 );
+  if( fclose( fp ) != 0 || failed )
+    {
+      perror( filename.c_str() );
+      unlink( filename.c_str() );
+      return false;
+    }
+  return true;
+}
+
+// Define the position model type [name]: a 20cm differential drive
+// robot, with the worldfile lines [body] added, for its sensors or
+// anything else
+static inline void WriteRobotType( FILE* fp, const char* name, const char* body = "" )
+{
+  fprintf( fp,
+	   "\ndefine %s position\n"
+	   "(\n"
+	   "  size [ 0.2 0.2 0.2 ]\n"
+	   "  drive \"diff\"\n"
+	   "  block( points 4 point[0] [ 0 0 ] point[1] [ 1 0 ] point[2] [ 1 1 ] point[3] [ 0 1 ] z [ 0 1 ] )\n"
+	   "%s"
+	   ")\n\n",
+	   name, body );
+}
+
+// Place [robots] models of type [type], named r0, r1, ..., on a square
+// grid [spacing] meters apart, robot i turned i * [turn] degrees. They
+// are replicated from one template, unless [pasted], when each is
+// written out in full as worldgen.sh does.
+static inline void WriteRobots( FILE* fp, const char* type, unsigned int robots,
+				double spacing, double turn = 0, bool pasted = false )
+{
+  const unsigned int side = (unsigned int)ceil( sqrt( (double)robots ) );
+
+  if( pasted )
+    {
+      for( unsigned int i=0; i<robots; ++i )
+	fprintf( fp, "%s( name \"r%u\" pose [ %.3f %.3f 0 %.3f ] )\n",
+		 type, i, (i % side) * spacing, (i / side) * spacing,
+		 fmod( i * turn, 360.0 ));
+      return;
+    }
+
+  // the name is on the template, so the copies take it from there
+  fprintf( fp,
+	   "replicate\n"
+	   "(\n"
+	   "  count %u\n"
+	   "  columns %u\n"
+	   "  step [ %.3f 0 0 %.3f ]\n"
+	   "  row_step [ 0 %.3f 0 %.3f ]\n"
+	   "  %s( name \"r\" )\n"
+	   ")\n",
+	   robots, side, spacing, turn, spacing, fmod( side * turn, 360.0 ), type );
+}
+
+#endif
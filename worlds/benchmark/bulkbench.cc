@@ -0,0 +1,154 @@
+/////////////////////////////////
+// File: bulkbench.cc
+// Desc: Bulk state API benchmark
+// License: GPL
+//
+// Usage: bulkbench [-n robots] [-s steps] [-r samples]
+//
+// Loads a generated world of [robots] position models, each carrying
+// a ranger of [samples] samples, and runs [steps] updates. Before each
+// update it reads every pose, velocity and scan and sets every speed,
+// once through the bulk state methods of World and once model by
+// model, and reports the time each takes per step. Both should give
+// the same numbers; the exit status is non-zero if they don't. The
+// collision tests the robots' moves needed are reported per step.
+/////////////////////////////////
+
+#include "stage.hh"
+#include "benchworld.hh"
+using namespace Stg;
+
+// Write a world of [robots] position models with rangers on a grid
+static bool Generate( std::string& filename, unsigned int robots, unsigned int samples )
+{
+  FILE* fp = CreateWorld( "bulkbench", filename );
+  if( !fp )
+    return false;
+
+  fprintf( fp,
+	   "resolution 0.02\n"
+	   "threads 1\n\n"
+	   "define bulkranger ranger\n"
+	   "(\n"
+	   "  sensor( range [ 0 4.0 ] fov 180 samples %u )\n"
+	   ")\n",
+	   samples );
+
+  WriteRobotType( fp, "bulkbot", "  bulkranger()\n" );
+  WriteRobots( fp, "bulkbot", robots, 1.0 );
+
+  return CloseWorld( fp, filename );
+}
+
+int main( int argc, char* argv[] )
+{
+  unsigned int robotcount = 1000;
+  unsigned int steps = 100;
+  unsigned int samples = 32;
+
+  int ch;
+  while( (ch = getopt( argc, argv, "n:s:r:" )) != -1 )
+    {
+      switch( ch )
+	{
+	case 'n': robotcount = std::max( 1, atoi( optarg ) ); break;
+	case 's': steps = std::max( 1, atoi( optarg ) ); break;
+	case 'r': samples = std::max( 1, atoi( optarg ) ); break;
+	default:
+	  fprintf( stderr, "usage: %s [-n robots] [-s steps] [-r samples]\n", argv[0] );
+	  return 1;
+	}
+    }
+
+  Stg::Init( &argc, &argv );
+
+  std::string filename;
+  if( ! Generate( filename, robotcount, samples ))
+    return 1;
+
+  World world( "bulkbench" );
+  world.Load( filename.c_str() );
+  unlink( filename.c_str() );
+
+  const size_t n = world.BulkPositionCount();
+  const size_t total = world.BulkRangeOffsets().back();
+
+  std::vector<double> x(n), y(n), a(n), vx(n), vy(n), va(n), cx(n), cy(n), ca(n);
+  std::vector<float> ranges( total + 1 );
+  std::vector<float> check( total + 1 );
+
+  // subscribe everything, so the rangers produce data
+  for( size_t i=0; i<n; ++i )
+    world.BulkPosition(i)->Subscribe();
+  for( size_t i=0; i<world.BulkRangerCount(); ++i )
+    world.BulkRanger(i)->Subscribe();
+
+  fprintf( stderr, "[%u robots, %lu positions, %lu rangers, %lu samples, %u steps]\n",
+	   robotcount, (unsigned long)n, (unsigned long)world.BulkRangerCount(),
+	   (unsigned long)total, steps );
+
+  double bulk = 0, single = 0;
+  unsigned long mismatches = 0;
+  World::CollisionStats collisions;
+
+  for( unsigned int s=0; s<steps; ++s )
+    {
+      // every robot gets a speed that depends on where it is
+      double start = Now();
+      world.GetBulkPoses( &x[0], &y[0], &a[0] );
+      world.GetBulkVelocities( &vx[0], &vy[0], &va[0] );
+      world.GetBulkRanges( &ranges[0] );
+      for( size_t i=0; i<n; ++i )
+	{
+	  cx[i] = 0.1 + 0.01 * ( i % 7 );
+	  ca[i] = 0.1 * sin( x[i] + y[i] );
+	}
+      world.SetBulkSpeeds( &cx[0], NULL, &ca[0] );
+      bulk += Now() - start;
+
+      // the same, model by model
+      start = Now();
+      size_t k = 0;
+      for( size_t i=0; i<n; ++i )
+	{
+	  ModelPosition* pos = world.BulkPosition(i);
+	  const Pose p = pos->GetGlobalPose();
+	  const Velocity v = pos->GetVelocity();
+
+	  if( p.x != x[i] || p.y != y[i] || p.a != a[i] ||
+	      v.x != vx[i] || v.y != vy[i] || v.a != va[i] )
+	    ++mismatches;
+
+	  pos->SetSpeed( 0.1 + 0.01 * ( i % 7 ), 0, 0.1 * sin( p.x + p.y ));
+	}
+      for( size_t i=0; i<world.BulkRangerCount(); ++i )
+	FOR_EACH( it, world.BulkRanger(i)->GetSensors() )
+	  for( unsigned int j=0; j<it->sample_count; ++j, ++k )
+	    check[k] = j < it->ranges.size() ? (float)it->ranges[j] : 0.0f;
+      single += Now() - start;
+
+      for( size_t j=0; j<total; ++j )
+	if( check[j] != ranges[j] )
+	  ++mismatches;
+
+      world.Update();
+
+      const World::CollisionStats& cs( world.GetCollisionStats() );
+      collisions.tests += cs.tests;
+      collisions.contacts += cs.contacts;
+      collisions.candidates += cs.candidates;
+      collisions.block_checks += cs.block_checks;
+      collisions.substeps += cs.substeps;
+    }
+
+  fprintf( stderr, "bulk: %.1f us/step\n", bulk * 1e6 / steps );
+  fprintf( stderr, "per model: %.1f us/step\n", single * 1e6 / steps );
+  fprintf( stderr, "collisions: %.1f tests, %.1f contacts, %.1f candidates, "
+	   "%.1f block checks, %.1f substeps per step\n",
+	   (double)collisions.tests / steps, (double)collisions.contacts / steps,
+	   (double)collisions.candidates / steps, (double)collisions.block_checks / steps,
+	   (double)collisions.substeps / steps );
+  fprintf( stderr, "%lu mismatches\n", mismatches );
+
+  return( mismatches ? 1 : 0 );
+}
@@ -0,0 +1,184 @@
+/////////////////////////////////
+// File: cbbench.cc
+// Desc: Model callback dispatch benchmark
+// License: GPL
+//
+// Usage: cbbench [-n robots] [-c callbacks] [-r repeats] [-s steps]
+//
+// Loads a generated world of [robots] position models, then times
+// Model::SetPose() with no callbacks and with [callbacks] CB_POSE
+// callbacks on every robot, raw CallCallbacks( CB_POSE ) dispatch,
+// callbacks that cancel and re-add themselves, and [steps] world
+// updates with every robot driving and [callbacks] CB_UPDATE
+// callbacks on each. Results go to stderr.
+/////////////////////////////////
+
+#include "stage.hh"
+#include "benchworld.hh"
+using namespace Stg;
+
+// Write a world of [robots] position models on a grid
+static bool Generate( std::string& filename, unsigned int robots )
+{
+  FILE* fp = CreateWorld( "cbbench", filename );
+  if( !fp )
+    return false;
+
+  fprintf( fp,
+	   "resolution 0.02\n"
+	   "interval_sim 100\n"
+	   "threads 1\n" );
+
+  WriteRobotType( fp, "cbbot" );
+  WriteRobots( fp, "cbbot", robots, 0.5 );
+
+  return CloseWorld( fp, filename );
+}
+
+static unsigned long long calls = 0;
+
+static int CountCallback( Model* mod, void* arg )
+{
+  (void)mod; (void)arg;
+  ++calls;
+  return 0; // keep me
+}
+
+// cancels itself every time, to exercise deferred removal
+static int OneShotCallback( Model* mod, void* arg )
+{
+  (void)mod; (void)arg;
+  ++calls;
+  return 1; // remove me
+}
+
+static void Report( const char* label, double elapsed, unsigned long long ops )
+{
+  fprintf( stderr, "%-36s %9.3f ms %10llu calls %8.1f ns/call\n",
+	   label, elapsed * 1e3, ops, ops ? elapsed * 1e9 / ops : 0.0 );
+}
+
+// SetPose() every robot [repeats] times
+static void BenchSetPose( const char* label,
+			  std::vector<Model*>& robots,
+			  unsigned int repeats )
+{
+  calls = 0;
+  const double start = Now();
+  for( unsigned int r=0; r<repeats; ++r )
+    FOR_EACH( it, robots )
+      {
+	Pose p = (*it)->GetPose();
+	p.a = normalize( p.a + 0.01 );
+	(*it)->SetPose( p );
+      }
+  const double elapsed = Now() - start;
+
+  fprintf( stderr, "%-36s %9.3f ms %10llu calls %8.1f ns/SetPose\n",
+	   label, elapsed * 1e3, calls,
+	   elapsed * 1e9 / ( repeats * robots.size() ));
+}
+
+int main( int argc, char* argv[] )
+{
+  unsigned int robotcount = 1000;
+  unsigned int cbcount = 2;
+  unsigned int repeats = 100;
+  unsigned int steps = 100;
+
+  int ch;
+  while( (ch = getopt( argc, argv, "n:c:r:s:" )) != -1 )
+    {
+      switch( ch )
+	{
+	case 'n': robotcount = std::max( 1, atoi( optarg ) ); break;
+	case 'c': cbcount = atoi( optarg ); break;
+	case 'r': repeats = std::max( 1, atoi( optarg ) ); break;
+	case 's': steps = atoi( optarg ); break;
+	default:
+	  fprintf( stderr, "usage: %s [-n robots] [-c callbacks] [-r repeats] [-s steps]\n", argv[0] );
+	  return 1;
+	}
+    }
+
+  Stg::Init( &argc, &argv );
+
+  std::string filename;
+  if( ! Generate( filename, robotcount ) )
+    return 1;
+
+  World world( "cbbench" );
+  world.Load( filename.c_str() );
+  unlink( filename.c_str() );
+
+  std::vector<Model*> robots;
+  for( unsigned int i=0; i<robotcount; ++i )
+    {
+      char name[32];
+      snprintf( name, sizeof(name), "r%u", i );
+      Model* mod = world.GetModel( name );
+      assert( mod );
+      robots.push_back( mod );
+    }
+
+  fprintf( stderr, "[%u robots, %u pose callbacks each]\n", robotcount, cbcount );
+
+  BenchSetPose( "SetPose, no callbacks", robots, repeats );
+
+  // each callback needs a distinct argument to be added separately
+  FOR_EACH( it, robots )
+    for( unsigned int c=0; c<cbcount; ++c )
+      (*it)->AddCallback( Model::CB_POSE, CountCallback, (void*)(size_t)(c+1) );
+
+  BenchSetPose( "SetPose, with callbacks", robots, repeats );
+
+  // dispatch alone, without the cost of moving the robot
+  calls = 0;
+  double start = Now();
+  for( unsigned int r=0; r<repeats * 10; ++r )
+    FOR_EACH( it, robots )
+      (*it)->CallCallbacks( Model::CB_POSE );
+  Report( "CallCallbacks( CB_POSE )", Now() - start, calls );
+
+  // an empty list should cost next to nothing
+  calls = 0;
+  start = Now();
+  for( unsigned int r=0; r<repeats * 10; ++r )
+    FOR_EACH( it, robots )
+      (*it)->CallCallbacks( Model::CB_GEOM );
+  Report( "CallCallbacks( CB_GEOM ), none", Now() - start, robots.size() * repeats * 10 );
+
+  // callbacks that remove themselves, re-added each time
+  calls = 0;
+  start = Now();
+  for( unsigned int r=0; r<repeats; ++r )
+    FOR_EACH( it, robots )
+      {
+	(*it)->AddCallback( Model::CB_POSE, OneShotCallback, NULL );
+	(*it)->CallCallbacks( Model::CB_POSE );
+      }
+  Report( "add + call + cancel one-shot", Now() - start, calls );
+
+  // drive everything round in circles. Move() sets the pose without
+  // firing CB_POSE, so count the CB_UPDATE callbacks each robot's
+  // update dispatches instead.
+  FOR_EACH( it, robots )
+    {
+      for( unsigned int c=0; c<cbcount; ++c )
+	(*it)->AddCallback( Model::CB_UPDATE, CountCallback, (void*)(size_t)(c+1) );
+      ((ModelPosition*)*it)->SetSpeed( 0.1, 0, 0.2 );
+      (*it)->Subscribe();
+    }
+
+  calls = 0;
+  start = Now();
+  for( unsigned int s=0; s<steps; ++s )
+    world.Update();
+  const double elapsed = Now() - start;
+
+  fprintf( stderr, "%-36s %9.3f ms %10llu calls %8.3f ms/step\n",
+	   "World::Update(), driving", elapsed * 1e3, calls,
+	   steps ? elapsed * 1e3 / steps : 0.0 );
+
+  return 0;
+}
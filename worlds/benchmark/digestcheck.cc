@@ -0,0 +1,252 @@
+/////////////////////////////////
+// File: digestcheck.cc
+// Desc: Checks that a deterministic world gives the same results with any number of threads
+// License: GPL
+//
+// Usage: digestcheck [-n robots] [-s steps] [-t threads] [-r samples] [-e seed]
+//
+// Runs a generated world of [robots] position models, each carrying a
+// noisy ranger of [samples] samples, for [steps] updates in
+// deterministic mode, once with 1 thread and once with [threads]. Each
+// ranger's update callback steers its robot away from what it sees
+// and records that it ran, so the order callbacks are called in is
+// part of the result. Each run is in its own process, so both get the
+// same model ids, and sends back World::Digest() at every update. The
+// digests are compared, and the time each run took reported. The exit
+// status is non-zero if any update differs, or if two models share a
+// name.
+/////////////////////////////////
+
+#include <sys/wait.h>
+
+#include "stage.hh"
+#include "benchworld.hh"
+using namespace Stg;
+
+// Write a world of [robots] position models with rangers on a grid
+static bool Generate( std::string& filename, unsigned int robots, unsigned int threads,
+		      unsigned int samples, unsigned int seed )
+{
+  FILE* fp = CreateWorld( "digestcheck", filename );
+  if( !fp )
+    return false;
+
+  fprintf( fp,
+	   "resolution 0.02\n"
+	   "threads %u\n"
+	   "seed %u\n"
+	   "deterministic 1\n\n"
+	   "define checkranger ranger\n"
+	   "(\n"
+	   "  sensor( range [ 0 2.0 ] fov 180 samples %u noise 0.05 )\n"
+	   ")\n",
+	   threads, seed, samples );
+
+  WriteRobotType( fp, "checkbot",
+		  "  localization \"odom\"\n"
+		  "  checkranger()\n" );
+  WriteRobots( fp, "checkbot", robots, 0.6, 37.0 );
+
+  return CloseWorld( fp, filename );
+}
+
+// the order the ranger callbacks ran in this update
+static std::vector<uint32_t> called;
+
+static int RangerUpdate( ModelRanger* rgr, ModelPosition* pos )
+{
+  called.push_back( rgr->GetId() );
+
+  // turn away from the nearer side
+  const std::vector<meters_t>& scan( rgr->GetSensors()[0].ranges );
+  const size_t half( scan.size() / 2 );
+  meters_t left(0), right(0);
+  for( size_t i=0; i<half; ++i )
+    {
+      right += scan[i];
+      left += scan[scan.size()-1-i];
+    }
+
+  pos->SetSpeed( 0.3, 0, left > right ? 0.5 : -0.5 );
+  return 0;
+}
+
+// Returns true if every model in [world] has a name of its own, by
+// which it can be found. The robots are replicated from a named
+// template, so this checks the copies and their children are renamed.
+static bool NamesUnique( World& world, unsigned int robots )
+{
+  std::set<std::string> names;
+  const std::set<Model*> models( world.GetAllModels() );
+  FOR_EACH( it, models )
+    if( ! names.insert( (*it)->Token() ).second ||
+	world.GetModel( (*it)->Token() ) != *it )
+      {
+	fprintf( stderr, "digestcheck: model name \"%s\" is not unique\n", (*it)->Token() );
+	return false;
+      }
+
+  for( unsigned int i=0; i<robots; ++i )
+    {
+      char name[32];
+      snprintf( name, sizeof(name), "r%u.ranger:0", i );
+      if( names.count( name ) == 0 )
+	{
+	  fprintf( stderr, "digestcheck: no model named \"%s\"\n", name );
+	  return false;
+	}
+    }
+
+  return true;
+}
+
+// Run the world with [threads] threads, writing a digest per update to [fd]
+static int Run( int fd, int argc, char* argv[], unsigned int robots, unsigned int steps,
+		unsigned int threads, unsigned int samples, unsigned int seed )
+{
+  Stg::Init( &argc, &argv );
+
+  std::string filename;
+  if( ! Generate( filename, robots, threads, samples, seed ))
+    return 1;
+
+  World world( "digestcheck" );
+  world.Load( filename.c_str() );
+  unlink( filename.c_str() );
+
+  if( ! NamesUnique( world, robots ))
+    return 1;
+
+  for( size_t i=0; i<world.BulkRangerCount(); ++i )
+    {
+      ModelRanger* rgr = world.BulkRanger(i);
+      rgr->AddCallback( Model::CB_UPDATE, (model_callback_t)RangerUpdate, rgr->Parent() );
+      rgr->Subscribe();
+    }
+
+  double elapsed = 0;
+  for( unsigned int s=0; s<steps; ++s )
+    {
+      called.clear();
+
+      const double start = Now();
+      world.Update();
+      elapsed += Now() - start;
+
+      uint64_t digest = world.Digest();
+      for( size_t i=0; i<called.size(); ++i )
+	digest = ( digest ^ called[i] ) * 1099511628211ULL;
+
+      if( write( fd, &digest, sizeof(digest) ) != (ssize_t)sizeof(digest) )
+	return 1;
+    }
+
+  fprintf( stderr, "%u threads: %.1f us/step\n", threads, elapsed * 1e6 / steps );
+  return 0;
+}
+
+// Fork a run, returning its pid and the read end of its pipe in [fd]
+static pid_t Start( int* fd, int argc, char* argv[], unsigned int robots, unsigned int steps,
+		    unsigned int threads, unsigned int samples, unsigned int seed )
+{
+  int p[2];
+  if( pipe( p ) != 0 )
+    {
+      perror( "digestcheck: pipe" );
+      return -1;
+    }
+
+  const pid_t child = fork();
+  if( child < 0 )
+    {
+      perror( "digestcheck: fork" );
+      return -1;
+    }
+  if( child == 0 )
+    {
+      close( p[0] );
+      _exit( Run( p[1], argc, argv, robots, steps, threads, samples, seed ));
+    }
+
+  close( p[1] );
+  *fd = p[0];
+  return child;
+}
+
+// Read the digests of [steps] updates from [fd]
+static bool Collect( int fd, std::vector<uint64_t>& digests, unsigned int steps )
+{
+  digests.resize( steps );
+  uint8_t* buf = (uint8_t*)&digests[0];
+  size_t want = steps * sizeof(uint64_t), got = 0;
+
+  while( got < want )
+    {
+      const ssize_t n = read( fd, buf + got, want - got );
+      if( n <= 0 )
+	break;
+      got += n;
+    }
+
+  close( fd );
+  return( got == want );
+}
+
+int main( int argc, char* argv[] )
+{
+  unsigned int robotcount = 200;
+  unsigned int steps = 200;
+  unsigned int threads = 4;
+  unsigned int samples = 32;
+  unsigned int seed = 1;
+
+  int ch;
+  while( (ch = getopt( argc, argv, "n:s:t:r:e:" )) != -1 )
+    {
+      switch( ch )
+	{
+	case 'n': robotcount = std::max( 1, atoi( optarg ) ); break;
+	case 's': steps = std::max( 1, atoi( optarg ) ); break;
+	case 't': threads = std::max( 1, atoi( optarg ) ); break;
+	case 'r': samples = std::max( 1, atoi( optarg ) ); break;
+	case 'e': seed = atoi( optarg ); break;
+	default:
+	  fprintf( stderr, "usage: %s [-n robots] [-s steps] [-t threads] [-r samples] [-e seed]\n", argv[0] );
+	  return 1;
+	}
+    }
+
+  fprintf( stderr, "[%u robots, %u samples, %u steps, 1 vs %u threads, seed %u]\n",
+	   robotcount, samples, steps, threads, seed );
+
+  // one after the other, so the timings are fair
+  std::vector<uint64_t> serial, parallel;
+  int fd, status;
+
+  pid_t child = Start( &fd, argc, argv, robotcount, steps, 1, samples, seed );
+  if( child < 0 )
+    return 1;
+  const bool serial_ok = Collect( fd, serial, steps );
+  waitpid( child, &status, 0 );
+
+  child = Start( &fd, argc, argv, robotcount, steps, threads, samples, seed );
+  if( child < 0 )
+    return 1;
+  const bool parallel_ok = Collect( fd, parallel, steps );
+  waitpid( child, &status, 0 );
+
+  if( ! serial_ok || ! parallel_ok )
+    {
+      fputs( "digestcheck: a run ended early\n", stderr );
+      return 1;
+    }
+
+  unsigned int differ = 0;
+  for( unsigned int s=0; s<steps; ++s )
+    if( serial[s] != parallel[s] && differ++ == 0 )
+      fprintf( stderr, "first difference at update %u: %016llx vs %016llx\n",
+	       s, (unsigned long long)serial[s], (unsigned long long)parallel[s] );
+
+  fprintf( stderr, "%u of %u updates differ\n", differ, steps );
+  return( differ ? 1 : 0 );
+}
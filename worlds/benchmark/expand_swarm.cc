@@ -41,8 +41,10 @@ extern "C" int Init( Model* mod )
   assert( robot->ranger );
 
 
-  // ask Stage to call into our ranger update function
-  robot->ranger->AddCallback( Model::CB_UPDATE, (model_callback_t)RangerUpdate, robot );
+  // ask Stage to call into our ranger update function. It only reads
+  // this ranger and sets the position's speed, so it is thread-safe
+  // and may run in the ranger's worker thread.
+  robot->ranger->AddCallback( Model::CB_UPDATE, (model_callback_t)RangerUpdate, robot, true );
 
   // subscribe to the laser, though we don't use it for navigating
   //robot->laser = (ModelLaser*)mod->GetUnusedModelofType( "laser" );
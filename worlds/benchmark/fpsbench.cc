@@ -0,0 +1,142 @@
+/////////////////////////////////
+// File: fpsbench.cc
+// Desc: GUI rendering benchmark
+// License: GPL
+//
+// Usage: fpsbench [-n robots] [-f frames] [-s steps]
+//
+// Loads a generated world of [robots] position models, each with a
+// ranger, drives them for [steps] updates to lay down trails, then
+// times [frames] redraws of the window with blocks, trail footprints
+// and ranger data shown, with and without batched rendering. Results
+// go to stderr.
+//
+// It needs a display, but not a GPU. To use Mesa's software
+// renderer on a headless machine:
+//
+//   LIBGL_ALWAYS_SOFTWARE=1 xvfb-run -s "-screen 0 1024x768x24" ./fpsbench
+/////////////////////////////////
+
+#include "stage.hh"
+#include "canvas.hh"
+#include "benchworld.hh"
+using namespace Stg;
+
+// Write a world of [robots] position models with rangers on a grid
+static bool Generate( std::string& filename, unsigned int robots )
+{
+  FILE* fp = CreateWorld( "fpsbench", filename );
+  if( !fp )
+    return false;
+
+  const unsigned int side = (unsigned int)ceil( sqrt( (double)robots ) );
+
+  fprintf( fp,
+	   "resolution 0.02\n"
+	   "interval_sim 100\n"
+	   "speedup -1\n"
+	   "paused 1\n\n"
+	   "window\n"
+	   "(\n"
+	   "  size [ 1024 768 ]\n"
+	   "  center [ %.3f %.3f ]\n"
+	   "  scale %.3f\n"
+	   "  show_data 1\n"
+	   "  show_footprints 1\n"
+	   "  show_clock 0\n"
+	   ")\n",
+	   side * 0.25, side * 0.25, 700.0 / ( side * 0.5 + 1.0 ) );
+
+  WriteRobotType( fp, "fpsbot",
+		  "  ranger( sensor( samples 16 range [ 0 0.5 ] fov 180 ) size [ 0.05 0.05 0.05 ] )\n" );
+  WriteRobots( fp, "fpsbot", robots, 0.5, 1.0 );
+
+  return CloseWorld( fp, filename );
+}
+
+// redraw the window [frames] times and report the frame rate
+static void Bench( const char* label, WorldGui& world, unsigned int frames )
+{
+  Canvas* canvas = world.GetCanvas();
+
+  // one untimed frame to build display lists and meshes
+  canvas->redraw();
+  Fl::flush();
+
+  const double start = Now();
+  for( unsigned int f=0; f<frames; ++f )
+    {
+      canvas->redraw();
+      Fl::flush();
+    }
+  canvas->make_current();
+  glFinish();
+  const double elapsed = Now() - start;
+
+  fprintf( stderr, "%-24s %6u frames %9.3f ms %8.3f ms/frame %8.2f fps\n",
+	   label, frames, elapsed * 1e3, elapsed * 1e3 / frames, frames / elapsed );
+}
+
+int main( int argc, char* argv[] )
+{
+  unsigned int robotcount = 2000;
+  unsigned int frames = 50;
+  unsigned int steps = 100;
+
+  int ch;
+  while( (ch = getopt( argc, argv, "n:f:s:" )) != -1 )
+    {
+      switch( ch )
+	{
+	case 'n': robotcount = std::max( 1, atoi( optarg ) ); break;
+	case 'f': frames = std::max( 1, atoi( optarg ) ); break;
+	case 's': steps = atoi( optarg ); break;
+	default:
+	  fprintf( stderr, "usage: %s [-n robots] [-f frames] [-s steps]\n", argv[0] );
+	  return 1;
+	}
+    }
+
+  Stg::Init( &argc, &argv );
+
+  std::string filename;
+  if( ! Generate( filename, robotcount ) )
+    return 1;
+
+  WorldGui world( 1024, 768, "fpsbench" );
+  world.Load( filename.c_str() );
+  unlink( filename.c_str() );
+  world.Show();
+  Fl::check();
+
+  // drive everything round in circles, with the rangers running, so
+  // there are trails and beams to draw
+  for( unsigned int i=0; i<robotcount; ++i )
+    {
+      char name[32];
+      snprintf( name, sizeof(name), "r%u", i );
+      ModelPosition* pos = (ModelPosition*)world.GetModel( name );
+      assert( pos );
+      pos->SetSpeed( 0.1, 0, 0.3 );
+      pos->Subscribe();
+
+      snprintf( name, sizeof(name), "r%u.ranger:0", i );
+      Model* rgr = world.GetModel( name );
+      if( rgr )
+	rgr->Subscribe();
+    }
+
+  for( unsigned int s=0; s<steps; ++s )
+    world.Update();
+
+  fprintf( stderr, "[%u robots, %u steps of trails, GL renderer \"%s\"]\n",
+	   robotcount, steps, (const char*)glGetString( GL_RENDERER ));
+
+  world.GetCanvas()->SetBatching( false );
+  Bench( "model by model", world, frames );
+
+  world.GetCanvas()->SetBatching( true );
+  Bench( "batched", world, frames );
+
+  return 0;
+}
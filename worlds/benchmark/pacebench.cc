@@ -0,0 +1,108 @@
+/////////////////////////////////
+// File: pacebench.cc
+// Desc: Real time pacing benchmark
+// License: GPL
+//
+// Usage: pacebench [-n robots] [-s steps] [-i interval_usec] [-p pace] [-w spin_usec]
+//
+// Loads a generated world of [robots] position models, each carrying
+// a ranger, with an update interval of [interval_usec], and runs
+// [steps] updates kept to [pace] times real time, spinning for the
+// last [spin_usec] before each deadline. Reports the rate achieved,
+// the overruns and a histogram of how late each update finished
+// relative to its deadline. The exit status is non-zero if the run
+// took more than 1% longer than it should have.
+/////////////////////////////////
+
+#include "stage.hh"
+#include "benchworld.hh"
+using namespace Stg;
+
+// Write a world of [robots] position models with rangers on a grid
+static bool Generate( std::string& filename, unsigned int robots, unsigned int interval )
+{
+  FILE* fp = CreateWorld( "pacebench", filename );
+  if( !fp )
+    return false;
+
+  fprintf( fp,
+	   "resolution 0.02\n"
+	   "interval_sim %.3f\n"
+	   "threads 1\n\n"
+	   "define paceranger ranger\n"
+	   "(\n"
+	   "  sensor( range [ 0 4.0 ] fov 180 samples 32 )\n"
+	   ")\n",
+	   interval / 1e3 );
+
+  WriteRobotType( fp, "pacebot", "  paceranger()\n" );
+  WriteRobots( fp, "pacebot", robots, 1.0 );
+
+  return CloseWorld( fp, filename );
+}
+
+int main( int argc, char* argv[] )
+{
+  unsigned int robotcount = 10;
+  unsigned int steps = 1000;
+  unsigned int interval = 1000; // 1 kHz
+  double pace = 1.0;
+  unsigned int spin = 100;
+
+  int ch;
+  while( (ch = getopt( argc, argv, "n:s:i:p:w:" )) != -1 )
+    {
+      switch( ch )
+	{
+	case 'n': robotcount = std::max( 1, atoi( optarg ) ); break;
+	case 's': steps = std::max( 1, atoi( optarg ) ); break;
+	case 'i': interval = std::max( 1, atoi( optarg ) ); break;
+	case 'p': pace = std::max( 0.001, atof( optarg ) ); break;
+	case 'w': spin = std::max( 0, atoi( optarg ) ); break;
+	default:
+	  fprintf( stderr, "usage: %s [-n robots] [-s steps] [-i interval_usec] [-p pace] [-w spin_usec]\n", argv[0] );
+	  return 1;
+	}
+    }
+
+  Stg::Init( &argc, &argv );
+
+  std::string filename;
+  if( ! Generate( filename, robotcount, interval ))
+    return 1;
+
+  World world( "pacebench" );
+  world.Load( filename.c_str() );
+  unlink( filename.c_str() );
+
+  for( size_t i=0; i<world.BulkRangerCount(); ++i )
+    world.BulkRanger(i)->Subscribe();
+
+  world.SetPace( pace );
+  world.SetPaceSpin( spin );
+
+  fprintf( stderr, "[%u robots, %u usec interval, %.2fx real time, %u usec spin, %u steps]\n",
+	   robotcount, interval, pace, spin, steps );
+
+  const double start = Now();
+  for( unsigned int s=0; s<steps; ++s )
+    world.Update();
+  const double elapsed = Now() - start;
+  const double expected = steps * interval / 1e6 / pace;
+
+  const World::PaceStats& ps( world.GetPaceStats() );
+
+  fprintf( stderr, "%.3f s for %.3f s expected, %.0f steps/s\n",
+	   elapsed, expected, steps / elapsed );
+  fprintf( stderr, "%llu overruns, %llu resyncs, %llu usec latest\n",
+	   (unsigned long long)ps.overruns, (unsigned long long)ps.resyncs,
+	   (unsigned long long)ps.max_late );
+
+  fputs( "lateness histogram:\n", stderr );
+  for( unsigned int b=0; b<World::PaceStats::BINS; ++b )
+    if( ps.late[b] )
+      fprintf( stderr, "  %8llu - %8llu usec: %llu\n",
+	       b ? 1ULL << (b-1) : 0ULL, 1ULL << b, (unsigned long long)ps.late[b] );
+
+  return( elapsed > expected * 1.01 ? 1 : 0 );
+}
@@ -0,0 +1,271 @@
+/////////////////////////////////
+// File: shmbench.cc
+// Desc: Shared memory transport benchmark and local test harness
+// License: GPL
+//
+// Usage: shmbench [-n robots] [-s steps] [-i interval_usec] [-r samples] [-f]
+//
+// Loads a generated world of [robots] position models, each carrying
+// a ranger of [samples] samples, with an update interval of
+// [interval_usec], and serves it through shared memory. A child
+// process drives every robot through libstageshm: each tick it reads
+// the poses and scans and sends back a velocity. The parent runs
+// [steps] updates in real time, or as fast as it can with -f, and
+// checks the robots moved. The child reports the ticks it saw and
+// slept through, malformed messages and drops. Results go to stderr;
+// the exit status is non-zero if any data was lost or malformed.
+/////////////////////////////////
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "stage.hh"
+#include "stage_shm.h"
+#include "benchworld.hh"
+using namespace Stg;
+
+// Write a world of [robots] position models with rangers on a grid
+static bool Generate( std::string& filename, const char* segment,
+		      unsigned int robots, unsigned int interval,
+		      unsigned int samples )
+{
+  FILE* fp = CreateWorld( "shmbench", filename );
+  if( !fp )
+    return false;
+
+  fprintf( fp,
+	   "resolution 0.02\n"
+	   "interval_sim %.3f\n"
+	   "threads 1\n"
+	   "shm_name \"%s\"\n\n"
+	   "define shmranger ranger\n"
+	   "(\n"
+	   "  sensor( range [ 0 4.0 ] fov 180 samples %u )\n"
+	   ")\n",
+	   interval / 1e3, segment, samples );
+
+  WriteRobotType( fp, "shmbot", "  shmranger()\n" );
+  WriteRobots( fp, "shmbot", robots, 1.0 );
+
+  return CloseWorld( fp, filename );
+}
+
+// The controller process: drive every robot until Stage goes away
+static int Client( const char* segment, unsigned int robots, unsigned int samples )
+{
+  stg_shm_client_t* cli = NULL;
+
+  // the parent creates the segment when it loads the world
+  for( int tries=0; cli == NULL && tries < 1000; ++tries )
+    if( (cli = stg_shm_open( segment )) == NULL )
+      usleep( 10000 );
+
+  if( cli == NULL )
+    {
+      perror( "shmbench: client failed to open segment" );
+      return 1;
+    }
+
+  std::vector<int> bots, lasers;
+  for( unsigned int i=0; i<robots; ++i )
+    {
+      char name[32];
+      snprintf( name, sizeof(name), "r%u", i );
+      const int bot = stg_shm_find_model( cli, name );
+      snprintf( name, sizeof(name), "r%u.ranger:0", i ); // unnamed child
+      const int laser = stg_shm_find_model( cli, name );
+
+      if( bot < 0 || laser < 0 ||
+	  stg_shm_subscribe( cli, bot ) || stg_shm_subscribe( cli, laser ))
+	{
+	  fprintf( stderr, "shmbench: client failed to subscribe robot %u\n", i );
+	  stg_shm_close( cli );
+	  return 1;
+	}
+
+      bots.push_back( bot );
+      lasers.push_back( laser );
+    }
+
+  std::vector<uint8_t> buf( 1<<20 );
+  stg_shm_msg_t msg;
+
+  uint32_t tick = stg_shm_tick( cli );
+  unsigned long ticks = 0, missed = 0, scans = 0, poses = 0, bad = 0;
+  double waited = 0;
+
+  while( true )
+    {
+      const double start = Now();
+      const int woke = stg_shm_wait_tick( cli, tick, 5000 );
+      waited += Now() - start;
+
+      if( woke < 0 ) // Stage has finished
+	break;
+      if( woke == 0 )
+	{
+	  fputs( "shmbench: client timed out waiting for a tick\n", stderr );
+	  break;
+	}
+
+      const uint32_t now = stg_shm_tick( cli );
+      if( ticks > 0 )
+	missed += now - tick - 1;
+      tick = now;
+      ++ticks;
+
+      for( unsigned int i=0; i<robots; ++i )
+	{
+	  int len;
+	  while( (len = stg_shm_read( cli, bots[i], &msg, &buf[0], buf.size() )) > 0 )
+	    {
+	      if( msg.type == STG_SHM_POSE && len >= (int)sizeof(stg_shm_pose_t) )
+		++poses;
+	      else
+		++bad;
+	    }
+
+	  while( (len = stg_shm_read( cli, lasers[i], &msg, &buf[0], buf.size() )) > 0 )
+	    {
+	      if( msg.type != STG_SHM_RANGER )
+		continue; // the ranger's pose
+
+	      const stg_shm_count_t* count = (const stg_shm_count_t*)&buf[0];
+	      if( count->count == 0 )
+		continue; // published before the ranger's first update
+	      if( count->count == samples &&
+		  len >= (int)( sizeof(stg_shm_count_t) + samples * sizeof(float) ))
+		++scans;
+	      else
+		++bad;
+	    }
+
+	  if( len < 0 )
+	    ++bad;
+
+	  // creep forward and turn, so the parent can see we drove
+	  stg_shm_set_velocity( cli, bots[i], 0.1, 0, 0, 0.1 );
+	}
+    }
+
+  unsigned long drops = 0;
+  for( unsigned int i=0; i<robots; ++i )
+    drops += stg_shm_drops( cli, bots[i] ) + stg_shm_drops( cli, lasers[i] );
+
+  stg_shm_close( cli );
+
+  fprintf( stderr, "client: %lu ticks, %lu missed, %lu poses, %lu scans, "
+	   "%lu bad, %lu dropped, %.1f us mean wait\n",
+	   ticks, missed, poses, scans, bad, drops,
+	   ticks ? waited * 1e6 / ticks : 0.0 );
+
+  // a tick slept through loses nothing, as the data waits in the rings
+  return( bad || drops ? 1 : 0 );
+}
+
+int main( int argc, char* argv[] )
+{
+  unsigned int robotcount = 10;
+  unsigned int steps = 10000;
+  unsigned int interval = 1000; // 1 kHz
+  unsigned int samples = 361;
+  bool fast = false;
+
+  int ch;
+  while( (ch = getopt( argc, argv, "n:s:i:r:f" )) != -1 )
+    {
+      switch( ch )
+	{
+	case 'n': robotcount = std::max( 1, atoi( optarg ) ); break;
+	case 's': steps = std::max( 1, atoi( optarg ) ); break;
+	case 'i': interval = std::max( 1, atoi( optarg ) ); break;
+	case 'r': samples = std::max( 1, atoi( optarg ) ); break;
+	case 'f': fast = true; break;
+	default:
+	  fprintf( stderr, "usage: %s [-n robots] [-s steps] [-i interval_usec] [-r samples] [-f]\n", argv[0] );
+	  return 1;
+	}
+    }
+
+  char segment[64];
+  snprintf( segment, sizeof(segment), "shmbench-%d", (int)getpid() );
+
+  const pid_t child = fork();
+  if( child < 0 )
+    {
+      perror( "shmbench: fork" );
+      return 1;
+    }
+  if( child == 0 )
+    _exit( Client( segment, robotcount, samples ));
+
+  Stg::Init( &argc, &argv );
+
+  std::string filename;
+  if( ! Generate( filename, segment, robotcount, interval, samples ))
+    {
+      kill( child, SIGTERM );
+      return 1;
+    }
+
+  World world( "shmbench" );
+  world.Load( filename.c_str() );
+  unlink( filename.c_str() );
+
+  if( ! world.IsServingShm() )
+    {
+      kill( child, SIGTERM );
+      return 1;
+    }
+
+  // give the client time to subscribe everything before timing
+  char lastname[32];
+  snprintf( lastname, sizeof(lastname), "r%u.ranger:0", robotcount-1 );
+  Model* last = world.GetModel( lastname );
+  for( int tries=0; last && last->GetSubscriptionCount() == 0 && tries < 5000; ++tries )
+    {
+      world.Update();
+      usleep( 1000 );
+    }
+
+  fprintf( stderr, "[%u robots, %u samples, %u usec interval, %u steps]\n",
+	   robotcount, samples, interval, steps );
+
+  const double start = Now();
+  for( unsigned int s=0; s<steps; ++s )
+    {
+      world.Update();
+
+      if( ! fast ) // keep to real time
+	{
+	  const double due = start + (s+1) * interval / 1e6;
+	  const double now = Now();
+	  if( now < due )
+	    usleep( (useconds_t)(( due - now ) * 1e6 ));
+	}
+    }
+  const double elapsed = Now() - start;
+
+  fprintf( stderr, "server: %.3f s, %.1f us/step, %.0f steps/s (%.1fx real time)\n",
+	   elapsed, elapsed * 1e6 / steps, steps / elapsed,
+	   steps * interval / 1e6 / elapsed );
+
+  // the robots should have moved under the client's control
+  unsigned int moved = 0;
+  for( unsigned int i=0; i<robotcount; ++i )
+    {
+      char name[32];
+      snprintf( name, sizeof(name), "r%u", i );
+      Model* mod = world.GetModel( name );
+      if( mod && mod->GetPose().a != 0.0 )
+	++moved;
+    }
+  fprintf( stderr, "server: %u of %u robots driven by the client\n", moved, robotcount );
+
+  world.StopShm(); // wakes the client to finish
+
+  int status = 0;
+  waitpid( child, &status, 0 );
+
+  return( moved == robotcount && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1 );
+}
@@ -0,0 +1,139 @@
+/////////////////////////////////
+// File: wfparse.cc
+// Desc: Worldfile tokenizer and parser benchmark
+// License: GPL
+//
+// Usage: wfparse [-n robots] [-r repeats] [worldfile ...]
+//
+// Times Worldfile::Load() for each named worldfile (e.g. the
+// tests/worldfile corpus), then for a generated world containing
+// [robots] macro-expanded robots, pasted once each in the style
+// produced by worldgen.sh, and for the same world written with
+// replicate. Results go to stderr; the debug dumps that test files
+// produce are discarded.
+/////////////////////////////////
+
+#include <string.h>
+#include <fcntl.h>
+
+#include "stage.hh"
+#include "worldfile.hh"
+#include "benchworld.hh"
+using namespace Stg;
+
+static long FileSize( const char* filename )
+{
+  FILE* fp = fopen( filename, "r" );
+  if( !fp )
+    return 0;
+  fseek( fp, 0, SEEK_END );
+  const long size = ftell( fp );
+  fclose( fp );
+  return size;
+}
+
+// Write a world of [robots] position models, each with a ranger, on a
+// grid, pasted once each like worldgen.sh does, or replicated
+static bool Generate( std::string& filename, unsigned int robots, bool pasted )
+{
+  FILE* fp = CreateWorld( "wfparse", filename );
+  if( !fp )
+    return false;
+
+  fprintf( fp,
+	   "resolution 0.02\n"
+	   "interval_sim 100\n\n"
+	   "define swarmranger ranger\n"
+	   "(\n"
+	   "  sensor( pose [ 0.1 0 0 0 ] range [ 0 1.0 ] fov 30 samples 1 )\n"
+	   "  sensor( pose [ 0 0.1 0 90 ] range [ 0 1.0 ] fov 30 samples 1 )\n"
+	   "  sensor( pose [ -0.1 0 0 180 ] range [ 0 1.0 ] fov 30 samples 1 )\n"
+	   "  sensor( pose [ 0 -0.1 0 270 ] range [ 0 1.0 ] fov 30 samples 1 )\n"
+	   ")\n" );
+
+  WriteRobotType( fp, "swarmbot",
+		  "  color \"red\"\n"
+		  "  swarmranger()\n" );
+  WriteRobots( fp, "swarmbot", robots, 0.25, 1.0, pasted );
+
+  return CloseWorld( fp, filename );
+}
+
+// Load the file [repeats] times, reporting the best time
+static void Bench( const char* filename, unsigned int repeats )
+{
+  double best = 1e9;
+  bool ok = false;
+  int entities = 0;
+
+  for( unsigned int r=0; r<repeats; ++r )
+    {
+      // test files dump their contents on stdout, so hide that
+      fflush( stdout );
+      const int saved = dup( STDOUT_FILENO );
+      const int devnull = open( "/dev/null", O_WRONLY );
+      dup2( devnull, STDOUT_FILENO );
+      close( devnull );
+
+      const double start = Now();
+      Worldfile* wf = new Worldfile();
+      ok = wf->Load( filename );
+      entities = wf->GetEntityCount();
+      delete wf;
+      const double elapsed = Now() - start;
+
+      fflush( stdout );
+      dup2( saved, STDOUT_FILENO );
+      close( saved );
+
+      best = std::min( best, elapsed );
+    }
+
+  const double mb = FileSize( filename ) / 1e6;
+
+  fprintf( stderr, "%-40s %8.2f KB %7d entities %9.3f ms %8.2f MB/s%s\n",
+	   filename,
+	   mb * 1e3,
+	   entities,
+	   best * 1e3,
+	   best > 0 ? mb / best : 0,
+	   ok ? "" : " (load returned false)" );
+}
+
+int main( int argc, char* argv[] )
+{
+  unsigned int robots = 20000;
+  unsigned int repeats = 5;
+
+  int ch;
+  while( (ch = getopt( argc, argv, "n:r:" )) != -1 )
+    {
+      switch( ch )
+	{
+	case 'n': robots = atoi( optarg ); break;
+	case 'r': repeats = std::max( 1, atoi( optarg ) ); break;
+	default:
+	  fprintf( stderr, "usage: %s [-n robots] [-r repeats] [worldfile ...]\n", argv[0] );
+	  return 1;
+	}
+    }
+
+  for( int i=optind; i<argc; ++i )
+    Bench( argv[i], repeats );
+
+  // parsing the replicated world is quick, but World::Load() then
+  // does the work of configuring every copy
+  for( int pasted=1; robots > 0 && pasted >= 0; --pasted )
+    {
+      std::string filename;
+      if( ! Generate( filename, robots, pasted ))
+	return 1;
+
+      fprintf( stderr, "[generated %u robots, %s]\n",
+	       robots, pasted ? "pasted" : "replicated" );
+      Bench( filename.c_str(), repeats );
+      unlink( filename.c_str() );
+    }
+
+  return 0;
+}
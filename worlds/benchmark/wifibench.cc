@@ -0,0 +1,142 @@
+/////////////////////////////////
+// File: wifibench.cc
+// Desc: Wifi message delivery benchmark
+// License: GPL
+//
+// Usage: wifibench [-n robots] [-s steps] [-d range] [-o obstruction]
+//
+// Loads a generated world of [robots] position models on a 1m grid,
+// each carrying a wifi radio of [range] meters and [obstruction], with
+// a wall across the grid every 10m. Before each of [steps] updates
+// every radio broadcasts a message and sends another to the next
+// radio by name. Reports the time per update, the links per radio and
+// the messages delivered and dropped per step. Run it with growing
+// [robots] to see how delivery scales.
+/////////////////////////////////
+
+#include "stage.hh"
+#include "benchworld.hh"
+using namespace Stg;
+
+// Write a world of [robots] position models with radios on a grid
+static bool Generate( std::string& filename, unsigned int robots,
+		      double range, double obstruction )
+{
+  FILE* fp = CreateWorld( "wifibench", filename );
+  if( !fp )
+    return false;
+
+  const unsigned int side = (unsigned int)ceil( sqrt( (double)robots ) );
+
+  fprintf( fp,
+	   "resolution 0.02\n"
+	   "threads 1\n\n"
+	   "define benchradio wifi\n"
+	   "(\n"
+	   "  range %.3f\n"
+	   "  obstruction %.3f\n"
+	   ")\n",
+	   range, obstruction );
+
+  // walls between the columns
+  const unsigned int walls = side ? ( side - 1 ) / 10 : 0;
+  if( walls )
+    fprintf( fp,
+	     "\nreplicate\n"
+	     "(\n"
+	     "  count %u\n"
+	     "  pose [ 9.5 %.3f 0 0 ]\n"
+	     "  step [ 10 0 0 0 ]\n"
+	     "  model( name \"wall\" size [ 0.05 %.3f 1 ] )\n"
+	     ")\n",
+	     walls, side / 2.0 - 0.5, (double)side );
+
+  WriteRobotType( fp, "benchbot", "  benchradio( pose [ 0 0 0.1 0 ] )\n" );
+  WriteRobots( fp, "benchbot", robots, 1.0 );
+
+  return CloseWorld( fp, filename );
+}
+
+int main( int argc, char* argv[] )
+{
+  unsigned int robotcount = 1000;
+  unsigned int steps = 100;
+  double range = 3.0;
+  double obstruction = 0.5;
+
+  int ch;
+  while( (ch = getopt( argc, argv, "n:s:d:o:" )) != -1 )
+    {
+      switch( ch )
+	{
+	case 'n': robotcount = std::max( 1, atoi( optarg ) ); break;
+	case 's': steps = std::max( 1, atoi( optarg ) ); break;
+	case 'd': range = std::max( 0.0, atof( optarg ) ); break;
+	case 'o': obstruction = atof( optarg ); break;
+	default:
+	  fprintf( stderr, "usage: %s [-n robots] [-s steps] [-d range] [-o obstruction]\n", argv[0] );
+	  return 1;
+	}
+    }
+
+  Stg::Init( &argc, &argv );
+
+  std::string filename;
+  if( ! Generate( filename, robotcount, range, obstruction ))
+    return 1;
+
+  World world( "wifibench" );
+  world.Load( filename.c_str() );
+  unlink( filename.c_str() );
+
+  std::vector<ModelWifi*> radios;
+  for( unsigned int i=0; i<robotcount; ++i )
+    {
+      char name[32];
+      snprintf( name, sizeof(name), "r%u.wifi:0", i ); // unnamed child
+      ModelWifi* radio = dynamic_cast<ModelWifi*>( world.GetModel( name ));
+      if( radio == NULL )
+	{
+	  fprintf( stderr, "wifibench: no radio %s\n", name );
+	  return 1;
+	}
+      radio->Subscribe();
+      radios.push_back( radio );
+    }
+
+  fprintf( stderr, "[%u robots, %.2f m range, %.2f obstruction, %u steps]\n",
+	   robotcount, range, obstruction, steps );
+
+  double elapsed = 0;
+  uint64_t links = 0;
+
+  for( unsigned int s=0; s<steps; ++s )
+    {
+      for( size_t i=0; i<radios.size(); ++i )
+	{
+	  radios[i]->Broadcast( "ping" );
+	  radios[i]->Send( radios[(i+1) % radios.size()], "hello" );
+	}
+
+      const double start = Now();
+      world.Update();
+      elapsed += Now() - start;
+
+      FOR_EACH( it, radios )
+	links += (*it)->GetNeighbours().size();
+    }
+
+  uint64_t received = 0, dropped = 0;
+  FOR_EACH( it, radios )
+    {
+      received += (*it)->GetReceivedCount();
+      dropped += (*it)->GetDroppedCount();
+    }
+
+  fprintf( stderr, "update: %.1f us/step\n", elapsed * 1e6 / steps );
+  fprintf( stderr, "links: %.2f per radio\n", (double)links / steps / radios.size() );
+  fprintf( stderr, "messages: %.1f delivered, %.1f dropped per step\n",
+	   (double)received / steps, (double)dropped / steps );
+
+  return 0;
+}